@@ -22,6 +22,11 @@ constexpr int POLL_TIMEOUT_MS = COMMAND_TIMEOUT_MS / 10;
 constexpr int WS_SEND_TIMEOUT_MS = 1000;
 
 constexpr int TILE_ROUNDTRIP_TIMEOUT_MS = 5000;
+constexpr int TILE_ROUNDTRIP_MIN_TIMEOUT_MS = 1000;
+
+/// Bounds of the number of tiles sent to a client and not acknowledged yet.
+constexpr size_t TILES_ON_FLY_MIN_UPPER_LIMIT = 10;
+constexpr size_t TILES_ON_FLY_MAX_UPPER_LIMIT = 200;
 
 /// Pipe and Socket read buffer size.
 /// Should be large enough for ethernet packets
@@ -36,6 +41,8 @@ constexpr const char JAILED_DOCUMENT_ROOT[] = "/user/docs/";
 constexpr const char CHILD_URI[] = "/loolws/child?";
 constexpr const char NEW_CHILD_URI[] = "/loolws/newchild";
 constexpr const char LO_JAIL_SUBPATH[] = "lo";
+/// The directory in the child root the jails are linked from.
+constexpr const char JAIL_TEMPLATE_NAME[] = "template";
 
 constexpr const char CAPABILITIES_END_POINT[] = "/hosting/capabilities";
 
@@ -10,15 +10,23 @@
 #ifndef INCLUDED_MESSAGE_HPP
 #define INCLUDED_MESSAGE_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
 
 #include "Protocol.hpp"
 #include "Log.hpp"
+#include "Util.hpp"
 
 /// The payload type used to send/receive data.
+/// The tokens, first line and abbreviation are only worked out when first
+/// asked for, most messages just pass through.  As they are cached then, the
+/// first use of each must not race with another.
 class Message
 {
 public:
@@ -32,13 +40,14 @@ public:
             const enum Dir dir) :
         _forwardToken(getForwardToken(message.data(), message.size())),
         _data(skipWhitespace(message.data() + _forwardToken.size()), message.data() + message.size()),
-        _tokens(LOOLProtocol::tokenize(_data.data(), _data.size())),
-        _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(_data.data(), _data.size())),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size())),
-        _type(detectType())
+        _idNum(makeId()),
+        _dir(dir),
+        _firstToken(getFirstToken(_data)),
+        _type(detectType()),
+        _hasTokens(false),
+        _hasFirstLine(false)
     {
-        LOG_TRC("Message " << _abbr);
+        LOG_TRC("Message " << abbr());
     }
 
     /// Construct a message from a string with type and
@@ -49,16 +58,17 @@ public:
             const size_t reserve) :
         _forwardToken(getForwardToken(message.data(), message.size())),
         _data(std::max(reserve, message.size())),
-        _tokens(LOOLProtocol::tokenize(message.data() + _forwardToken.size(), message.size() - _forwardToken.size())),
-        _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(message)),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(message)),
-        _type(detectType())
+        _idNum(makeId()),
+        _dir(dir),
+        _hasTokens(false),
+        _hasFirstLine(false)
     {
-        _data.resize(message.size());
         const char* offset = skipWhitespace(message.data() + _forwardToken.size());
-        std::memcpy(_data.data(), offset, message.size() - (offset - message.data()));
-        LOG_TRC("Message " << _abbr);
+        _data.resize(message.size() - (offset - message.data()));
+        std::memcpy(_data.data(), offset, _data.size());
+        _firstToken = getFirstToken(_data);
+        _type = detectType();
+        LOG_TRC("Message " << abbr());
     }
 
     /// Construct a message from a character array with type.
@@ -68,37 +78,130 @@ public:
             const enum Dir dir) :
         _forwardToken(getForwardToken(p, len)),
         _data(skipWhitespace(p + _forwardToken.size()), p + len),
-        _tokens(LOOLProtocol::tokenize(_data.data(), _data.size())),
-        _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(_data.data(), _data.size())),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size())),
-        _type(detectType())
+        _idNum(makeId()),
+        _dir(dir),
+        _firstToken(getFirstToken(_data)),
+        _type(detectType()),
+        _hasTokens(false),
+        _hasFirstLine(false)
     {
-        LOG_TRC("Message " << _abbr);
+        LOG_TRC("Message " << abbr());
     }
 
-    size_t size() const { return _data.size(); }
+    /// Construct a message adopting the buffer, rather than copying it.
+    /// Note: data must include the full first-line.
+    Message(std::vector<char>&& data,
+            const enum Dir dir) :
+        _forwardToken(getForwardToken(data.data(), data.size())),
+        _data(std::move(data)),
+        _idNum(makeId()),
+        _dir(dir),
+        _hasTokens(false),
+        _hasFirstLine(false)
+    {
+        const char* offset = skipWhitespace(_data.data() + _forwardToken.size());
+        _data.erase(_data.begin(), _data.begin() + (offset - _data.data()));
+        _firstToken = getFirstToken(_data);
+        _type = detectType();
+        LOG_TRC("Message " << abbr());
+    }
+
+    /// Construct a message from a header and a body shared with others, e.g. the TileCache.
+    /// The body is referenced, not copied, all the way to the socket and must not change.
+    /// header must include the full first-line.
+    Message(const std::string& header,
+            const std::shared_ptr<const std::vector<char>>& body,
+            const enum Dir dir) :
+        Message(header, std::vector<std::shared_ptr<const std::vector<char>>>(1, body), dir)
+    {
+    }
+
+    /// Construct a message from a header followed by the bodies, in order, as above.
+    Message(const std::string& header,
+            const std::vector<std::shared_ptr<const std::vector<char>>>& bodies,
+            const enum Dir dir) :
+        _forwardToken(getForwardToken(header.data(), header.size())),
+        _data(skipWhitespace(header.data() + _forwardToken.size()), header.data() + header.size()),
+        _bodies(bodies),
+        _idNum(makeId()),
+        _dir(dir),
+        _firstToken(getFirstToken(_data)),
+        _type(detectType()),
+        _hasTokens(false),
+        _hasFirstLine(false)
+    {
+        LOG_TRC("Message " << abbr());
+    }
+
+    /// The total size, including the shared body, if any.
+    size_t size() const
+    {
+        size_t total = _data.size();
+        for (const auto& body : _bodies)
+            total += body->size();
+
+        return total;
+    }
+
+    /// The payload, or just its header when it has a shared body.
     const std::vector<char>& data() const { return _data; }
 
-    const std::vector<std::string>& tokens() const { return _tokens; }
+    /// The shared bodies following data(), if any.
+    const std::vector<std::shared_ptr<const std::vector<char>>>& bodies() const { return _bodies; }
+
+    const std::vector<std::string>& tokens() const
+    {
+        if (!_hasTokens)
+        {
+            _tokens = LOOLProtocol::tokenize(_data.data(), _data.size());
+            _hasTokens = true;
+        }
+
+        return _tokens;
+    }
+
     const std::string& forwardToken() const { return _forwardToken; }
-    const std::string& firstToken() const { return _tokens[0]; }
-    const std::string& firstLine() const { return _firstLine; }
-    const std::string& operator[](size_t index) const { return _tokens[index]; }
+    const std::string& firstToken() const { return _firstToken; }
+
+    const std::string& firstLine() const
+    {
+        if (!_hasFirstLine)
+        {
+            _firstLine = LOOLProtocol::getFirstLine(_data.data(), _data.size());
+            _hasFirstLine = true;
+        }
+
+        return _firstLine;
+    }
+
+    const std::string& operator[](size_t index) const { return tokens()[index]; }
 
     bool getTokenInteger(const std::string& name, int& value)
     {
-        return LOOLProtocol::getTokenInteger(_tokens, name, value);
+        return LOOLProtocol::getTokenInteger(tokens(), name, value);
     }
 
     /// Return the abbreviated message for logging purposes.
-    const std::string& abbr() const { return _abbr; }
-    const std::string& id() const { return _id; }
+    const std::string& abbr() const
+    {
+        if (_abbr.empty())
+            _abbr = id() + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size());
+
+        return _abbr;
+    }
+
+    const std::string& id() const
+    {
+        if (_id.empty())
+            _id = (_dir == Dir::In ? 'i' : 'o') + std::to_string(_idNum);
+
+        return _id;
+    }
 
     /// Returns the json part of the message, if any.
     std::string jsonString() const
     {
-        if (_tokens.size() > 1 && _tokens[1] == "{")
+        if (tokens().size() > 1 && _tokens[1] == "{")
         {
             const size_t firstTokenSize = _tokens[0].size();
             return std::string(_data.data() + firstTokenSize, _data.size() - firstTokenSize);
@@ -110,9 +213,13 @@ public:
     /// Append more data to the message.
     void append(const char* p, const size_t len)
     {
+        assert(_bodies.empty() && "Cannot append to a message with a shared body");
         const size_t curSize = _data.size();
         _data.resize(curSize + len);
         std::memcpy(_data.data() + curSize, p, len);
+        _hasTokens = false;
+        _hasFirstLine = false;
+        _abbr.clear();
     }
 
     /// Returns true if and only if the payload is considered Binary.
@@ -124,8 +231,8 @@ public:
         if (func(_data))
         {
             // Check - just the body.
-            assert(_firstLine == LOOLProtocol::getFirstLine(_data.data(), _data.size()));
-            assert(_abbr == _id + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size()));
+            assert(!_hasFirstLine || _firstLine == LOOLProtocol::getFirstLine(_data.data(), _data.size()));
+            assert(_abbr.empty() || _abbr == id() + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size()));
             assert(_type == detectType());
         }
     }
@@ -133,18 +240,18 @@ public:
 private:
 
     /// Constructs a unique ID.
-    static std::string makeId(const enum Dir dir)
+    static unsigned makeId()
     {
         static std::atomic<unsigned> Counter;
-        return (dir == Dir::In ? 'i' : 'o') + std::to_string(++Counter);
+        return ++Counter;
     }
 
     Type detectType() const
     {
-        if (_tokens[0] == "tile:" ||
-            _tokens[0] == "tilecombine:" ||
-            _tokens[0] == "renderfont:" ||
-            _tokens[0] == "windowpaint:")
+        if (_firstToken == "tile:" ||
+            _firstToken == "tilecombine:" ||
+            _firstToken == "renderfont:" ||
+            _firstToken == "windowpaint:")
         {
             return Type::Binary;
         }
@@ -158,6 +265,14 @@ private:
         return Type::Text;
     }
 
+    /// The first token, as tokens() would have it.
+    static std::string getFirstToken(const std::vector<char>& data)
+    {
+        const size_t space = Util::getDelimiterPosition(data.data(), data.size(), ' ');
+        const size_t newline = Util::getDelimiterPosition(data.data(), space, '\n');
+        return std::string(data.data(), newline);
+    }
+
     std::string getForwardToken(const char* buffer, int length)
     {
         std::string forward = LOOLProtocol::getFirstToken(buffer, length);
@@ -177,11 +292,19 @@ private:
 private:
     const std::string _forwardToken;
     std::vector<char> _data;
-    const std::vector<std::string> _tokens;
-    const std::string _id;
-    const std::string _firstLine;
-    const std::string _abbr;
-    const Type _type;
+    const std::vector<std::shared_ptr<const std::vector<char>>> _bodies;
+    const unsigned _idNum;
+    const Dir _dir;
+    std::string _firstToken;
+    Type _type;
+
+    /// Worked out on first use.
+    mutable std::vector<std::string> _tokens;
+    mutable bool _hasTokens;
+    mutable std::string _firstLine;
+    mutable bool _hasFirstLine;
+    mutable std::string _abbr;
+    mutable std::string _id;
 };
 
 #endif
@@ -12,6 +12,7 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <set>
 
 #include <Poco/JSON/JSON.h>
 #include <Poco/JSON/Object.h>
@@ -24,6 +25,118 @@
 
 using Poco::StringTokenizer;
 
+namespace {
+
+/// Read the viewId from the tokens.
+std::string extractViewId(const std::string& origMsg, const std::vector<std::string>& tokens)
+{
+    size_t nonJson = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
+    std::string jsonString(origMsg.data() + nonJson, origMsg.size() - nonJson);
+
+    Poco::JSON::Parser parser;
+    const Poco::Dynamic::Var result = parser.parse(jsonString);
+    const auto& json = result.extract<Poco::JSON::Object::Ptr>();
+    return json->get("viewId").toString();
+}
+
+/// Extract the .uno: command ID from the potential command.
+std::string extractUnoCommand(const std::string& command)
+{
+    if (!LOOLProtocol::matchPrefix(".uno:", command))
+        return std::string();
+
+    size_t equalPos = command.find('=');
+    if (equalPos != std::string::npos)
+        return command.substr(0, equalPos);
+
+    return command;
+}
+
+/// Extract rectangle from the invalidation callback
+bool extractRectangle(const std::vector<std::string>& tokens, int& x, int& y, int& w, int& h, int& part)
+{
+    x = 0;
+    y = 0;
+    w = INT_MAX;
+    h = INT_MAX;
+    part = 0;
+
+    if (tokens.size() < 5)
+        return false;
+
+    if (tokens[3] == "EMPTY,")
+    {
+        part = std::atoi(tokens[4].c_str());
+        return true;
+    }
+
+    if (tokens.size() < 8)
+        return false;
+
+    x = std::atoi(tokens[3].c_str());
+    y = std::atoi(tokens[4].c_str());
+    w = std::atoi(tokens[5].c_str());
+    h = std::atoi(tokens[6].c_str());
+    part = std::atoi(tokens[7].c_str());
+
+    return true;
+}
+
+/// What the callback supersedes or merges with, empty if nothing.
+std::string getCallbackKey(const std::string& callbackMsg, const std::vector<std::string>& tokens)
+{
+    if (tokens.size() < 3)
+        return std::string();
+
+    // the message is "callback <view> <id> ..."
+    const std::string& callbackType = tokens[2];
+
+    // FIXME: Good grief, why don't we use the symbolic LOK_CALLBACK_FOO names here? Doing it this
+    // way is somewhat fragile and certainly bad style.
+    if (callbackType == "0")        // invalidation
+    {
+        int x, y, w, h, part;
+        if (!extractRectangle(tokens, x, y, w, h, part))
+            return std::string();
+
+        // merges with the invalidations of the same part
+        return tokens[1] + ' ' + callbackType + ' ' + std::to_string(part);
+    }
+    else if (callbackType == "8")   // state changed
+    {
+        if (tokens.size() < 4)
+            return std::string();
+
+        // supersedes the obsolete states of the same .uno: command
+        const std::string unoCommand = extractUnoCommand(tokens[3]);
+        if (unoCommand.empty())
+            return std::string();
+
+        return tokens[1] + ' ' + callbackType + ' ' + unoCommand;
+    }
+    else if (callbackType == "1" || // the cursor has moved
+            callbackType == "5" ||  // the cursor visibility has changed
+            callbackType == "10" || // setting the indicator value
+            callbackType == "13" || // setting the document size
+            callbackType == "17")   // the cell cursor has moved
+    {
+        return tokens[1] + ' ' + callbackType;
+    }
+    else if (callbackType == "24" || // the view cursor has moved
+            callbackType == "26" ||  // the view cell cursor has moved
+            callbackType == "28")    // the view cursor visibility has changed
+    {
+        // we additionally need to ensure that the payload is about
+        // the same viewid (otherwise we'd merge them all views into
+        // one)
+        return tokens[1] + ' ' + callbackType + ' ' + extractViewId(callbackMsg, tokens);
+    }
+
+    return std::string();
+}
+
+}
+
 void TileQueue::put_impl(const Payload& value)
 {
     const std::string msg = std::string(value.data(), value.size());
@@ -31,226 +144,250 @@ void TileQueue::put_impl(const Payload& value)
 
     if (firstToken == "canceltiles")
     {
-        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(msg) << "]. Before canceltiles have " << getQueue().size() << " in queue.");
+        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(msg) << "]. Before canceltiles have " << _queue.size() << " in queue.");
         const std::string seqs = msg.substr(12);
         StringTokenizer tokens(seqs, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-        getQueue().erase(std::remove_if(getQueue().begin(), getQueue().end(),
-                [&tokens](const Payload& v)
-                {
-                    const std::string s(v.data(), v.size());
-                    // Tile is for a thumbnail, don't cancel it
-                    if (s.find("id=") != std::string::npos)
-                        return false;
-                    for (size_t i = 0; i < tokens.count(); ++i)
-                    {
-                        if (s.find("ver=" + tokens[i]) != std::string::npos)
-                        {
-                            LOG_TRC("Matched " << tokens[i] << ", Removing [" << s << "]");
-                            return true;
-                        }
-                    }
-
-                    return false;
-
-                }), getQueue().end());
+        std::set<int> versions;
+        for (size_t i = 0; i < tokens.count(); ++i)
+            versions.insert(std::atoi(tokens[i].c_str()));
+
+        for (auto it = _queue.begin(); it != _queue.end(); )
+        {
+            // Only tiles, the previews (tiles with 'id') are for thumbnails, don't cancel them.
+            if (it->second._type == QueueItem::Type::Tile &&
+                versions.count(it->second._tile->getVersion()))
+            {
+                LOG_TRC("Matched " << it->second._tile->getVersion() << ", Removing [" << it->second._tile->serialize("tile") << "]");
+                it = erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
 
         // Don't push canceltiles into the queue.
-        LOG_TRC("After canceltiles have " << getQueue().size() << " in queue.");
+        LOG_TRC("After canceltiles have " << _queue.size() << " in queue.");
         return;
     }
     else if (firstToken == "tilecombine")
     {
         // Breakup tilecombine and deduplicate (we are re-combining the tiles
         // in the get_impl() again)
-        const TileCombined tileCombined = TileCombined::parse(msg);
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(msg);
+        const bool deltas = std::find(tokens.begin(), tokens.end(), "deltas=true") != tokens.end();
+
+        const TileCombined tileCombined = TileCombined::parse(tokens);
         for (auto& tile : tileCombined.getTiles())
         {
-            const std::string newMsg = tile.serialize("tile");
-
-            removeTileDuplicate(newMsg);
+            putTile(tile, std::string(), deltas);
+        }
+        return;
+    }
+    else if (firstToken == "tilecombinebin")
+    {
+        // The same in the binary form, the suffix is text again.
+        size_t offset = firstToken.size() + 1;
+        const TileCombined tileCombined = TileCombined::parseBinary(value.data(), value.size(), offset);
+        const bool deltas = msg.find(" deltas=true", offset) != std::string::npos;
 
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+        _binaryTiles = true;
+        for (auto& tile : tileCombined.getTiles())
+        {
+            putTile(tile, std::string(), deltas);
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeTileDuplicate(msg);
-
-        MessageQueue::put_impl(value);
+        putTile(TileDesc::parse(msg), msg, false);
         return;
     }
     else if (firstToken == "callback")
     {
-        const std::string newMsg = removeCallbackDuplicate(msg);
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(msg);
+        const std::string callbackKey = getCallbackKey(msg, tokens);
+        const std::string newMsg = removeCallbackDuplicate(msg, tokens, callbackKey);
 
         if (newMsg.empty())
         {
-            MessageQueue::put_impl(value);
+            QueueItem item(QueueItem::Type::Callback, value);
+            item._tokens = tokens;
+            item._callbackKey = callbackKey;
+            push(std::move(item));
         }
         else
         {
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            QueueItem item(QueueItem::Type::Callback, Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            item._tokens = LOOLProtocol::tokenize(newMsg);
+            item._callbackKey = callbackKey;
+            push(std::move(item));
         }
 
         return;
     }
 
-    MessageQueue::put_impl(value);
+    push(QueueItem(QueueItem::Type::Other, value));
 }
 
-void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+void TileQueue::push(QueueItem&& item)
 {
-    assert(LOOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+    const uint64_t seq = _nextSeq++;
 
-    // Ver is always provided at this point and it is necessary to
-    // return back to clients the last rendered version of a tile
-    // in case there are new invalidations and requests while rendering.
-    // Here we compare duplicates without 'ver' since that's irrelevant.
-    size_t newMsgPos = tileMsg.find(" ver");
-    if (newMsgPos == std::string::npos)
+    if (item._tile)
+        _tileIndex[TileRequestKey(*item._tile)] = seq;
+
+    if (item._type == QueueItem::Type::Tile)
     {
-        newMsgPos = tileMsg.size() - 1;
+        item._priority = priority(*item._tile);
+        _tilesByPriority.emplace(-item._priority, seq);
+    }
+    else
+    {
+        _barriers.insert(seq);
     }
 
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    if (!item._callbackKey.empty())
     {
-        auto& it = getQueue()[i];
-        if (it.size() > newMsgPos &&
-            strncmp(tileMsg.data(), it.data(), newMsgPos) == 0)
-        {
-            LOG_TRC("Remove duplicate tile request: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(tileMsg));
-            getQueue().erase(getQueue().begin() + i);
-            break;
-        }
+        if (item._tokens[2] == "0")
+            _invalidations[item._callbackKey].insert(seq);
+        else
+            _callbackIndex[item._callbackKey] = seq;
     }
-}
 
-namespace {
+    _queue.emplace(seq, std::move(item));
+}
 
-/// Read the viewId from the tokens.
-std::string extractViewId(const std::string& origMsg, const std::vector<std::string>& tokens)
+std::map<uint64_t, TileQueue::QueueItem>::iterator TileQueue::erase(std::map<uint64_t, QueueItem>::iterator it)
 {
-    size_t nonJson = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
-    std::string jsonString(origMsg.data() + nonJson, origMsg.size() - nonJson);
+    const QueueItem& item = it->second;
 
-    Poco::JSON::Parser parser;
-    const Poco::Dynamic::Var result = parser.parse(jsonString);
-    const auto& json = result.extract<Poco::JSON::Object::Ptr>();
-    return json->get("viewId").toString();
-}
+    if (item._tile)
+    {
+        const auto index = _tileIndex.find(TileRequestKey(*item._tile));
+        if (index != _tileIndex.end() && index->second == it->first)
+            _tileIndex.erase(index);
+    }
 
-/// Extract the .uno: command ID from the potential command.
-std::string extractUnoCommand(const std::string& command)
-{
-    if (!LOOLProtocol::matchPrefix(".uno:", command))
-        return std::string();
+    if (item._type == QueueItem::Type::Tile)
+        _tilesByPriority.erase(std::make_pair(-item._priority, it->first));
+    else
+        _barriers.erase(it->first);
 
-    size_t equalPos = command.find('=');
-    if (equalPos != std::string::npos)
-        return command.substr(0, equalPos);
+    if (!item._callbackKey.empty())
+    {
+        if (item._tokens[2] == "0")
+        {
+            const auto invalidations = _invalidations.find(item._callbackKey);
+            if (invalidations != _invalidations.end())
+            {
+                invalidations->second.erase(it->first);
+                if (invalidations->second.empty())
+                    _invalidations.erase(invalidations);
+            }
+        }
+        else
+        {
+            const auto index = _callbackIndex.find(item._callbackKey);
+            if (index != _callbackIndex.end() && index->second == it->first)
+                _callbackIndex.erase(index);
+        }
+    }
 
-    return command;
+    return _queue.erase(it);
 }
 
-/// Extract rectangle from the invalidation callback
-bool extractRectangle(const std::vector<std::string>& tokens, int& x, int& y, int& w, int& h, int& part)
+void TileQueue::clear_impl()
 {
-    x = 0;
-    y = 0;
-    w = INT_MAX;
-    h = INT_MAX;
-    part = 0;
+    _queue.clear();
+    _tileIndex.clear();
+    _tilesByPriority.clear();
+    _barriers.clear();
+    _callbackIndex.clear();
+    _invalidations.clear();
+}
 
-    if (tokens.size() < 5)
-        return false;
+void TileQueue::putTile(const TileDesc& tile, const std::string& tileMsg, bool deltas)
+{
+    removeTileDuplicate(tile);
 
-    if (tokens[3] == "EMPTY,")
+    // Previews are handed out as they came, the other tiles get combined.
+    if (tile.getId() >= 0)
     {
-        part = std::atoi(tokens[4].c_str());
-        return true;
+        const std::string msg = (tileMsg.empty() ? tile.serialize("tile") : tileMsg);
+        QueueItem item(QueueItem::Type::Preview, Payload(msg.data(), msg.data() + msg.size()));
+        item._tile.reset(new TileDesc(tile));
+        push(std::move(item));
+        return;
     }
 
-    if (tokens.size() < 8)
-        return false;
+    QueueItem item(QueueItem::Type::Tile, Payload());
+    item._tile.reset(new TileDesc(tile));
+    item._deltas = deltas;
+    push(std::move(item));
+}
 
-    x = std::atoi(tokens[3].c_str());
-    y = std::atoi(tokens[4].c_str());
-    w = std::atoi(tokens[5].c_str());
-    h = std::atoi(tokens[6].c_str());
-    part = std::atoi(tokens[7].c_str());
+void TileQueue::removeTileDuplicate(const TileDesc& tile)
+{
+    // Ver is always provided at this point and it is necessary to
+    // return back to clients the last rendered version of a tile
+    // in case there are new invalidations and requests while rendering.
+    // Here we compare duplicates without 'ver' since that's irrelevant.
+    const auto index = _tileIndex.find(TileRequestKey(tile));
+    if (index == _tileIndex.end())
+        return;
 
-    return true;
-}
+    const auto it = _queue.find(index->second);
+    assert(it != _queue.end() && "Stale tile index.");
 
+    LOG_TRC("Remove duplicate tile request: " << it->second._tile->serialize("tile") << " -> " << tile.serialize("tile"));
+    erase(it);
 }
 
-std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
+std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg,
+                                               const std::vector<std::string>& tokens,
+                                               const std::string& callbackKey)
 {
     assert(LOOLProtocol::matchPrefix("callback", callbackMsg, /*ignoreWhitespace*/ true));
 
-    std::vector<std::string> tokens = LOOLProtocol::tokenize(callbackMsg);
-
-    if (tokens.size() < 3)
+    if (callbackKey.empty())
         return std::string();
 
-    // the message is "callback <view> <id> ..."
-    const std::string& callbackType = tokens[2];
-
-    // FIXME: Good grief, why don't we use the symbolic LOK_CALLBACK_FOO names here? Doing it this
-    // way is somewhat fragile and certainly bad style.
-    if (callbackType == "0")        // invalidation
+    if (tokens[2] == "0")        // invalidation
     {
         int msgX, msgY, msgW, msgH, msgPart;
 
         if (!extractRectangle(tokens, msgX, msgY, msgW, msgH, msgPart))
             return std::string();
 
+        const auto invalidations = _invalidations.find(callbackKey);
+        if (invalidations == _invalidations.end())
+            return std::string();
+
         bool performedMerge = false;
 
-        // we always travel the entire queue
-        size_t i = 0;
-        while (i < getQueue().size())
+        // we always travel all the invalidations of the part, copied as we
+        // remove them while merging
+        const std::vector<uint64_t> seqs(invalidations->second.begin(), invalidations->second.end());
+        for (const uint64_t seq : seqs)
         {
-            auto& it = getQueue()[i];
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
-            {
-                ++i;
-                continue;
-            }
-
-            // not a invalidation callback
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
-            {
-                ++i;
-                continue;
-            }
+            const auto it = _queue.find(seq);
+            assert(it != _queue.end() && "Stale invalidation index.");
 
             int queuedX, queuedY, queuedW, queuedH, queuedPart;
+            extractRectangle(it->second._tokens, queuedX, queuedY, queuedW, queuedH, queuedPart);
 
-            if (!extractRectangle(queuedTokens, queuedX, queuedY, queuedW, queuedH, queuedPart))
-            {
-                ++i;
-                continue;
-            }
-
-            if (msgPart != queuedPart)
-            {
-                ++i;
-                continue;
-            }
+            const Payload& queued = it->second._payload;
 
             // the invalidation in the queue is fully covered by the message,
             // just remove it
             if (msgX <= queuedX && queuedX + queuedW <= msgX + msgW && msgY <= queuedY && queuedY + queuedH <= msgY + msgH)
             {
-                LOG_TRC("Removing smaller invalidation: " << std::string(it.data(), it.size()) << " -> " <<
+                LOG_TRC("Removing smaller invalidation: " << std::string(queued.data(), queued.size()) << " -> " <<
                         tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart);
 
                 // remove from the queue
-                getQueue().erase(getQueue().begin() + i);
+                erase(it);
                 continue;
             }
 
@@ -266,12 +403,9 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                 const int reasonableSizeX = 4*3840; // 4x tile at 100% zoom
                 const int reasonableSizeY = 2*3840; // 2x tile at 100% zoom
                 if (joinW > reasonableSizeX || joinH > reasonableSizeY)
-                {
-                    ++i;
                     continue;
-                }
 
-                LOG_TRC("Merging invalidations: " << std::string(it.data(), it.size()) << " and " <<
+                LOG_TRC("Merging invalidations: " << std::string(queued.data(), queued.size()) << " and " <<
                         tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart << " -> " <<
                         tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << joinX << " " << joinY << " " << joinW << " " << joinH << " " << msgPart);
 
@@ -282,11 +416,8 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                 performedMerge = true;
 
                 // remove from the queue
-                getQueue().erase(getQueue().begin() + i);
-                continue;
+                erase(it);
             }
-
-            ++i;
         }
 
         if (performedMerge)
@@ -305,100 +436,27 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
             return result;
         }
     }
-    else if (callbackType == "8")        // state changed
+    else
     {
-        if (tokens.size() < 4)
-            return std::string();
-
-        std::string unoCommand = extractUnoCommand(tokens[3]);
-        if (unoCommand.empty())
-            return std::string();
-
-        // remove obsolete states of the same .uno: command
-        for (size_t i = 0; i < getQueue().size(); ++i)
+        // the cursor position, the state of the .uno: command etc. is
+        // obsoleted by the new one
+        const auto index = _callbackIndex.find(callbackKey);
+        if (index != _callbackIndex.end())
         {
-            auto& it = getQueue()[i];
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 4)
-                continue;
+            const auto it = _queue.find(index->second);
+            assert(it != _queue.end() && "Stale callback index.");
 
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
-                continue;
-
-            // callback, the same target, state changed; now check it's
-            // the same .uno: command
-            std::string queuedUnoCommand = extractUnoCommand(queuedTokens[3]);
-            if (queuedUnoCommand.empty())
-                continue;
-
-            if (unoCommand == queuedUnoCommand)
-            {
-                LOG_TRC("Remove obsolete uno command: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                getQueue().erase(getQueue().begin() + i);
-                break;
-            }
-        }
-    }
-    else if (callbackType == "1" || // the cursor has moved
-            callbackType == "5" ||  // the cursor visibility has changed
-            callbackType == "10" || // setting the indicator value
-            callbackType == "13" || // setting the document size
-            callbackType == "17" || // the cell cursor has moved
-            callbackType == "24" || // the view cursor has moved
-            callbackType == "26" || // the view cell cursor has moved
-            callbackType == "28")   // the view cursor visibility has changed
-    {
-        const bool isViewCallback = (callbackType == "24" || callbackType == "26" || callbackType == "28");
-
-        std::string viewId;
-        if (isViewCallback)
-        {
-            viewId = extractViewId(callbackMsg, tokens);
-        }
-
-        for (size_t i = 0; i < getQueue().size(); ++i)
-        {
-            auto& it = getQueue()[i];
-
-            // skip non-callbacks quickly
-            if (!LOOLProtocol::matchPrefix("callback", it))
-                continue;
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
-                continue;
-
-            if (!isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
-            {
-                LOG_TRC("Remove obsolete callback: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                getQueue().erase(getQueue().begin() + i);
-                break;
-            }
-            else if (isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
-            {
-                // we additionally need to ensure that the payload is about
-                // the same viewid (otherwise we'd merge them all views into
-                // one)
-                const std::string queuedViewId = extractViewId(std::string(it.data(), it.size()), queuedTokens);
-
-                if (viewId == queuedViewId)
-                {
-                    LOG_TRC("Remove obsolete view callback: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
-                    break;
-                }
-            }
+            const Payload& queued = it->second._payload;
+            LOG_TRC("Remove obsolete callback: " << std::string(queued.data(), queued.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
+            erase(it);
         }
     }
 
     return std::string();
 }
 
-int TileQueue::priority(const std::string& tileMsg)
+int TileQueue::priority(const TileDesc& tile)
 {
-    TileDesc tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
-
     for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
     {
         auto& cursor = _cursorPositions[_viewOrder[i]];
@@ -410,127 +468,120 @@ int TileQueue::priority(const std::string& tileMsg)
     return -1;
 }
 
-void TileQueue::deprioritizePreviews()
+void TileQueue::updatePriorities()
 {
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    if (!_priorityDirty)
+        return;
+
+    _priorityDirty = false;
+    _tilesByPriority.clear();
+    for (auto& it : _queue)
     {
-        const Payload front = getQueue().front();
-        const std::string message(front.data(), front.size());
+        QueueItem& item = it.second;
+        if (item._type == QueueItem::Type::Tile)
+        {
+            item._priority = priority(*item._tile);
+            _tilesByPriority.emplace(-item._priority, it.first);
+        }
+    }
+}
 
+void TileQueue::deprioritizePreviews()
+{
+    for (size_t i = _queue.size(); i > 0; --i)
+    {
         // stop at the first non-tile or non-'id' (preview) message
-        std::string id;
-        if (!LOOLProtocol::matchPrefix("tile", message) ||
-            !LOOLProtocol::getTokenStringFromMessage(message, "id", id))
+        const auto front = _queue.begin();
+        if (front->second._type != QueueItem::Type::Preview)
         {
             break;
         }
 
-        getQueue().erase(getQueue().begin());
-        getQueue().push_back(front);
+        QueueItem item(QueueItem::Type::Preview, front->second._payload);
+        item._tile.reset(new TileDesc(*front->second._tile));
+        erase(front);
+        push(std::move(item));
     }
 }
 
 TileQueue::Payload TileQueue::get_impl()
 {
-    LOG_TRC("MessageQueue depth: " << getQueue().size());
-
-    const Payload front = getQueue().front();
+    LOG_TRC("MessageQueue depth: " << _queue.size());
 
-    std::string msg(front.data(), front.size());
-
-    std::string id;
-    bool isTile = LOOLProtocol::matchPrefix("tile", msg);
-    bool isPreview = isTile && LOOLProtocol::getTokenStringFromMessage(msg, "id", id);
-    if (!isTile || isPreview)
+    const auto front = _queue.begin();
+    if (front->second._type != QueueItem::Type::Tile)
     {
         // Don't combine non-tiles or tiles with id.
-        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
-        getQueue().erase(getQueue().begin());
+        const Payload result = front->second._payload;
+        const bool isPreview = (front->second._type == QueueItem::Type::Preview);
+        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(result));
+        erase(front);
 
         // de-prioritize the other tiles with id - usually the previews in
         // Impress
         if (isPreview)
             deprioritizePreviews();
 
-        return front;
+        return result;
     }
 
+    updatePriorities();
+
     // We are handling a tile; first try to find one that is at the cursor's
-    // position, otherwise handle the one that is at the front
-    int prioritized = 0;
-    int prioritySoFar = -1;
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    // position, otherwise handle the one that is at the front.
+    // Avoid starving - only pick from before the first non-tile, otherwise we
+    // may keep growing the queue of unhandled stuff (both tiles and non-tiles).
+    const uint64_t end = (_barriers.empty() ? _nextSeq : *_barriers.begin());
+    auto prioritized = _tilesByPriority.begin();
+    while (prioritized->second >= end)
     {
-        auto& it = getQueue()[i];
-        const std::string prio(it.data(), it.size());
-
-        // avoid starving - stop the search when we reach a non-tile,
-        // otherwise we may keep growing the queue of unhandled stuff (both
-        // tiles and non-tiles)
-        if (!LOOLProtocol::matchPrefix("tile", prio) ||
-            LOOLProtocol::getTokenStringFromMessage(prio, "id", id))
-        {
-            break;
-        }
-
-        const int p = priority(prio);
-        if (p > prioritySoFar)
-        {
-            prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
-
-            // found the highest priority already?
-            if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
-            {
-                break;
-            }
-        }
+        // Even the oldest tile of this priority is too late, try the next one.
+        prioritized = _tilesByPriority.lower_bound(std::make_pair(prioritized->first + 1, uint64_t(0)));
+        assert(prioritized != _tilesByPriority.end() && "The front tile must be found.");
     }
 
-    getQueue().erase(getQueue().begin() + prioritized);
-
+    const auto top = _queue.find(prioritized->second);
     std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
+    tiles.emplace_back(*top->second._tile);
+    bool deltas = top->second._deltas;
+    erase(top);
 
     // Combine as many tiles as possible with the top one.
-    for (size_t i = 0; i < getQueue().size(); )
+    for (auto it = _queue.begin(); it != _queue.end(); )
     {
-        auto& it = getQueue()[i];
-        msg = std::string(it.data(), it.size());
-        if (!LOOLProtocol::matchPrefix("tile", msg) ||
-            LOOLProtocol::getTokenStringFromMessage(msg, "id", id))
-        {
-            // Don't combine non-tiles or tiles with id.
-            ++i;
-            continue;
-        }
-
-        TileDesc tile2 = TileDesc::parse(msg);
-        LOG_TRC("Combining candidate: " << LOOLProtocol::getAbbreviatedMessage(msg));
-
+        // Don't combine non-tiles or tiles with id.
         // Check if it's on the same row.
-        if (tiles[0].canCombine(tile2))
+        if (it->second._type == QueueItem::Type::Tile && tiles[0].canCombine(*it->second._tile))
         {
-            tiles.emplace_back(tile2);
-            getQueue().erase(getQueue().begin() + i);
+            tiles.emplace_back(*it->second._tile);
+            deltas = deltas || it->second._deltas;
+            it = erase(it);
         }
         else
         {
-            ++i;
+            ++it;
         }
     }
 
-    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueue().size() << " in queue.");
+    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << _queue.size() << " in queue.");
 
-    if (tiles.size() == 1)
+    // Deltas are handled for combined tiles only.
+    if (tiles.size() == 1 && !deltas)
     {
-        msg = tiles[0].serialize("tile");
+        const std::string msg = tiles[0].serialize("tile");
         LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
         return Payload(msg.data(), msg.data() + msg.size());
     }
 
-    std::string tileCombined = TileCombined::create(tiles).serialize("tilecombine");
+    const TileCombined combined = TileCombined::create(tiles);
+    if (_binaryTiles)
+    {
+        const std::string tileCombined = combined.serializeBinary("tilecombinebin", deltas ? " deltas=true" : "");
+        LOG_TRC("MessageQueue res: " << combined.serialize("tilecombinebin", deltas ? " deltas=true" : ""));
+        return Payload(tileCombined.data(), tileCombined.data() + tileCombined.size());
+    }
+
+    const std::string tileCombined = combined.serialize("tilecombine", deltas ? " deltas=true" : "");
     LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(tileCombined));
     return Payload(tileCombined.data(), tileCombined.data() + tileCombined.size());
 }
@@ -14,10 +14,15 @@
 #include <condition_variable>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <TileDesc.hpp>
+
 /// Thread-safe message queue (FIFO).
 template <typename T>
 class MessageQueueBase
@@ -83,7 +88,7 @@ public:
     Payload pop()
     {
         std::unique_lock<std::mutex> lock(_mutex);
-        if (_queue.empty())
+        if (!wait_impl())
             return Payload();
         return get_impl();
     }
@@ -92,7 +97,7 @@ public:
     bool isEmpty()
     {
         std::unique_lock<std::mutex> lock(_mutex);
-        return _queue.empty();
+        return !wait_impl();
     }
 
     /// Thread safe removal of all the pending messages.
@@ -115,7 +120,8 @@ protected:
         _queue.push_back(value);
     }
 
-    bool wait_impl() const
+    /// Whether there is anything to get.
+    virtual bool wait_impl() const
     {
         return _queue.size() > 0;
     }
@@ -127,7 +133,7 @@ protected:
         return result;
     }
 
-    void clear_impl()
+    virtual void clear_impl()
     {
         _queue.clear();
     }
@@ -146,6 +152,10 @@ private:
 typedef MessageQueueBase<std::vector<char>> MessageQueue;
 
 /// MessageQueue specialized for priority handling of tiles.
+///
+/// The messages are kept parsed, in the order of arrival: tiles as TileDesc,
+/// callbacks tokenized.  The tiles are further indexed by what they show, to
+/// find duplicates, and by their priority, to find the one to render next.
 class TileQueue : public MessageQueue
 {
     friend class TileQueueTests;
@@ -178,7 +188,84 @@ private:
         int _height = 0;
     };
 
+    /// A message in the queue.
+    struct QueueItem
+    {
+        enum class Type { Tile, Preview, Callback, Other };
+
+        QueueItem(Type type, const Payload& payload)
+            : _type(type)
+            , _payload(payload)
+            , _priority(-1)
+            , _deltas(false)
+        {
+        }
+
+        Type _type;
+        /// The message as it is handed out, empty for tiles which get serialized (and combined).
+        Payload _payload;
+        /// Tiles and previews (tiles with 'id') only.
+        std::unique_ptr<TileDesc> _tile;
+        /// Callbacks only.
+        std::vector<std::string> _tokens;
+        /// Callbacks only, the callbacks with the same key supersede or merge with it.
+        std::string _callbackKey;
+        /// Tiles only, see priority().
+        int _priority;
+        /// Tiles only, the requester can take deltas against its oldwid.
+        bool _deltas;
+    };
+
+    /// What makes tile requests duplicates of each other: all but the version.
+    struct TileRequestKey
+    {
+        explicit TileRequestKey(const TileDesc& tile)
+            : _key(tile.getKey())
+            , _width(tile.getWidth())
+            , _height(tile.getHeight())
+            , _oldWireId(tile.getOldWireId())
+            , _wireId(tile.getWireId())
+        {
+        }
+
+        bool operator==(const TileRequestKey& other) const
+        {
+            return _key == other._key &&
+                   _width == other._width &&
+                   _height == other._height &&
+                   _oldWireId == other._oldWireId &&
+                   _wireId == other._wireId;
+        }
+
+        TileKey _key;
+        int _width;
+        int _height;
+        TileWireId _oldWireId;
+        TileWireId _wireId;
+    };
+
+    struct TileRequestKeyHash
+    {
+        size_t operator()(const TileRequestKey& key) const
+        {
+            size_t hash = key._key;
+            hash = hash * 31 + key._width;
+            hash = hash * 31 + key._height;
+            hash = hash * 31 + key._oldWireId;
+            hash = hash * 31 + key._wireId;
+
+            return hash;
+        }
+    };
+
 public:
+    TileQueue()
+        : _nextSeq(0)
+        , _priorityDirty(false)
+        , _binaryTiles(false)
+    {
+    }
+
     void updateCursorPosition(int viewId, int part, int x, int y, int width, int height)
     {
         const TileQueue::CursorPosition cursorPosition = CursorPosition(part, x, y, width, height);
@@ -204,6 +291,7 @@ public:
         }
 
         _viewOrder.push_back(viewId);
+        _priorityDirty = true;
     }
 
     void removeCursorPosition(int viewId)
@@ -217,16 +305,36 @@ public:
         }
 
         _cursorPositions.erase(viewId);
+        _priorityDirty = true;
     }
 
 protected:
     virtual void put_impl(const Payload& value) override;
 
+    virtual bool wait_impl() const override
+    {
+        return !_queue.empty();
+    }
+
     virtual Payload get_impl() override;
 
+    virtual void clear_impl() override;
+
+    const std::map<uint64_t, QueueItem>& getQueue() const { return _queue; }
+
 private:
+    /// Append the item to the queue and index it.
+    void push(QueueItem&& item);
+
+    /// Remove the item from the queue and from the indexes.
+    /// @return The item following it.
+    std::map<uint64_t, QueueItem>::iterator erase(std::map<uint64_t, QueueItem>::iterator it);
+
+    /// Queue the tile (or preview), replacing any duplicate.
+    void putTile(const TileDesc& tile, const std::string& tileMsg, bool deltas);
+
     /// Search the queue for a duplicate tile and remove it (if present).
-    void removeTileDuplicate(const std::string& tileMsg);
+    void removeTileDuplicate(const TileDesc& tile);
 
     /// Search the queue for a duplicate callback and remove it (if present).
     ///
@@ -234,18 +342,51 @@ private:
     /// message, like the new cursor position invalidates the old one etc.
     ///
     /// @return New message to put into the queue.  If empty, use what was in callbackMsg.
-    std::string removeCallbackDuplicate(const std::string& callbackMsg);
+    std::string removeCallbackDuplicate(const std::string& callbackMsg,
+                                        const std::vector<std::string>& tokens,
+                                        const std::string& callbackKey);
 
     /// De-prioritize the previews (tiles with 'id') - move them to the end of
     /// the queue.
     void deprioritizePreviews();
 
-    /// Priority of the given tile message.
+    /// Priority of the given tile.
     /// -1 means the lowest prio (the tile does not intersect any of the cursors),
     /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    int priority(const TileDesc& tile);
+
+    /// Re-evaluate the priorities of the queued tiles if the cursors have moved.
+    void updatePriorities();
 
 private:
+    /// The messages by their sequence number, ie. in the order of arrival.
+    std::map<uint64_t, QueueItem> _queue;
+    uint64_t _nextSeq;
+
+    /// The sequence number of the queued tile (or preview) for each tile key.
+    std::unordered_map<TileRequestKey, uint64_t, TileRequestKeyHash> _tileIndex;
+
+    /// The tiles (not previews) as (-priority, sequence number), so the
+    /// oldest tile of the highest priority comes first.
+    std::set<std::pair<int, uint64_t>> _tilesByPriority;
+
+    /// The sequence numbers of anything but tiles; tiles are picked by
+    /// priority only from before the first of these to avoid starving them.
+    std::set<uint64_t> _barriers;
+
+    /// The queued callback superseded by the next one of the same key, like
+    /// the cursor position of a view, or the state of a .uno: command.
+    std::unordered_map<std::string, uint64_t> _callbackIndex;
+
+    /// The queued invalidations by view and part, in the order of arrival.
+    std::unordered_map<std::string, std::set<uint64_t>> _invalidations;
+
+    /// The cursors have changed since the priorities were evaluated.
+    bool _priorityDirty;
+
+    /// Tiles were requested with tilecombinebin, the combined ones are returned so too.
+    bool _binaryTiles;
+
     std::map<int, CursorPosition> _cursorPositions;
 
     /// Check the views in the order of how the editing (cursor movement) has
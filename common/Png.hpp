@@ -45,17 +45,32 @@
  *        Chris Wilson <chris@chris-wilson.co.uk>
  */
 
+#ifndef INCLUDED_PNG_HPP
+#define INCLUDED_PNG_HPP
+
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
 #include <zlib.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
 
 #ifdef IOS
 #include <Foundation/Foundation.h>
 #endif
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+// Kernels built for SSE2, SSE4.1 and AVX2, picked by the CPU at runtime.
+#define LOOL_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #include "Log.hpp"
 #include "SpookyV2.h"
 
@@ -83,32 +98,414 @@ extern "C"
 }
 
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
-static void
-unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+/// Unpremultiplying colour c of alpha a: get()[a][c], with no division.
+class UnpremultiplyTable
 {
-    unsigned int i;
+public:
+    static const uint8_t (*get())[256]
+    {
+        static const UnpremultiplyTable table;
+        return table._table;
+    }
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
+private:
+    UnpremultiplyTable()
+    {
+        for (int a = 0; a < 256; ++a)
+        {
+            for (int c = 0; c < 256; ++c)
+                _table[a][c] = (a == 0 ? 0 : static_cast<uint8_t>((c * 255 + a / 2) / a));
+        }
+    }
+
+    uint8_t _table[256][256];
+};
+
+/// Unpremultiplies width pixels of native endian ARGB into RGBA bytes.
+/// src and dst may be the same.
+inline void unpremultiplyRowScalar(const unsigned char* src, unsigned char* dst, size_t width)
+{
+    const uint8_t (*table)[256] = UnpremultiplyTable::get();
+    for (size_t x = 0; x < width; ++x, src += 4, dst += 4)
     {
-        uint8_t *b = &data[i];
         uint32_t pixel;
-        uint8_t  alpha;
+        std::memcpy(&pixel, src, sizeof(uint32_t));
+        const uint8_t alpha = pixel >> 24;
+        const uint8_t* const divided = table[alpha];
+        dst[0] = divided[(pixel >> 16) & 0xff];
+        dst[1] = divided[(pixel >> 8) & 0xff];
+        dst[2] = divided[pixel & 0xff];
+        dst[3] = alpha;
+    }
+}
+
+#if LOOL_X86_SIMD
+
+// Opaque pixels only swap R and B, and transparent ones become zero.
+// Runs of those, which is most of a document, are done a vector at a time.
+
+__attribute__((target("sse4.1")))
+inline void unpremultiplyRowSSE41(const unsigned char* src, unsigned char* dst, size_t width)
+{
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+    const __m128i swapRB = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+        const __m128i alpha = _mm_and_si128(pixels, alphaMask);
+        if (_mm_test_all_ones(_mm_cmpeq_epi32(alpha, alphaMask)))
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm_shuffle_epi8(pixels, swapRB));
+        else if (_mm_testz_si128(pixels, alphaMask))
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm_setzero_si128());
+        else
+            unpremultiplyRowScalar(src + x * 4, dst + x * 4, 4);
+    }
+
+    unpremultiplyRowScalar(src + x * 4, dst + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+inline void unpremultiplyRowAVX2(const unsigned char* src, unsigned char* dst, size_t width)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+    const __m256i swapRB = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
 
-        std::memcpy (&pixel, b, sizeof (uint32_t));
-        alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0)
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * 4));
+        const __m256i alpha = _mm256_and_si256(pixels, alphaMask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaMask)) == -1)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), _mm256_shuffle_epi8(pixels, swapRB));
+        else if (_mm256_testz_si256(pixels, alphaMask))
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), _mm256_setzero_si256());
+        else
+            unpremultiplyRowScalar(src + x * 4, dst + x * 4, 8);
+    }
+
+    unpremultiplyRowScalar(src + x * 4, dst + x * 4, width - x);
+}
+
+#endif
+
+typedef void (*UnpremultiplyRowFn)(const unsigned char* src, unsigned char* dst, size_t width);
+
+inline UnpremultiplyRowFn selectUnpremultiplyRow()
+{
+#if LOOL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return unpremultiplyRowAVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return unpremultiplyRowSSE41;
+#endif
+    return unpremultiplyRowScalar;
+}
+
+/// Unpremultiplies with the best kernel the CPU has.
+inline void unpremultiplyRow(const unsigned char* src, unsigned char* dst, size_t width)
+{
+    static const UnpremultiplyRowFn unpremultiply = selectUnpremultiplyRow();
+    unpremultiply(src, dst, width);
+}
+
+/// The tile content hash: 8 lanes of 64 bits, each accumulating the
+/// product of the halves of its pixel word mixed with a key, plus the
+/// neighbouring word, over stripes of 64 bytes, and scrambled every 16
+/// stripes; as in XXH3, which is what makes it vectorize well. Each row
+/// of the tile is hashed as whole stripes, its tail zero-padded to one,
+/// so every kernel gives the same hash.
+namespace TileHash
+{
+    /// Keys that the pixels get mixed with: 8 + 7 for the stripes,
+    /// 8 for the scrambling, and the last ones again for the folding.
+    static const uint64_t Secret[24] = {
+        0xb558e7931e9f3cacULL, 0x687ef840d2a9fc51ULL, 0xcc13539c90e6aeb5ULL,
+        0xe1aea09920f8ea08ULL, 0xf509b90f5d52bc75ULL, 0x7b3d1fe21302cef4ULL,
+        0xf594d37fea4c949bULL, 0x1bba1f0483afe185ULL, 0x8ace9b2dbc0398c9ULL,
+        0x23a13ca2a3bf34fcULL, 0x12ed6717ce43ac2bULL, 0xa188d2e5275f79eaULL,
+        0xa873deb0387b9969ULL, 0x4299b8779fa86c22ULL, 0x0dbadd66530fa7e9ULL,
+        0xf308620a5d1d0cb7ULL, 0x1af4a7a18a8f08bdULL, 0x5bf67ba95d924617ULL,
+        0x0a0ebd44c4979272ULL, 0x9ebec02822f75387ULL, 0xef501c41c30aa7faULL,
+        0x13b8d0c0cc68528eULL, 0xe6aa79c030b6f4a8ULL, 0xdbd29b567754c385ULL,
+    };
+
+    static const uint64_t Prime32 = 0x9E3779B1ULL;
+    static const uint64_t Prime64 = 0x9E3779B185EBCA87ULL;
+
+    static const size_t StripeSize = 64;
+    static const uint64_t StripesPerScramble = 16;
+
+    inline void scrambleScalar(uint64_t* acc)
+    {
+        for (int i = 0; i < 8; ++i)
         {
-            b[0] = b[1] = b[2] = b[3] = 0;
+            uint64_t value = acc[i];
+            value ^= value >> 47;
+            value ^= Secret[8 + 8 + i];
+            acc[i] = value * Prime32;
         }
-        else
+    }
+
+    /// Hashes count stripes of data into acc; stripes counts them all.
+    inline void hashStripesScalar(uint64_t* acc, const unsigned char* data, size_t count,
+                                  uint64_t& stripes)
+    {
+        for (size_t s = 0; s < count; ++s, data += StripeSize)
+        {
+            const uint64_t* key = Secret + (stripes % 8);
+            for (int i = 0; i < 8; ++i)
+            {
+                uint64_t value;
+                std::memcpy(&value, data + i * 8, sizeof(uint64_t));
+                const uint64_t mixed = value ^ key[i];
+                acc[i ^ 1] += value;
+                acc[i] += (mixed & 0xffffffff) * (mixed >> 32);
+            }
+
+            if (++stripes % StripesPerScramble == 0)
+                scrambleScalar(acc);
+        }
+    }
+
+#if LOOL_X86_SIMD
+    __attribute__((target("sse2")))
+    inline void hashStripesSSE2(uint64_t* acc, const unsigned char* data, size_t count,
+                                uint64_t& stripes)
+    {
+        __m128i lanes[4];
+        for (int j = 0; j < 4; ++j)
+            lanes[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + j);
+
+        const __m128i prime = _mm_set1_epi64x(Prime32);
+        for (size_t s = 0; s < count; ++s, data += StripeSize)
+        {
+            const uint64_t* key = Secret + (stripes % 8);
+            for (int j = 0; j < 4; ++j)
+            {
+                const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + j);
+                const __m128i mixed = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + j * 2)));
+                const __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+                const __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+                lanes[j] = _mm_add_epi64(lanes[j], _mm_add_epi64(product, swapped));
+            }
+
+            if (++stripes % StripesPerScramble == 0)
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    __m128i value = lanes[j];
+                    value = _mm_xor_si128(value, _mm_srli_epi64(value, 47));
+                    value = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(Secret + 16 + j * 2)));
+                    const __m128i low = _mm_mul_epu32(value, prime);
+                    const __m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+                    lanes[j] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+                }
+            }
+        }
+
+        for (int j = 0; j < 4; ++j)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + j, lanes[j]);
+    }
+
+    __attribute__((target("avx2")))
+    inline void hashStripesAVX2(uint64_t* acc, const unsigned char* data, size_t count,
+                                uint64_t& stripes)
+    {
+        __m256i lanes[2];
+        for (int j = 0; j < 2; ++j)
+            lanes[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc) + j);
+
+        const __m256i prime = _mm256_set1_epi64x(Prime32);
+        for (size_t s = 0; s < count; ++s, data += StripeSize)
+        {
+            const uint64_t* key = Secret + (stripes % 8);
+            for (int j = 0; j < 2; ++j)
+            {
+                const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data) + j);
+                const __m256i mixed = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + j * 4)));
+                const __m256i product = _mm256_mul_epu32(mixed, _mm256_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+                const __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+                lanes[j] = _mm256_add_epi64(lanes[j], _mm256_add_epi64(product, swapped));
+            }
+
+            if (++stripes % StripesPerScramble == 0)
+            {
+                for (int j = 0; j < 2; ++j)
+                {
+                    __m256i value = lanes[j];
+                    value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+                    value = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Secret + 16 + j * 4)));
+                    const __m256i low = _mm256_mul_epu32(value, prime);
+                    const __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+                    lanes[j] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+                }
+            }
+        }
+
+        for (int j = 0; j < 2; ++j)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + j, lanes[j]);
+    }
+#endif
+
+    typedef void (*HashStripesFn)(uint64_t* acc, const unsigned char* data, size_t count,
+                                  uint64_t& stripes);
+
+    /// The fastest kernel, or nullptr when there is none faster than Spooky.
+    inline HashStripesFn selectHashStripes()
+    {
+#if LOOL_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return hashStripesAVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return hashStripesSSE2;
+#endif
+        return nullptr;
+    }
+
+    /// The 128-bit product of a and b, its halves xor-ed.
+    inline uint64_t multiplyFold(uint64_t a, uint64_t b)
+    {
+        const uint64_t aLow = a & 0xffffffff;
+        const uint64_t aHigh = a >> 32;
+        const uint64_t bLow = b & 0xffffffff;
+        const uint64_t bHigh = b >> 32;
+
+        const uint64_t lowLow = aLow * bLow;
+        const uint64_t highLow = aHigh * bLow;
+        const uint64_t lowHigh = aLow * bHigh;
+        const uint64_t highHigh = aHigh * bHigh;
+
+        const uint64_t cross = (lowLow >> 32) + (highLow & 0xffffffff) + lowHigh;
+        const uint64_t upper = (highLow >> 32) + (cross >> 32) + highHigh;
+        const uint64_t lower = (cross << 32) | (lowLow & 0xffffffff);
+        return lower ^ upper;
+    }
+
+    inline uint64_t hash(HashStripesFn hashStripes, const unsigned char* pixmap,
+                         size_t startX, size_t startY, long width, long height,
+                         int bufferWidth, int bufferHeight)
+    {
+        if (bufferWidth < width || bufferHeight < height)
+            return 0; // magic invalid hash.
+
+        uint64_t acc[8] = { 0xC2B2AE3DULL, Prime64, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+                            0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL, 0x27D4EB2F165667C5ULL, Prime32 };
+        uint64_t stripes = 0;
+
+        const size_t rowSize = width * 4;
+        const size_t wholeStripes = rowSize / StripeSize;
+        const size_t tail = rowSize % StripeSize;
+        for (long y = 0; y < height; ++y)
         {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
+            const unsigned char* row = pixmap + ((startY + y) * bufferWidth + startX) * 4;
+            hashStripes(acc, row, wholeStripes, stripes);
+            if (tail)
+            {
+                unsigned char padded[StripeSize] = { 0 };
+                std::memcpy(padded, row + wholeStripes * StripeSize, tail);
+                hashStripesScalar(acc, padded, 1, stripes);
+            }
         }
+
+        uint64_t result = ((static_cast<uint64_t>(width) << 32) ^ height) * Prime64;
+        for (int i = 0; i < 4; ++i)
+            result += multiplyFold(acc[i * 2] ^ Secret[i * 2 + 9], acc[i * 2 + 1] ^ Secret[i * 2 + 10]);
+
+        result ^= result >> 37;
+        result *= 0x165667919E3779F9ULL;
+        result ^= result >> 32;
+
+        return result ? result : 1;
+    }
+}
+
+/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
+static void
+unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+{
+    unpremultiplyRow(data, data, row_info->rowbytes / 4);
+}
+
+/// PNG row filter types, as in the IHDR filter method 0.
+enum class Filter : int
+{
+    None = 0,
+    Sub = 1,
+    Up = 2,
+    Average = 3,
+    Paeth = 4,
+    /// Choose per row, by the smallest sum of absolute differences, as libpng does.
+    Adaptive = -1
+};
+
+/// How we encode PNGs: which encoder, and its settings.
+/// Read once from the environment: LOOL_PNG_ENCODER (deflate or libpng),
+/// LOOL_PNG_LEVEL (0-9) and LOOL_PNG_FILTER (none, sub, up, average,
+/// paeth or adaptive), which loolwsd sets from its config.
+struct EncoderOptions
+{
+    /// Use libpng rather than writing the PNG directly with zlib.
+    bool _useLibPng;
+    /// The zlib compression level.
+    int _level;
+    Filter _filter;
+};
+
+inline EncoderOptions readEncoderOptions()
+{
+    EncoderOptions options;
+    options._useLibPng = false;
+#if MOBILEAPP
+    options._level = Z_BEST_SPEED;
+#else
+    // Level 4 gives virtually identical compression
+    // ratio to level 6, but is between 5-10% faster.
+    // Level 3 runs almost twice as fast, but the
+    // output is typically 2-3x larger.
+    options._level = 4;
+#endif
+    // Document tiles are mostly flat colour and text, which compress
+    // best, and by far fastest, unfiltered.
+    options._filter = Filter::None;
+
+    const char* encoder = std::getenv("LOOL_PNG_ENCODER");
+    if (encoder)
+        options._useLibPng = (std::strcmp(encoder, "libpng") == 0);
+
+    const char* level = std::getenv("LOOL_PNG_LEVEL");
+    if (level && *level)
+        options._level = std::max(0, std::min(9, std::atoi(level)));
+
+    const char* filter = std::getenv("LOOL_PNG_FILTER");
+    if (filter)
+    {
+        const std::string name = filter;
+        if (name == "none")
+            options._filter = Filter::None;
+        else if (name == "sub")
+            options._filter = Filter::Sub;
+        else if (name == "up")
+            options._filter = Filter::Up;
+        else if (name == "average")
+            options._filter = Filter::Average;
+        else if (name == "paeth")
+            options._filter = Filter::Paeth;
+        else if (name == "adaptive")
+            options._filter = Filter::Adaptive;
     }
+
+    return options;
+}
+
+inline const EncoderOptions& getEncoderOptions()
+{
+    static const EncoderOptions options = readEncoderOptions();
+    return options;
 }
 
 /// This function uses setjmp which may clobbers non-trivial objects.
@@ -121,7 +518,8 @@ unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 /// png_write_row(), so can't use const here for pixmap.
 inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                                       int width, int height, int bufferWidth, int bufferHeight,
-                                      std::vector<char>& output, LibreOfficeKitTileMode mode)
+                                      std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                      const EncoderOptions& options)
 {
     if (bufferWidth < width || bufferHeight < height)
     {
@@ -138,19 +536,16 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
         return false;
     }
 
-#if MOBILEAPP
-    png_set_compression_level(png_ptr, Z_BEST_SPEED);
-#else
-    // Level 4 gives virtually identical compression
-    // ratio to level 6, but is between 5-10% faster.
-    // Level 3 runs almost twice as fast, but the
-    // output is typically 2-3x larger.
-    png_set_compression_level(png_ptr, 4);
-#endif
-
-#ifdef IOS
-    auto initialSize = output.size();
-#endif
+    png_set_compression_level(png_ptr, options._level);
+    switch (options._filter)
+    {
+        case Filter::None: png_set_filter(png_ptr, 0, PNG_FILTER_NONE); break;
+        case Filter::Sub: png_set_filter(png_ptr, 0, PNG_FILTER_SUB); break;
+        case Filter::Up: png_set_filter(png_ptr, 0, PNG_FILTER_UP); break;
+        case Filter::Average: png_set_filter(png_ptr, 0, PNG_FILTER_AVG); break;
+        case Filter::Paeth: png_set_filter(png_ptr, 0, PNG_FILTER_PAETH); break;
+        case Filter::Adaptive: break;
+    }
 
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
@@ -175,15 +570,273 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
 
-#ifdef IOS
-    auto base64 = [[NSData dataWithBytesNoCopy:output.data() + initialSize length:(output.size() - initialSize) freeWhenDone:NO] base64EncodedDataWithOptions:0];
+    return true;
+}
+
+/// A zlib stream, kept per thread for reuse as setting one up is costly.
+class Deflater
+{
+public:
+    Deflater(int level, int strategy)
+        : _level(level),
+          _strategy(strategy)
+    {
+        std::memset(&_stream, 0, sizeof(_stream));
+        _valid = (deflateInit2(&_stream, level, Z_DEFLATED, 15, 8, strategy) == Z_OK);
+    }
 
-    const char dataURLStart[] = "data:image/png;base64,";
+    ~Deflater()
+    {
+        if (_valid)
+            deflateEnd(&_stream);
+    }
 
-    output.resize(initialSize);
-    output.insert(output.end(), dataURLStart, dataURLStart + sizeof(dataURLStart)-1);
-    output.insert(output.end(), (char*)base64.bytes, (char*)base64.bytes + base64.length);
-#endif
+    Deflater(const Deflater&) = delete;
+    Deflater& operator=(const Deflater&) = delete;
+
+    /// Returns this thread's deflater for the given settings.
+    static Deflater& get(std::unique_ptr<Deflater>& deflater, int level, int strategy)
+    {
+        if (!deflater || deflater->_level != level || deflater->_strategy != strategy)
+            deflater.reset(new Deflater(level, strategy));
+        return *deflater;
+    }
+
+    /// Compresses size bytes of data, in one go, into a zlib stream appended to output.
+    bool compress(const unsigned char* data, size_t size, std::vector<unsigned char>& output)
+    {
+        if (!_valid || deflateReset(&_stream) != Z_OK)
+            return false;
+
+        const size_t start = output.size();
+        const size_t bound = deflateBound(&_stream, size);
+        output.resize(start + bound);
+
+        _stream.next_in = const_cast<Bytef*>(data);
+        _stream.avail_in = size;
+        _stream.next_out = output.data() + start;
+        _stream.avail_out = bound;
+        const int rc = deflate(&_stream, Z_FINISH);
+        output.resize(start + bound - _stream.avail_out);
+        return rc == Z_STREAM_END;
+    }
+
+private:
+    const int _level;
+    const int _strategy;
+    z_stream _stream;
+    bool _valid;
+};
+
+inline void appendUInt32BE(std::vector<char>& output, uint32_t value)
+{
+    const char bytes[4] = { static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+                            static_cast<char>(value >> 8), static_cast<char>(value) };
+    output.insert(output.end(), bytes, bytes + 4);
+}
+
+/// Appends a PNG chunk: length, type, data and the CRC of the latter two.
+inline void appendChunk(std::vector<char>& output, const char* type,
+                        const unsigned char* data, size_t size)
+{
+    appendUInt32BE(output, size);
+    output.insert(output.end(), type, type + 4);
+    output.insert(output.end(), data, data + size);
+
+    uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    if (size > 0)
+        crc = crc32(crc, data, size);
+    appendUInt32BE(output, crc);
+}
+
+/// Converts a row of native endian premultiplied ARGB to RGBA, or copies RGBA.
+inline void convertRow(const unsigned char* src, unsigned char* dst, int width,
+                       LibreOfficeKitTileMode mode)
+{
+    if (mode == LOK_TILEMODE_BGRA)
+        unpremultiplyRow(src, dst, width);
+    else
+        std::memcpy(dst, src, width * 4);
+}
+
+inline unsigned char paethPredictor(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return (pb <= pc ? b : c);
+}
+
+/// Filters a row of size bytes of RGBA into out, given the previous (unfiltered) row.
+inline void filterRow(Filter filter, const unsigned char* row, const unsigned char* prior,
+                      unsigned char* out, size_t size)
+{
+    const size_t bpp = 4;
+    switch (filter)
+    {
+        case Filter::None:
+        case Filter::Adaptive:
+            std::memcpy(out, row, size);
+            break;
+        case Filter::Sub:
+            std::memcpy(out, row, bpp);
+            for (size_t i = bpp; i < size; ++i)
+                out[i] = row[i] - row[i - bpp];
+            break;
+        case Filter::Up:
+            for (size_t i = 0; i < size; ++i)
+                out[i] = row[i] - prior[i];
+            break;
+        case Filter::Average:
+            for (size_t i = 0; i < bpp; ++i)
+                out[i] = row[i] - (prior[i] >> 1);
+            for (size_t i = bpp; i < size; ++i)
+                out[i] = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+            break;
+        case Filter::Paeth:
+            for (size_t i = 0; i < bpp; ++i)
+                out[i] = row[i] - paethPredictor(0, prior[i], 0);
+            for (size_t i = bpp; i < size; ++i)
+                out[i] = row[i] - paethPredictor(row[i - bpp], prior[i], prior[i - bpp]);
+            break;
+    }
+}
+
+/// Filters a row with each filter, and keeps the one with the smallest
+/// sum of absolute (signed) values, which tends to compress best.
+inline Filter filterRowAdaptive(const unsigned char* row, const unsigned char* prior,
+                                unsigned char* out, unsigned char* scratch, size_t size)
+{
+    static const Filter filters[] = { Filter::None, Filter::Sub, Filter::Up,
+                                      Filter::Average, Filter::Paeth };
+    Filter best = Filter::None;
+    uint64_t bestSum = UINT64_MAX;
+    unsigned char* bestRow = out;
+    unsigned char* candidate = scratch;
+    for (const Filter filter : filters)
+    {
+        filterRow(filter, row, prior, candidate, size);
+
+        // Give up on a filter as soon as it's worse than the best so far.
+        uint64_t sum = 0;
+        for (size_t i = 0; i < size && sum < bestSum; i += 256)
+        {
+            const size_t end = std::min(size, i + 256);
+            for (size_t j = i; j < end; ++j)
+                sum += std::abs(static_cast<signed char>(candidate[j]));
+        }
+
+        if (sum < bestSum)
+        {
+            bestSum = sum;
+            best = filter;
+            std::swap(bestRow, candidate);
+        }
+    }
+
+    if (bestRow != out)
+        std::memcpy(out, bestRow, size);
+
+    return best;
+}
+
+/// Writes the PNG directly: filters all rows into one buffer and deflates that
+/// in one go with a reused zlib stream. A tile of a single colour, as most
+/// background tiles are, filters to zeros and is compressed run-length only.
+inline bool impl_encodeSubBufferToPNGDeflate(const unsigned char* pixmap, size_t startX, size_t startY,
+                                             int width, int height, int bufferWidth, int bufferHeight,
+                                             std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                             const EncoderOptions& options)
+{
+    if (bufferWidth < width || bufferHeight < height || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    const size_t rowSize = width * 4;
+    const size_t stride = bufferWidth * 4;
+    const unsigned char* const first = pixmap + (startY * stride) + (startX * 4);
+
+    bool singleColour = true;
+    for (int y = 0; y < height && singleColour; ++y)
+    {
+        const unsigned char* row = first + y * stride;
+        for (size_t x = 4; x < rowSize; x += 4)
+        {
+            if (std::memcmp(row + x, first, 4) != 0)
+            {
+                singleColour = false;
+                break;
+            }
+        }
+
+        if (y > 0 && singleColour && std::memcmp(row, first, 4) != 0)
+            singleColour = false;
+    }
+
+    // The filtered rows, each prefixed by its filter type.
+    static thread_local std::vector<unsigned char> filtered;
+    static thread_local std::vector<unsigned char> rows;
+    static thread_local std::vector<unsigned char> scratch;
+    static thread_local std::vector<unsigned char> compressed;
+    filtered.resize((rowSize + 1) * height);
+    rows.resize(rowSize * 2);
+    scratch.resize(rowSize);
+
+    unsigned char* row = rows.data();
+    unsigned char* prior = rows.data() + rowSize;
+    std::memset(prior, 0, rowSize);
+    for (int y = 0; y < height; ++y)
+    {
+        convertRow(first + y * stride, row, width, mode);
+
+        unsigned char* out = filtered.data() + y * (rowSize + 1);
+        Filter filter = options._filter;
+        if (singleColour)
+        {
+            // Sub zeroes all but the first pixel, Up all of the following rows.
+            filter = (y == 0 ? Filter::Sub : Filter::Up);
+            filterRow(filter, row, prior, out + 1, rowSize);
+        }
+        else if (filter == Filter::Adaptive)
+            filter = filterRowAdaptive(row, prior, out + 1, scratch.data(), rowSize);
+        else
+            filterRow(filter, row, prior, out + 1, rowSize);
+
+        out[0] = static_cast<unsigned char>(filter);
+        std::swap(row, prior);
+    }
+
+    static thread_local std::unique_ptr<Deflater> deflater;
+    static thread_local std::unique_ptr<Deflater> rleDeflater;
+    Deflater& activeDeflater = singleColour
+        ? Deflater::get(rleDeflater, Z_BEST_SPEED, Z_RLE)
+        : Deflater::get(deflater, options._level,
+                        options._filter == Filter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+
+    compressed.clear();
+    if (!activeDeflater.compress(filtered.data(), filtered.size(), compressed))
+        return false;
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    output.reserve(output.size() + sizeof(signature) + 25 + compressed.size() + 12 + 12);
+    output.insert(output.end(), signature, signature + sizeof(signature));
+
+    const unsigned char header[13] = {
+        static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+        8, // Bit depth.
+        6, // RGBA.
+        0, 0, 0 // Deflate, adaptive filtering, not interlaced.
+    };
+    appendChunk(output, "IHDR", header, sizeof(header));
+    appendChunk(output, "IDAT", compressed.data(), compressed.size());
+    appendChunk(output, "IEND", nullptr, 0);
 
     return true;
 }
@@ -192,12 +845,33 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
 /// png_write_row(), so can't use const here for pixmap.
 inline bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY, int width,
                                  int height, int bufferWidth, int bufferHeight,
-                                 std::vector<char>& output, LibreOfficeKitTileMode mode)
+                                 std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                 const EncoderOptions& options = getEncoderOptions())
 {
     const auto start = std::chrono::steady_clock::now();
 
-    const bool res = impl_encodeSubBufferToPNG(pixmap, startX, startY, width, height, bufferWidth,
-                                               bufferHeight, output, mode);
+#ifdef IOS
+    auto initialSize = output.size();
+#endif
+
+    const bool res = options._useLibPng
+        ? impl_encodeSubBufferToPNG(pixmap, startX, startY, width, height, bufferWidth,
+                                    bufferHeight, output, mode, options)
+        : impl_encodeSubBufferToPNGDeflate(pixmap, startX, startY, width, height, bufferWidth,
+                                           bufferHeight, output, mode, options);
+
+#ifdef IOS
+    if (res)
+    {
+        auto base64 = [[NSData dataWithBytesNoCopy:output.data() + initialSize length:(output.size() - initialSize) freeWhenDone:NO] base64EncodedDataWithOptions:0];
+
+        const char dataURLStart[] = "data:image/png;base64,";
+
+        output.resize(initialSize);
+        output.insert(output.end(), dataURLStart, dataURLStart + sizeof(dataURLStart)-1);
+        output.insert(output.end(), (char*)base64.bytes, (char*)base64.bytes + base64.length);
+    }
+#endif
     if (Log::traceEnabled())
     {
         const auto end = std::chrono::steady_clock::now();
@@ -231,9 +905,29 @@ uint64_t hashBuffer(unsigned char* pixmap, long width, long height)
     return SpookyHash::Hash64(pixmap, width * height * 4, 1073741789);
 }
 
+inline
+uint64_t hashSubBufferSpooky(unsigned char* pixmap, size_t startX, size_t startY,
+                             long width, long height, int bufferWidth, int bufferHeight);
+
+/// Hashes the tile content with the best kernel the CPU has. The hash
+/// depends on the CPU, so it's only to be compared within the process.
 inline
 uint64_t hashSubBuffer(unsigned char* pixmap, size_t startX, size_t startY,
                        long width, long height, int bufferWidth, int bufferHeight)
+{
+    static const TileHash::HashStripesFn hashStripes = TileHash::selectHashStripes();
+    if (!hashStripes)
+        return hashSubBufferSpooky(pixmap, startX, startY, width, height,
+                                   bufferWidth, bufferHeight);
+
+    return TileHash::hash(hashStripes, pixmap, startX, startY, width, height,
+                          bufferWidth, bufferHeight);
+}
+
+/// Spooky hash of the tile content, portable but slower than the vector kernels.
+inline
+uint64_t hashSubBufferSpooky(unsigned char* pixmap, size_t startX, size_t startY,
+                             long width, long height, int bufferWidth, int bufferHeight)
 {
     if (bufferWidth < width || bufferHeight < height)
         return 0; // magic invalid hash.
@@ -326,4 +1020,6 @@ std::vector<png_bytep> decodePNG(std::stringstream& stream, png_uint_32& height,
 
 }
 
+#endif
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -56,7 +56,9 @@ Session::Session(const std::string& name, const std::string& id, bool readOnly)
     _docPassword(""),
     _haveDocPassword(false),
     _isDocPasswordProtected(false),
-    _watermarkOpacity(0.2)
+    _watermarkOpacity(0.2),
+    _acceptsTileDeltas(false),
+    _acceptsTileCombined(false)
 {
 }
 
@@ -76,6 +78,14 @@ bool Session::sendBinaryFrame(const char *buffer, int length)
     return sendMessage(buffer, length, WSOpCode::Binary) >= length;
 }
 
+bool Session::sendBinaryFrame(const char* header, int length,
+                              const std::shared_ptr<const std::vector<char>>& body)
+{
+    const int total = length + (body ? body->size() : 0);
+    LOG_TRC(getName() << ": Send: " << std::to_string(total) << " binary bytes.");
+    return sendMessage(header, length, body, WSOpCode::Binary) >= total;
+}
+
 void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part, std::string& timestamp, std::string& doctemplate)
 {
     // First token is the "load" command itself.
@@ -162,6 +172,16 @@ void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part,
             _watermarkOpacity = std::stod(value);
             ++offset;
         }
+        else if (name == "deltas")
+        {
+            _acceptsTileDeltas = value == "true";
+            ++offset;
+        }
+        else if (name == "tilecombine")
+        {
+            _acceptsTileCombined = value == "true";
+            ++offset;
+        }
         else if (name == "timestamp")
         {
             timestamp = value;
@@ -275,6 +295,8 @@ void Session::dumpState(std::ostream& os)
        << "\n\t\tuserId: " << _userId
        << "\n\t\tuserName: " << _userName
        << "\n\t\tlang: " << _lang
+       << "\n\t\tacceptsTileDeltas: " << _acceptsTileDeltas
+       << "\n\t\tacceptsTileCombined: " << _acceptsTileCombined
        << "\n";
 }
 
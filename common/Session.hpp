@@ -42,6 +42,10 @@ public:
 
     virtual bool sendBinaryFrame(const char* buffer, int length);
     virtual bool sendTextFrame(const char* buffer, const int length);
+
+    /// Sends the header followed by the shared body in one binary frame, without copying the body.
+    bool sendBinaryFrame(const char* header, int length,
+                         const std::shared_ptr<const std::vector<char>>& body);
     bool sendTextFrame(const std::string& text)
     {
         return sendTextFrame(text.data(), text.size());
@@ -110,6 +114,12 @@ public:
 
     const std::string& getLang() const { return _lang; }
 
+    /// Whether the client can apply tile deltas, instead of getting whole pngs.
+    bool acceptsTileDeltas() const { return _acceptsTileDeltas; }
+
+    /// Whether the client can take tiles combined in one 'tilecombine:' response.
+    bool acceptsTileCombined() const { return _acceptsTileCombined; }
+
     bool getHaveDocPassword() const { return _haveDocPassword; }
 
     const std::string& getDocPassword() const { return _docPassword; }
@@ -212,6 +222,12 @@ private:
 
     /// Language for the document based on what the user has in the UI.
     std::string _lang;
+
+    /// Whether the client can apply tile deltas, instead of getting whole pngs.
+    bool _acceptsTileDeltas;
+
+    /// Whether the client can take tiles combined in one 'tilecombine:' response.
+    bool _acceptsTileCombined;
 };
 
 #endif
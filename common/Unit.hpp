@@ -215,7 +215,7 @@ public:
     /// Called before the lookupTile call returns. Should always be called to fire events.
     virtual void lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
                             int tileWidth, int tileHeight,
-                            std::shared_ptr<std::vector<char>> &tile);
+                            std::shared_ptr<const std::vector<char>> &tile);
 
     // ---------------- DocumentBroker hooks ----------------
     virtual bool filterLoad(const std::string& /* sessionId */,
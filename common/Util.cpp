@@ -14,6 +14,7 @@
 #include <csignal>
 #include <sys/poll.h>
 #ifdef __linux
+#include <sched.h>
 #include <sys/prctl.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
@@ -27,6 +28,7 @@
 #include <dirent.h>
 #include <time.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -390,6 +392,39 @@ namespace Util
         return totalMemKb;
     }
 
+    int getAvailableCpuCount()
+    {
+        int count = std::thread::hardware_concurrency();
+#ifdef __linux
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+            count = CPU_COUNT(&cpuSet);
+
+        // A CFS quota (cgroup v2, else v1) can give us less than the CPUs we may run on.
+        long quota = -1;
+        long period = 0;
+        std::ifstream cpuMax("/sys/fs/cgroup/cpu.max");
+        std::string quotaStr;
+        if (cpuMax >> quotaStr >> period)
+        {
+            if (quotaStr != "max")
+                quota = std::strtol(quotaStr.c_str(), nullptr, 10);
+        }
+        else
+        {
+            std::ifstream quotaFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            std::ifstream periodFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            if (!(quotaFile >> quota && periodFile >> period))
+                quota = -1;
+        }
+
+        if (quota > 0 && period > 0)
+            count = std::min<long>(count, std::max<long>(1, (quota + period - 1) / period));
+#endif
+        return std::max(count, 1);
+    }
+
     std::pair<size_t, size_t> getPssAndDirtyFromSMaps(FILE* file)
     {
         size_t numPSSKb = 0;
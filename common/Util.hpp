@@ -132,6 +132,9 @@ namespace Util
     /// Returns the total physical memory (in kB) available in the system
     size_t getTotalSystemMemoryKb();
 
+    /// Returns the number of CPUs we may run on, bounded by any cgroup CPU quota.
+    int getAvailableCpuCount();
+
     /// Returns the process PSS in KB (works only when we have perms for /proc/pid/smaps).
     size_t getMemoryUsagePSS(const Poco::Process::PID pid);
 
@@ -183,8 +186,9 @@ namespace Util
     }
 
     /// Dump a lineof data as hex
+    template <typename T>
     inline std::string stringifyHexLine(
-                            const std::vector<char> &buffer,
+                            const T &buffer,
                             unsigned int offset,
                             const unsigned int width = 32)
     {
@@ -216,8 +220,9 @@ namespace Util
     }
 
     /// Dump data as hex and chars to stream
+    template <typename T>
     inline void dumpHex (std::ostream &os, const char *legend, const char *prefix,
-                         const std::vector<char> &buffer, bool skipDup = true,
+                         const T &buffer, bool skipDup = true,
                          const unsigned int width = 32)
     {
         unsigned int j;
@@ -258,9 +263,9 @@ namespace Util
         dumpHex(os, legend, prefix, buffer, skipDup, width);
     }
 
+    template <typename It>
     inline std::string dumpHex (const char *legend, const char *prefix,
-                                const std::vector<char>::iterator &startIt,
-                                const std::vector<char>::iterator &endIt,
+                                const It &startIt, const It &endIt,
                                 bool skipDup = true, const unsigned int width = 32)
     {
         std::ostringstream oss;
@@ -9,31 +9,63 @@
 #ifndef INCLUDED_DELTA_HPP
 #define INCLUDED_DELTA_HPP
 
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <assert.h>
+#include <zlib.h>
+#define LOK_USE_UNSTABLE_API
+#include <LibreOfficeKit/LibreOfficeKitEnums.h>
 #include <Log.hpp>
+#include <Png.hpp>
 
 #ifndef TILE_WIRE_ID
 #  define TILE_WIRE_ID
    typedef uint32_t TileWireId;
 #endif
 
-/// A quick and dirty delta generator for last tile changes
+/// Generates deltas between the last tiles rendered, so that a client
+/// having the tile of one wire-id can be sent just what changed since.
+///
+/// A delta is 'D' followed by a zlib stream of commands, applied in order
+/// to a copy of the old tile. Rows and columns are bytes, so only tiles of
+/// up to 256x256 pixels get deltas. Pixels are RGBA, as in the pngs.
+///   'c' <count> <src row> <dest row> - copy count rows of the old tile.
+///   'd' <row> <column> <count> <count RGBA pixels> - new pixels.
 class DeltaGenerator {
 
     struct DeltaBitmapRow {
     private:
-        uint64_t _crc;
+        uint64_t _hash;
         std::vector<uint32_t> _pixels;
 
     public:
+        DeltaBitmapRow()
+            : _hash(0)
+        {
+        }
+
         bool identical(const DeltaBitmapRow &other) const
         {
-            if (_crc != other._crc)
+            if (_hash != other._hash)
                 return false;
             return _pixels == other._pixels;
         }
 
+        uint64_t getHash() const
+        {
+            return _hash;
+        }
+
+        void setHash(uint64_t hash)
+        {
+            _hash = hash;
+        }
+
         const std::vector<uint32_t>& getPixels() const
         {
             return _pixels;
@@ -86,14 +118,43 @@ class DeltaGenerator {
             return _rows;
         }
 
+        /// Indexes the rows by hash, once they are all set.
+        void indexRows()
+        {
+            _rowIndex.reserve(_rows.size());
+            for (int y = static_cast<int>(_rows.size()) - 1; y >= 0; --y)
+                _rowIndex[_rows[y].getHash()] = y;
+        }
+
+        /// The first row identical to row, or -1.
+        int findRow(const DeltaBitmapRow& row) const
+        {
+            const auto it = _rowIndex.find(row.getHash());
+            if (it != _rowIndex.end() && _rows[it->second].identical(row))
+                return it->second;
+            return -1;
+        }
+
     private:
         TileWireId _wid;
         int _width;
         int _height;
         std::vector<DeltaBitmapRow> _rows;
+        /// The first row of each row hash.
+        std::unordered_map<uint64_t, int> _rowIndex;
     };
-    std::vector<std::shared_ptr<DeltaData>> _deltaEntries;
 
+    /// The number of tiles kept by default to make deltas against.
+    static const size_t DefaultMaxEntries = 128;
+
+    /// Guards the entries, the deltas are made outside of it.
+    std::mutex _mutex;
+    size_t _maxEntries;
+    /// Least recently used first.
+    std::list<std::shared_ptr<const DeltaData>> _deltaEntries;
+    std::unordered_map<TileWireId, std::list<std::shared_ptr<const DeltaData>>::iterator> _deltaIndex;
+
+    /// Appends the commands turning prev into cur to output.
     bool makeDelta(
         const DeltaData &prev,
         const DeltaData &cur,
@@ -107,7 +168,6 @@ class DeltaGenerator {
             return false;
         }
 
-        output.push_back('D');
         LOG_TRC("building delta of a " << cur.getWidth() << "x" << cur.getHeight() << " bitmap");
 
         // row move/copy src/dest is a byte.
@@ -116,79 +176,73 @@ class DeltaGenerator {
         assert (prev.getWidth() <= 256);
 
         // How do the rows look against each other ?
-        size_t lastMatchOffset = 0;
         size_t lastCopy = 0;
-        for (int y = 0; y < prev.getHeight(); ++y)
+        for (int y = 0; y < cur.getHeight(); ++y)
         {
+            const DeltaBitmapRow &curRow = cur.getRows()[y];
+
             // Life is good where rows match:
-            if (prev.getRows()[y].identical(cur.getRows()[y]))
+            if (prev.getRows()[y].identical(curRow))
                 continue;
 
-            // Hunt for other rows
-            bool matched = false;
-            for (int yn = 0; yn < prev.getHeight() && !matched; ++yn)
+            // Continue the last copy where we can, as when scrolling, else hunt for the row.
+            if (lastCopy > 0)
             {
-                size_t match = (y + lastMatchOffset + yn) % prev.getHeight();
-                if (prev.getRows()[match].identical(cur.getRows()[y]))
+                const uint8_t count = output[lastCopy];
+                const int next = static_cast<uint8_t>(output[lastCopy + 1]) + count;
+                if (static_cast<uint8_t>(output[lastCopy + 2]) + count == y &&
+                    next < prev.getHeight() && count < 255 &&
+                    prev.getRows()[next].identical(curRow))
                 {
-                    // TODO: if offsets are >256 - use 16bits?
-                    if (lastCopy > 0)
-                    {
-                        char cnt = output[lastCopy];
-                        if (output[lastCopy + 1] + cnt == (char)(match) &&
-                            output[lastCopy + 2] + cnt == (char)(y))
-                        {
-                            output[lastCopy]++;
-                            matched = true;
-                            continue;
-                        }
-                    }
-
-                    lastMatchOffset = match - y;
-                    output.push_back('c');   // copy-row
-                    lastCopy = output.size();
-                    output.push_back(1);     // count
-                    output.push_back(match); // src
-                    output.push_back(y);     // dest
-
-                    matched = true;
+                    output[lastCopy]++;
                     continue;
                 }
             }
-            if (matched)
+
+            const int match = prev.findRow(curRow);
+            if (match >= 0)
+            {
+                output.push_back('c');   // copy-row
+                lastCopy = output.size();
+                output.push_back(1);     // count
+                output.push_back(match); // src
+                output.push_back(y);     // dest
                 continue;
+            }
 
             // Our row is just that different:
-            const DeltaBitmapRow &curRow = cur.getRows()[y];
             const DeltaBitmapRow &prevRow = prev.getRows()[y];
-            for (int x = 0; x < prev.getWidth();)
+            const uint32_t* prevPixels = prevRow.getPixels().data();
+            const uint32_t* curPixels = curRow.getPixels().data();
+            const int width = cur.getWidth();
+            for (int x = 0; x < width;)
             {
-                int same;
-                for (same = 0; same + x < prev.getWidth() &&
-                         prevRow.getPixels()[x+same] == curRow.getPixels()[x+same];)
-                    ++same;
-
-                x += same;
-
-                int diff;
-                for (diff = 0; diff + x < prev.getWidth() &&
-                         (prevRow.getPixels()[x+diff] == curRow.getPixels()[x+diff] || diff < 2) &&
-                         diff < 254;)
-                    ++diff;
-                if (diff > 0)
-                {
-                    output.push_back('d');
-                    output.push_back(y);
-                    output.push_back(x);
-                    output.push_back(diff);
+                while (x < width && prevPixels[x] == curPixels[x])
+                    ++x;
 
-                    size_t dest = output.size();
-                    output.resize(dest + diff * 4);
-                    memcpy(&output[dest], &curRow.getPixels()[x], diff * 4);
+                if (x >= width)
+                    break;
 
-                    LOG_TRC("different " << diff << "pixels");
-                    x += diff;
+                // Run over the changed pixels, and short gaps of unchanged ones,
+                // cheaper to send than to start a new run.
+                int diff = 1;
+                for (int scan = 1; x + scan < width && scan < 255 && scan - diff < 4; ++scan)
+                {
+                    if (prevPixels[x + scan] != curPixels[x + scan])
+                        diff = scan + 1;
                 }
+
+                output.push_back('d');
+                output.push_back(y);
+                output.push_back(x);
+                output.push_back(diff);
+
+                const size_t dest = output.size();
+                output.resize(dest + diff * 4);
+                std::memcpy(&output[dest], &curPixels[x], diff * 4);
+
+                LOG_TRC("different " << diff << " pixels");
+                x += diff;
             }
         }
 
@@ -197,9 +251,10 @@ class DeltaGenerator {
 
     std::shared_ptr<DeltaData> dataToDeltaData(
         TileWireId wid,
-        unsigned char* pixmap, size_t startX, size_t startY,
+        const unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
-        int bufferWidth, int bufferHeight)
+        int bufferWidth, int bufferHeight,
+        LibreOfficeKitTileMode mode)
     {
         auto data = std::make_shared<DeltaData>();
         data->setWid(wid);
@@ -220,52 +275,160 @@ class DeltaGenerator {
         {
             DeltaBitmapRow &row = data->getRows()[y];
             size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-            int32_t *src = reinterpret_cast<int32_t *>(pixmap + position);
-
-            // We get the hash ~for free as we copy - with a cheap hash.
-            uint64_t crc = 0x7fffffff - 1;
             row.getPixels().resize(width);
-            for (int x = 0; x < width; ++x)
-            {
-                crc = (crc << 7) + crc + src[x];
-                row.getPixels()[x] = src[x];
-            }
+            unsigned char* pixels = reinterpret_cast<unsigned char*>(row.getPixels().data());
+            if (mode == LOK_TILEMODE_BGRA)
+                Png::unpremultiplyRow(pixmap + position, pixels, width);
+            else
+                std::memcpy(pixels, pixmap + position, width * 4);
+
+            // A cheap hash, only to find candidate rows.
+            uint64_t hash = 0x7fffffff - 1;
+            for (const uint32_t pixel : row.getPixels())
+                hash = (hash << 7) + hash + pixel;
+            row.setHash(hash);
         }
 
+        data->indexRows();
+        return data;
+    }
+
+    /// Finds the entry of wid, and makes it the most recently used.
+    std::shared_ptr<const DeltaData> findEntry(TileWireId wid)
+    {
+        const auto it = _deltaIndex.find(wid);
+        if (it == _deltaIndex.end())
+            return nullptr;
+
+        _deltaEntries.splice(_deltaEntries.end(), _deltaEntries, it->second);
+        return *it->second;
+    }
+
+    void addEntry(const std::shared_ptr<const DeltaData>& data)
+    {
+        if (_deltaIndex.find(data->getWid()) != _deltaIndex.end())
+            return;
+
+        while (!_deltaEntries.empty() && _deltaEntries.size() >= _maxEntries)
+        {
+            _deltaIndex.erase(_deltaEntries.front()->getWid());
+            _deltaEntries.pop_front();
+        }
+
+        _deltaIndex[data->getWid()] = _deltaEntries.insert(_deltaEntries.end(), data);
+    }
+
+    /// Stores the tile to make later deltas against, if it's not already.
+    std::shared_ptr<const DeltaData> storeTile(
+        const unsigned char* pixmap, size_t startX, size_t startY,
+        int width, int height,
+        int bufferWidth, int bufferHeight,
+        TileWireId wid, LibreOfficeKitTileMode mode)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::shared_ptr<const DeltaData> data = findEntry(wid);
+            if (data)
+                return data;
+        }
+
+        // The same content gets the same wid, so it's only copied once.
+        std::shared_ptr<const DeltaData> data =
+            dataToDeltaData(wid, pixmap, startX, startY, width, height,
+                            bufferWidth, bufferHeight, mode);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        addEntry(data);
         return data;
     }
 
   public:
-    DeltaGenerator() {}
+    DeltaGenerator(size_t maxEntries = DefaultMaxEntries)
+        : _maxEntries(std::max<size_t>(maxEntries, 1))
+    {
+    }
+
+    /// The number of tiles kept to make deltas against.
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _deltaEntries.size();
+    }
+
+    /// Forgets all tiles, when their wire ids can't be trusted anymore.
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _deltaEntries.clear();
+        _deltaIndex.clear();
+    }
+
+    /// Stores the tile to make later deltas against, if it's not already.
+    void rememberTile(
+        const unsigned char* pixmap, size_t startX, size_t startY,
+        int width, int height,
+        int bufferWidth, int bufferHeight,
+        TileWireId wid, LibreOfficeKitTileMode mode = LOK_TILEMODE_RGBA)
+    {
+        if (width <= 256 && height <= 256)
+            storeTile(pixmap, startX, startY, width, height, bufferWidth, bufferHeight, wid, mode);
+    }
 
     /**
      * Creates a delta between @oldWid and pixmap if possible:
      *   if so - returns @true and appends the delta to @output
      * stores @pixmap, and other data to accelerate delta
      * creation in a limited size cache.
+     *
+     * Safe to call from several threads at once.
      */
     bool createDelta(
-        unsigned char* pixmap, size_t startX, size_t startY,
+        const unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
         int bufferWidth, int bufferHeight,
         std::vector<char>& output,
-        TileWireId wid, TileWireId oldWid)
+        TileWireId wid, TileWireId oldWid,
+        LibreOfficeKitTileMode mode = LOK_TILEMODE_RGBA)
     {
-        // First store a copy for later:
-        if (_deltaEntries.size() > 6) // FIXME: hard-coded ...
-            _deltaEntries.erase(_deltaEntries.begin());
+        if (width > 256 || height > 256)
+            return false;
 
-        std::shared_ptr<DeltaData> update =
-            dataToDeltaData(wid, pixmap, startX, startY, width, height,
-                            bufferWidth, bufferHeight);
-        _deltaEntries.push_back(update);
+        std::shared_ptr<const DeltaData> old;
+        if (oldWid != 0 && oldWid != wid)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            old = findEntry(oldWid);
+        }
+
+        // First store a copy for later.
+        std::shared_ptr<const DeltaData> update =
+            storeTile(pixmap, startX, startY, width, height, bufferWidth, bufferHeight, wid, mode);
 
-        for (auto &old : _deltaEntries)
+        if (!old)
+            return false;
+
+        std::vector<char> commands;
+        commands.reserve(width * 4 * 8);
+        if (!makeDelta(*old, *update, commands))
+            return false;
+
+        const size_t start = output.size();
+        uLongf compressedSize = compressBound(commands.size());
+        output.resize(start + 1 + compressedSize);
+        output[start] = 'D';
+        if (compress2(reinterpret_cast<Bytef*>(&output[start + 1]), &compressedSize,
+                      reinterpret_cast<const Bytef*>(commands.data()), commands.size(),
+                      Z_BEST_SPEED) != Z_OK)
         {
-            if (oldWid == old->getWid())
-                return makeDelta(*old, *update, output);
+            LOG_ERR("Failed to compress a delta of " << commands.size() << " bytes.");
+            output.resize(start);
+            return false;
         }
-        return false;
+
+        output.resize(start + 1 + compressedSize);
+        LOG_TRC("Delta of " << commands.size() << " bytes compressed to " << compressedSize <<
+                " from wid " << oldWid << " to " << wid);
+        return true;
     }
 };
 
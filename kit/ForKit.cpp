@@ -537,6 +537,10 @@ int main(int argc, char** argv)
         options += ":profile_events";
     ::setenv("SAL_LOK_OPTIONS", options.c_str(), 0);
 
+    // Link the jails from a template next to them, rather than from afar.
+    if (!NoCapsForKit)
+        createJailTemplate(childRoot, sysTemplate, loTemplate, loSubPath);
+
     // Initialize LoKit
     if (!globalPreinit(loTemplate))
     {
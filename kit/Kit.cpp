@@ -15,8 +15,11 @@
 
 #include <dlfcn.h>
 #ifdef __linux
+#include <fcntl.h>
 #include <ftw.h>
+#include <linux/fs.h>
 #include <sys/capability.h>
+#include <sys/ioctl.h>
 #include <sys/sysmacros.h>
 #endif
 #include <unistd.h>
@@ -30,11 +33,14 @@
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <sstream>
 #include <thread>
+#include <unordered_set>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
@@ -68,8 +74,11 @@
 #include <UserMessages.hpp>
 #include <Util.hpp>
 #include "Delta.hpp"
+#include "PngCache.hpp"
+#include "ThreadPool.hpp"
 
 #if !MOBILEAPP
+#include <common/FileUtil.hpp>
 #include <common/SigUtil.hpp>
 #include <common/Seccomp.hpp>
 #endif
@@ -100,9 +109,7 @@ using Poco::Thread;
 using Poco::URI;
 using Poco::Util::Application;
 
-#ifndef BUILDING_TESTS
 using Poco::Path;
-#endif
 
 using namespace LOOLProtocol;
 using std::size_t;
@@ -128,7 +135,6 @@ static LokHookFunction2* initFunction = nullptr;
 
 namespace
 {
-#ifndef BUILDING_TESTS
     enum class LinkOrCopyType { All, LO, NoUsr };
     LinkOrCopyType linkOrCopyType;
     std::string sourceForLinkOrCopy;
@@ -137,6 +143,15 @@ namespace
     bool linkOrCopyVerboseLogging = false;
     unsigned slowLinkOrCopyLimitInSecs = 10; // after this much seconds, start spamming the logs
 
+    /// The jail template created by createJailTemplate(), if any.
+    std::string jailTemplatePath;
+
+    /// Set while linking a jail from the template: where the template's files come from.
+    /// Those that aren't links to them are copies, that go copied into each jail.
+    std::string templateSysSource;
+    std::string templateLOSource;
+    std::string templateLOSubPath;
+
     bool shouldCopyDir(const char *path)
     {
         switch (linkOrCopyType)
@@ -206,6 +221,59 @@ namespace
         }
     }
 
+    /// Clones the file, sharing its blocks, where the filesystem can (btrfs, xfs).
+    bool reflinkFile(const char *fpath, const std::string& newPath)
+    {
+#ifdef FICLONE
+        const int src = open(fpath, O_RDONLY | O_CLOEXEC);
+        if (src == -1)
+            return false;
+
+        bool cloned = false;
+        struct stat st;
+        if (fstat(src, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            const int dst = open(newPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+            if (dst != -1)
+            {
+                cloned = (ioctl(dst, FICLONE, src) == 0);
+                close(dst);
+                if (!cloned)
+                    unlink(newPath.c_str());
+            }
+        }
+
+        close(src);
+        return cloned;
+#else
+        (void)fpath;
+        (void)newPath;
+        return false;
+#endif
+    }
+
+    /// Clones the file where the filesystem can, else copies it.
+    void cloneOrCopyFile(const char *fpath, const Path& newPath)
+    {
+        if (reflinkFile(fpath, newPath.toString()))
+        {
+            LOG_TRC("Cloned \"" << fpath << "\" to \"" << newPath.toString() << "\".");
+            return;
+        }
+
+        try
+        {
+            File(fpath).copyTo(newPath.toString());
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_FTL("Copying of '" << fpath << "' to " << newPath.toString() <<
+                    " failed: " << exc.what() << ". Exiting.");
+            Log::shutdown();
+            std::_Exit(Application::EXIT_SOFTWARE);
+        }
+    }
+
     void linkOrCopyFile(const char *fpath, const Path& newPath)
     {
         if (linkOrCopyVerboseLogging)
@@ -213,21 +281,29 @@ namespace
         if (link(fpath, newPath.toString().c_str()) == -1)
         {
             LOG_INF("link(\"" << fpath << "\", \"" <<
-                    newPath.toString() << "\") failed. Will copy.");
-            try
-            {
-                File(fpath).copyTo(newPath.toString());
-            }
-            catch (const std::exception& exc)
-            {
-                LOG_FTL("Copying of '" << fpath << "' to " << newPath.toString() <<
-                        " failed: " << exc.what() << ". Exiting.");
-                Log::shutdown();
-                std::_Exit(Application::EXIT_SOFTWARE);
-            }
+                    newPath.toString() << "\") failed. Will clone or copy.");
+            cloneOrCopyFile(fpath, newPath);
         }
     }
 
+    /// Whether the file of the template, at relativePath in it, is a link to that of the
+    /// system or LO template, rather than a copy made by, and owned by, the kit user.
+    bool isLinkedInTemplate(const char *fpath, const char *relativePath)
+    {
+        std::string source;
+        const size_t loSubPathLength = templateLOSubPath.size();
+        if (strncmp(relativePath, templateLOSubPath.c_str(), loSubPathLength) == 0 &&
+            relativePath[loSubPathLength] == '/')
+            source = templateLOSource + (relativePath + loSubPathLength);
+        else
+            source = templateSysSource + '/' + relativePath;
+
+        struct stat templateStat;
+        struct stat sourceStat;
+        return lstat(fpath, &templateStat) == 0 && lstat(source.c_str(), &sourceStat) == 0 &&
+               templateStat.st_dev == sourceStat.st_dev && templateStat.st_ino == sourceStat.st_ino;
+    }
+
     int linkOrCopyFunction(const char *fpath,
                            const struct stat* /*sb*/,
                            int typeflag,
@@ -258,7 +334,14 @@ namespace
         case FTW_SLN:
             File(newPath.parent()).createDirectories();
 
-            if (shouldLinkFile(relativeOldPath))
+            if (!shouldLinkFile(relativeOldPath))
+                break;
+
+            // Shared by all the jails, the template's own copies would let
+            // one kit write to the files of the others.
+            if (!templateSysSource.empty() && !isLinkedInTemplate(fpath, relativeOldPath))
+                cloneOrCopyFile(fpath, newPath);
+            else
                 linkOrCopyFile(fpath, newPath);
             break;
         case FTW_D:
@@ -320,6 +403,7 @@ namespace
         }
     }
 
+#ifndef BUILDING_TESTS
     void dropCapability(cap_value_t capability)
     {
         cap_t caps;
@@ -380,206 +464,71 @@ namespace
 #endif
 }
 
-#endif
-
-/// A quick & dirty cache of the last few PNGs
-/// and their hashes to avoid re-compression
-/// wherever possible.
-class PngCache
+bool createJailTemplate(const std::string& childRoot,
+                        const std::string& sysTemplate,
+                        const std::string& loTemplate,
+                        const std::string& loSubPath)
 {
-public:
-    typedef std::shared_ptr< std::vector< char > > CacheData;
-private:
-    struct CacheEntry {
-    private:
-        size_t    _hitCount;
-        TileWireId _wireId;
-        CacheData _data;
-    public:
-        CacheEntry(const CacheData &data, TileWireId id) :
-            _hitCount(1),   // Every entry is used at least once; prevent removal at birth.
-            _wireId(id),
-            _data(data)
-        {
-        }
+    const auto startTime = std::chrono::steady_clock::now();
+    const Path templatePath = Path::forDirectory(childRoot + "/" + JAIL_TEMPLATE_NAME);
+    LOG_INF("Creating jail template [" << templatePath.toString() << "].");
 
-        size_t getHitCount() const
-        {
-            return _hitCount;
-        }
+    // Start afresh, the installation may have changed since the last one.
+    // The jails linked from it keep their files.
+    FileUtil::removeFile(templatePath.toString(), true);
 
-        void incrementHitCount()
-        {
-            ++_hitCount;
-        }
-
-        void decrementHitCount()
-        {
-            --_hitCount;
-        }
-
-        const CacheData& getData() const
-        {
-            return _data;
-        }
-
-        TileWireId getWireId() const
-        {
-            return _wireId;
-        }
-    } ;
-    size_t _cacheSize;
-    static const size_t CacheSizeSoftLimit = (1024 * 4 * 32); // 128k of cache
-    static const size_t CacheSizeHardLimit = CacheSizeSoftLimit * 2;
-    static const size_t CacheWidHardLimit = 4096;
-    size_t _cacheHits;
-    size_t _cacheTests;
-    TileWireId _nextId;
-    DeltaGenerator _deltaGen;
-
-    std::unordered_map< TileBinaryHash, CacheEntry > _cache;
-    // This uses little storage so can be much larger
-    std::unordered_map< TileBinaryHash, TileWireId > _hashToWireId;
-
-    void clearCache(bool logStats = false)
+    try
     {
-        if (logStats)
-            LOG_DBG("cache clear " << _cache.size() << " items total size " <<
-                    _cacheSize << " current hits " << _cacheHits);
-        _cache.clear();
-        _hashToWireId.clear();
-        _cacheSize = 0;
-        _cacheHits = 0;
-        _cacheTests = 0;
-        _nextId = 1;
-    }
+        File(templatePath).createDirectories();
+        linkOrCopy(sysTemplate, templatePath, LinkOrCopyType::All);
 
-    // Keep these ids small and wrap them.
-    TileWireId createNewWireId()
-    {
-        TileWireId id = ++_nextId;
-        // FIXME: if we wrap - we should flush the clients too really ...
-        if (id < 1)
-            clearCache(true);
-        return id;
+        Path templateLOInstallation(templatePath, loSubPath);
+        templateLOInstallation.makeDirectory();
+        File(templateLOInstallation).createDirectory();
+        linkOrCopy(loTemplate, templateLOInstallation, LinkOrCopyType::LO);
     }
-
-public:
-    // Performed only after a complete combinetiles
-    void balanceCache()
-    {
-        // A normalish PNG image size for text in a writer document is
-        // around 4k for a content tile, and sub 1k for a background one.
-        if (_cacheSize > CacheSizeHardLimit)
-        {
-            size_t avgHits = 0;
-            for (auto it = _cache.begin(); it != _cache.end(); ++it)
-                avgHits += it->second.getHitCount();
-
-            LOG_DBG("PNG cache has " << _cache.size() << " items, total size " <<
-                    _cacheSize << ", current hits " << avgHits << ", total hit rate " <<
-                    (_cacheHits * 100. / _cacheTests) << "% at balance start.");
-            avgHits /= _cache.size();
-
-            for (auto it = _cache.begin(); it != _cache.end();)
-            {
-                if ((_cacheSize > CacheSizeSoftLimit && it->second.getHitCount() == 0) ||
-                    (_cacheSize > CacheSizeHardLimit && it->second.getHitCount() > 0 && it->second.getHitCount() <= avgHits))
-                {
-                    // Shrink cache when we exceed the size to maximize
-                    // the chance of hitting these entries in the future.
-                    _cacheSize -= it->second.getData()->size();
-                    it = _cache.erase(it);
-                }
-                else
-                {
-                    if (it->second.getHitCount() > 0)
-                        it->second.decrementHitCount();
-                    ++it;
-                }
-            }
-
-            LOG_DBG("PNG cache has " << _cache.size() << " items, total size " <<
-                    _cacheSize << " after balance.");
-        }
-
-        if (_hashToWireId.size() > CacheWidHardLimit)
-        {
-            LOG_DBG("Clear half of wid cache of size " << _hashToWireId.size());
-            TileWireId max = _nextId - CacheWidHardLimit/2;
-            for (auto it = _hashToWireId.begin(); it != _hashToWireId.end();)
-            {
-                if (it->second < max)
-                    it = _hashToWireId.erase(it);
-                else
-                    ++it;
-            }
-            LOG_DBG("Wid cache is now size " << _hashToWireId.size());
-        }
-    }
-
-    /// Lookup an entry in the cache and store the data in output.
-    /// Returns true on success, otherwise false.
-    bool copyFromCache(const TileBinaryHash hash, std::vector<char>& output, size_t &imgSize)
+    catch (const std::exception& exc)
     {
-        if (hash)
-        {
-            ++_cacheTests;
-            auto it = _cache.find(hash);
-            if (it != _cache.end())
-            {
-                ++_cacheHits;
-                LOG_DBG("PNG cache with hash " << hash << " hit.");
-                output.insert(output.end(),
-                              it->second.getData()->begin(),
-                              it->second.getData()->end());
-                it->second.incrementHitCount();
-                imgSize = it->second.getData()->size();
-
-                return true;
-            }
-        }
-
+        LOG_ERR("Failed to create jail template [" << templatePath.toString() << "]: " <<
+                exc.what() << ". Each jail will be linked from the system and LO templates.");
+        FileUtil::removeFile(templatePath.toString(), true);
         return false;
     }
 
-    void addToCache(const CacheData &data, TileWireId wid, const TileBinaryHash hash)
-    {
-        CacheEntry newEntry(data, wid);
-
-        if (hash)
-        {
-            // Adding duplicates causes grim wid mixups
-            assert(hashToWireId(hash) == wid);
-            assert(_cache.find(hash) == _cache.end());
-
-            data->shrink_to_fit();
-            _cache.emplace(hash, newEntry);
-            _cacheSize += data->size();
-        }
-    }
+    jailTemplatePath = templatePath.toString();
+    LOG_INF("Created jail template [" << jailTemplatePath << "] in " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count() << " ms.");
+    return true;
+}
 
-    PngCache()
-    {
-        clearCache();
-    }
+void linkJailFromTemplate(const std::string& templatePath,
+                          const std::string& sysTemplate,
+                          const std::string& loTemplate,
+                          const std::string& loSubPath,
+                          const std::string& jailPath,
+                          bool noUsr)
+{
+    templateSysSource = sysTemplate;
+    templateLOSource = loTemplate;
+    templateLOSubPath = loSubPath;
+    if (templateSysSource.back() == '/')
+        templateSysSource.pop_back();
+    if (templateLOSource.back() == '/')
+        templateLOSource.pop_back();
+    if (!templateLOSubPath.empty() && templateLOSubPath.back() == '/')
+        templateLOSubPath.pop_back();
+
+    // Already filtered, and on the same filesystem, so hard links don't fail.
+    linkOrCopy(templatePath, Path::forDirectory(jailPath),
+               noUsr ? LinkOrCopyType::NoUsr : LinkOrCopyType::All);
+
+    templateSysSource.clear();
+    templateLOSource.clear();
+    templateLOSubPath.clear();
+}
 
-    TileWireId hashToWireId(TileBinaryHash hash)
-    {
-        TileWireId wid;
-        if (hash == 0)
-            return 0;
-        auto it = _hashToWireId.find(hash);
-        if (it != _hashToWireId.end())
-            wid = it->second;
-        else
-        {
-            wid = createNewWireId();
-            _hashToWireId.emplace(hash, wid);
-        }
-        return wid;
-    }
-};
+#endif
 
 class Watermark
 {
@@ -750,103 +699,6 @@ private:
 static FILE* ProcSMapsFile = nullptr;
 #endif
 
-class ThreadPool {
-    std::mutex _mutex;
-    std::condition_variable _cond;
-    std::condition_variable _complete;
-    typedef std::function<void()> ThreadFn;
-    std::queue<ThreadFn> _work;
-    std::vector<std::thread> _threads;
-    size_t _working;
-    bool   _shutdown;
-public:
-    ThreadPool()
-        : _working(0),
-          _shutdown(false)
-    {
-        int maxConcurrency = 2;
-#if MOBILEAPP && !defined(GTKAPP)
-#  warning "Good defaults ? - 2 for iOS, 4 for Android ?"
-#else
-        const char *max = getenv("MAX_CONCURRENCY");
-        if (max)
-            maxConcurrency = atoi(max);
-#endif
-        LOG_TRC("PNG compression thread pool size " << maxConcurrency);
-        for (int i = 1; i < maxConcurrency; ++i)
-            _threads.push_back(std::thread(&ThreadPool::work, this));
-    }
-    ~ThreadPool()
-    {
-        {
-            std::unique_lock< std::mutex > lock(_mutex);
-            assert(_working == 0);
-            _shutdown = true;
-        }
-        _cond.notify_all();
-        for (auto &it : _threads)
-            it.join();
-    }
-
-    size_t count() const
-    {
-        return _work.size();
-    }
-
-    void pushWorkUnlocked(const ThreadFn &fn)
-    {
-        _work.push(fn);
-    }
-
-    void runOne(std::unique_lock< std::mutex >& lock)
-    {
-        assert(!_work.empty());
-
-        ThreadFn fn = _work.front();
-        _work.pop();
-        _working++;
-        lock.unlock();
-
-        fn();
-
-        lock.lock();
-        _working--;
-        if (_work.empty() && _working == 0)
-            _complete.notify_all();
-    }
-
-    void run()
-    {
-        std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
-
-        // Avoid notifying threads if we don't need to.
-        bool useThreads = _threads.size() > 1 && _work.size() > 1;
-        if (useThreads)
-            _cond.notify_all();
-
-        while(!_work.empty())
-            runOne(lock);
-
-        if (useThreads && (_working > 0 || !_work.empty()))
-            _complete.wait(lock, [this]() { return _working == 0 && _work.empty(); } );
-
-        assert(_working==0);
-        assert(_work.empty());
-    }
-
-    void work()
-    {
-        std::unique_lock< std::mutex > lock(_mutex);
-        while (!_shutdown)
-        {
-            _cond.wait(lock);
-            if (!_shutdown && !_work.empty())
-                runOne(lock);
-        }
-    }
-};
-
 /// A document container.
 /// Owns LOKitDocument instance and connections.
 /// Manages the lifetime of a document.
@@ -1050,13 +902,63 @@ public:
     void renderTile(const std::vector<std::string>& tokens)
     {
         TileCombined tileCombined(TileDesc::parse(tokens));
-        renderTiles(tileCombined, false);
+        renderTiles(tileCombined, false, false);
     }
 
     void renderCombinedTiles(const std::vector<std::string>& tokens)
     {
         TileCombined tileCombined = TileCombined::parse(tokens);
-        renderTiles(tileCombined, true);
+
+        // Whether the client asking can take deltas against its oldwid.
+        bool deltas = false;
+        for (const std::string& token : tokens)
+        {
+            if (token == "deltas=true")
+                deltas = true;
+        }
+
+        renderTiles(tileCombined, true, deltas);
+    }
+
+    void renderBinaryCombinedTiles(const TileQueue::Payload& input)
+    {
+        size_t offset = sizeof("tilecombinebin");
+        TileCombined tileCombined = TileCombined::parseBinary(input.data(), input.size(), offset);
+
+        const std::string suffix(input.data() + offset, input.size() - offset);
+        const bool deltas = (suffix.find(" deltas=true") != std::string::npos);
+
+        // Answered in kind.
+        renderTiles(tileCombined, true, deltas, true);
+    }
+
+    /// Appends the tile data to output, or a reference to it if WSD has it.
+    /// Returns the size appended.
+    size_t appendTile(std::vector<char>& output, const std::vector<char>& data) const
+    {
+        if (!_knownTiles.empty() && !data.empty() && data[0] != 'D')
+        {
+            const TileBinaryHash hash = TileRef::hash(data.data(), data.size());
+            if (_knownTiles.count(hash))
+            {
+                TileRef::append(output, hash);
+                return TileRef::Size;
+            }
+        }
+
+        output.insert(output.end(), data.begin(), data.end());
+        return data.size();
+    }
+
+    void addKnownTiles(const std::vector<std::string>& tokens)
+    {
+        if (tokens.size() < 2)
+            return;
+
+        for (const std::string& hash : LOOLProtocol::tokenize(tokens[1], ','))
+            _knownTiles.insert(std::strtoull(hash.c_str(), nullptr, 10));
+
+        LOG_DBG("WSD has " << _knownTiles.size() << " tiles to refer to.");
     }
 
     static void pushRendered(std::vector<TileDesc> &renderedTiles,
@@ -1067,7 +969,7 @@ public:
         renderedTiles.back().setImgSize(imgSize);
     }
 
-    void renderTiles(TileCombined &tileCombined, bool combined)
+    void renderTiles(TileCombined &tileCombined, bool combined, bool deltas, bool binary = false)
     {
         auto& tiles = tileCombined.getTiles();
 
@@ -1128,6 +1030,7 @@ public:
         auto duration = std::chrono::system_clock::now() - start;
         auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
         double totalTime = elapsed/1000.;
+        _renderStats._paintUs += elapsed;
         LOG_DBG("paintTile (combined) at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), (" <<
                 renderArea.getWidth() << ", " << renderArea.getHeight() << ") " <<
                 " rendered in " << totalTime << " ms (" << area / elapsed << " MP/s).");
@@ -1145,6 +1048,20 @@ public:
         std::vector<TileBinaryHash> duplicateHashes;
         std::vector<TileWireId> renderingIds;
 
+        // The output of each tile, in tile order, whether cached or encoded
+        // in parallel into its own buffer; merged once all are done.
+        struct TileOutput
+        {
+            size_t _tileIndex;
+            TileWireId _wireId;
+            TileBinaryHash _hash;
+            bool _encoded;
+        };
+        std::vector<TileOutput> tileOutputs;
+        tileOutputs.reserve(tiles.size());
+        std::vector<PngCache::CacheData> tileData(tiles.size());
+        const uint64_t wireIdWraps = _pngCache.getWireIdWraps();
+
         size_t tileIndex = 0;
         for (Util::Rectangle& tileRect : tileRecs)
         {
@@ -1168,12 +1085,28 @@ public:
                 continue;
             }
 
+            // Try a delta against what the client has, else a png.
+            const bool tryDelta = deltas && oldWireId != 0;
+
             bool skipCompress = false;
             size_t imgSize = -1;
-            if (_pngCache.copyFromCache(hash, output, imgSize))
+            tileData[tileIndex] = (tryDelta ? nullptr : _pngCache.getFromCache(hash));
+            if (tryDelta)
             {
-                pushRendered(renderedTiles, tiles[tileIndex], wireId, imgSize);
+                LOG_DBG("Trying a delta for tile #" << tileIndex << " from wireId " << oldWireId);
+            }
+            else if (tileData[tileIndex])
+            {
+                tileOutputs.push_back(TileOutput{ tileIndex, wireId, hash, false });
+                imgSize = tileData[tileIndex]->size();
                 skipCompress = true;
+
+                // The cached png has any watermark, these pixels don't yet.
+                if (deltas && !_docWatermark)
+                    _pngPool.pushWork([=,&pixmap](){
+                            _deltaGen.rememberTile(pixmap.data(), offsetX, offsetY, pixelWidth, pixelHeight,
+                                                   pixmapWidth, pixmapHeight, wireId, mode);
+                        });
             }
             else
             {
@@ -1196,30 +1129,39 @@ public:
 
             if (!skipCompress)
             {
-                renderingIds.push_back(wireId);
+                // Deltas can't be copied for duplicates.
+                if (!tryDelta)
+                    renderingIds.push_back(wireId);
                 if (_docWatermark)
                     _docWatermark->blending(pixmap.data(), offsetX, offsetY,
                                             pixmapWidth, pixmapHeight,
                                             pixelWidth, pixelHeight,
                                             mode);
 
-                // Queue to be executed later in parallel inside 'run'
-                _pngPool.pushWorkUnlocked([=,&output,&pixmap,&tiles,&renderedTiles](){
-                        PngCache::CacheData data(new std::vector< char >() );
-                        data->reserve(pixmapWidth * pixmapHeight * 1);
-
-                        /*
-                         * Disable for now - pushed in error.
-                         *
-                         if (_deltaGen.createDelta(pixmap, startX, startY, width, height,
-                                                   bufferWidth, bufferHeight,
-                                                   output, wid, oldWid))
-                         else ...
-                        */
+                // Queue to be executed in parallel, finished inside 'run'
+                tileOutputs.push_back(TileOutput{ tileIndex, wireId, hash, true });
+                PngCache::CacheData& data = tileData[tileIndex];
+                _pngPool.pushWork([=,&data,&pixmap](){
+                        const auto encodeStart = std::chrono::steady_clock::now();
+                        PngCache::CacheData encoded(new std::vector< char >() );
+                        encoded->reserve(pixmapWidth * pixmapHeight * 1);
+
+                        if (deltas && _deltaGen.createDelta(pixmap.data(), offsetX, offsetY,
+                                                            pixelWidth, pixelHeight,
+                                                            pixmapWidth, pixmapHeight,
+                                                            *encoded, wireId, oldWireId, mode))
+                        {
+                            LOG_DBG("Tile " << tileIndex << " is a delta of " << encoded->size() << " bytes.");
+                            data = encoded;
+                            ++_renderStats._deltas;
+                            _renderStats._encodeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - encodeStart).count();
+                            return;
+                        }
 
                         LOG_DBG("Encode a new png for tile #" << tileIndex);
                         if (!Png::encodeSubBufferToPNG(pixmap.data(), offsetX, offsetY, pixelWidth, pixelHeight,
-                                                       pixmapWidth, pixmapHeight, *data, mode))
+                                                       pixmapWidth, pixmapHeight, *encoded, mode))
                         {
                             // FIXME: Return error.
                             // sendTextFrame("error: cmd=tile kind=failure");
@@ -1227,11 +1169,10 @@ public:
                             return;
                         }
 
-                        LOG_DBG("Tile " << tileIndex << " is " << data->size() << " bytes.");
-                        std::unique_lock<std::mutex> pngLock(_pngMutex);
-                        output.insert(output.end(), data->begin(), data->end());
-                        _pngCache.addToCache(data, wireId, hash);
-                        pushRendered(renderedTiles, tiles[tileIndex], wireId, data->size());
+                        LOG_DBG("Tile " << tileIndex << " is " << encoded->size() << " bytes.");
+                        data = encoded;
+                        _renderStats._encodeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - encodeStart).count();
                     });
             }
 
@@ -1240,7 +1181,29 @@ public:
             tileIndex++;
         }
 
-        _pngPool.run();
+        // The wire ids started anew, some of those the deltas are against are given to
+        // other tiles now. Nothing was encoded yet, the pool only runs below.
+        if (_pngCache.getWireIdWraps() != wireIdWraps)
+            _deltaGen.clear();
+
+        _renderStats._waitUs += _pngPool.run().count();
+        ++_renderStats._renders;
+
+        // Merge in tile order, so the output doesn't depend on the scheduling.
+        for (const TileOutput& tileOutput : tileOutputs)
+        {
+            const PngCache::CacheData& data = tileData[tileOutput._tileIndex];
+            if (!data)
+                continue; // Failed to encode.
+
+            const size_t imgSize = appendTile(output, *data);
+
+            // Deltas start with 'D', pngs never do. A tile that failed to
+            // make a delta isn't deduplicated, so its png may be already.
+            if (tileOutput._encoded && (*data)[0] != 'D' && !_pngCache.isCached(tileOutput._hash))
+                _pngCache.addToCache(data, tileOutput._wireId, tileOutput._hash);
+            pushRendered(renderedTiles, tiles[tileOutput._tileIndex], tileOutput._wireId, imgSize);
+        }
 
         for (auto &i : renderedTiles)
         {
@@ -1254,13 +1217,13 @@ public:
         // FIXME: append duplicates - tragically for now as real duplicates
         // we should append these as
         {
-            size_t imgSize = -1;
             assert(duplicateTiles.size() == duplicateHashes.size());
             for (size_t i = 0; i < duplicateTiles.size(); ++i)
             {
-                if (_pngCache.copyFromCache(duplicateHashes[i], output, imgSize))
+                const PngCache::CacheData data = _pngCache.getFromCache(duplicateHashes[i]);
+                if (data)
                     pushRendered(renderedTiles, duplicateTiles[i],
-                                 duplicateTiles[i].getWireId(), imgSize);
+                                 duplicateTiles[i].getWireId(), appendTile(output, *data));
                 else
                     LOG_ERR("Horror - tile disappeared while rendering! " << duplicateHashes[i]);
             }
@@ -1282,12 +1245,16 @@ public:
         }
 
         std::string tileMsg;
-        if (combined)
+        if (binary)
+            tileMsg = tileCombined.serializeBinary("tilecombinebin:", ADD_DEBUG_RENDERID, renderedTiles);
+        else if (combined)
             tileMsg = tileCombined.serialize("tilecombine:", ADD_DEBUG_RENDERID, renderedTiles);
         else
             tileMsg = tiles[0].serialize("tile:", ADD_DEBUG_RENDERID);
 
-        LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << output.size() << " bytes) for: " << tileMsg);
+        LOG_TRC("Sending back painted tiles for " <<
+                (binary ? tileCombined.serialize("tilecombinebin:", std::string(), renderedTiles) : tileMsg) <<
+                " of size " << output.size() << " bytes)");
 
         std::shared_ptr<std::vector<char>> response = std::make_shared<std::vector<char>>(tileMsg.size() + output.size());
         std::copy(tileMsg.begin(), tileMsg.end(), response->begin());
@@ -2007,6 +1974,13 @@ public:
                     break;
                 }
 
+                // Not to be tokenized.
+                if (LOOLProtocol::getFirstToken(input) == "tilecombinebin")
+                {
+                    renderBinaryCombinedTiles(input);
+                    continue;
+                }
+
                 const std::vector<std::string> tokens = LOOLProtocol::tokenize(input.data(), input.size());
 
                 if (tokens[0] == "eof")
@@ -2019,6 +1993,10 @@ public:
                 {
                     renderTile(tokens);
                 }
+                else if (tokens[0] == "knowntiles")
+                {
+                    addKnownTiles(tokens);
+                }
                 else if (tokens[0] == "tilecombine")
                 {
                     renderCombinedTiles(tokens);
@@ -2109,6 +2087,20 @@ public:
             {
                 sendTextFrame(Util::getMemoryStats(ProcSMapsFile));
                 _lastMemStatsTime = std::chrono::steady_clock::now();
+
+                std::ostringstream pngCacheStats;
+                pngCacheStats << "pngcachestats: size=" << _pngCache.getCacheSize()
+                              << " count=" << _pngCache.getCount()
+                              << " hits=" << _pngCache.getHits()
+                              << " misses=" << _pngCache.getMisses()
+                              << " evictions=" << _pngCache.getEvictions();
+                sendTextFrame(pngCacheStats.str());
+
+                LOG_DBG("Rendered " << _renderStats._renders << " times: paint " <<
+                        _renderStats._paintUs / 1000 << " ms, encode " <<
+                        _renderStats._encodeUs / 1000 << " ms, waiting for the encoding " <<
+                        _renderStats._waitUs / 1000 << " ms, " <<
+                        _renderStats._deltas << " deltas.");
             }
 #endif
         }
@@ -2170,8 +2162,11 @@ private:
     std::shared_ptr<TileQueue> _tileQueue;
     std::shared_ptr<WebSocketHandler> _websocketHandler;
 
-    std::mutex _pngMutex;
     PngCache _pngCache;
+    /// The hashes of the tiles WSD has pinned, sent as TileRefs.
+    std::unordered_set<TileBinaryHash> _knownTiles;
+    /// The last tiles rendered, to send deltas against.
+    DeltaGenerator _deltaGen;
 
     // Document password provided
     std::string _docPassword;
@@ -2190,6 +2185,28 @@ private:
 
     ThreadPool _pngPool;
 
+    /// Where renderTiles spends its time, logged with the memory stats.
+    struct RenderStats
+    {
+        RenderStats()
+            : _renders(0),
+              _paintUs(0),
+              _encodeUs(0),
+              _waitUs(0),
+              _deltas(0)
+        {
+        }
+
+        size_t _renders;
+        uint64_t _paintUs;
+        /// Summed over the threads of _pngPool.
+        std::atomic<uint64_t> _encodeUs;
+        /// Spent by the kit thread waiting for the pool to finish encoding.
+        uint64_t _waitUs;
+        /// Tiles sent as deltas rather than pngs.
+        std::atomic<uint64_t> _deltas;
+    } _renderStats;
+
     std::condition_variable _cvLoading;
     std::atomic_size_t _isLoading;
     int _editorId;
@@ -2245,16 +2262,24 @@ protected:
         if (logger.enabled())
         {
             logger << _socketName << ": recv [";
-            for (const std::string& token : tokens)
+            if (tokens[0] == "tilecombinebin")
             {
-                // Don't log user-data, there are anonymized versions that get logged instead.
-                if (Util::startsWith(token, "jail") ||
-                    Util::startsWith(token, "author") ||
-                    Util::startsWith(token, "name") ||
-                    Util::startsWith(token, "url"))
-                    continue;
-
-                logger << token << ' ';
+                // Binary past the first token.
+                logger << tokens[0] << " (" << data.size() << " bytes) ";
+            }
+            else
+            {
+                for (const std::string& token : tokens)
+                {
+                    // Don't log user-data, there are anonymized versions that get logged instead.
+                    if (Util::startsWith(token, "jail") ||
+                        Util::startsWith(token, "author") ||
+                        Util::startsWith(token, "name") ||
+                        Util::startsWith(token, "url"))
+                        continue;
+
+                    logger << token << ' ';
+                }
             }
 
             LOG_END(logger, true);
@@ -2293,7 +2318,8 @@ protected:
             SigUtil::getTerminationFlag() = true;
             document.reset();
         }
-        else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "canceltiles" ||
+        else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "tilecombinebin" ||
+                tokens[0] == "canceltiles" || tokens[0] == "knowntiles" ||
                 tokens[0] == "paintwindow" || tokens[0] == "resizewindow" ||
                 LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
         {
@@ -2433,6 +2459,7 @@ void wakeCallback(void* pData)
 
 #ifndef BUILDING_TESTS
 
+
 void lokit_main(
 #if !MOBILEAPP
                 const std::string& childRoot,
@@ -2513,6 +2540,19 @@ void lokit_main(
     try
     {
 #if !MOBILEAPP
+        // How long each phase of the startup takes, reported to WSD.
+        std::string startupTimes;
+        auto phaseStartTime = std::chrono::steady_clock::now();
+        const auto endStartupPhase = [&startupTimes, &phaseStartTime](const char* phase)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (!startupTimes.empty())
+                startupTimes += ',';
+            startupTimes += std::string(phase) + ':' + std::to_string(
+                std::chrono::duration_cast<std::chrono::milliseconds>(now - phaseStartTime).count());
+            phaseStartTime = now;
+        };
+
         jailPath = Path::forDirectory(childRoot + "/" + jailId);
         LOG_INF("Jail path: " << jailPath.toString());
         File(jailPath).createDirectories();
@@ -2556,9 +2596,17 @@ void lokit_main(
                 bLoopMounted = !system(mountCommand.c_str());
                 LOG_DBG("Initialized jail bind mount.");
             }
-            linkOrCopy(sysTemplate, jailPath,
-                       bLoopMounted ? LinkOrCopyType::NoUsr : LinkOrCopyType::All);
-            linkOrCopy(loTemplate, jailLOInstallation, LinkOrCopyType::LO);
+            if (!jailTemplatePath.empty())
+            {
+                linkJailFromTemplate(jailTemplatePath, sysTemplate, loTemplate, loSubPath,
+                                     jailPath.toString(), bLoopMounted);
+            }
+            else
+            {
+                linkOrCopy(sysTemplate, jailPath,
+                           bLoopMounted ? LinkOrCopyType::NoUsr : LinkOrCopyType::All);
+                linkOrCopy(loTemplate, jailLOInstallation, LinkOrCopyType::LO);
+            }
 
             // Copy some needed files - makes the networking work in the
             // chroot
@@ -2572,6 +2620,7 @@ void lokit_main(
             }
 
             LOG_DBG("Initialized jail files.");
+            endStartupPhase("jail");
 
             // Create the urandom and random devices
             File(Path(jailPath, "/dev")).createDirectory();
@@ -2615,6 +2664,7 @@ void lokit_main(
             dropCapability(CAP_FOWNER);
 
             LOG_DBG("Initialized jail nodes, dropped caps.");
+            endStartupPhase("chroot");
         }
         else // noCapabilities set
         {
@@ -2654,6 +2704,8 @@ void lokit_main(
             }
         }
 
+        endStartupPhase("lokit");
+
         // Lock down the syscalls that can be used
         if (!Seccomp::lockdown(Seccomp::Type::KIT))
         {
@@ -2689,11 +2741,16 @@ void lokit_main(
         else
             LOG_SYS("Failed to get RLIMIT_NOFILE.");
 
-        LOG_INF("Process is ready.");
+        endStartupPhase("seccomp");
+        LOG_INF("Process is ready, startup took (ms) " << startupTimes << ".");
 
         std::string pathAndQuery(NEW_CHILD_URI);
         pathAndQuery.append("?jailid=");
         pathAndQuery.append(jailId);
+        // We take tilecombinebin requests.
+        pathAndQuery.append("&binarytiles=true");
+        pathAndQuery.append("&startup=");
+        pathAndQuery.append(startupTimes);
         if (queryVersion)
         {
             char* versionInfo = loKit->getVersionInfo();
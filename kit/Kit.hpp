@@ -44,6 +44,27 @@ void lokit_main(
                 );
 
 bool globalPreinit(const std::string& loTemplate);
+
+#if !MOBILEAPP
+/// Links the system template and the LO installation, as they go in a jail, into
+/// JAIL_TEMPLATE_NAME in childRoot, for the kits forked after to link their jail from.
+/// That is a single pass over files already filtered, on the filesystem of the jails.
+bool createJailTemplate(const std::string& childRoot,
+                        const std::string& sysTemplate,
+                        const std::string& loTemplate,
+                        const std::string& loSubPath);
+
+/// Links the jail at jailPath from the template made by createJailTemplate(), from
+/// sysTemplate and loTemplate. Only the files of the template that are links to those
+/// are linked: the ones it had to copy belong to the kit user, and are copied again,
+/// lest a kit write through its jail into all the others.
+void linkJailFromTemplate(const std::string& templatePath,
+                          const std::string& sysTemplate,
+                          const std::string& loTemplate,
+                          const std::string& loSubPath,
+                          const std::string& jailPath,
+                          bool noUsr);
+#endif
 /// Wrapper around private Document::ViewCallback().
 void documentViewCallback(const int type, const char* p, void* data);
 
@@ -0,0 +1,208 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PNGCACHE_HPP
+#define INCLUDED_PNGCACHE_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <Log.hpp>
+#include <TileDesc.hpp>
+
+/// A cache of the last PNGs and their hashes to avoid re-compression
+/// wherever possible, and of the wire ids given to the hashes.
+/// The PNGs are dropped least recently used first once they take more
+/// than the byte budget, which is read from LOOL_PNG_CACHE_SIZE_KB, which
+/// loolwsd sets from its config.
+class PngCache
+{
+public:
+    typedef std::shared_ptr< std::vector< char > > CacheData;
+
+    /// The budget if not configured: a screenful of tiles and the repeated backgrounds.
+    static const size_t DefaultCacheSize = 4 * 1024 * 1024;
+
+private:
+    struct CacheEntry
+    {
+        CacheData _data;
+        /// Where the hash is in _lru.
+        std::list<TileBinaryHash>::iterator _lru;
+    };
+
+    /// The hashes having a wire id, halved when exceeded.
+    static const size_t CacheWidHardLimit = 4096;
+
+    size_t _cacheSize;
+    const size_t _maxCacheSize;
+    TileWireId _nextId;
+
+    uint64_t _cacheHits;
+    uint64_t _cacheTests;
+    uint64_t _evictions;
+    uint64_t _wireIdWraps;
+
+    /// Least recently used first.
+    std::list<TileBinaryHash> _lru;
+    std::unordered_map< TileBinaryHash, CacheEntry > _cache;
+    // This uses little storage so can be much larger
+    std::unordered_map< TileBinaryHash, TileWireId > _hashToWireId;
+
+    // Keep these ids small and wrap them.
+    TileWireId createNewWireId()
+    {
+        if (++_nextId == 0)
+        {
+            // Start the ids anew: the hashes having one get a new one when seen again.
+            // The PNGs stay, they are found by their hash.
+            LOG_WRN("Wire ids wrapped, forgetting those of " << _hashToWireId.size() << " hashes.");
+            _hashToWireId.clear();
+            ++_wireIdWraps;
+            _nextId = 1;
+        }
+
+        return _nextId;
+    }
+
+public:
+    explicit PngCache(size_t maxCacheSize = readCacheSize())
+        : _cacheSize(0)
+        , _maxCacheSize(maxCacheSize)
+        , _nextId(1)
+        , _cacheHits(0)
+        , _cacheTests(0)
+        , _evictions(0)
+        , _wireIdWraps(0)
+    {
+    }
+
+    /// The byte budget configured in the environment, else DefaultCacheSize.
+    static size_t readCacheSize()
+    {
+        const char* sizeKb = std::getenv("LOOL_PNG_CACHE_SIZE_KB");
+        if (sizeKb && *sizeKb)
+            return std::strtoul(sizeKb, nullptr, 10) * 1024;
+
+        return DefaultCacheSize;
+    }
+
+    // Performed only after a complete combinetiles, so that the tiles
+    // copied at its end are still there.
+    void balanceCache()
+    {
+        if (_cacheSize > _maxCacheSize)
+        {
+            const size_t count = _cache.size();
+            while (_cacheSize > _maxCacheSize && !_lru.empty())
+            {
+                const auto it = _cache.find(_lru.front());
+                assert(it != _cache.end());
+                _cacheSize -= it->second._data->size();
+                _cache.erase(it);
+                _lru.pop_front();
+                ++_evictions;
+            }
+
+            LOG_DBG("PNG cache evicted " << count - _cache.size() << " items, has " <<
+                    _cache.size() << " items of total size " << _cacheSize << ", total hit rate " <<
+                    (_cacheHits * 100. / _cacheTests) << "%.");
+        }
+
+        if (_hashToWireId.size() > CacheWidHardLimit)
+        {
+            LOG_DBG("Clear half of wid cache of size " << _hashToWireId.size());
+            for (auto it = _hashToWireId.begin(); it != _hashToWireId.end();)
+            {
+                // The age of the id, even across a wrap.
+                if (static_cast<TileWireId>(_nextId - it->second) >= CacheWidHardLimit / 2)
+                    it = _hashToWireId.erase(it);
+                else
+                    ++it;
+            }
+            LOG_DBG("Wid cache is now size " << _hashToWireId.size());
+        }
+    }
+
+    /// Whether there is an entry for hash, without counting it as a hit.
+    bool isCached(const TileBinaryHash hash) const
+    {
+        return _cache.find(hash) != _cache.end();
+    }
+
+    /// Lookup an entry in the cache.
+    /// Returns the data on success, otherwise nullptr.
+    CacheData getFromCache(const TileBinaryHash hash)
+    {
+        if (hash)
+        {
+            ++_cacheTests;
+            auto it = _cache.find(hash);
+            if (it != _cache.end())
+            {
+                ++_cacheHits;
+                LOG_DBG("PNG cache with hash " << hash << " hit.");
+                _lru.splice(_lru.end(), _lru, it->second._lru);
+                return it->second._data;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void addToCache(const CacheData &data, TileWireId wid, const TileBinaryHash hash)
+    {
+        if (hash)
+        {
+            // Adding duplicates causes grim wid mixups
+            assert(hashToWireId(hash) == wid);
+            assert(_cache.find(hash) == _cache.end());
+            (void)wid;
+
+            data->shrink_to_fit();
+            _cache.emplace(hash, CacheEntry{ data, _lru.insert(_lru.end(), hash) });
+            _cacheSize += data->size();
+        }
+    }
+
+    TileWireId hashToWireId(TileBinaryHash hash)
+    {
+        TileWireId wid;
+        if (hash == 0)
+            return 0;
+        auto it = _hashToWireId.find(hash);
+        if (it != _hashToWireId.end())
+            wid = it->second;
+        else
+        {
+            wid = createNewWireId();
+            _hashToWireId.emplace(hash, wid);
+        }
+        return wid;
+    }
+
+    /// The total size of the PNGs cached.
+    size_t getCacheSize() const { return _cacheSize; }
+    size_t getMaxCacheSize() const { return _maxCacheSize; }
+    size_t getCount() const { return _cache.size(); }
+    uint64_t getHits() const { return _cacheHits; }
+    uint64_t getMisses() const { return _cacheTests - _cacheHits; }
+    uint64_t getEvictions() const { return _evictions; }
+    /// How many times the wire ids started anew.
+    uint64_t getWireIdWraps() const { return _wireIdWraps; }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
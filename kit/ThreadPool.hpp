@@ -0,0 +1,214 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_THREADPOOL_HPP
+#define INCLUDED_THREADPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Log.hpp>
+#include <Util.hpp>
+
+/// A persistent pool of threads for the PNG compression, where each
+/// thread has its own queue of work and steals from the others' when
+/// that runs dry. The thread calling run() works too, so a pool of
+/// N concurrency has N - 1 threads.
+class ThreadPool {
+    typedef std::function<void()> ThreadFn;
+
+    /// The owner pops from the front, thieves from the back.
+    struct WorkQueue
+    {
+        std::mutex _mutex;
+        std::deque<ThreadFn> _work;
+    };
+
+    /// Queue 0 belongs to the thread calling run(), N to _threads[N - 1].
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _threads;
+    size_t _nextQueue;
+    /// Work pushed and not yet finished.
+    std::atomic<size_t> _pending;
+
+    /// Protects the below, and serializes waking and completion.
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _complete;
+    size_t _generation;
+    bool   _shutdown;
+public:
+    explicit ThreadPool(int maxConcurrency = readMaxConcurrency())
+        : _nextQueue(0),
+          _pending(0),
+          _generation(0),
+          _shutdown(false)
+    {
+        LOG_TRC("PNG compression thread pool size " << maxConcurrency);
+        for (int i = 0; i < std::max(maxConcurrency, 1); ++i)
+            _queues.emplace_back(new WorkQueue());
+        for (int i = 1; i < maxConcurrency; ++i)
+            _threads.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock< std::mutex > lock(_mutex);
+            assert(_pending == 0);
+            _shutdown = true;
+        }
+        _cond.notify_all();
+        for (auto &it : _threads)
+            it.join();
+    }
+
+    /// The concurrency loolwsd passes in MAX_CONCURRENCY, else one
+    /// thread per available CPU.
+    static int readMaxConcurrency()
+    {
+        int maxConcurrency = 2;
+#if MOBILEAPP && !defined(GTKAPP)
+#  warning "Good defaults ? - 2 for iOS, 4 for Android ?"
+#else
+        const char *max = std::getenv("MAX_CONCURRENCY");
+        if (max)
+            maxConcurrency = std::atoi(max);
+#if !MOBILEAPP
+        else
+            maxConcurrency = Util::getAvailableCpuCount();
+#endif
+#endif
+        return maxConcurrency;
+    }
+
+    size_t count() const
+    {
+        return _pending;
+    }
+
+    /// Queue work for the next run(). Idle threads may start on it right away.
+    void pushWork(const ThreadFn &fn)
+    {
+        WorkQueue& queue = *_queues[_nextQueue++ % _queues.size()];
+        ++_pending;
+
+        std::lock_guard<std::mutex> lock(queue._mutex);
+        queue._work.push_back(fn);
+    }
+
+    /// Run all the pushed work to completion, in this thread and the pool.
+    /// @returns the time this thread spent waiting for others to finish.
+    std::chrono::microseconds run()
+    {
+        if (_pending == 0)
+            return std::chrono::microseconds::zero();
+
+        // Avoid notifying threads if we don't need to.
+        if (!_threads.empty() && _pending > 1)
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            ++_generation;
+            _cond.notify_all();
+        }
+
+        workUntilEmpty(0);
+
+        const auto waitStart = std::chrono::steady_clock::now();
+        {
+            std::unique_lock< std::mutex > lock(_mutex);
+            _complete.wait(lock, [this]() { return _pending == 0; });
+        }
+
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - waitStart);
+    }
+
+private:
+    /// Take work from our own queue, or else steal it.
+    bool popWork(size_t index, ThreadFn& fn)
+    {
+        {
+            WorkQueue& own = *_queues[index];
+            std::lock_guard<std::mutex> lock(own._mutex);
+            if (!own._work.empty())
+            {
+                fn = std::move(own._work.front());
+                own._work.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < _queues.size(); ++i)
+        {
+            WorkQueue& victim = *_queues[(index + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(victim._mutex);
+            if (!victim._work.empty())
+            {
+                fn = std::move(victim._work.back());
+                victim._work.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void workUntilEmpty(size_t index)
+    {
+        ThreadFn fn;
+        while (popWork(index, fn))
+        {
+            try
+            {
+                fn();
+            }
+            catch (const std::exception& exc)
+            {
+                LOG_ERR("Exception in PNG compression work: " << exc.what());
+            }
+
+            if (--_pending == 0)
+            {
+                std::lock_guard< std::mutex > lock(_mutex);
+                _complete.notify_all();
+            }
+        }
+    }
+
+    void work(size_t index)
+    {
+        size_t generation = 0;
+        std::unique_lock< std::mutex > lock(_mutex);
+        while (!_shutdown)
+        {
+            _cond.wait(lock, [&]() { return _shutdown || _generation != generation; });
+            generation = _generation;
+            if (_shutdown)
+                break;
+
+            lock.unlock();
+            workUntilEmpty(index);
+            lock.lock();
+        }
+    }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -193,6 +193,10 @@ L.Socket = L.Class.extend({
 		if (String.locale) {
 			msg += ' lang=' + String.locale;
 		}
+		if (!window.ThisIsTheiOSApp) {
+			// Cached tiles can come combined in one message.
+			msg += ' tilecombine=true';
+		}
 		if (this._map.options.renderingOptions) {
 			var options = {
 				'rendering': this._map.options.renderingOptions
@@ -722,6 +726,10 @@ L.Socket = L.Class.extend({
 				vex.closeAll();
 			}
 		}
+		else if (textMsg.startsWith('tilecombine:') && imgBytes !== undefined) {
+			this._onTileCombinedMsg(textMsg, imgBytes.subarray(index + 1));
+			return;
+		}
 		else if (!textMsg.startsWith('tile:') && !textMsg.startsWith('renderfont:') && !textMsg.startsWith('windowpaint:')) {
 			// log the tile msg separately as we need the tile coordinates
 			L.Log.log(textMsg, L.INCOMING);
@@ -755,22 +763,7 @@ L.Socket = L.Class.extend({
 			}
 		}
 		else {
-			var data = imgBytes.subarray(index + 1);
-
-			if (data.length > 0 && data[0] == 68 /* D */)
-			{
-				console.log('Socket: got a delta !');
-				img = data;
-			}
-			else
-			{
-				// read the tile data
-				var strBytes = '';
-				for (var i = 0; i < data.length; i++) {
-					strBytes += String.fromCharCode(data[i]);
-				}
-				img = 'data:image/png;base64,' + window.btoa(strBytes);
-			}
+			img = this._tileImage(imgBytes.subarray(index + 1));
 		}
 
 		if (textMsg.startsWith('status:')) {
@@ -800,6 +793,68 @@ L.Socket = L.Class.extend({
 		}
 	},
 
+	// The tile data as the doc layer takes it: a delta as-is, a png as a data: URL.
+	_tileImage: function (data) {
+		if (data.length > 0 && data[0] == 68 /* D */) {
+			console.log('Socket: got a delta !');
+			return data;
+		}
+
+		// read the tile data
+		var strBytes = '';
+		for (var i = 0; i < data.length; i++) {
+			strBytes += String.fromCharCode(data[i]);
+		}
+		return 'data:image/png;base64,' + window.btoa(strBytes);
+	},
+
+	// Cached tiles sent together, their data one after the other: each is
+	// handled as its own 'tile:', and all are acknowledged at once.
+	_onTileCombinedMsg: function (textMsg, data) {
+		var docLayer = this._map._docLayer;
+		if (!docLayer) {
+			return;
+		}
+
+		var command = {};
+		var tokens = textMsg.split(/[ \n]+/);
+		for (var i = 1; i < tokens.length; i++) {
+			var eq = tokens[i].indexOf('=');
+			if (eq > 0) {
+				command[tokens[i].substring(0, eq)] = tokens[i].substring(eq + 1);
+			}
+		}
+
+		var xs = command.tileposx.split(',');
+		var ys = command.tileposy.split(',');
+		var sizes = command.imgsize.split(',');
+		var vers = command.ver ? command.ver.split(',') : [];
+		var wids = command.wid ? command.wid.split(',') : [];
+		var tileIDs = [];
+		var offset = 0;
+		for (i = 0; i < xs.length; i++) {
+			var size = parseInt(sizes[i]);
+			var tileMsg = 'tile: part=' + command.part + ' width=' + command.width + ' height=' + command.height +
+				' tileposx=' + xs[i] + ' tileposy=' + ys[i] +
+				' tilewidth=' + command.tilewidth + ' tileheight=' + command.tileheight;
+			if (vers[i] !== undefined) {
+				tileMsg += ' ver=' + vers[i];
+			}
+			if (wids[i] !== undefined) {
+				tileMsg += ' wid=' + wids[i];
+			}
+			if (command.renderid !== undefined) {
+				tileMsg += ' renderid=' + command.renderid;
+			}
+
+			docLayer._onTileMsg(tileMsg, this._tileImage(data.subarray(offset, offset + size)), true);
+			offset += size;
+			tileIDs.push(command.part + ':' + xs[i] + ':' + ys[i] + ':' + command.tilewidth + ':' + command.tileheight);
+		}
+
+		this.sendMessage('tileprocessed tile=' + tileIDs.join(','));
+	},
+
 	_delayedFitToScreen: function(height) {
 		if (this._map.getSize().y > 0) {
 			// If we have a presentation document and the zoom level has not been set
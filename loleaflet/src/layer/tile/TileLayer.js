@@ -1567,7 +1567,7 @@ L.TileLayer = L.GridLayer.extend({
 		this._map.fire('window', dialogMsg);
 	},
 
-	_onTileMsg: function (textMsg, img) {
+	_onTileMsg: function (textMsg, img, noAck) {
 		var command = this._map._socket.parseServerCmd(textMsg);
 		var coords = this._twipsToCoords(command);
 		coords.z = command.zoom;
@@ -1711,9 +1711,11 @@ L.TileLayer = L.GridLayer.extend({
 		}
 		L.Log.log(textMsg, L.INCOMING, key);
 
-		// Send acknowledgment, that the tile message arrived
-		var tileID = command.part + ':' + command.x + ':' + command.y + ':' + command.tileWidth + ':' + command.tileHeight;
-		this._map._socket.sendMessage('tileprocessed tile=' + tileID);
+		// Send acknowledgment, that the tile message arrived, unless the caller does for many.
+		if (!noAck) {
+			var tileID = command.part + ':' + command.x + ':' + command.y + ':' + command.tileWidth + ':' + command.tileHeight;
+			this._map._socket.sendMessage('tileprocessed tile=' + tileID);
+		}
 	},
 
 	_tileOnLoad: function (done, tile) {
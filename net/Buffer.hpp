@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_BUFFER_HPP
+#define INCLUDED_BUFFER_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+/// A byte buffer appended to at the back and consumed from the front, as socket input is.
+/// Consuming only moves an offset, the consumed space is reclaimed when that's cheap:
+/// when there is less left to move than there is to reclaim, or when growing anyway.
+class Buffer
+{
+public:
+    typedef char* iterator;
+    typedef const char* const_iterator;
+
+    Buffer()
+        : _offset(0)
+    {
+    }
+
+    size_t size() const { return _data.size() - _offset; }
+    bool empty() const { return _offset == _data.size(); }
+
+    char* data() { return _data.data() + _offset; }
+    const char* data() const { return _data.data() + _offset; }
+
+    char& operator[](size_t index) { return _data[_offset + index]; }
+    const char& operator[](size_t index) const { return _data[_offset + index]; }
+
+    iterator begin() { return data(); }
+    iterator end() { return _data.data() + _data.size(); }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return _data.data() + _data.size(); }
+
+    void clear()
+    {
+        _data.clear();
+        _offset = 0;
+    }
+
+    /// Appends [first, last) at the back.
+    void append(const char* first, const char* last)
+    {
+        compact(last - first);
+        _data.insert(_data.end(), first, last);
+    }
+
+    /// Removes the first len bytes.
+    void eraseFirst(size_t len)
+    {
+        assert(len <= size());
+        _offset += len;
+        if (_offset == _data.size())
+            clear();
+    }
+
+    /// Removes [first, last), which is cheap at the front only.
+    iterator erase(iterator first, iterator last)
+    {
+        assert(first >= begin() && first <= last && last <= end());
+        if (first == begin())
+        {
+            eraseFirst(last - first);
+            return begin();
+        }
+
+        const size_t pos = first - _data.data();
+        _data.erase(_data.begin() + pos, _data.begin() + (last - _data.data()));
+        return _data.data() + pos;
+    }
+
+private:
+    /// Moves the data to the front when it's cheap, or we'd reallocate anyway.
+    void compact(size_t toAppend)
+    {
+        if (_offset > 0 && (_offset >= size() || _data.size() + toAppend > _data.capacity()))
+        {
+            _data.erase(_data.begin(), _data.begin() + _offset);
+            _offset = 0;
+        }
+    }
+
+    std::vector<char> _data;
+    /// Bytes consumed from the front of _data.
+    size_t _offset;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
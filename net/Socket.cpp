@@ -75,6 +75,7 @@ namespace {
 
 SocketPoll::SocketPoll(const std::string& threadName)
     : _name(threadName),
+      _epollFd(-1),
       _stop(false),
       _threadStarted(false),
       _threadFinished(false),
@@ -112,6 +113,8 @@ SocketPoll::~SocketPoll()
     }
 
 #if !MOBILEAPP
+    if (_epollFd >= 0)
+        ::close(_epollFd);
     ::close(_wakeup[0]);
     ::close(_wakeup[1]);
 #else
@@ -184,6 +187,8 @@ void SocketPoll::pollingThreadEntry()
         pollingThread();
 
         // Release sockets.
+        for (const auto& socket : _pollSockets)
+            epollRemove(socket->getFD());
         _pollSockets.clear();
         _newSockets.clear();
     }
@@ -201,6 +206,180 @@ void SocketPoll::wakeupWorld()
         wakeup(fd);
 }
 
+#if !MOBILEAPP && defined(__linux)
+
+static_assert(EPOLLIN == POLLIN && EPOLLPRI == POLLPRI && EPOLLOUT == POLLOUT &&
+              EPOLLERR == POLLERR && EPOLLHUP == POLLHUP,
+              "epoll events are passed through as poll events");
+
+namespace {
+    /// Registers fd with epoll for events, whether it is registered already or not.
+    /// The kernel forgets closed fds on its own, so our idea of it can be stale.
+    bool epollSet(int epollFd, int fd, int events, bool registered)
+    {
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+
+        if (::epoll_ctl(epollFd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0)
+            return true;
+
+        if (errno == ENOENT)
+            return ::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+        if (errno == EEXIST)
+            return ::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+
+        return false;
+    }
+}
+
+bool SocketPoll::setUseEpoll(bool useEpoll)
+{
+    assert(!_threadStarted);
+
+    if (useEpoll && _epollFd < 0)
+    {
+        _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (_epollFd < 0)
+        {
+            LOG_SYS("Failed to create epoll instance for " << _name << ", using poll.");
+            return false;
+        }
+
+        if (!epollSet(_epollFd, _wakeup[0], EPOLLIN, false))
+        {
+            LOG_SYS("Failed to register the wakeup pipe of " << _name << ", using poll.");
+            ::close(_epollFd);
+            _epollFd = -1;
+            return false;
+        }
+
+        LOG_INF("Poll [" << _name << "] uses epoll.");
+    }
+    else if (!useEpoll && _epollFd >= 0)
+    {
+        ::close(_epollFd);
+        _epollFd = -1;
+        _epollEntries.clear();
+    }
+
+    return isUsingEpoll();
+}
+
+int SocketPoll::epollWait(int timeoutMs)
+{
+    const size_t size = _pollFds.size() - 1; // The wakeup pipe is registered for good.
+
+    // Most sockets want the same events as last time, and cost nothing.
+    int failed = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        const int fd = _pollFds[i].fd;
+        const int events = _pollFds[i].events;
+
+        auto it = _epollEntries.find(fd);
+        const bool registered = (it != _epollEntries.end());
+        if (registered && it->second._events == events)
+        {
+            it->second._index = i;
+            continue;
+        }
+
+        if (epollSet(_epollFd, fd, events, registered))
+        {
+            if (registered)
+                it->second = EpollEntry{ events, i };
+            else
+                _epollEntries.emplace(fd, EpollEntry{ events, i });
+        }
+        else
+        {
+            // Report it as poll(2) would an invalid fd, so it gets dropped.
+            LOG_SYS("Failed to register socket #" << fd << " with epoll in " << _name);
+            if (registered)
+                _epollEntries.erase(it);
+            _pollFds[i].revents = POLLNVAL;
+            ++failed;
+        }
+    }
+
+    if (_epollEvents.size() < size + 1)
+        _epollEvents.resize(size + 1);
+
+    int rc;
+    do
+    {
+        LOG_TRC("Poll start");
+        rc = ::epoll_wait(_epollFd, _epollEvents.data(), static_cast<int>(_epollEvents.size()),
+                          failed ? 0 : timeoutMs);
+    }
+    while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+    {
+        LOG_SYS("epoll_wait failed in " << _name);
+        return failed ? failed : rc;
+    }
+
+    for (int j = 0; j < rc; ++j)
+    {
+        const int fd = _epollEvents[j].data.fd;
+        if (fd == _wakeup[0])
+        {
+            _pollFds[size].revents = _epollEvents[j].events;
+            continue;
+        }
+
+        const auto it = _epollEntries.find(fd);
+        if (it != _epollEntries.end() && it->second._index < size &&
+            _pollFds[it->second._index].fd == fd)
+        {
+            _pollFds[it->second._index].revents = _epollEvents[j].events;
+        }
+        else
+        {
+            // Not one of ours any more, don't let it wake us again.
+            LOG_WRN("Unknown socket #" << fd << " signalled in epoll of " << _name);
+            epollRemove(fd);
+        }
+    }
+
+    return rc + failed;
+}
+
+void SocketPoll::epollRemove(int fd)
+{
+    if (_epollFd < 0)
+        return;
+
+    _epollEntries.erase(fd);
+
+    // Fails harmlessly if the kernel has forgotten it already.
+    ::epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+#else
+
+bool SocketPoll::setUseEpoll(bool useEpoll)
+{
+    if (useEpoll)
+        LOG_WRN("epoll is not available, poll [" << _name << "] uses poll.");
+    return false;
+}
+
+int SocketPoll::epollWait(int /* timeoutMs */)
+{
+    assert(false);
+    return -1;
+}
+
+void SocketPoll::epollRemove(int /* fd */)
+{
+}
+
+#endif
+
 #if !MOBILEAPP
 
 void SocketPoll::insertNewWebSocketSync(
@@ -402,12 +581,14 @@ void StreamSocket::dumpState(std::ostream& os)
     int timeoutMaxMs = SocketPoll::DefaultPollTimeoutMs;
     int events = getPollEvents(std::chrono::steady_clock::now(), timeoutMaxMs);
     os << "\t" << getFD() << "\t" << events << "\t"
-       << _inBuffer.size() << "\t" << _outBuffer.size() << "\t"
+       << _inBuffer.size() << "\t" << getPendingOutputSize() << "\t"
        << " r: " << _bytesRecvd << "\t w: " << _bytesSent << "\t"
        << clientAddress() << "\t";
     _socketHandler->dumpState(os);
     if (_inBuffer.size() > 0)
         Util::dumpHex(os, "\t\tinBuffer:\n", "\t\t", _inBuffer);
+    if (!_outQueue.empty())
+        os << "\t\toutQueue: " << _outQueue.size() << " segments of " << _outQueueSize << " bytes\n";
     if (_outBuffer.size() > 0)
         Util::dumpHex(os, "\t\toutBuffer:\n", "\t\t", _outBuffer);
 }
@@ -643,13 +824,23 @@ bool StreamSocket::parseHeader(const char *clientName,
 
     assert(!map || (map->_headerSize == 0 && map->_messageSize == 0));
 
+    if (_shutdownSignalled)
+    {
+        // Don't answer what follows a request we refused, say.
+        _inBuffer.clear();
+        return false;
+    }
+
     // Find the end of the header, if any.
     static const std::string marker("\r\n\r\n");
     auto itBody = std::search(_inBuffer.begin(), _inBuffer.end(),
                               marker.begin(), marker.end());
     if (itBody == _inBuffer.end())
     {
-        LOG_TRC("#" << getFD() << " doesn't have enough data yet.");
+        if (isMessageTooBig(_inBuffer.size()))
+            refuseTooBigRequest(_inBuffer.size());
+        else
+            LOG_TRC("#" << getFD() << " doesn't have enough data yet.");
         return false;
     }
 
@@ -685,6 +876,14 @@ bool StreamSocket::parseHeader(const char *clientName,
         const auto offset = itBody - _inBuffer.begin();
         const std::streamsize available = _inBuffer.size() - offset;
 
+        // Refuse it before it is all read.
+        if (contentLength != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH &&
+            isMessageTooBig(offset + contentLength))
+        {
+            refuseTooBigRequest(offset + contentLength);
+            return false;
+        }
+
         if (contentLength != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH && available < contentLength)
         {
             LOG_DBG("Not enough content yet: ContentLength: " << contentLength << ", available: " << available);
@@ -753,6 +952,8 @@ bool StreamSocket::parseHeader(const char *clientName,
                     LOG_DBG("Not enough content yet in chunk " << chunk <<
                             " starting at offset " << (chunkStart - _inBuffer.begin()) <<
                             " chunk len: " << chunkLen << ", available: " << chunkAvailable);
+                    if (isMessageTooBig(_inBuffer.size()))
+                        refuseTooBigRequest(_inBuffer.size());
                     return false;
                 }
                 itBody += chunkLen;
@@ -774,6 +975,8 @@ bool StreamSocket::parseHeader(const char *clientName,
                 chunk++;
             }
             LOG_TRC("Not enough chunks yet, so far " << chunk << " chunks of total length " << (itBody - _inBuffer.begin()));
+            if (isMessageTooBig(_inBuffer.size()))
+                refuseTooBigRequest(_inBuffer.size());
             return false;
         }
     }
@@ -795,6 +998,20 @@ bool StreamSocket::parseHeader(const char *clientName,
     return true;
 }
 
+void StreamSocket::refuseTooBigRequest(uint64_t size)
+{
+    LOG_ERR("#" << getFD() << ": Refusing HTTP request of at least " << size <<
+            " bytes, over the limit of " << _maxMessageSize << " bytes.");
+
+    Poco::Net::HTTPResponse response(Poco::Net::HTTPResponse::HTTP_REQUESTENTITYTOOLARGE);
+    response.setContentLength(0);
+    send(response);
+    shutdown();
+
+    // Nothing more of it is to be read.
+    _inBuffer.clear();
+}
+
 bool StreamSocket::compactChunks(MessageMap *map)
 {
     assert (map);
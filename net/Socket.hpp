@@ -15,6 +15,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#endif
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -25,6 +29,7 @@
 #include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -32,7 +37,9 @@
 #include <mutex>
 #include <sstream>
 #include <thread>
+#include <unordered_map>
 
+#include "Buffer.hpp"
 #include "Common.hpp"
 #include "FakeSocket.hpp"
 #include "Log.hpp"
@@ -388,6 +395,9 @@ public:
 /// hundred users on same document to suffer poll(2)'s
 /// scalability limit. Meanwhile, epoll(2)'s high
 /// overhead to adding/removing sockets is not helpful.
+/// The server-wide polls, which can hold thousands of
+/// mostly idle connections, can opt into epoll(7) on
+/// Linux with setUseEpoll().
 class SocketPoll
 {
 public:
@@ -433,6 +443,7 @@ public:
             socket->assertCorrectThread();
             socket->setThreadOwner(std::thread::id());
 
+            epollRemove(socket->getFD());
             _pollSockets.pop_back();
         }
     }
@@ -448,6 +459,15 @@ public:
     /// Executed inside the poll in case of a wakeup
     virtual void wakeupHook() {}
 
+    /// Wait with epoll(7) instead of poll(2), where available.
+    /// Only the registrations whose events changed cost a syscall
+    /// per spin, and the wait itself is independent of the number
+    /// of idle sockets. Must be set before the thread starts.
+    /// @returns true if epoll is in use.
+    bool setUseEpoll(bool useEpoll);
+
+    bool isUsingEpoll() const { return _epollFd >= 0; }
+
     /// The default implementation of our polling thread
     virtual void pollingThread()
     {
@@ -506,17 +526,22 @@ public:
         const size_t size = _pollSockets.size();
 
         int rc;
-        do
+        if (isUsingEpoll())
+            rc = epollWait(std::max(timeoutMaxMs, 0));
+        else
         {
-            LOG_TRC("Poll start");
+            do
+            {
+                LOG_TRC("Poll start");
 #if !MOBILEAPP
-            rc = ::poll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
+                rc = ::poll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
 #else
-            LOG_TRC("SocketPoll Poll");
-            rc = fakeSocketPoll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
+                LOG_TRC("SocketPoll Poll");
+                rc = fakeSocketPoll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
 #endif
+            }
+            while (rc < 0 && errno == EINTR);
         }
-        while (rc < 0 && errno == EINTR);
         LOG_TRC("Poll completed with " << rc << " live polls max (" <<
                 timeoutMaxMs << "ms)" << ((rc==0) ? "(timedout)" : ""));
 
@@ -599,6 +624,7 @@ public:
             {
                 LOG_DBG("Removing socket #" << _pollFds[i].fd << " (of " <<
                         _pollSockets.size() << ") from " << _name);
+                epollRemove(_pollFds[i].fd);
                 _pollSockets.erase(_pollSockets.begin() + i);
             }
 
@@ -707,6 +733,7 @@ public:
         auto it = std::find(_pollSockets.begin(), _pollSockets.end(), socket);
         assert(it != _pollSockets.end());
 
+        epollRemove(socket->getFD());
         _pollSockets.erase(it);
         LOG_DBG("Removing socket #" << socket->getFD() << " (of " <<
                 _pollSockets.size() << ") from " << _name);
@@ -778,6 +805,14 @@ private:
         _pollFds[size].revents = 0;
     }
 
+    /// Brings the epoll registrations in line with _pollFds, waits,
+    /// and fills in the revents. @returns the number of ready fds.
+    int epollWait(int timeoutMs);
+
+    /// Unregisters the fd of a socket we stop polling, before it's closed
+    /// or moved to another poll.
+    void epollRemove(int fd);
+
     /// The polling thread entry.
     /// Used to set the thread name and mark the thread as stopped when done.
     void pollingThreadEntry();
@@ -796,6 +831,19 @@ private:
     /// The fds to poll.
     std::vector<pollfd> _pollFds;
 
+    /// The epoll instance, or -1 when using poll(2).
+    int _epollFd;
+    /// An fd's registered events, and its index into _pollFds.
+    struct EpollEntry
+    {
+        int _events;
+        size_t _index;
+    };
+    std::unordered_map<int, EpollEntry> _epollEntries;
+#ifdef __linux
+    std::vector<struct epoll_event> _epollEvents;
+#endif
+
     /// Flag the thread to stop.
     std::atomic<bool> _stop;
     /// The polling thread.
@@ -815,8 +863,11 @@ public:
                  std::shared_ptr<SocketHandlerInterface> socketHandler) :
         Socket(fd),
         _socketHandler(std::move(socketHandler)),
+        _maxMessageSize(0),
+        _outQueueSize(0),
         _bytesSent(0),
         _bytesRecvd(0),
+        _writeCount(0),
         _wsState(WSState::HTTP),
         _closed(false),
         _sentHTTPContinue(false),
@@ -869,7 +920,7 @@ public:
         // cf. SslSocket::getPollEvents
         assertCorrectThread();
         int events = _socketHandler->getPollEvents(now, timeoutMaxMs);
-        if (!_outBuffer.empty() || _shutdownSignalled)
+        if (hasPendingOutput() || _shutdownSignalled)
             events |= POLLOUT;
         return events;
     }
@@ -886,6 +937,33 @@ public:
         }
     }
 
+    /// Send shared data to the socket peer, without copying it.
+    /// The data must not change until it's written.
+    void send(const std::shared_ptr<const std::vector<char>>& data, const bool flush = true)
+    {
+        assertCorrectThread();
+        if (data && !data->empty())
+        {
+            sealOutBuffer();
+            _outQueue.push_back(OutSegment(data));
+            _outQueueSize += data->size();
+            if (flush)
+                writeOutgoingData();
+        }
+    }
+
+    /// True if we have output that is not yet written.
+    bool hasPendingOutput() const
+    {
+        return !_outBuffer.empty() || !_outQueue.empty();
+    }
+
+    /// The number of bytes of output not yet written.
+    size_t getPendingOutputSize() const
+    {
+        return _outBuffer.size() + _outQueueSize;
+    }
+
     /// Send a string to the socket peer.
     void send(const std::string& str, const bool flush = true)
     {
@@ -906,10 +984,14 @@ public:
         // SSL decodes blocks of 16Kb, so for efficiency we use the same.
         char buf[16 * 1024];
         ssize_t len;
+        const size_t limit = _inBuffer.size() + MaxReadAheadSize;
         do
         {
-            // Drain the read buffer.
-            // TODO: Cap the buffer size, lest we grow beyond control.
+            // Drain the read buffer, but no more than the handler will
+            // have to process at once. The rest waits in the kernel,
+            // which throttles the peer, and poll wakes us again for it.
+            // A message that stays incomplete beyond _maxMessageSize is
+            // refused by the handler, which closes the connection.
             do
             {
                 len = readData(buf, sizeof(buf));
@@ -920,11 +1002,11 @@ public:
             {
                 assert (len <= ssize_t(sizeof(buf)));
                 _bytesRecvd += len;
-                _inBuffer.insert(_inBuffer.end(), &buf[0], &buf[len]);
+                _inBuffer.append(&buf[0], &buf[len]);
             }
             // else poll will handle errors.
         }
-        while (len == (sizeof(buf)));
+        while (len == (sizeof(buf)) && _inBuffer.size() < limit);
 #else
         LOG_TRC("readIncomingData #" << getFD());
         ssize_t available = fakeSocketAvailableDataLength(getFD());
@@ -940,7 +1022,7 @@ public:
             assert(len == available);
             _bytesRecvd += len;
             assert(_inBuffer.size() == 0);
-            _inBuffer.insert(_inBuffer.end(), buf.data(), buf.data() + len);
+            _inBuffer.append(buf.data(), buf.data() + len);
         }
 #endif
 
@@ -986,7 +1068,7 @@ public:
         if (toErase < count)
             LOG_ERR("#" << getFD() << ": attempted to remove: " << count << " which is > size: " << _inBuffer.size() << " clamped to " << toErase);
         if (toErase > 0)
-            _inBuffer.erase(_inBuffer.begin(), _inBuffer.begin() + count);
+            _inBuffer.eraseFirst(toErase);
     }
 
     /// Compacts chunk headers away leaving just the data we want
@@ -994,7 +1076,8 @@ public:
     bool compactChunks(MessageMap *map);
 
     /// Detects if we have an HTTP header in the provided message and
-    /// populates a request for that.
+    /// populates a request for that. A request over the message size
+    /// limit is refused with a 413 and the connection shut down.
     bool parseHeader(const char *clientLoggingName,
                      Poco::MemoryInputStream &message,
                      Poco::Net::HTTPRequest &request,
@@ -1007,11 +1090,30 @@ public:
         recv = _bytesRecvd;
     }
 
-    std::vector<char>& getInBuffer()
+    /// The number of writes that sent anything, to tell how well output gets batched.
+    uint64_t getWriteCount() const
+    {
+        return _writeCount;
+    }
+
+    /// Consumed data is to be erased from the front, which is cheap.
+    Buffer& getInBuffer()
     {
         return _inBuffer;
     }
 
+    /// The largest message the peer may send, 0 for unlimited. The handlers close
+    /// the connection on a message that gets larger while still incomplete.
+    void setMaxMessageSize(size_t size) { _maxMessageSize = size; }
+    size_t getMaxMessageSize() const { return _maxMessageSize; }
+
+    /// Whether a message of this size, complete or not, is over the limit.
+    bool isMessageTooBig(uint64_t size) const
+    {
+        return _maxMessageSize > 0 && size > _maxMessageSize;
+    }
+
+    /// Output appended here goes out after all that is pending.
     std::vector<char>& getOutBuffer()
     {
         return _outBuffer;
@@ -1060,27 +1162,27 @@ protected:
         do
         {
             // If we have space for writing and that was requested
-            if ((events & POLLOUT) && _outBuffer.empty())
+            if ((events & POLLOUT) && !hasPendingOutput())
                 _socketHandler->performWrites();
 
             // perform the shutdown if we have sent everything.
-            if (_shutdownSignalled && _outBuffer.empty())
+            if (_shutdownSignalled && !hasPendingOutput())
             {
                 closeConnection();
                 closed = true;
                 break;
             }
 
-            oldSize = _outBuffer.size();
+            oldSize = getPendingOutputSize();
 
             // Write if we can and have data to write.
-            if ((events & POLLOUT) && !_outBuffer.empty())
+            if ((events & POLLOUT) && hasPendingOutput())
             {
                 writeOutgoingData();
                 closed = closed || (errno == EPIPE);
             }
         }
-        while (oldSize != _outBuffer.size());
+        while (oldSize != getPendingOutputSize());
 
         if (closed)
         {
@@ -1098,21 +1200,35 @@ public:
     virtual void writeOutgoingData()
     {
         assertCorrectThread();
-        assert(!_outBuffer.empty());
+        assert(hasPendingOutput());
+
+        sealOutBuffer();
+
+        struct iovec iov[MaxWriteSegments];
         do
         {
+            // Writing more than we can absorb in the kernel causes SSL wasteage.
+            size_t toWrite = getSendBufferSize();
+            int iovcnt = 0;
+            for (auto it = _outQueue.begin(); it != _outQueue.end() && iovcnt < MaxWriteSegments && toWrite > 0; ++it)
+            {
+                const size_t len = std::min(it->_data->size() - it->_offset, toWrite);
+                iov[iovcnt].iov_base = const_cast<char*>(it->_data->data() + it->_offset);
+                iov[iovcnt].iov_len = len;
+                ++iovcnt;
+                toWrite -= len;
+            }
+
             ssize_t len;
             do
             {
-                // Writing more than we can absorb in the kernel causes SSL wasteage.
-                len = writeData(&_outBuffer[0], std::min((int)_outBuffer.size(),
-                                                         getSendBufferSize()));
+                len = writeData(iov, iovcnt);
 
                 auto& log = Log::logger();
                 if (log.trace() && len > 0) {
                     LOG_TRC("#" << getFD() << ": Wrote outgoing data " << len <<
-                            " bytes of " << _outBuffer.size() << " bytes buffered.");
-                    // log.dump("", &_outBuffer[0], len);
+                            " bytes of " << _outQueueSize << " bytes buffered in " <<
+                            iovcnt << " of " << _outQueue.size() << " segments.");
                 }
 
                 if (len <= 0 && errno != EAGAIN && errno != EWOULDBLOCK)
@@ -1123,7 +1239,8 @@ public:
             if (len > 0)
             {
                 _bytesSent += len;
-                _outBuffer.erase(_outBuffer.begin(), _outBuffer.begin() + len);
+                ++_writeCount;
+                consumeOutput(len);
             }
             else
             {
@@ -1131,7 +1248,7 @@ public:
                 break;
             }
         }
-        while (!_outBuffer.empty());
+        while (!_outQueue.empty());
     }
 
     /// Does it look like we have some TLS / SSL where we don't expect it ?
@@ -1160,6 +1277,20 @@ protected:
 #endif
     }
 
+    /// Override to handle writing gathered data to socket differently.
+    /// Returns as writev(2), partial writes are fine.
+    virtual int writeData(const struct iovec* iov, const int iovcnt)
+    {
+        assertCorrectThread();
+#if !MOBILEAPP
+        return ::writev(getFD(), iov, iovcnt);
+#else
+        // Each write is a message, and each segment holds whole messages.
+        (void)iovcnt;
+        return fakeSocketWrite(getFD(), iov[0].iov_base, iov[0].iov_len);
+#endif
+    }
+
     void dumpState(std::ostream& os) override;
 
     void setShutdownSignalled(bool shutdownSignalled)
@@ -1178,14 +1309,71 @@ protected:
     }
 
   private:
+    /// Moves the output appended to _outBuffer to the end of the queue.
+    void sealOutBuffer()
+    {
+        if (!_outBuffer.empty())
+        {
+            _outQueueSize += _outBuffer.size();
+            _outQueue.push_back(OutSegment(std::make_shared<const std::vector<char>>(std::move(_outBuffer))));
+            _outBuffer.clear();
+        }
+    }
+
+    /// Drops the first len written bytes of the queue.
+    void consumeOutput(size_t len)
+    {
+        assert(len <= _outQueueSize);
+        _outQueueSize -= len;
+        while (len > 0)
+        {
+            OutSegment& segment = _outQueue.front();
+            const size_t consumed = std::min(segment._data->size() - segment._offset, len);
+            segment._offset += consumed;
+            len -= consumed;
+            if (segment._offset == segment._data->size())
+                _outQueue.pop_front();
+        }
+    }
+
+    /// Part of the output, shared with others when given to send().
+    struct OutSegment
+    {
+        OutSegment(const std::shared_ptr<const std::vector<char>>& data)
+            : _data(data)
+            , _offset(0)
+        {
+        }
+
+        std::shared_ptr<const std::vector<char>> _data;
+        /// Bytes already written.
+        size_t _offset;
+    };
+
+    /// The most segments we write with a single call.
+    static constexpr int MaxWriteSegments = 64;
+
+    /// Answers a request too big to buffer with a 413, and shuts down.
+    void refuseTooBigRequest(uint64_t size);
+
     /// Client handling the actual data.
     std::shared_ptr<SocketHandlerInterface> _socketHandler;
 
-    std::vector<char> _inBuffer;
+    /// The most input read per poll, ahead of the handler consuming it.
+    static constexpr size_t MaxReadAheadSize = 1024 * 1024;
+
+    Buffer _inBuffer;
+    size_t _maxMessageSize;
+
+    /// Output not yet sealed into _outQueue.
     std::vector<char> _outBuffer;
+    /// Output waiting to be written, in order, before _outBuffer.
+    std::deque<OutSegment> _outQueue;
+    size_t _outQueueSize;
 
     uint64_t _bytesSent;
     uint64_t _bytesRecvd;
+    uint64_t _writeCount;
 
     enum class WSState { HTTP, WS } _wsState;
 
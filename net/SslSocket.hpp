@@ -124,6 +124,27 @@ public:
         return handleSslState(SSL_write(_ssl, buf, len));
     }
 
+    virtual int writeData(const struct iovec* iov, const int iovcnt) override
+    {
+        assertCorrectThread();
+
+        // Each SSL_write is at least one record, so coalesce small segments into full ones.
+        // A retry after SSL_ERROR_WANT_WRITE rebuilds the same bytes, which is fine with
+        // SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER.
+        if (iovcnt == 1 || iov[0].iov_len >= MaxSslRecordSize)
+            return writeData(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
+
+        _sslRecord.clear();
+        for (int i = 0; i < iovcnt && _sslRecord.size() < MaxSslRecordSize; ++i)
+        {
+            const size_t len = std::min(iov[i].iov_len, MaxSslRecordSize - _sslRecord.size());
+            const char* data = static_cast<const char*>(iov[i].iov_base);
+            _sslRecord.insert(_sslRecord.end(), data, data + len);
+        }
+
+        return writeData(_sslRecord.data(), _sslRecord.size());
+    }
+
     int getPollEvents(std::chrono::steady_clock::time_point now,
                       int & timeoutMaxMs) override
     {
@@ -141,7 +162,7 @@ public:
             return POLLOUT;
         }
 
-        if (!getOutBuffer().empty() || isShutdownSignalled())
+        if (hasPendingOutput() || isShutdownSignalled())
             events |= POLLOUT;
 
         return events;
@@ -289,7 +310,12 @@ private:
     }
 
 private:
+    /// The maximum payload of a TLS record.
+    static constexpr size_t MaxSslRecordSize = 16 * 1024;
+
     SSL* _ssl;
+    /// Small output segments coalesced into one record.
+    std::vector<char> _sslRecord;
     /// During handshake SSL might want to read
     /// on write, or write on read.
     SslWantsTo _sslWantsTo;
@@ -145,7 +145,7 @@ public:
         const unsigned char flags = WSFrameMask::Fin
                                   | static_cast<char>(WSOpCode::Close);
 
-        sendFrame(socket, buf.data(), buf.size(), flags);
+        sendFrame(socket, buf.data(), buf.size(), {}, flags);
 #endif
     }
 
@@ -225,6 +225,15 @@ public:
             headerLen += 4;
         }
 
+        // Refuse it before it is all read, with what came in previous fragments.
+        if (socket->isMessageTooBig(_wsPayload.size() + payloadLen))
+        {
+            LOG_ERR("#" << socket->getFD() << ": WebSocket message of " << _wsPayload.size() + payloadLen <<
+                    " bytes is over the limit of " << socket->getMaxMessageSize() << " bytes.");
+            shutdown(StatusCodes::PAYLOAD_TOO_BIG);
+            return true;
+        }
+
         if (payloadLen + headerLen > len)
         { // partial read wait for more data.
             LOG_TRC("#" << socket->getFD() << ": Still incomplete WebSocket frame, have " << len
@@ -251,7 +260,7 @@ public:
             std::vector<char> ctrlPayload;
 
             readPayload(data, payloadLen, mask, ctrlPayload);
-            socket->getInBuffer().erase(socket->getInBuffer().begin(), socket->getInBuffer().begin() + headerLen + payloadLen);
+            socket->getInBuffer().eraseFirst(headerLen + payloadLen);
             LOG_TRC("#" << socket->getFD() << ": Incoming WebSocket frame code " << static_cast<unsigned>(code) <<
                 ", fin? " << fin << ", mask? " << hasMask << ", payload length: " << payloadLen <<
                 ", residual socket data: " << socket->getInBuffer().size() << " bytes.");
@@ -356,7 +365,7 @@ public:
         const size_t payloadLen = len;
 #endif
 
-        socket->getInBuffer().erase(socket->getInBuffer().begin(), socket->getInBuffer().begin() + headerLen + payloadLen);
+        socket->getInBuffer().eraseFirst(headerLen + payloadLen);
 
 #if !MOBILEAPP
 
@@ -515,18 +524,39 @@ public:
         //TODO: Support fragmented messages.
 
         std::shared_ptr<StreamSocket> socket = _socket.lock();
-        return sendFrame(socket, data, len, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
+        return sendFrame(socket, data, len, {}, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
+    }
+
+    /// Sends a WebSocket message of WPOpCode type made of the header data followed by the bodies.
+    /// The bodies are gathered into the frame as-is, so they can be shared by many messages.
+    /// Returns as sendMessage above.
+    int sendMessage(const char* data, const size_t len,
+                    const std::vector<std::shared_ptr<const std::vector<char>>>& bodies,
+                    const WSOpCode code, const bool flush = true) const
+    {
+        // Units filter on the first line, which is in the header.
+        int unitReturn = -1;
+        if (UnitBase::get().filterSendMessage(data, len, code, flush, unitReturn))
+            return unitReturn;
+
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        return sendFrame(socket, data, len, bodies, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
     }
 
 private:
 
-    /// Sends a WebSocket frame given the data, length, and flags.
+    /// Sends a WebSocket frame given the data, length, bodies following the data, if any, and flags.
     /// Returns the number of bytes written (including frame overhead) on success,
     /// 0 for closed/invalid socket, and -1 for other errors.
     int sendFrame(const std::shared_ptr<StreamSocket>& socket,
-                  const char* data, const size_t len,
+                  const char* data, const size_t dataLen,
+                  const std::vector<std::shared_ptr<const std::vector<char>>>& bodies,
                   unsigned char flags, const bool flush = true) const
     {
+        size_t len = dataLen;
+        for (const auto& body : bodies)
+            len += body->size();
+
         if (!socket || data == nullptr || len == 0)
             return -1;
 
@@ -574,8 +604,10 @@ private:
             out.push_back(static_cast<char>(0x81));
             out.push_back(static_cast<char>(0x76));
 
-            // Copy the data.
-            out.insert(out.end(), data, data + len);
+            // Copy the data, the bodies too as we mask them in place.
+            out.insert(out.end(), data, data + dataLen);
+            for (const auto& body : bodies)
+                out.insert(out.end(), body->begin(), body->end());
 
             // Mask it.
             for (size_t i = 4; i < out.size() - mask; ++i)
@@ -584,15 +616,27 @@ private:
         else
         {
             // Copy the data.
-            out.insert(out.end(), data, data + len);
+            out.insert(out.end(), data, data + dataLen);
+        }
+        size_t size = out.size() - oldSize;
+
+        // Queue the bodies as-is, they are shared (e.g. with the TileCache).
+        if (!_isMasking)
+        {
+            for (const auto& body : bodies)
+            {
+                socket->send(body, false);
+                size += body->size();
+            }
         }
-        const size_t size = out.size() - oldSize;
 #else
         LOG_TRC("WebSocketHandle::sendFrame: Writing to #" << socket->getFD() << " " << len << " bytes");
         assert(flush);
         assert(out.size() == 0);
 
-        out.insert(out.end(), data, data + len);
+        out.insert(out.end(), data, data + dataLen);
+        for (const auto& body : bodies)
+            out.insert(out.end(), body->begin(), body->end());
         const size_t size = out.size();
 #endif
         if (flush)
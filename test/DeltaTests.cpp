@@ -9,7 +9,10 @@
 
 #include <config.h>
 
+#include <random>
+
 #include <cppunit/extensions/HelperMacros.h>
+#include <zlib.h>
 
 #include <Delta.hpp>
 #include <Util.hpp>
@@ -23,11 +26,19 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDeltaSequence);
     CPPUNIT_TEST(testRandomDeltas);
+    CPPUNIT_TEST(testDeltaScroll);
+    CPPUNIT_TEST(testDeltaEviction);
+    CPPUNIT_TEST(testDeltaBGRA);
+    CPPUNIT_TEST(testDeltaBytesSaved);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testDeltaSequence();
     void testRandomDeltas();
+    void testDeltaScroll();
+    void testDeltaEviction();
+    void testDeltaBGRA();
+    void testDeltaBytesSaved();
 
     std::vector<char> loadPng(const char *relpath,
                               png_uint_32& height,
@@ -65,10 +76,29 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 std::vector<char> DeltaTests::applyDelta(
     const std::vector<char> &pixmap,
     png_uint_32 width, png_uint_32 height,
-    const std::vector<char> &delta)
+    const std::vector<char> &compressed)
 {
-    CPPUNIT_ASSERT(delta.size() >= 4);
-    CPPUNIT_ASSERT(delta[0] == 'D');
+    CPPUNIT_ASSERT(compressed.size() >= 4);
+    CPPUNIT_ASSERT(compressed[0] == 'D');
+
+    // Inflate the commands, after the 'D'.
+    std::vector<char> delta(1, 'D');
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    CPPUNIT_ASSERT_EQUAL(Z_OK, inflateInit(&stream));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + 1));
+    stream.avail_in = compressed.size() - 1;
+    int result = Z_OK;
+    while (result == Z_OK)
+    {
+        char chunk[16384];
+        stream.next_out = reinterpret_cast<Bytef*>(chunk);
+        stream.avail_out = sizeof(chunk);
+        result = inflate(&stream, Z_NO_FLUSH);
+        delta.insert(delta.end(), chunk, chunk + sizeof(chunk) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    CPPUNIT_ASSERT_EQUAL(Z_STREAM_END, result);
 
     // start with the same state.
     std::vector<char> output = pixmap;
@@ -200,6 +230,172 @@ void DeltaTests::testDeltaSequence()
 
 void DeltaTests::testRandomDeltas()
 {
+    DeltaGenerator gen;
+
+    const int width = 256;
+    const int height = 256;
+    std::mt19937 rng(42);
+
+    // A page of mostly white, with some lines of 'text'.
+    std::vector<char> frame(width * height * 4, static_cast<char>(0xff));
+    for (int y = 20; y < height; y += 16)
+    {
+        for (int i = y * width * 4; i < std::min(y + 8, height) * width * 4; ++i)
+            frame[i] = rng() % 4 ? static_cast<char>(0xff) : rng();
+    }
+
+    TileWireId wid = 1;
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(frame.data()),
+                                    0, 0, width, height, width, height, delta, wid, 0));
+
+    for (int step = 0; step < 20; ++step)
+    {
+        // Change a few random runs, some rows, some single pixels.
+        std::vector<char> next = frame;
+        for (int change = 0, changes = rng() % 16; change < changes; ++change)
+        {
+            const size_t start = rng() % next.size();
+            const size_t end = std::min(next.size(), start + rng() % (change % 2 ? 4096 : 8));
+            for (size_t i = start; i < end; ++i)
+                next[i] = rng();
+        }
+
+        delta.clear();
+        CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(next.data()),
+                                       0, 0, width, height, width, height, delta, wid + 1, wid));
+
+        assertEqual(applyDelta(frame, width, height, delta), next, width, height);
+
+        frame = next;
+        ++wid;
+    }
+}
+
+void DeltaTests::testDeltaScroll()
+{
+    DeltaGenerator gen;
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text = loadPng(TDOC "/delta-text.png", height, width, rowBytes);
+    CPPUNIT_ASSERT(height == 256 && width == 256);
+
+    // Scroll by 10 rows, with new content at the bottom.
+    std::vector<char> scrolled(text.begin() + 10 * width * 4, text.end());
+    scrolled.resize(text.size(), static_cast<char>(0x80));
+
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(text.data()),
+                                    0, 0, width, height, width, height, delta, 1, 0));
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(scrolled.data()),
+                                   0, 0, width, height, width, height, delta, 2, 1));
+
+    assertEqual(applyDelta(text, width, height, delta), scrolled, width, height);
+
+    // Mostly copies of rows, which cost nearly nothing.
+    CPPUNIT_ASSERT(delta.size() < 2048);
+}
+
+void DeltaTests::testDeltaEviction()
+{
+    DeltaGenerator gen(2);
+
+    const int width = 64;
+    const int height = 64;
+    std::vector<std::vector<char>> frames;
+    for (int i = 0; i < 3; ++i)
+        frames.push_back(std::vector<char>(width * height * 4, static_cast<char>(i * 50)));
+
+    std::vector<char> delta;
+    for (int i = 0; i < 3; ++i)
+        CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(frames[i].data()),
+                                        0, 0, width, height, width, height, delta, i + 1, 0));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), gen.size());
+
+    // The first was evicted, the second is still there.
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(frames[0].data()),
+                                    0, 0, width, height, width, height, delta, 4, 1));
+    CPPUNIT_ASSERT(delta.empty());
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(frames[0].data()),
+                                   0, 0, width, height, width, height, delta, 4, 3));
+    assertEqual(applyDelta(frames[2], width, height, delta), frames[0], width, height);
+
+    // Too large to address in bytes.
+    std::vector<char> large(512 * 512 * 4);
+    delta.clear();
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(large.data()),
+                                    0, 0, 512, 512, 512, 512, delta, 5, 4));
+    CPPUNIT_ASSERT(delta.empty());
+}
+
+void DeltaTests::testDeltaBGRA()
+{
+    DeltaGenerator gen;
+
+    // Premultiplied BGRA areas of a larger buffer.
+    const int width = 32;
+    const int height = 32;
+    const int bufferWidth = 100;
+    const int bufferHeight = 50;
+    std::vector<char> pixmap(bufferWidth * bufferHeight * 4);
+    for (size_t i = 0; i < pixmap.size(); i += 4)
+    {
+        const unsigned char alpha = (i / 4) % 3 ? 255 : 128;
+        for (size_t c = 0; c < 3; ++c)
+            pixmap[i + c] = ((i + c) * 7) % (alpha + 1);
+        pixmap[i + 3] = alpha;
+    }
+
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(pixmap.data()),
+                                    0, 0, width, height, bufferWidth, bufferHeight,
+                                    delta, 1, 0, LOK_TILEMODE_BGRA));
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(pixmap.data()),
+                                   50, 10, width, height, bufferWidth, bufferHeight,
+                                   delta, 2, 1, LOK_TILEMODE_BGRA));
+
+    // The delta applies to, and gives, what the pngs would have.
+    const auto unpremultiplied = [&](int startX, int startY)
+    {
+        std::vector<char> output(width * height * 4);
+        for (int y = 0; y < height; ++y)
+        {
+            Png::unpremultiplyRowScalar(reinterpret_cast<unsigned char*>(
+                                            &pixmap[((startY + y) * bufferWidth + startX) * 4]),
+                                        reinterpret_cast<unsigned char*>(&output[y * width * 4]),
+                                        width);
+        }
+        return output;
+    };
+
+    assertEqual(applyDelta(unpremultiplied(0, 0), width, height, delta),
+                unpremultiplied(50, 10), width, height);
+}
+
+void DeltaTests::testDeltaBytesSaved()
+{
+    const char* testname = "deltaBytesSaved ";
+
+    DeltaGenerator gen;
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text = loadPng(TDOC "/delta-text.png", height, width, rowBytes);
+    std::vector<char> text2 = loadPng(TDOC "/delta-text2.png", height, width, rowBytes);
+
+    std::vector<char> png;
+    CPPUNIT_ASSERT(Png::encodeSubBufferToPNG(reinterpret_cast<unsigned char*>(text2.data()),
+                                             0, 0, width, height, width, height,
+                                             png, LOK_TILEMODE_RGBA));
+
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(text.data()),
+                                    0, 0, width, height, width, height, delta, 1, 0));
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(text2.data()),
+                                   0, 0, width, height, width, height, delta, 2, 1));
+
+    TST_LOG("Typing a character: png of " << png.size() << " bytes, delta of " <<
+            delta.size() << " bytes, " << 100 - delta.size() * 100 / png.size() << "% saved.");
+    CPPUNIT_ASSERT(delta.size() < png.size());
 }
 
 CPPUNIT_TEST_SUITE_REGISTRATION(DeltaTests);
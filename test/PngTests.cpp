@@ -0,0 +1,380 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <Png.hpp>
+#include <helpers.hpp>
+
+/// PNG encoder unit-tests.
+class PngTests : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(PngTests);
+
+    CPPUNIT_TEST(testEncodeFilters);
+    CPPUNIT_TEST(testEncodeSingleColour);
+    CPPUNIT_TEST(testEncodeBGRA);
+    CPPUNIT_TEST(testEncodePerf);
+    CPPUNIT_TEST(testUnpremultiply);
+    CPPUNIT_TEST(testHash);
+    CPPUNIT_TEST(testTilePerf);
+
+    CPPUNIT_TEST_SUITE_END();
+
+    void testEncodeFilters();
+    void testEncodeSingleColour();
+    void testEncodeBGRA();
+    void testEncodePerf();
+    void testUnpremultiply();
+    void testHash();
+    void testTilePerf();
+
+    std::vector<std::vector<char>> loadTiles();
+
+    std::vector<char> loadPng(const char *relpath,
+                              png_uint_32& height,
+                              png_uint_32& width)
+    {
+        std::ifstream file(relpath);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        file.close();
+        png_uint_32 rowBytes;
+        std::vector<png_bytep> rows =
+            Png::decodePNG(buffer, height, width, rowBytes);
+        std::vector<char> output;
+        for (png_uint_32 y = 0; y < height; ++y)
+            output.insert(output.end(), rows[y], rows[y] + width * 4);
+        return output;
+    }
+
+    /// Decodes png and checks it matches the given area of pixmap.
+    void assertDecodesTo(const std::vector<char>& png, const std::vector<char>& pixmap,
+                         int startX, int startY, int width, int height, int bufferWidth)
+    {
+        std::stringstream stream(std::string(png.begin(), png.end()));
+        png_uint_32 decodedHeight, decodedWidth, rowBytes;
+        std::vector<png_bytep> rows = Png::decodePNG(stream, decodedHeight, decodedWidth, rowBytes);
+        CPPUNIT_ASSERT_EQUAL(static_cast<png_uint_32>(width), decodedWidth);
+        CPPUNIT_ASSERT_EQUAL(static_cast<png_uint_32>(height), decodedHeight);
+        for (int y = 0; y < height; ++y)
+        {
+            const char* expected = &pixmap[((startY + y) * bufferWidth + startX) * 4];
+            CPPUNIT_ASSERT(std::memcmp(rows[y], expected, width * 4) == 0);
+        }
+    }
+
+    std::vector<char> encode(std::vector<char>& pixmap, int startX, int startY,
+                             int width, int height, int bufferWidth, int bufferHeight,
+                             LibreOfficeKitTileMode mode, const Png::EncoderOptions& options)
+    {
+        std::vector<char> png;
+        CPPUNIT_ASSERT(Png::encodeSubBufferToPNG(reinterpret_cast<unsigned char*>(pixmap.data()),
+                                                 startX, startY, width, height,
+                                                 bufferWidth, bufferHeight, png, mode, options));
+        return png;
+    }
+};
+
+void PngTests::testEncodeFilters()
+{
+    // An area of a larger buffer, with content that suits no filter in particular.
+    const int bufferWidth = 300;
+    const int bufferHeight = 200;
+    std::vector<char> pixmap(bufferWidth * bufferHeight * 4);
+    for (size_t i = 0; i < pixmap.size(); ++i)
+        pixmap[i] = (i * 7 + (i / 1200) * 13) % 251;
+
+    const Png::Filter filters[] = { Png::Filter::None, Png::Filter::Sub, Png::Filter::Up,
+                                    Png::Filter::Average, Png::Filter::Paeth,
+                                    Png::Filter::Adaptive };
+    for (const bool useLibPng : { false, true })
+    {
+        for (const Png::Filter filter : filters)
+        {
+            Png::EncoderOptions options = Png::getEncoderOptions();
+            options._useLibPng = useLibPng;
+            options._filter = filter;
+            const std::vector<char> png = encode(pixmap, 10, 20, 256, 128,
+                                                 bufferWidth, bufferHeight,
+                                                 LOK_TILEMODE_RGBA, options);
+            assertDecodesTo(png, pixmap, 10, 20, 256, 128, bufferWidth);
+        }
+    }
+}
+
+void PngTests::testEncodeSingleColour()
+{
+    std::vector<char> pixmap(256 * 256 * 4);
+    for (size_t i = 0; i < pixmap.size(); i += 4)
+    {
+        pixmap[i] = 0x20;
+        pixmap[i + 1] = 0x40;
+        pixmap[i + 2] = 0x60;
+        pixmap[i + 3] = static_cast<char>(0xff);
+    }
+
+    Png::EncoderOptions options = Png::getEncoderOptions();
+    options._useLibPng = false;
+    const std::vector<char> png = encode(pixmap, 0, 0, 256, 256, 256, 256,
+                                         LOK_TILEMODE_RGBA, options);
+    assertDecodesTo(png, pixmap, 0, 0, 256, 256, 256);
+
+    // All rows filter to zeros, which compress to next to nothing.
+    CPPUNIT_ASSERT(png.size() < 1024);
+}
+
+void PngTests::testEncodeBGRA()
+{
+    // Premultiplied pixels of all sorts of alpha.
+    std::vector<char> pixmap(64 * 64 * 4);
+    for (size_t i = 0; i < pixmap.size(); i += 4)
+    {
+        const unsigned alpha = (i % 3 ? (i * 5) % 256 : 255);
+        for (size_t c = 0; c < 3; ++c)
+            pixmap[i + c] = alpha ? ((i + c) * 11) % (alpha + 1) : 0;
+        pixmap[i + 3] = alpha;
+    }
+
+    // Both encoders unpremultiply the same.
+    Png::EncoderOptions options = Png::getEncoderOptions();
+    options._useLibPng = true;
+    std::vector<char> pixmapCopy = pixmap;
+    const std::vector<char> expected = encode(pixmapCopy, 0, 0, 64, 64, 64, 64,
+                                              LOK_TILEMODE_BGRA, options);
+
+    std::stringstream stream(std::string(expected.begin(), expected.end()));
+    png_uint_32 height, width, rowBytes;
+    std::vector<png_bytep> rows = Png::decodePNG(stream, height, width, rowBytes);
+    std::vector<char> unpremultiplied;
+    for (png_uint_32 y = 0; y < height; ++y)
+        unpremultiplied.insert(unpremultiplied.end(), rows[y], rows[y] + width * 4);
+
+    options._useLibPng = false;
+    const std::vector<char> png = encode(pixmap, 0, 0, 64, 64, 64, 64,
+                                         LOK_TILEMODE_BGRA, options);
+    assertDecodesTo(png, unpremultiplied, 0, 0, 64, 64, 64);
+}
+
+void PngTests::testEncodePerf()
+{
+    const char* testname = "encodePerf ";
+
+    std::vector<std::vector<char>> tiles = loadTiles();
+
+    const std::pair<const char*, Png::Filter> filters[] = {
+        { "none", Png::Filter::None }, { "up", Png::Filter::Up },
+        { "paeth", Png::Filter::Paeth }, { "adaptive", Png::Filter::Adaptive } };
+
+    for (const bool useLibPng : { true, false })
+    {
+        for (const auto& filter : filters)
+        {
+            Png::EncoderOptions options = Png::getEncoderOptions();
+            options._useLibPng = useLibPng;
+            options._filter = filter.second;
+
+            const int iterations = 5;
+            size_t bytes = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                for (std::vector<char>& tile : tiles)
+                    bytes += encode(tile, 0, 0, 256, 256, 256, 256, LOK_TILEMODE_RGBA, options).size();
+            }
+            const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+            const size_t count = iterations * tiles.size();
+            TST_LOG((useLibPng ? "libpng" : "deflate") << " level " << options._level <<
+                    ", filter " << filter.first << ": " << bytes / count << " bytes, " <<
+                    us / count << " us per 256x256 tile.");
+        }
+    }
+}
+
+void PngTests::testUnpremultiply()
+{
+    // Every colour at every alpha, and a few opaque and transparent runs.
+    std::vector<unsigned char> pixmap;
+    for (unsigned alpha = 0; alpha < 256; ++alpha)
+    {
+        for (unsigned colour = 0; colour < 256; ++colour)
+        {
+            pixmap.push_back(colour);
+            pixmap.push_back(colour * 7);
+            pixmap.push_back(255 - colour);
+            pixmap.push_back(alpha);
+        }
+    }
+    pixmap.insert(pixmap.end(), 4 * 37, 0);
+    for (size_t i = 0; i < 4 * 41; ++i)
+        pixmap.push_back(i % 4 == 3 ? 255 : i * 3);
+
+    const size_t width = pixmap.size() / 4;
+    std::vector<unsigned char> expected(pixmap.size());
+    for (size_t x = 0; x < width; ++x)
+    {
+        const unsigned char* pixel = &pixmap[x * 4];
+        const unsigned alpha = pixel[3];
+        for (size_t c = 0; c < 3 && alpha; ++c)
+            expected[x * 4 + c] = (pixel[2 - c] * 255 + alpha / 2) / alpha;
+        expected[x * 4 + 3] = alpha;
+    }
+
+    std::vector<unsigned char> output(pixmap.size());
+    Png::unpremultiplyRowScalar(pixmap.data(), output.data(), width);
+    CPPUNIT_ASSERT(output == expected);
+
+    // Whichever kernel is in use, and in place.
+    output = pixmap;
+    Png::unpremultiplyRow(output.data(), output.data(), width);
+    CPPUNIT_ASSERT(output == expected);
+
+#if LOOL_X86_SIMD
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        std::fill(output.begin(), output.end(), 0);
+        Png::unpremultiplyRowSSE41(pixmap.data(), output.data(), width);
+        CPPUNIT_ASSERT(output == expected);
+    }
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        std::fill(output.begin(), output.end(), 0);
+        Png::unpremultiplyRowAVX2(pixmap.data(), output.data(), width);
+        CPPUNIT_ASSERT(output == expected);
+    }
+#endif
+}
+
+void PngTests::testHash()
+{
+    const int bufferWidth = 600;
+    const int bufferHeight = 300;
+    std::vector<unsigned char> pixmap(bufferWidth * bufferHeight * 4);
+    for (size_t i = 0; i < pixmap.size(); ++i)
+        pixmap[i] = (i * 2654435761u) >> 13;
+
+    std::vector<Png::TileHash::HashStripesFn> kernels;
+#if LOOL_X86_SIMD
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back(Png::TileHash::hashStripesSSE2);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(Png::TileHash::hashStripesAVX2);
+#endif
+
+    // The kernels agree on any area, rows of partial stripes too.
+    for (const int width : { 1, 15, 16, 17, 100, 256, 512 })
+    {
+        for (const int start : { 0, 3, 17 })
+        {
+            const uint64_t expected = Png::TileHash::hash(Png::TileHash::hashStripesScalar,
+                                                          pixmap.data(), start, start, width, 200,
+                                                          bufferWidth, bufferHeight);
+            CPPUNIT_ASSERT(expected != 0);
+            for (const Png::TileHash::HashStripesFn kernel : kernels)
+            {
+                CPPUNIT_ASSERT_EQUAL(expected,
+                                     Png::TileHash::hash(kernel, pixmap.data(), start, start, width,
+                                                         200, bufferWidth, bufferHeight));
+            }
+        }
+    }
+
+    // Any change of content, or of area, changes the hash.
+    const uint64_t hash = Png::hashSubBuffer(pixmap.data(), 10, 10, 256, 256, bufferWidth, bufferHeight);
+    CPPUNIT_ASSERT(hash != 0);
+    CPPUNIT_ASSERT(hash != Png::hashSubBuffer(pixmap.data(), 11, 10, 256, 256, bufferWidth, bufferHeight));
+    CPPUNIT_ASSERT(hash != Png::hashSubBuffer(pixmap.data(), 10, 10, 256, 255, bufferWidth, bufferHeight));
+    pixmap[(100 * bufferWidth + 200) * 4 + 1] ^= 1;
+    CPPUNIT_ASSERT(hash != Png::hashSubBuffer(pixmap.data(), 10, 10, 256, 256, bufferWidth, bufferHeight));
+    pixmap[(100 * bufferWidth + 200) * 4 + 1] ^= 1;
+    CPPUNIT_ASSERT_EQUAL(hash, Png::hashSubBuffer(pixmap.data(), 10, 10, 256, 256, bufferWidth, bufferHeight));
+
+    // Blank tiles too.
+    std::vector<unsigned char> blank(256 * 256 * 4);
+    const uint64_t blankHash = Png::hashSubBuffer(blank.data(), 0, 0, 256, 256, 256, 256);
+    CPPUNIT_ASSERT(blankHash != 0);
+    CPPUNIT_ASSERT(blankHash != Png::hashSubBuffer(blank.data(), 0, 0, 128, 256, 256, 256));
+}
+
+void PngTests::testTilePerf()
+{
+    const char* testname = "tilePerf ";
+
+    std::vector<std::vector<char>> tiles = loadTiles();
+    const int iterations = 200;
+    const size_t count = iterations * tiles.size();
+
+    const auto measure = [&](const char* name, const std::function<void(unsigned char*)>& func)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            for (std::vector<char>& tile : tiles)
+                func(reinterpret_cast<unsigned char*>(tile.data()));
+        }
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        TST_LOG(name << ": " << ns / count / 1000. << " us per 256x256 tile.");
+    };
+
+    uint64_t hashes = 0;
+    measure("hash spooky", [&](unsigned char* tile)
+            { hashes += Png::hashSubBufferSpooky(tile, 0, 0, 256, 256, 256, 256); });
+    measure("hash", [&](unsigned char* tile)
+            { hashes += Png::hashSubBuffer(tile, 0, 0, 256, 256, 256, 256); });
+
+    std::vector<unsigned char> output(256 * 256 * 4);
+    measure("unpremultiply scalar", [&](unsigned char* tile)
+            { Png::unpremultiplyRowScalar(tile, output.data(), 256 * 256); });
+    measure("unpremultiply", [&](unsigned char* tile)
+            { Png::unpremultiplyRow(tile, output.data(), 256 * 256); });
+
+    // Keep the hashing from being optimized out.
+    CPPUNIT_ASSERT(hashes != 0);
+}
+
+std::vector<std::vector<char>> PngTests::loadTiles()
+{
+    // Tiles of real document renderings.
+    png_uint_32 height, width;
+    std::vector<std::vector<char>> tiles;
+    std::vector<char> calc = loadPng(TDOC "/calc_render_0_512x512.3840,0.7680x7680.png", height, width);
+    CPPUNIT_ASSERT(height == 512 && width == 512);
+    for (size_t y = 0; y < 2; ++y)
+    {
+        for (size_t x = 0; x < 2; ++x)
+        {
+            std::vector<char> tile;
+            for (size_t row = 0; row < 256; ++row)
+            {
+                const size_t offset = ((y * 256 + row) * width + x * 256) * 4;
+                tile.insert(tile.end(), calc.begin() + offset, calc.begin() + offset + 256 * 4);
+            }
+            tiles.push_back(tile);
+        }
+    }
+    tiles.push_back(loadPng(TDOC "/delta-text.png", height, width));
+    tiles.push_back(loadPng(TDOC "/delta-text2.png", height, width));
+    return tiles;
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(PngTests);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
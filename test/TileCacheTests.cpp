@@ -16,11 +16,13 @@
 #include <cppunit/extensions/HelperMacros.h>
 
 #include <Common.hpp>
+#include <common/FileUtil.hpp>
 #include <Protocol.hpp>
 #include <LOOLWebSocket.hpp>
 #include <MessageQueue.hpp>
 #include <Png.hpp>
 #include <TileCache.hpp>
+#include <TileDiskCache.hpp>
 #include <Unit.hpp>
 #include <Util.hpp>
 
@@ -59,6 +61,12 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDesc);
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testCacheEviction);
+    CPPUNIT_TEST(testTotalCacheEviction);
+    CPPUNIT_TEST(testSharedTiles);
+    CPPUNIT_TEST(testPersistedTiles);
+    CPPUNIT_TEST(testPrefetchHits);
+    CPPUNIT_TEST(testInvalidateTilesPerf);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testCancelTiles);
     // unstable
@@ -94,6 +102,12 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     void testDesc();
     void testSimple();
+    void testCacheEviction();
+    void testTotalCacheEviction();
+    void testSharedTiles();
+    void testPrefetchHits();
+    void testPersistedTiles();
+    void testInvalidateTilesPerf();
     void testSimpleCombine();
     void testCancelTiles();
     void testCancelTilesMultiView();
@@ -227,6 +241,343 @@ void TileCacheTests::testSimple()
     CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tileData);
 }
 
+void TileCacheTests::testCacheEviction()
+{
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+
+    const int size = 1024;
+    const std::vector<char> data = genRandomData(size);
+    tc.setMaxCacheSize(4 * size);
+
+    std::vector<TileDesc> tiles;
+    for (int i = 0; i < 4; ++i)
+    {
+        tiles.emplace_back(0, 256, 256, i * 3840, 0, 3840, 3840, -1, 0, -1, false);
+        tc.saveTileAndNotify(tiles.back(), data.data(), size);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4 * size), tc.getCacheSize());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), tc.getCacheEvictions());
+
+    // Touch the oldest tile, so it's no longer the least recently used.
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tc.lookupTile(tiles[0]));
+
+    // A larger tile that pushes us over budget.
+    const std::vector<char> large = genRandomData(2 * size);
+    tiles.emplace_back(0, 256, 256, 4 * 3840, 0, 3840, 3840, -1, 0, -1, false);
+    tc.saveTileAndNotify(tiles.back(), large.data(), large.size());
+
+    CPPUNIT_ASSERT(tc.getCacheSize() <= tc.getMaxCacheSize());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(2), tc.getCacheEvictions());
+    CPPUNIT_ASSERT_MESSAGE("recently used tile was evicted", tc.lookupTile(tiles[0]));
+    CPPUNIT_ASSERT_MESSAGE("least recently used tile was kept", !tc.lookupTile(tiles[1]));
+    CPPUNIT_ASSERT_MESSAGE("new tile was evicted", tc.lookupTile(tiles[4]));
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(3), tc.getCacheHits());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tc.getCacheMisses());
+
+    // Invalidation releases the budget.
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tc.getCacheSize());
+}
+
+void TileCacheTests::testTotalCacheEviction()
+{
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const int size = 1024;
+    TileCache::setMaxTotalCacheSize(8 * size);
+
+    TileCache idle("idle.ods", std::chrono::system_clock::time_point());
+    for (int i = 0; i < 8; ++i)
+    {
+        const std::vector<char> data = genRandomData(size);
+        idle.saveTileAndNotify(TileDesc(0, 256, 256, i * 3840, 0, 3840, 3840, -1, 0, -1, false),
+                               data.data(), size);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(8 * size), idle.getCacheSize());
+
+    // The active document gets its share, the total is over budget until the idle one shrinks.
+    TileCache active("active.ods", std::chrono::system_clock::time_point());
+    for (int i = 0; i < 8; ++i)
+    {
+        const std::vector<char> data = genRandomData(size);
+        active.saveTileAndNotify(TileDesc(0, 256, 256, i * 3840, 0, 3840, 3840, -1, 0, -1, false),
+                                 data.data(), size);
+    }
+
+    CPPUNIT_ASSERT(active.getCacheSize() <= static_cast<size_t>(4 * size));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(8 * size), idle.getCacheSize());
+    CPPUNIT_ASSERT(TileCache::getTotalCacheSize() > TileCache::getMaxTotalCacheSize());
+
+    idle.evictTiles();
+    CPPUNIT_ASSERT(idle.getCacheSize() <= static_cast<size_t>(4 * size));
+    CPPUNIT_ASSERT(idle.getCacheEvictions() >= 4);
+
+    TileCache::setMaxTotalCacheSize(0);
+}
+
+void TileCacheTests::testSharedTiles()
+{
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    TileStore::clear();
+
+    TileCache tcA("docA.ods", std::chrono::system_clock::time_point());
+    TileCache tcB("docB.ods", std::chrono::system_clock::time_point());
+
+    const int size = 1024;
+    const std::vector<char> data = genRandomData(size);
+    TileDesc tile(0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+
+    // The same content in two documents is held once.
+    tcA.saveTileAndNotify(tile, data.data(), size);
+    tcB.saveTileAndNotify(tile, data.data(), size);
+    TileCache::Tile tileA = tcA.lookupTile(tile);
+    TileCache::Tile tileB = tcB.lookupTile(tile);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tileA && tileB);
+    CPPUNIT_ASSERT_MESSAGE("identical tiles are not shared", tileA == tileB);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), TileStore::getPinnedCount());
+
+    // Different content isn't.
+    const std::vector<char> other = genRandomData(size);
+    TileDesc otherTile(0, 256, 256, 3840, 0, 3840, 3840, -1, 0, -1, false);
+    tcB.saveTileAndNotify(otherTile, other.data(), size);
+    CPPUNIT_ASSERT(other == *tcB.lookupTile(otherTile));
+    CPPUNIT_ASSERT(tcB.lookupTile(otherTile) != tileA);
+
+    // Stored often enough, but by a single document, the tile is not pinned.
+    for (int i = 1; i < 8; ++i)
+    {
+        TileDesc manyTile(0, 256, 256, 0, i * 3840, 3840, 3840, -1, 0, -1, false);
+        tcB.saveTileAndNotify(manyTile, other.data(), size);
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), TileStore::getPinnedCount());
+
+    // By more than one, it gets pinned.
+    for (int i = 1; i < 8; ++i)
+    {
+        TileDesc manyTile(0, 256, 256, 0, i * 3840, 3840, 3840, -1, 0, -1, false);
+        tcA.saveTileAndNotify(manyTile, data.data(), size);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), TileStore::getPinnedCount());
+    std::vector<TileBinaryHash> hashes;
+    TileStore::getPinned(0, hashes);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), hashes.size());
+    CPPUNIT_ASSERT_EQUAL(TileRef::hash(data.data(), size), hashes[0]);
+
+    // A reference to it is refused from a kit it wasn't sent to.
+    std::vector<char> ref;
+    TileRef::append(ref, hashes[0]);
+    CPPUNIT_ASSERT(TileRef::isRef(ref.data(), ref.size()));
+    TileCache tcC("docC.ods", std::chrono::system_clock::time_point());
+    tcC.saveTileAndNotify(tile, ref.data(), ref.size());
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tcC.lookupTile(tile));
+
+    // And stands for it from one it was sent to.
+    tcC.addKnownTiles(hashes);
+    tcC.saveTileAndNotify(tile, ref.data(), ref.size());
+    TileCache::Tile tileC = tcC.lookupTile(tile);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tileC);
+    CPPUNIT_ASSERT(data == *tileC);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(size), tcC.getCacheSize());
+
+    // An unknown reference is not cached, even when told of, as the tile of another
+    // document, never pinned, can't be referred to.
+    ref.clear();
+    TileRef::append(ref, TileRef::hash(other.data(), size));
+    tcC.addKnownTiles(std::vector<TileBinaryHash>(1, TileRef::hash(other.data(), size)));
+    tcC.saveTileAndNotify(otherTile, ref.data(), ref.size());
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tcC.lookupTile(otherTile));
+
+    TileStore::clear();
+}
+
+void TileCacheTests::testPrefetchHits()
+{
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+
+    const TileDesc prefetched(0, 256, 256, 0, 0, 3840, 3840, 1, 0, -1, false);
+    const TileDesc other(0, 256, 256, 3840, 0, 3840, 3840, 2, 0, -1, false);
+    tc.registerTilePrefetch(prefetched);
+    tc.registerTilePrefetch(other);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), tc.getPrefetchHits());
+
+    // Requested while being prefetched, it is waited for rather than rendered again.
+    TileDesc requested = prefetched;
+    requested.setVersion(10);
+    CPPUNIT_ASSERT(tc.takeOverPrefetch(requested));
+    CPPUNIT_ASSERT_EQUAL(prefetched.getVersion(), requested.getVersion());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tc.getPrefetchHits());
+
+    // Only the prefetch not requested is cancelled.
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles 2,"), tc.cancelPrefetches());
+    CPPUNIT_ASSERT(tc.hasTileBeingRendered(prefetched));
+    CPPUNIT_ASSERT(!tc.hasTileBeingRendered(other));
+
+    // It is a requested tile now, not taken over twice.
+    CPPUNIT_ASSERT(!tc.takeOverPrefetch(requested));
+    CPPUNIT_ASSERT_EQUAL(std::string(), tc.cancelPrefetches());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tc.getPrefetchHits());
+
+    // Once rendered, it is cached.
+    const std::vector<char> data = genRandomData(1024);
+    tc.saveTileAndNotify(prefetched, data.data(), data.size());
+    CPPUNIT_ASSERT(!tc.hasTileBeingRendered(prefetched));
+    CPPUNIT_ASSERT(tc.lookupTile(prefetched));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tc.getTilesPrefetched());
+}
+
+void TileCacheTests::testPersistedTiles()
+{
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const std::string dir = Poco::Path(Poco::Path::temp(), FileUtil::createRandomDir(Poco::Path::temp())).toString();
+    TileDiskCache::initialize(dir, 1024 * 1024);
+
+    const std::string docKey = "file:///tmp/doc.ods";
+    const std::chrono::system_clock::time_point modifiedTime(std::chrono::seconds(1000));
+
+    const int size = 1024;
+    const std::vector<char> dataA = genRandomData(size);
+    const std::vector<char> dataB = genRandomData(size);
+    TileDesc tileA(0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    TileDesc tileB(0, 256, 256, 4 * 3840, 0, 3840, 3840, -1, 0, -1, false);
+
+    // Nothing on disk yet.
+    {
+        TileCache tc("doc.ods", modifiedTime);
+        tc.openPersisted(docKey, modifiedTime);
+        TileDiskCache::flush();
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tileA));
+
+        tc.saveTileAndNotify(tileA, dataA.data(), size);
+        tc.saveTileAndNotify(tileB, dataB.data(), size);
+        tc.persist(modifiedTime);
+        TileDiskCache::flush();
+    }
+
+    // Opened again, the tiles are there.
+    {
+        TileCache tc("doc.ods", modifiedTime);
+        tc.openPersisted(docKey, modifiedTime);
+        TileDiskCache::flush();
+        CPPUNIT_ASSERT(tc.hasCachedTile(tileA));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tc.getCacheSize());
+
+        TileCache::Tile tileData = tc.lookupTile(tileA);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tileData);
+        CPPUNIT_ASSERT_MESSAGE("persisted tile corrupted", dataA == *tileData);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(size), tc.getCacheSize());
+
+        // Invalidated, they are gone from the disk too.
+        tc.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tileA));
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.hasCachedTile(tileA));
+
+        tileData = tc.lookupTile(tileB);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tileData);
+        CPPUNIT_ASSERT_MESSAGE("persisted tile corrupted", dataB == *tileData);
+    }
+
+    // Not when the document was modified since.
+    {
+        TileCache tc("doc.ods", modifiedTime + std::chrono::seconds(1));
+        tc.openPersisted(docKey, modifiedTime + std::chrono::seconds(1));
+        TileDiskCache::flush();
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tileB));
+    }
+
+    TileDiskCache::shutdown();
+    FileUtil::removeFile(dir, true);
+}
+
+void TileCacheTests::testInvalidateTilesPerf()
+{
+    const char* testname = "invalidateTilesPerf ";
+
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+
+    // A large spreadsheet scrolled all over.
+    const int columns = 120;
+    const int rows = 100;
+    const int tileSize = 3840;
+    const std::vector<char> data = genRandomData(64);
+    for (int column = 0; column < columns; ++column)
+    {
+        for (int row = 0; row < rows; ++row)
+        {
+            const TileDesc tile(0, 256, 256, column * tileSize, row * tileSize, tileSize, tileSize, -1, 0, -1, false);
+            tc.saveTileAndNotify(tile, data.data(), data.size());
+        }
+    }
+
+    const size_t totalSize = columns * rows * data.size();
+    CPPUNIT_ASSERT_EQUAL(totalSize, tc.getCacheSize());
+
+    // Typing-sized invalidations, each within a single tile.
+    const int invalidations = 1000;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < invalidations; ++i)
+    {
+        const int x = (i % columns) * tileSize + 100;
+        const int y = (i / columns) * tileSize + 100;
+        tc.invalidateTiles("invalidatetiles: part=0 x=" + std::to_string(x) + " y=" + std::to_string(y) +
+                           " width=200 height=200");
+    }
+    const auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - start).count();
+
+    TST_LOG(invalidations << " invalidations of " << columns * rows << " cached tiles took " <<
+            elapsedUs << " us, " << elapsedUs / static_cast<double>(invalidations) << " us each.");
+
+    CPPUNIT_ASSERT_EQUAL(totalSize - invalidations * data.size(), tc.getCacheSize());
+
+    // Tile edges are inclusive: this touches the four tiles around the corner.
+    tc.invalidateTiles("invalidatetiles: part=0 x=" + std::to_string(20 * tileSize) + " y=" +
+                       std::to_string(20 * tileSize) + " width=0 height=0");
+    CPPUNIT_ASSERT_EQUAL(totalSize - (invalidations + 4) * data.size(), tc.getCacheSize());
+
+    // Other parts are not affected.
+    tc.invalidateTiles("invalidatetiles: EMPTY, 1");
+    CPPUNIT_ASSERT_EQUAL(totalSize - (invalidations + 4) * data.size(), tc.getCacheSize());
+
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tc.getCacheSize());
+}
+
 void TileCacheTests::testSimpleCombine()
 {
     const char* testname = "simpleCombine ";
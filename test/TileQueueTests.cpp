@@ -16,6 +16,7 @@
 #include <Message.hpp>
 #include <MessageQueue.hpp>
 #include <SenderQueue.hpp>
+#include <TileWindow.hpp>
 #include <Util.hpp>
 
 namespace CPPUNIT_NS
@@ -46,12 +47,20 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileRecombining);
     CPPUNIT_TEST(testViewOrder);
     CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testCancelTiles);
+    CPPUNIT_TEST(testTileCombinedDeltas);
+    CPPUNIT_TEST(testTileCombinedBinary);
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
+    CPPUNIT_TEST(testSenderQueueDeduplicationOrder);
+    CPPUNIT_TEST(testSenderQueueTileDeltas);
+    CPPUNIT_TEST(testTileWindow);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
     CPPUNIT_TEST(testCallbackInvalidation);
     CPPUNIT_TEST(testCallbackIndicatorValue);
     CPPUNIT_TEST(testCallbackPageSize);
+    CPPUNIT_TEST(testCallbackUnoCommand);
+    CPPUNIT_TEST(testCallbackViewCursor);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -60,12 +69,20 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testTileRecombining();
     void testViewOrder();
     void testPreviewsDeprioritization();
+    void testCancelTiles();
+    void testTileCombinedDeltas();
+    void testTileCombinedBinary();
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
+    void testSenderQueueDeduplicationOrder();
+    void testSenderQueueTileDeltas();
+    void testTileWindow();
     void testInvalidateViewCursorDeduplication();
     void testCallbackInvalidation();
     void testCallbackIndicatorValue();
     void testCallbackPageSize();
+    void testCallbackUnoCommand();
+    void testCallbackViewCursor();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -272,6 +289,72 @@ void TileQueueTests::testPreviewsDeprioritization()
     CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
 }
 
+void TileQueueTests::testCancelTiles()
+{
+    TileQueue queue;
+
+    queue.put("tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840 ver=5,6,7");
+    queue.put("tile part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=6 id=0");
+
+    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+
+    // the tiles of the versions are gone, the thumbnail stays
+    queue.put("canceltiles 6,7");
+
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=5"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("tile part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=6 id=0"), payloadAsString(queue.get()));
+}
+
+void TileQueueTests::testTileCombinedDeltas()
+{
+    TileQueue queue;
+
+    // the tiles get split and recombined, still the request for deltas has to survive
+    queue.put("tilecombine part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=7 deltas=true");
+
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=0 width=256 height=256 tileposx=0 tileposy=0 imgsize=0 tilewidth=3840 tileheight=3840 ver=-1 oldwid=7 wid=0 deltas=true"), payloadAsString(queue.get()));
+
+    queue.put("tilecombine part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=7 deltas=true");
+    queue.put("tile part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840");
+
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 imgsize=0,0 tilewidth=3840 tileheight=3840 ver=-1,-1 oldwid=7,0 wid=0,0 deltas=true"), payloadAsString(queue.get()));
+}
+
+void TileQueueTests::testTileCombinedBinary()
+{
+    const std::string text = "tilecombine part=2 width=256 height=256 tileposx=7680,3840,0,253440 tileposy=0,3840,3840,7680 imgsize=0,1034,0,5 tilewidth=3840 tileheight=3840 ver=-1,12,0,4095 oldwid=0,7,0,4294967295 wid=3,0,9,1";
+    const TileCombined tileCombined = TileCombined::parse(text);
+
+    // The same tiles back, in the text form too; negative steps and versions, the largest wire id.
+    const std::string binary = tileCombined.serializeBinary("tilecombinebin", " deltas=true");
+    CPPUNIT_ASSERT(binary.size() < text.size() / 2);
+    size_t offset = sizeof("tilecombinebin");
+    const TileCombined parsed = TileCombined::parseBinary(binary.data(), binary.size(), offset);
+    CPPUNIT_ASSERT_EQUAL(text, parsed.serialize("tilecombine"));
+    CPPUNIT_ASSERT_EQUAL(std::string(" deltas=true"), binary.substr(offset));
+
+    // Cut anywhere, the descriptor is rejected.
+    const std::string descriptor = tileCombined.serializeBinary("tilecombinebin");
+    for (size_t size = sizeof("tilecombinebin"); size < descriptor.size(); ++size)
+    {
+        offset = sizeof("tilecombinebin");
+        CPPUNIT_ASSERT_THROW(TileCombined::parseBinary(descriptor.data(), size, offset), BadArgumentException);
+    }
+
+    // Requested in the binary form, the queue recombines them so as well.
+    TileQueue queue;
+    queue.put(TileCombined::parse("tilecombine part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=7").serializeBinary("tilecombinebin", " deltas=true"));
+    queue.put("tile part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840");
+
+    const TileQueue::Payload payload = queue.get();
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombinebin"), LOOLProtocol::getFirstToken(payload));
+    offset = sizeof("tilecombinebin");
+    const TileCombined recombined = TileCombined::parseBinary(payload.data(), payload.size(), offset);
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 imgsize=0,0 tilewidth=3840 tileheight=3840 ver=-1,-1 oldwid=7,0 wid=0,0"), recombined.serialize("tilecombine"));
+    CPPUNIT_ASSERT_EQUAL(std::string(" deltas=true"), std::string(payload.data() + offset, payload.size() - offset));
+}
+
 void TileQueueTests::testSenderQueue()
 {
     SenderQueue<std::shared_ptr<Message>> queue;
@@ -361,6 +444,156 @@ void TileQueueTests::testSenderQueueTileDeduplication()
     CPPUNIT_ASSERT_EQUAL(0UL, queue.size());
 }
 
+void TileQueueTests::testSenderQueueDeduplicationOrder()
+{
+    SenderQueue<std::shared_ptr<Message>> queue;
+
+    std::shared_ptr<Message> item;
+
+    const std::vector<std::string> messages =
+    {
+        "tile: part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=1",
+        "setpart: part=1",
+        "tile: part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840 ver=1",
+        "tile: part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=2",
+        "setpart: part=2"
+    };
+
+    for (const auto& msg : messages)
+    {
+        queue.enqueue(std::make_shared<Message>(msg, Message::Dir::Out));
+    }
+
+    // The replaced ones are gone, the others keep their order.
+    CPPUNIT_ASSERT_EQUAL(3UL, queue.size());
+    CPPUNIT_ASSERT_EQUAL(3UL, queue.getMaxSize());
+
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[2], std::string(item->data().data(), item->data().size()));
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[3], std::string(item->data().data(), item->data().size()));
+
+    // Replacing works after dequeueing too.
+    queue.enqueue(std::make_shared<Message>(messages[0], Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(messages[1], Message::Dir::Out));
+    CPPUNIT_ASSERT_EQUAL(2UL, queue.size());
+
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[0], std::string(item->data().data(), item->data().size()));
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[1], std::string(item->data().data(), item->data().size()));
+
+    CPPUNIT_ASSERT_EQUAL(false, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(0UL, queue.size());
+}
+
+void TileQueueTests::testSenderQueueTileDeltas()
+{
+    SenderQueue<std::shared_ptr<Message>> queue;
+
+    std::shared_ptr<Message> item;
+
+    const std::string tile = "tile: part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840";
+    const std::vector<std::string> messages =
+    {
+        tile + " oldwid=0 wid=5\n\x89PNG",
+        tile + " oldwid=5 wid=6\nD56",
+        tile + " oldwid=6 wid=7\nD67",
+        tile + " oldwid=0 wid=8\n\x89PNG"
+    };
+
+    for (const auto& msg : messages)
+    {
+        queue.enqueue(std::make_shared<Message>(msg, Message::Dir::Out));
+    }
+
+    // Each delta needs the tile queued before it: none is replaced.
+    CPPUNIT_ASSERT_EQUAL(4UL, queue.size());
+    for (const auto& msg : messages)
+    {
+        CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+        CPPUNIT_ASSERT_EQUAL(msg, std::string(item->data().data(), item->data().size()));
+    }
+
+    // A full tile replaces a full tile no delta is based on yet, and the same delta replaces itself.
+    queue.enqueue(std::make_shared<Message>(messages[0], Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(messages[3], Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(messages[1], Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(messages[1], Message::Dir::Out));
+    CPPUNIT_ASSERT_EQUAL(2UL, queue.size());
+
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[3], std::string(item->data().data(), item->data().size()));
+    CPPUNIT_ASSERT_EQUAL(true, queue.dequeue(item));
+    CPPUNIT_ASSERT_EQUAL(messages[1], std::string(item->data().data(), item->data().size()));
+    CPPUNIT_ASSERT_EQUAL(false, queue.dequeue(item));
+}
+
+void TileQueueTests::testTileWindow()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::chrono::milliseconds fastRtt(5);
+
+    // All that is visible at first, or the largest before the visible area is known.
+    TileWindow window;
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT, window.getWindow());
+    CPPUNIT_ASSERT_EQUAL(TILE_ROUNDTRIP_TIMEOUT_MS, window.getTimeoutMs());
+    window.setVisibleTiles(40);
+    CPPUNIT_ASSERT_EQUAL(size_t(44), window.getWindow());
+    window.setVisibleTiles(1000);
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT, window.getWindow());
+    window.setVisibleTiles(1);
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MIN_UPPER_LIMIT, window.getWindow());
+
+    // A fast client, the roundtrip stays flat: the window opens fully.
+    for (int i = 0; i < 1000; ++i)
+    {
+        now += fastRtt;
+        window.onAcknowledged(now - fastRtt, now, 1000);
+    }
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT, window.getWindow());
+    CPPUNIT_ASSERT_EQUAL(5.0, window.getMinRttMs());
+    CPPUNIT_ASSERT_EQUAL(TILE_ROUNDTRIP_MIN_TIMEOUT_MS, window.getTimeoutMs());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1000 * 1000), window.getBytesDelivered());
+
+    // Measured, the visible area no longer matters.
+    window.setVisibleTiles(40);
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT, window.getWindow());
+
+    // A lost tile halves it, once per roundtrip.
+    window.onTimeout(now);
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT / 2, window.getWindow());
+    window.onTimeout(now);
+    CPPUNIT_ASSERT_EQUAL(TILES_ON_FLY_MAX_UPPER_LIMIT / 2, window.getWindow());
+
+    // A slow link, 20ms per tile, where the tiles on fly queue up: the roundtrip
+    // grows with the window, which stays small, yet the link is kept busy.
+    TileWindow slow;
+    slow.setVisibleTiles(TILES_ON_FLY_MIN_UPPER_LIMIT);
+    size_t maxWindow = 0;
+    for (int i = 0; i < 3000; ++i)
+    {
+        const std::chrono::milliseconds rtt(50 + 20 * slow.getWindow());
+        now += std::chrono::milliseconds(20);
+        slow.onAcknowledged(now - rtt, now, 20000);
+        if (i > 1000)
+            maxWindow = std::max(maxWindow, slow.getWindow());
+    }
+    CPPUNIT_ASSERT(maxWindow < TILES_ON_FLY_MAX_UPPER_LIMIT / 4);
+    CPPUNIT_ASSERT(slow.getWindow() >= TILES_ON_FLY_MIN_UPPER_LIMIT);
+    CPPUNIT_ASSERT_EQUAL(1000000.0, slow.getDeliveryRate());
+
+    // The path got slower for good: the lowest roundtrip follows, and the window grows again.
+    const std::chrono::milliseconds slowRtt(300);
+    for (int i = 0; i < 8000; ++i)
+    {
+        now += std::chrono::milliseconds(2);
+        window.onAcknowledged(now - slowRtt, now, 1000);
+    }
+    CPPUNIT_ASSERT_EQUAL(300.0, window.getMinRttMs());
+    CPPUNIT_ASSERT(window.getWindow() > TILES_ON_FLY_MIN_UPPER_LIMIT);
+}
+
 void TileQueueTests::testInvalidateViewCursorDeduplication()
 {
     SenderQueue<std::shared_ptr<Message>> queue;
@@ -471,6 +704,36 @@ void TileQueueTests::testCallbackPageSize()
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 13 12474, 205748"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testCallbackUnoCommand()
+{
+    TileQueue queue;
+
+    // only the last state of the same command for the same view persists
+    queue.put("callback all 8 .uno:Bold=true");
+    queue.put("callback all 8 .uno:Italic=true");
+    queue.put("callback 1 8 .uno:Bold=true");
+    queue.put("callback all 8 .uno:Bold=false");
+
+    CPPUNIT_ASSERT_EQUAL(3, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback all 8 .uno:Italic=true"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback 1 8 .uno:Bold=true"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback all 8 .uno:Bold=false"), payloadAsString(queue.get()));
+}
+
+void TileQueueTests::testCallbackViewCursor()
+{
+    TileQueue queue;
+
+    // the view cursors are superseded per view
+    queue.put("callback all 24 { \"viewId\": \"1\", \"rectangle\": \"3999, 1418, 0, 298\" }");
+    queue.put("callback all 24 { \"viewId\": \"2\", \"rectangle\": \"3999, 1418, 0, 298\" }");
+    queue.put("callback all 24 { \"viewId\": \"1\", \"rectangle\": \"1000, 1418, 0, 298\" }");
+
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback all 24 { \"viewId\": \"2\", \"rectangle\": \"3999, 1418, 0, 298\" }"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback all 24 { \"viewId\": \"1\", \"rectangle\": \"1000, 1418, 0, 298\" }"), payloadAsString(queue.get()));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileQueueTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,6 +10,7 @@
 #include <config.h>
 
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <random>
 
@@ -21,7 +22,9 @@
 #include <Util.hpp>
 #include <FileUtil.hpp>
 #include <helpers.hpp>
+#include <wsd/DocumentBroker.hpp>
 
+#include <Poco/StreamCopier.h>
 #include <Poco/Timestamp.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/Net/HTTPServerRequest.h>
@@ -54,6 +57,127 @@ public:
 
         config.setBool("ssl.enable", true);
         config.setInt("per_document.limit_load_secs", 1);
+
+        // One conversion at a time and one waiting, so that the third is refused.
+        config.setInt("convert_to.max_concurrent", 1);
+        config.setInt("convert_to.max_queued", 1);
+        config.setInt("convert_to.limit_convert_secs", 10);
+    }
+
+    bool filterChildMessage(const std::vector<char>& payload) override
+    {
+        // Lose the result of the save, as if the kit was still at it.
+        const std::string message(payload.data(), payload.size());
+        if (message.find("saveas: url=") != std::string::npos
+            && message.find("sleep-on-save") != std::string::npos)
+        {
+            std::cerr << "Saveas result dropped\n";
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Posts a conversion of a text file, without waiting for the response.
+    std::unique_ptr<Poco::Net::HTTPClientSession> sendConvert(const std::string& fileName)
+    {
+        std::unique_ptr<Poco::Net::HTTPClientSession> session(helpers::createSession(Poco::URI(helpers::getTestServerURI())));
+        session->setTimeout(Poco::Timespan(30, 0)); // 30 seconds.
+
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/lool/convert-to/pdf");
+        Poco::Net::HTMLForm form;
+        form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+        form.set("format", "txt");
+        form.addPart("data", new Poco::Net::StringPartSource("Hello World Content", "text/plain", fileName));
+        form.prepareSubmit(request);
+        form.write(session->sendRequest(request));
+
+        return session;
+    }
+
+    /// Whether the conversion was dropped without a response, as when its kit is killed.
+    bool isDropped(Poco::Net::HTTPClientSession& session)
+    {
+        Poco::Net::HTTPResponse response;
+        try {
+            session.receiveResponse(response);
+        } catch (Poco::Net::NoMessageException &) {
+            return true;
+        }
+
+        std::cerr << "Unexpected response " << response.getStatus() << "\n";
+        return false;
+    }
+
+    /// Waits until the conversion stats contain the expected fragment.
+    bool waitForStats(const std::string& expected)
+    {
+        for (int i = 0; i < 300; ++i)
+        {
+            if (ConvertToBroker::getStatsJSON().find(expected) != std::string::npos)
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        std::cerr << "Stats " << ConvertToBroker::getStatsJSON() << " lack " << expected << "\n";
+        return false;
+    }
+
+    /// The kit sleeping on load is killed by limit_load_secs.
+    bool testLoadTimeout()
+    {
+        std::unique_ptr<Poco::Net::HTTPClientSession> session = sendConvert("sleep-on-load.txt");
+        if (!isDropped(*session))
+        {
+            std::cerr << "Failed to terminate the sleeping kit\n";
+            return false;
+        }
+
+        std::cerr << "No response as expected.\n";
+        return waitForStats("\"running\": 0");
+    }
+
+    /// A conversion never done saving is killed by limit_convert_secs,
+    /// meanwhile another waits its turn, and the one after that is refused.
+    bool testQueue()
+    {
+        std::unique_ptr<Poco::Net::HTTPClientSession> slow = sendConvert("sleep-on-save.txt");
+        if (!waitForStats("\"running\": 1"))
+            return false;
+
+        std::unique_ptr<Poco::Net::HTTPClientSession> queued = sendConvert("queued.txt");
+        if (!waitForStats("\"queued\": 1"))
+            return false;
+
+        std::unique_ptr<Poco::Net::HTTPClientSession> refused = sendConvert("refused.txt");
+        Poco::Net::HTTPResponse response;
+        refused->receiveResponse(response);
+        if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE
+            || !response.has("Retry-After"))
+        {
+            std::cerr << "Expected 503 with Retry-After for a full queue, got " << response.getStatus() << "\n";
+            return false;
+        }
+
+        if (!isDropped(*slow))
+        {
+            std::cerr << "Failed to terminate the kit over its conversion time\n";
+            return false;
+        }
+
+        // Its slot frees and the one waiting converts.
+        Poco::Net::HTTPResponse converted;
+        std::istream& rs = queued->receiveResponse(converted);
+        std::string body;
+        Poco::StreamCopier::copyToString(rs, body);
+        if (converted.getStatus() != Poco::Net::HTTPResponse::HTTP_OK || body.compare(0, 4, "%PDF") != 0)
+        {
+            std::cerr << "Queued conversion failed with " << converted.getStatus() << "\n";
+            return false;
+        }
+
+        return waitForStats("\"running\": 0, \"queued\": 0");
     }
 
     void invokeTest() override
@@ -64,27 +188,13 @@ public:
         std::cerr << "Starting thread ...\n";
         _worker = std::thread([this]{
                 std::cerr << "Now started thread ...\n";
-                std::unique_ptr<Poco::Net::HTTPClientSession> session(helpers::createSession(Poco::URI(helpers::getTestServerURI())));
-                session->setTimeout(Poco::Timespan(10, 0)); // 10 seconds.
-
-                Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/lool/convert-to/pdf");
-                Poco::Net::HTMLForm form;
-                form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
-                form.set("format", "txt");
-                form.addPart("data", new Poco::Net::StringPartSource("Hello World Content", "text/plain", "foo.txt"));
-                form.prepareSubmit(request);
-                form.write(session->sendRequest(request));
-
-                Poco::Net::HTTPResponse response;
-                try {
-                    session->receiveResponse(response);
-                } catch (Poco::Net::NoMessageException &) {
-                    std::cerr << "No response as expected.\n";
-                    exitTest(TestResult::Ok); // child should have timed out and been killed.
+                if (!testLoadTimeout() || !testQueue())
+                {
+                    exitTest(TestResult::Failed);
                     return;
-                } // else
-                std::cerr << "Failed to terminate the sleeping kit\n";
-                exitTest(TestResult::Failed);
+                }
+
+                exitTest(TestResult::Ok);
             });
     }
 };
@@ -100,7 +210,8 @@ public:
     bool filterKitMessage(WebSocketHandler *, std::string &message) override
     {
         std::cerr << "kit message " << message << "\n";
-        if (message.find("load") != std::string::npos)
+        if (message.find("load url=") != std::string::npos
+            && message.find("sleep-on-load") != std::string::npos)
         {
             std::cerr << "Load message received - starting to sleep\n";
             sleep(60);
@@ -37,9 +37,11 @@ public:
         UnitWSD::configure(config);
         // force HTTPS - to test harder
         config.setBool("ssl.enable", true);
+        // small enough to exceed without slowing the tests.
+        config.setInt("net.max_message_size_kb", 64);
     }
 
-    void testContinue()
+    bool testContinue()
     {
         std::cerr << "testContinue\n";
         for (int i = 0; i < 3; ++i)
@@ -80,9 +82,11 @@ public:
             {
                 std::cerr << "Test " << i << " failed - mismatching string '" << responseStr << " vs. '" << sent << "'\n";
                 exitTest(TestResult::Failed);
-                return;
+                return false;
             }
         }
+
+        return true;
     }
 
     void writeString(const std::shared_ptr<Poco::Net::StreamSocket> &socket, const std::string& str)
@@ -106,7 +110,7 @@ public:
             return true;
     }
 
-    void testChunks()
+    bool testChunks()
     {
         std::cerr << "testChunks\n";
 
@@ -125,7 +129,7 @@ public:
         if (!expectString(
                 socket,
                 "HTTP/1.1 100 Continue\r\n\r\n"))
-            return;
+            return false;
 
 #define START_CHUNK_HEX(len) len "\r\n"
 #define END_CHUNK "\r\n"
@@ -177,7 +181,7 @@ public:
         {
             std::cerr << "missing pre-amble " << got << " '" << buffer << " vs. expected '" << start << "'\n";
             exitTest(TestResult::Failed);
-            return;
+            return false;
         }
 
         // TODO: check content-length etc.
@@ -187,7 +191,7 @@ public:
         {
             std::cerr << "missing separator " << got << " '" << buffer << "\n";
             exitTest(TestResult::Failed);
-            return;
+            return false;
         }
 
         // Oddly we need another read to get the content.
@@ -198,21 +202,90 @@ public:
         {
             std::cerr << "No content returned " << got << "\n";
             exitTest(TestResult::Failed);
-            return;
+            return false;
         }
 
         if (strcmp(buffer, "\357\273\277This is some text.\nAnd some more.\n"))
         {
             std::cerr << "unexpected file content " << got << " '" << buffer << "\n";
             exitTest(TestResult::Failed);
-            return;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool testTooBigRequest()
+    {
+        std::cerr << "testTooBigRequest\n";
+
+        std::shared_ptr<Poco::Net::StreamSocket> socket = helpers::createRawSocket();
+
+        // Refused on the header, before any of the content.
+        writeString(
+            socket,
+            "POST /lool/convert-to/txt HTTP/1.1\r\n"
+            "Host: localhost:9980\r\n"
+            "User-Agent: looltests/1.2.3\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 1048576\r\n\r\n");
+        if (!expectString(socket, "HTTP/1.0 413"))
+            return false;
+
+        // And the connection closed.
+        try
+        {
+            char buffer[4096];
+            socket->setReceiveTimeout(Poco::Timespan(5, 0));
+            while (socket->receiveBytes(buffer, sizeof(buffer)) > 0)
+                ; // the rest of the response.
+        }
+        catch (const Poco::TimeoutException&)
+        {
+            std::cerr << "connection not closed after a 413\n";
+            exitTest(TestResult::Failed);
+            return false;
+        }
+        catch (const std::exception&)
+        {
+            // Closed too.
+        }
+
+        return true;
+    }
+
+    bool testTooBigFrame()
+    {
+        const char testname[] = "testTooBigFrame ";
+        std::cerr << "testTooBigFrame\n";
+
+        std::string documentPath;
+        std::string documentURL;
+        helpers::getDocumentPathAndURL("hello.odt", documentPath, documentURL, testname);
+        std::shared_ptr<LOOLWebSocket> socket = helpers::loadDocAndGetSocket(
+            Poco::URI(helpers::getTestServerURI()), documentURL, testname);
+
+        // A single frame over the limit closes the socket.
+        helpers::sendTextFrame(socket, "paste mimetype=text/plain;charset=utf-8\n" + std::string(80 * 1024, 'x'), testname);
+
+        std::string message;
+        const int statusCode = helpers::getErrorCode(socket, message, testname);
+        if (statusCode != static_cast<int>(Poco::Net::WebSocket::WS_PAYLOAD_TOO_BIG))
+        {
+            std::cerr << "expected a 1009 close for a too big frame, got " << statusCode << "\n";
+            exitTest(TestResult::Failed);
+            return false;
         }
+
+        return true;
     }
 
     void invokeTest() override
     {
-        testChunks();
-        testContinue();
+        // Stop at the first failure, lest it be reported as a success.
+        if (!testChunks() || !testContinue() || !testTooBigRequest() || !testTooBigFrame())
+            return;
+
         std::cerr << "All tests passed.\n";
         exitTest(TestResult::Ok);
     }
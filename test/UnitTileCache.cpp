@@ -35,7 +35,7 @@ public:
 
     virtual void lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
                             int tileWidth, int tileHeight,
-                            std::shared_ptr<std::vector<char>> &tile)
+                            std::shared_ptr<const std::vector<char>> &tile)
     {
         // Call base to fire events.
         UnitWSD::lookupTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, tile);
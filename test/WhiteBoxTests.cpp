@@ -9,14 +9,23 @@
 
 #include <config.h>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+
 #include <cppunit/extensions/HelperMacros.h>
 
 #include <Auth.hpp>
 #include <ChildSession.hpp>
 #include <Common.hpp>
+#include <FileUtil.hpp>
 #include <Kit.hpp>
 #include <MessageQueue.hpp>
+#include <PngCache.hpp>
 #include <Protocol.hpp>
+#include <ThreadPool.hpp>
 #include <TileDesc.hpp>
 #include <Util.hpp>
 #include <JsonUtil.hpp>
@@ -37,6 +46,10 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testRegexListMatcher_Init);
     CPPUNIT_TEST(testEmptyCellCursor);
     CPPUNIT_TEST(testRectanglesIntersect);
+    CPPUNIT_TEST(testTileKey);
+    CPPUNIT_TEST(testPngCache);
+    CPPUNIT_TEST(testThreadPool);
+    CPPUNIT_TEST(testJailTemplate);
     CPPUNIT_TEST(testAuthorization);
     CPPUNIT_TEST(testJson);
     CPPUNIT_TEST(testAnonymization);
@@ -53,6 +66,10 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testRegexListMatcher_Init();
     void testEmptyCellCursor();
     void testRectanglesIntersect();
+    void testTileKey();
+    void testPngCache();
+    void testThreadPool();
+    void testJailTemplate();
     void testAuthorization();
     void testJson();
     void testAnonymization();
@@ -593,6 +610,179 @@ void WhiteBoxTests::testRectanglesIntersect()
                                                   1000, 1000, 2000, 1000));
 }
 
+void WhiteBoxTests::testTileKey()
+{
+    const TileDesc tile(3, 256, 256, 7680, 38400, 3840, 3840, -1, 0, -1, false);
+
+    // The pixel size and the version don't matter, as for generateID().
+    CPPUNIT_ASSERT_EQUAL(tile.getKey(),
+                         TileDesc(3, 512, 512, 7680, 38400, 3840, 3840, 12, 0, -1, false).getKey());
+
+    // Packed on the grid.
+    CPPUNIT_ASSERT_EQUAL(TileKey(0), tile.getKey() >> 63);
+    CPPUNIT_ASSERT_EQUAL(TileKey(3), tile.getKey() >> 52);
+    CPPUNIT_ASSERT_EQUAL(TileKey(10), tile.getKey() & ((1 << 22) - 1));
+
+    // Any other field does.
+    CPPUNIT_ASSERT(tile.getKey() != TileDesc(4, 256, 256, 7680, 38400, 3840, 3840, -1, 0, -1, false).getKey());
+    CPPUNIT_ASSERT(tile.getKey() != TileDesc(3, 256, 256, 3840, 38400, 3840, 3840, -1, 0, -1, false).getKey());
+    CPPUNIT_ASSERT(tile.getKey() != TileDesc(3, 256, 256, 7680, 34560, 3840, 3840, -1, 0, -1, false).getKey());
+    CPPUNIT_ASSERT(tile.getKey() != TileDesc(3, 256, 256, 7680, 38400, 1920, 1920, -1, 0, -1, false).getKey());
+
+    // Off the grid, hashed.
+    const TileDesc offGrid(3, 256, 256, 7681, 38400, 3840, 3840, -1, 0, -1, false);
+    CPPUNIT_ASSERT_EQUAL(TileKey(1), offGrid.getKey() >> 63);
+    CPPUNIT_ASSERT(offGrid.getKey() != tile.getKey());
+
+    // Back from the ID of tileprocessed.
+    TileKey key = 0;
+    CPPUNIT_ASSERT(TileDesc::parseKey(tile.generateID(), key));
+    CPPUNIT_ASSERT_EQUAL(tile.getKey(), key);
+    CPPUNIT_ASSERT(TileDesc::parseKey(offGrid.generateID(), key));
+    CPPUNIT_ASSERT_EQUAL(offGrid.getKey(), key);
+    CPPUNIT_ASSERT(!TileDesc::parseKey("3:7680:38400:3840", key));
+    CPPUNIT_ASSERT(!TileDesc::parseKey("3:7680:38400:3840:3840:1", key));
+    CPPUNIT_ASSERT(!TileDesc::parseKey("", key));
+}
+
+void WhiteBoxTests::testPngCache()
+{
+    PngCache cache(1000);
+
+    // The same content gets the same wire id, other content another.
+    const TileWireId wid1 = cache.hashToWireId(1);
+    CPPUNIT_ASSERT_EQUAL(wid1, cache.hashToWireId(1));
+    CPPUNIT_ASSERT(wid1 != cache.hashToWireId(2));
+    CPPUNIT_ASSERT_EQUAL(TileWireId(0), cache.hashToWireId(0));
+
+    for (TileBinaryHash hash = 1; hash <= 3; ++hash)
+    {
+        cache.addToCache(std::make_shared<std::vector<char>>(400, 'x'), cache.hashToWireId(hash), hash);
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(1200), cache.getCacheSize());
+
+    // Over budget only until balanced, the least recently used goes.
+    CPPUNIT_ASSERT(cache.getFromCache(1));
+    CPPUNIT_ASSERT(!cache.getFromCache(4));
+    cache.balanceCache();
+    CPPUNIT_ASSERT_EQUAL(size_t(800), cache.getCacheSize());
+    CPPUNIT_ASSERT_EQUAL(size_t(2), cache.getCount());
+    CPPUNIT_ASSERT(cache.isCached(1));
+    CPPUNIT_ASSERT(!cache.isCached(2));
+    CPPUNIT_ASSERT(cache.isCached(3));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), cache.getHits());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), cache.getMisses());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), cache.getEvictions());
+
+    // The wire ids of many hashes are trimmed to the recent ones.
+    for (TileBinaryHash hash = 10; hash < 5010; ++hash)
+        cache.hashToWireId(hash);
+    const TileWireId recent = cache.hashToWireId(5009);
+    cache.balanceCache();
+    CPPUNIT_ASSERT_EQUAL(recent, cache.hashToWireId(5009));
+    CPPUNIT_ASSERT(cache.hashToWireId(10) > recent);
+    CPPUNIT_ASSERT(cache.isCached(1));
+}
+
+void WhiteBoxTests::testThreadPool()
+{
+    ThreadPool pool(4);
+
+    // Each generation writes its own slots, so however the work is
+    // stolen, the output comes out in the order it was pushed.
+    const size_t jobs[] = { 0, 1, 3, 100, 1000, 7 };
+    for (const size_t count : jobs)
+    {
+        std::vector<size_t> output(count, 0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t* slot = &output[i];
+            pool.pushWork([slot, i]() { *slot = i * i + 1; });
+        }
+
+        pool.run();
+        CPPUNIT_ASSERT_EQUAL(size_t(0), pool.count());
+        for (size_t i = 0; i < count; ++i)
+            CPPUNIT_ASSERT_EQUAL(i * i + 1, output[i]);
+    }
+
+    // A throwing job neither loses the others nor hangs run().
+    std::atomic<size_t> done(0);
+    for (size_t i = 0; i < 50; ++i)
+    {
+        pool.pushWork([&done, i]() {
+                if (i % 10 == 0)
+                    throw std::runtime_error("failed");
+                ++done;
+            });
+    }
+    pool.run();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), pool.count());
+    CPPUNIT_ASSERT_EQUAL(size_t(45), done.load());
+}
+
+void WhiteBoxTests::testJailTemplate()
+{
+    const auto writeFile = [](const std::string& path, const std::string& content)
+    {
+        Poco::File(Poco::Path(path).parent()).createDirectories();
+        std::ofstream(path, std::ios::trunc) << content;
+    };
+    const auto readFile = [](const std::string& path)
+    {
+        std::ifstream file(path);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    const auto inode = [](const std::string& path)
+    {
+        struct stat st;
+        CPPUNIT_ASSERT_EQUAL(0, lstat(path.c_str(), &st));
+        return st.st_ino;
+    };
+
+    const std::string root = Poco::Path(Poco::Path::temp(), FileUtil::createRandomDir(Poco::Path::temp())).toString();
+    const std::string sysTemplate = root + "/systemplate";
+    const std::string loTemplate = root + "/instdir";
+    const std::string childRoot = root + "/child-roots";
+    writeFile(sysTemplate + "/etc/fonts/fonts.conf", "fonts");
+    writeFile(loTemplate + "/program/soffice.bin", "soffice");
+    writeFile(loTemplate + "/program/sofficerc", "sofficerc");
+
+    CPPUNIT_ASSERT(createJailTemplate(childRoot, sysTemplate, loTemplate, "lo"));
+    const std::string templatePath = childRoot + '/' + JAIL_TEMPLATE_NAME;
+    CPPUNIT_ASSERT_EQUAL(inode(loTemplate + "/program/soffice.bin"), inode(templatePath + "/lo/program/soffice.bin"));
+
+    // A file the template had to copy, as from an installation on another filesystem,
+    // owned by the kit user.
+    const std::string copied = templatePath + "/lo/program/sofficerc";
+    CPPUNIT_ASSERT_EQUAL(0, unlink(copied.c_str()));
+    writeFile(copied, "sofficerc");
+
+    const std::string jail1 = childRoot + "/jail1";
+    const std::string jail2 = childRoot + "/jail2";
+    linkJailFromTemplate(templatePath, sysTemplate, loTemplate, "lo", jail1, false);
+    linkJailFromTemplate(templatePath, sysTemplate, loTemplate, "lo", jail2, false);
+
+    // The links to the installation are shared, the copy is not.
+    CPPUNIT_ASSERT_EQUAL(inode(sysTemplate + "/etc/fonts/fonts.conf"), inode(jail1 + "/etc/fonts/fonts.conf"));
+    CPPUNIT_ASSERT_EQUAL(inode(loTemplate + "/program/soffice.bin"), inode(jail2 + "/lo/program/soffice.bin"));
+    CPPUNIT_ASSERT(inode(copied) != inode(jail1 + "/lo/program/sofficerc"));
+    CPPUNIT_ASSERT(inode(copied) != inode(jail2 + "/lo/program/sofficerc"));
+    CPPUNIT_ASSERT(inode(jail1 + "/lo/program/sofficerc") != inode(jail2 + "/lo/program/sofficerc"));
+    CPPUNIT_ASSERT_EQUAL(std::string("sofficerc"), readFile(jail1 + "/lo/program/sofficerc"));
+
+    // Writing through one jail reaches neither the template nor the other jails.
+    writeFile(jail1 + "/lo/program/sofficerc", "poisoned");
+    CPPUNIT_ASSERT_EQUAL(std::string("sofficerc"), readFile(copied));
+    CPPUNIT_ASSERT_EQUAL(std::string("sofficerc"), readFile(jail2 + "/lo/program/sofficerc"));
+
+    const std::string jail3 = childRoot + "/jail3";
+    linkJailFromTemplate(templatePath, sysTemplate, loTemplate, "lo", jail3, false);
+    CPPUNIT_ASSERT_EQUAL(std::string("sofficerc"), readFile(jail3 + "/lo/program/sofficerc"));
+
+    FileUtil::removeFile(root, true);
+}
+
 void WhiteBoxTests::testAuthorization()
 {
     Authorization auth1(Authorization::Type::Token, "abc");
@@ -0,0 +1,230 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Measures the wakeup latency and CPU cost of a SocketPoll holding many
+ * idle sockets, one of which at a time gets a byte, with poll and epoll.
+ *
+ * Usage: loolpollbench [wakeups [sockets...]]
+ */
+
+#include <config.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Log.hpp>
+#include <Socket.hpp>
+#include <Unit.hpp>
+#include <Util.hpp>
+
+namespace
+{
+    std::mutex Mutex;
+    std::condition_variable Cond;
+    unsigned Received = 0;
+
+    /// Swallows whatever arrives and tells the benchmark.
+    class SinkHandler : public SocketHandlerInterface
+    {
+    public:
+        void onConnect(const std::shared_ptr<StreamSocket>& socket) override
+        {
+            _socket = socket;
+        }
+
+        void handleIncomingMessage(SocketDisposition& /* disposition */) override
+        {
+            std::shared_ptr<StreamSocket> socket = _socket.lock();
+            if (socket)
+                socket->getInBuffer().clear();
+
+            std::lock_guard<std::mutex> lock(Mutex);
+            ++Received;
+            Cond.notify_one();
+        }
+
+        int getPollEvents(std::chrono::steady_clock::time_point /* now */,
+                          int & /* timeoutMaxMs */) override
+        {
+            return POLLIN;
+        }
+
+        void performWrites() override
+        {
+        }
+
+    private:
+        std::weak_ptr<StreamSocket> _socket;
+    };
+
+    /// User and system CPU time of the process so far.
+    double getCpuSeconds()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    /// Blocks until the poll thread has run everything queued so far.
+    void waitForPoll(SocketPoll& poll)
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        bool done = false;
+        poll.addCallback([&done]()
+                         {
+                             std::lock_guard<std::mutex> callbackLock(Mutex);
+                             done = true;
+                             Cond.notify_one();
+                         });
+        Cond.wait(lock, [&done]() { return done; });
+    }
+
+    void run(size_t count, bool useEpoll, unsigned wakeups)
+    {
+        SocketPoll poll(useEpoll ? "bench_epoll" : "bench_poll");
+        if (poll.setUseEpoll(useEpoll) != useEpoll)
+        {
+            std::fprintf(stderr, "epoll is not available.\n");
+            return;
+        }
+
+        poll.startThread();
+
+        std::vector<int> peers;
+        for (size_t i = 0; i < count; ++i)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+            {
+                std::perror("socketpair");
+                break;
+            }
+
+            poll.insertNewSocket(StreamSocket::create<StreamSocket>(
+                                     fds[0], false, std::make_shared<SinkHandler>()));
+            peers.push_back(fds[1]);
+        }
+
+        waitForPoll(poll);
+
+        std::mt19937 rng(42);
+        std::vector<double> latencies;
+        latencies.reserve(wakeups);
+
+        const double cpuStart = getCpuSeconds();
+        for (unsigned i = 0; i < wakeups && !peers.empty(); ++i)
+        {
+            const int fd = peers[rng() % peers.size()];
+
+            std::unique_lock<std::mutex> lock(Mutex);
+            const unsigned expected = Received + 1;
+            const auto sent = std::chrono::steady_clock::now();
+            if (write(fd, "x", 1) != 1)
+            {
+                std::perror("write");
+                break;
+            }
+
+            Cond.wait(lock, [expected]() { return Received >= expected; });
+            latencies.push_back(std::chrono::duration<double, std::micro>(
+                                    std::chrono::steady_clock::now() - sent).count());
+        }
+        const double cpu = getCpuSeconds() - cpuStart;
+
+        poll.joinThread();
+        for (const int fd : peers)
+            close(fd);
+
+        if (latencies.empty())
+            return;
+
+        double total = 0;
+        for (const double latency : latencies)
+            total += latency;
+        std::sort(latencies.begin(), latencies.end());
+
+        std::printf("%8zu  %-6s  %10.1f  %10.1f  %10.1f  %12.1f\n",
+                    peers.size(), useEpoll ? "epoll" : "poll",
+                    total / latencies.size(),
+                    latencies[latencies.size() / 2],
+                    latencies[latencies.size() * 99 / 100],
+                    cpu * 1e6 / latencies.size());
+    }
+}
+
+namespace Util
+{
+    void alertAllUsers(const std::string& cmd, const std::string& kind)
+    {
+        std::cout << "error: cmd=" << cmd << " kind=" << kind << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    Log::initialize("PollBench", "error", false, false,
+                    std::map<std::string, std::string>());
+
+    const unsigned wakeups = (argc > 1 ? std::atoi(argv[1]) : 2000);
+
+    std::vector<size_t> counts;
+    for (int i = 2; i < argc; ++i)
+        counts.push_back(std::atoi(argv[i]));
+    if (counts.empty())
+        counts = { 1000, 5000, 10000 };
+
+    // Each socket takes two fds, both ends of its pair.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        const size_t maxCount = (limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0);
+        for (size_t& count : counts)
+        {
+            if (count > maxCount)
+            {
+                std::fprintf(stderr, "Only %zu sockets fit the fd limit.\n", maxCount);
+                count = maxCount;
+            }
+        }
+    }
+
+    std::printf("%8s  %-6s  %10s  %10s  %10s  %12s\n",
+                "sockets", "wait", "avg us", "p50 us", "p99 us", "cpu us/wake");
+    for (const size_t count : counts)
+    {
+        run(count, false, wakeups);
+        run(count, true, wakeups);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
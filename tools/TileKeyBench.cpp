@@ -0,0 +1,182 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Measures the bookkeeping ClientSession does for each tile it sends and
+ * gets acknowledged: the wire id lookup, the tiles on fly and their count,
+ * with string tile IDs as before and with packed TileKeys.
+ *
+ * Usage: loolkeybench [rounds [tiles on fly...]]
+ */
+
+#include <config.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <TileDesc.hpp>
+
+namespace
+{
+    /// The bookkeeping with string IDs, lists and ordered maps.
+    class StringIds
+    {
+    public:
+        size_t send(const TileDesc& tile)
+        {
+            const std::string tileID = tile.generateID();
+            auto iter = _oldWireIds.find(tileID);
+            if (iter != _oldWireIds.end())
+                iter->second = tile.getWireId();
+            else
+                _oldWireIds.insert(std::pair<std::string, TileWireId>(tileID, tile.getWireId()));
+
+            size_t count = 0;
+            for (const auto& tileItem : _tilesOnFly)
+            {
+                if (tileItem.first == tileID)
+                    ++count;
+            }
+
+            _tilesOnFly.push_back({ tileID, std::chrono::steady_clock::now() });
+            return count;
+        }
+
+        void acknowledge(const std::string& tileID)
+        {
+            auto iter = std::find_if(_tilesOnFly.begin(), _tilesOnFly.end(),
+                                     [&tileID](const std::pair<std::string, std::chrono::steady_clock::time_point>& curTile)
+                                     {
+                                         return curTile.first == tileID;
+                                     });
+            if (iter != _tilesOnFly.end())
+                _tilesOnFly.erase(iter);
+        }
+
+    private:
+        std::list<std::pair<std::string, std::chrono::steady_clock::time_point>> _tilesOnFly;
+        std::map<std::string, TileWireId> _oldWireIds;
+    };
+
+    /// The same with TileKeys and hash maps.
+    class PackedKeys
+    {
+    public:
+        size_t send(const TileDesc& tile)
+        {
+            const TileKey key = tile.getKey();
+            auto iter = _oldWireIds.find(key);
+            if (iter != _oldWireIds.end())
+                iter->second = tile.getWireId();
+            else
+                _oldWireIds.insert(std::make_pair(key, tile.getWireId()));
+
+            const auto sent = _tilesOnFlyByKey.find(key);
+            const size_t count = (sent != _tilesOnFlyByKey.end() ? sent->second.size() : 0);
+
+            _tilesOnFly.push_back({ key, std::chrono::steady_clock::now() });
+            _tilesOnFlyByKey[key].push_back(std::prev(_tilesOnFly.end()));
+            return count;
+        }
+
+        void acknowledge(const std::string& tileID)
+        {
+            TileKey key;
+            if (!TileDesc::parseKey(tileID, key))
+                return;
+
+            const auto iter = _tilesOnFlyByKey.find(key);
+            if (iter == _tilesOnFlyByKey.end())
+                return;
+
+            _tilesOnFly.erase(iter->second.front());
+            iter->second.pop_front();
+            if (iter->second.empty())
+                _tilesOnFlyByKey.erase(iter);
+        }
+
+    private:
+        typedef std::list<std::pair<TileKey, std::chrono::steady_clock::time_point>> TilesOnFly;
+        TilesOnFly _tilesOnFly;
+        std::unordered_map<TileKey, std::deque<TilesOnFly::iterator>> _tilesOnFlyByKey;
+        std::unordered_map<TileKey, TileWireId> _oldWireIds;
+    };
+
+    /// Sends the visible tiles over and again, keeping onFly unacknowledged.
+    template <typename Bookkeeping>
+    double run(const std::vector<TileDesc>& tiles, const std::vector<std::string>& ids,
+               size_t onFly, unsigned rounds)
+    {
+        Bookkeeping bookkeeping;
+        size_t duplicates = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned round = 0; round < rounds; ++round)
+        {
+            for (size_t i = 0; i < tiles.size(); ++i)
+            {
+                duplicates += bookkeeping.send(tiles[i]);
+                if (i >= onFly || round > 0)
+                    bookkeeping.acknowledge(ids[(i + tiles.size() - onFly) % tiles.size()]);
+            }
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // Keep the work from being optimized away.
+        if (duplicates == size_t(-1))
+            std::printf("\n");
+
+        return std::chrono::duration<double, std::nano>(elapsed).count() / (rounds * tiles.size());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned rounds = (argc > 1 ? std::atoi(argv[1]) : 2000);
+
+    std::vector<size_t> counts;
+    for (int i = 2; i < argc; ++i)
+        counts.push_back(std::atoi(argv[i]));
+    if (counts.empty())
+        counts = { 10, 40, 200 };
+
+    // A view of 16 x 12 tiles, at 100%, well down a spreadsheet.
+    std::vector<TileDesc> tiles;
+    std::vector<std::string> ids;
+    for (int row = 0; row < 12; ++row)
+    {
+        for (int column = 0; column < 16; ++column)
+        {
+            tiles.emplace_back(0, 256, 256, column * 3840, (row + 2000) * 3840, 3840, 3840,
+                               -1, 0, -1, false);
+            tiles.back().setWireId(row * 16 + column + 1);
+            ids.push_back(tiles.back().generateID());
+        }
+    }
+
+    std::printf("%8s  %12s  %12s\n", "on fly", "string ns", "packed ns");
+    for (size_t onFly : counts)
+    {
+        onFly = std::min(onFly, tiles.size());
+        const double before = run<StringIds>(tiles, ids, onFly, rounds);
+        const double after = run<PackedKeys>(tiles, ids, onFly, rounds);
+        std::printf("%8zu  %12.1f  %12.1f\n", onFly, before, after);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
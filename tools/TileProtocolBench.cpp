@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Measures the size of tilecombine requests between WSD and the kit and the
+ * time to serialize and to parse them, in the text form and the binary one.
+ *
+ * Usage: loolprotobench [rounds [columns rows]]
+ */
+
+#include <config.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <TileDesc.hpp>
+
+namespace
+{
+    /// The ns per round of work.
+    template <typename Work>
+    double measure(unsigned rounds, Work work)
+    {
+        size_t total = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned round = 0; round < rounds; ++round)
+            total += work();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // Keep the work from being optimized away.
+        if (total == size_t(-1))
+            std::printf("\n");
+
+        return std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned rounds = (argc > 1 ? std::atoi(argv[1]) : 20000);
+    const int columns = (argc > 3 ? std::atoi(argv[2]) : 16);
+    const int rows = (argc > 3 ? std::atoi(argv[3]) : 9);
+
+    // A 4K view of 256px tiles, at 100%, well down a spreadsheet, the client having had them.
+    std::vector<TileDesc> tiles;
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int column = 0; column < columns; ++column)
+        {
+            tiles.emplace_back(0, 256, 256, column * 3840, (row + 2000) * 3840, 3840, 3840,
+                               12345 + row * columns + column, 0, -1, false);
+            tiles.back().setOldWireId(70000 + row * columns + column);
+        }
+    }
+
+    const TileCombined tileCombined = TileCombined::create(tiles);
+    const std::string text = tileCombined.serialize("tilecombine", " deltas=true");
+    const std::string binary = tileCombined.serializeBinary("tilecombinebin", " deltas=true");
+
+    const double serializeText = measure(rounds, [&]() {
+            return tileCombined.serialize("tilecombine", " deltas=true").size();
+        });
+    const double serializeBinary = measure(rounds, [&]() {
+            return tileCombined.serializeBinary("tilecombinebin", " deltas=true").size();
+        });
+    const double parseText = measure(rounds, [&]() {
+            return TileCombined::parse(text).getTiles().size();
+        });
+    const double parseBinary = measure(rounds, [&]() {
+            size_t offset = sizeof("tilecombinebin");
+            return TileCombined::parseBinary(binary.data(), binary.size(), offset).getTiles().size();
+        });
+
+    std::printf("%zu tiles\n", tiles.size());
+    std::printf("%8s  %10s  %14s  %10s\n", "form", "bytes", "serialize ns", "parse ns");
+    std::printf("%8s  %10zu  %14.0f  %10.0f\n", "text", text.size(), serializeText, parseText);
+    std::printf("%8s  %10zu  %14.0f  %10.0f\n", "binary", binary.size(), serializeBinary, parseBinary);
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -23,6 +23,7 @@
 #include "AdminModel.hpp"
 #include "Auth.hpp"
 #include <Common.hpp>
+#include "DocumentBroker.hpp"
 #include "FileServer.hpp"
 #include <IoUtil.hpp>
 #include "LOOLWSD.hpp"
@@ -143,6 +144,9 @@ void AdminSocketHandler::handleMessage(bool /* fin */, WSOpCode /* code */,
     else if (tokens[0] == "mem_consumed")
         sendTextFrame("mem_consumed " + std::to_string(_admin->getTotalMemoryUsage()));
 
+    else if (tokens[0] == "convert_stats")
+        sendTextFrame("convert_stats " + ConvertToBroker::getStatsJSON());
+
     else if (tokens[0] == "total_avail_mem")
         sendTextFrame("total_avail_mem " + std::to_string(_admin->getTotalAvailableMemory()));
 
@@ -567,6 +571,26 @@ void Admin::addBytes(const std::string& docKey, uint64_t sent, uint64_t recv)
     addCallback([=] { _model.addBytes(docKey, sent, recv); });
 }
 
+void Admin::updateTileCacheStats(const std::string& docKey, size_t size,
+                                 uint64_t hits, uint64_t misses, uint64_t evictions,
+                                 uint64_t prefetched, uint64_t prefetchHits)
+{
+    addCallback([=] { _model.updateTileCacheStats(docKey, size, hits, misses, evictions,
+                                                  prefetched, prefetchHits); });
+}
+
+void Admin::updatePngCacheStats(const std::string& docKey, size_t size, size_t count,
+                                uint64_t hits, uint64_t misses, uint64_t evictions)
+{
+    addCallback([=] { _model.updatePngCacheStats(docKey, size, count, hits, misses, evictions); });
+}
+
+void Admin::updateTileWindow(const std::string& docKey, const std::string& sessionId,
+                             size_t window, int rttMs)
+{
+    addCallback([=] { _model.updateTileWindow(docKey, sessionId, window, rttMs); });
+}
+
 void Admin::notifyForkit()
 {
     std::ostringstream oss;
@@ -109,6 +109,13 @@ public:
     void updateLastActivityTime(const std::string& docKey);
     void updateMemoryDirty(const std::string& docKey, int dirty);
     void addBytes(const std::string& docKey, uint64_t sent, uint64_t recv);
+    void updateTileCacheStats(const std::string& docKey, size_t size,
+                              uint64_t hits, uint64_t misses, uint64_t evictions,
+                              uint64_t prefetched, uint64_t prefetchHits);
+    void updatePngCacheStats(const std::string& docKey, size_t size, size_t count,
+                             uint64_t hits, uint64_t misses, uint64_t evictions);
+    void updateTileWindow(const std::string& docKey, const std::string& sessionId,
+                          size_t window, int rttMs);
 
     void dumpState(std::ostream& os) override;
 
@@ -57,6 +57,13 @@ int Document::expireView(const std::string& sessionId)
     return _activeViews;
 }
 
+void Document::updateTileWindow(const std::string& sessionId, size_t window, int rttMs)
+{
+    auto it = _views.find(sessionId);
+    if (it != _views.end())
+        it->second.setTileWindow(window, rttMs);
+}
+
 std::pair<std::time_t, std::string> Document::getSnapshot() const
 {
     std::time_t ct = std::time(nullptr);
@@ -671,6 +678,17 @@ std::string AdminModel::getDocuments() const
                 << "\"fileName\"" << ':' << '"' << encodedFilename << '"' << ','
                 << "\"activeViews\"" << ':' << it.second.getActiveViews() << ','
                 << "\"memory\"" << ':' << it.second.getMemoryDirty() << ','
+                << "\"tileCacheSize\"" << ':' << it.second.getTileCacheSize() << ','
+                << "\"tileCacheHits\"" << ':' << it.second.getTileCacheHits() << ','
+                << "\"tileCacheMisses\"" << ':' << it.second.getTileCacheMisses() << ','
+                << "\"tileCacheEvictions\"" << ':' << it.second.getTileCacheEvictions() << ','
+                << "\"tilesPrefetched\"" << ':' << it.second.getTilesPrefetched() << ','
+                << "\"tilePrefetchHits\"" << ':' << it.second.getTilePrefetchHits() << ','
+                << "\"pngCacheSize\"" << ':' << it.second.getPngCacheSize() << ','
+                << "\"pngCacheCount\"" << ':' << it.second.getPngCacheCount() << ','
+                << "\"pngCacheHits\"" << ':' << it.second.getPngCacheHits() << ','
+                << "\"pngCacheMisses\"" << ':' << it.second.getPngCacheMisses() << ','
+                << "\"pngCacheEvictions\"" << ':' << it.second.getPngCacheEvictions() << ','
                 << "\"elapsedTime\"" << ':' << it.second.getElapsedTime() << ','
                 << "\"idleTime\"" << ':' << it.second.getIdleTime() << ','
                 << "\"modified\"" << ':' << '"' << (it.second.getModifiedStatus() ? "Yes" : "No") << '"' << ','
@@ -683,7 +701,9 @@ std::string AdminModel::getDocuments() const
                     oss << separator << '{'
                         << "\"userName\"" << ':' << '"' << viewIt.second.getUserName() << '"' << ','
                         << "\"userId\"" << ':' << '"' << viewIt.second.getUserId() << '"' << ','
-                        << "\"sessionid\"" << ':' << '"' << viewIt.second.getSessionId() << '"' << '}';
+                        << "\"sessionid\"" << ':' << '"' << viewIt.second.getSessionId() << '"' << ','
+                        << "\"tileWindow\"" << ':' << viewIt.second.getTileWindow() << ','
+                        << "\"tileRtt\"" << ':' << viewIt.second.getTileRttMs() << '}';
                         separator = ',';
                 }
             }
@@ -734,6 +754,70 @@ void AdminModel::updateMemoryDirty(const std::string& docKey, int dirty)
     }
 }
 
+bool Document::updateTileCacheStats(size_t size, uint64_t hits, uint64_t misses, uint64_t evictions,
+                                    uint64_t prefetched, uint64_t prefetchHits)
+{
+    const bool sizeChanged = (_tileCacheSize != size);
+    _tileCacheSize = size;
+    _tileCacheHits = hits;
+    _tileCacheMisses = misses;
+    _tileCacheEvictions = evictions;
+    _tilesPrefetched = prefetched;
+    _tilePrefetchHits = prefetchHits;
+    return sizeChanged;
+}
+
+void AdminModel::updateTileCacheStats(const std::string& docKey, size_t size,
+                                      uint64_t hits, uint64_t misses, uint64_t evictions,
+                                      uint64_t prefetched, uint64_t prefetchHits)
+{
+    assertCorrectThread();
+
+    auto docIt = _documents.find(docKey);
+    if (docIt != _documents.end() &&
+        docIt->second.updateTileCacheStats(size, hits, misses, evictions, prefetched, prefetchHits))
+    {
+        notify("propchange " + std::to_string(docIt->second.getPid()) +
+               " tilecache " + std::to_string(size));
+    }
+}
+
+bool Document::updatePngCacheStats(size_t size, size_t count, uint64_t hits, uint64_t misses,
+                                   uint64_t evictions)
+{
+    const bool sizeChanged = (_pngCacheSize != size);
+    _pngCacheSize = size;
+    _pngCacheCount = count;
+    _pngCacheHits = hits;
+    _pngCacheMisses = misses;
+    _pngCacheEvictions = evictions;
+    return sizeChanged;
+}
+
+void AdminModel::updatePngCacheStats(const std::string& docKey, size_t size, size_t count,
+                                     uint64_t hits, uint64_t misses, uint64_t evictions)
+{
+    assertCorrectThread();
+
+    auto docIt = _documents.find(docKey);
+    if (docIt != _documents.end() &&
+        docIt->second.updatePngCacheStats(size, count, hits, misses, evictions))
+    {
+        notify("propchange " + std::to_string(docIt->second.getPid()) +
+               " pngcache " + std::to_string(size));
+    }
+}
+
+void AdminModel::updateTileWindow(const std::string& docKey, const std::string& sessionId,
+                                  size_t window, int rttMs)
+{
+    assertCorrectThread();
+
+    auto docIt = _documents.find(docKey);
+    if (docIt != _documents.end())
+        docIt->second.updateTileWindow(sessionId, window, rttMs);
+}
+
 double AdminModel::getServerUptime()
 {
     auto currentTime = std::chrono::system_clock::now();
@@ -28,7 +28,9 @@ public:
         _sessionId(sessionId),
         _userName(userName),
         _userId(userId),
-        _start(std::time(nullptr))
+        _start(std::time(nullptr)),
+        _tileWindow(0),
+        _tileRttMs(0)
     {
     }
 
@@ -38,12 +40,23 @@ public:
     std::string getSessionId() const { return _sessionId; }
     bool isExpired() const { return _end != 0 && std::time(nullptr) >= _end; }
 
+    void setTileWindow(size_t window, int rttMs)
+    {
+        _tileWindow = window;
+        _tileRttMs = rttMs;
+    }
+    size_t getTileWindow() const { return _tileWindow; }
+    int getTileRttMs() const { return _tileRttMs; }
+
 private:
     const std::string _sessionId;
     const std::string _userName;
     const std::string _userId;
     const std::time_t _start;
     std::time_t _end = 0;
+    /// Tiles allowed on fly to the client and their roundtrip.
+    size_t _tileWindow;
+    int _tileRttMs;
 };
 
 struct DocProcSettings
@@ -108,6 +121,17 @@ public:
           _end(0),
           _sentBytes(0),
           _recvBytes(0),
+          _tileCacheSize(0),
+          _tileCacheHits(0),
+          _tileCacheMisses(0),
+          _tileCacheEvictions(0),
+          _tilesPrefetched(0),
+          _tilePrefetchHits(0),
+          _pngCacheSize(0),
+          _pngCacheCount(0),
+          _pngCacheHits(0),
+          _pngCacheMisses(0),
+          _pngCacheEvictions(0),
           _isModified(false)
     {
     }
@@ -134,6 +158,7 @@ public:
     void setLastJiffies(size_t newJ) { _lastJiffy = newJ; }
 
     const std::map<std::string, View>& getViews() const { return _views; }
+    void updateTileWindow(const std::string& sessionId, size_t window, int rttMs);
 
     void updateLastActivityTime() { _lastActivity = std::time(nullptr); }
     bool updateMemoryDirty(int dirty);
@@ -152,6 +177,22 @@ public:
         _recvBytes += recv;
     }
 
+    bool updateTileCacheStats(size_t size, uint64_t hits, uint64_t misses, uint64_t evictions,
+                              uint64_t prefetched, uint64_t prefetchHits);
+    size_t getTileCacheSize() const { return _tileCacheSize; }
+    uint64_t getTileCacheHits() const { return _tileCacheHits; }
+    uint64_t getTileCacheMisses() const { return _tileCacheMisses; }
+    uint64_t getTileCacheEvictions() const { return _tileCacheEvictions; }
+    uint64_t getTilesPrefetched() const { return _tilesPrefetched; }
+    uint64_t getTilePrefetchHits() const { return _tilePrefetchHits; }
+
+    bool updatePngCacheStats(size_t size, size_t count, uint64_t hits, uint64_t misses, uint64_t evictions);
+    size_t getPngCacheSize() const { return _pngCacheSize; }
+    size_t getPngCacheCount() const { return _pngCacheCount; }
+    uint64_t getPngCacheHits() const { return _pngCacheHits; }
+    uint64_t getPngCacheMisses() const { return _pngCacheMisses; }
+    uint64_t getPngCacheEvictions() const { return _pngCacheEvictions; }
+
     const DocProcSettings& getDocProcSettings() const { return _docProcSettings; }
     void setDocProcSettings(const DocProcSettings& docProcSettings) { _docProcSettings = docProcSettings; }
 
@@ -179,6 +220,15 @@ private:
     /// Total bytes sent and recv'd by this document.
     uint64_t _sentBytes, _recvBytes;
 
+    /// Size and counters of the document's tile cache in WSD.
+    size_t _tileCacheSize;
+    uint64_t _tileCacheHits, _tileCacheMisses, _tileCacheEvictions;
+    /// Tiles rendered ahead of requests, and how many of those got requested.
+    uint64_t _tilesPrefetched, _tilePrefetchHits;
+    /// Size and counters of the cache of encoded tiles in the document's Kit process.
+    size_t _pngCacheSize, _pngCacheCount;
+    uint64_t _pngCacheHits, _pngCacheMisses, _pngCacheEvictions;
+
     /// Per-doc kit process settings.
     DocProcSettings _docProcSettings;
     bool _isModified;
@@ -281,6 +331,16 @@ public:
 
     void addBytes(const std::string& docKey, uint64_t sent, uint64_t recv);
 
+    void updateTileCacheStats(const std::string& docKey, size_t size,
+                              uint64_t hits, uint64_t misses, uint64_t evictions,
+                              uint64_t prefetched, uint64_t prefetchHits);
+
+    void updatePngCacheStats(const std::string& docKey, size_t size, size_t count,
+                             uint64_t hits, uint64_t misses, uint64_t evictions);
+
+    void updateTileWindow(const std::string& docKey, const std::string& sessionId,
+                          size_t window, int rttMs);
+
     uint64_t getSentBytesTotal() { return _sentBytesTotal; }
     uint64_t getRecvBytesTotal() { return _recvBytesTotal; }
 
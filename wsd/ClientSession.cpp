@@ -51,12 +51,16 @@ ClientSession::ClientSession(const std::string& id,
     _isDocumentOwner(false),
     _state(SessionState::DETACHED),
     _keyEvents(1),
+    _framesSent(0),
     _clientVisibleArea(0, 0, 0, 0),
     _clientSelectedPart(-1),
     _tileWidthPixel(0),
     _tileHeightPixel(0),
     _tileWidthTwips(0),
     _tileHeightTwips(0),
+    _scrollDirectionX(0),
+    _scrollDirectionY(0),
+    _prefetchPending(false),
     _kitViewId(-1),
     _hostNoTrust(hostNoTrust),
     _isTextDocument(false)
@@ -562,7 +566,16 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         }
         else
         {
+            // Remember which way the view scrolled, to prefetch ahead of it.
+            if (_clientVisibleArea.getWidth() == width && _clientVisibleArea.getHeight() == height)
+            {
+                _scrollDirectionX = (x > _clientVisibleArea.getLeft()) - (x < _clientVisibleArea.getLeft());
+                _scrollDirectionY = (y > _clientVisibleArea.getTop()) - (y < _clientVisibleArea.getTop());
+            }
+
             _clientVisibleArea = Util::Rectangle(x, y, width, height);
+            updateVisibleTiles();
+            _prefetchPending = true;
             resetWireIdMap();
             return forwardToChild(std::string(buffer, length), docBroker);
         }
@@ -581,6 +594,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             else
             {
                 _clientSelectedPart = temp;
+                _prefetchPending = true;
                 resetWireIdMap();
                 return forwardToChild(std::string(buffer, length), docBroker);
             }
@@ -642,15 +656,17 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             _tileHeightPixel = tilePixelHeight;
             _tileWidthTwips = tileTwipWidth;
             _tileHeightTwips = tileTwipHeight;
+            updateVisibleTiles();
+            _prefetchPending = true;
             resetWireIdMap();
             return forwardToChild(std::string(buffer, length), docBroker);
         }
     }
     else if (tokens[0] == "tileprocessed")
     {
-        std::string tileID;
+        std::string tileIDs;
         if (tokens.size() != 2 ||
-            !getTokenString(tokens[1], "tile", tileID))
+            !getTokenString(tokens[1], "tile", tileIDs))
         {
             // Be forgiving and log instead of disconnecting.
             // sendTextFrame("error: cmd=tileprocessed kind=syntax");
@@ -658,16 +674,22 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             return true;
         }
 
-        auto iter = std::find_if(_tilesOnFly.begin(), _tilesOnFly.end(),
-        [&tileID](const std::pair<std::string, std::chrono::steady_clock::time_point>& curTile)
+        // All the tiles of a tilecombine are acknowledged at once.
+        const auto now = std::chrono::steady_clock::now();
+        for (const std::string& tileID : LOOLProtocol::tokenize(tileIDs, ','))
         {
-            return curTile.first == tileID;
-        });
-
-        if(iter != _tilesOnFly.end())
-            _tilesOnFly.erase(iter);
-        else
-            LOG_INF("Tileprocessed message with an unknown tile ID");
+            TileKey key;
+            const auto iter = (TileDesc::parseKey(tileID, key) ? _tilesOnFlyByKey.find(key)
+                                                                : _tilesOnFlyByKey.end());
+            if(iter != _tilesOnFlyByKey.end())
+            {
+                const std::list<TileOnFly>::iterator oldest = iter->second.front();
+                _tileWindow.onAcknowledged(oldest->_sent, now, oldest->_size);
+                eraseTileOnFly(oldest);
+            }
+            else
+                LOG_INF("Tileprocessed message with an unknown tile ID");
+        }
 
         docBroker->sendRequestedTiles(shared_from_this());
         return true;
@@ -965,20 +987,42 @@ void ClientSession::performWrites()
 {
     LOG_TRC(getName() << " ClientSession: performing writes.");
 
+#if !MOBILEAPP
+    // Frame as many messages as the socket can take, they are then written
+    // gathered by a single call rather than one per message.
+    const std::shared_ptr<StreamSocket> socket = getSocket().lock();
+    const size_t limit = (socket ? std::max(socket->getSendBufferSize(), 0) : 0);
+    const bool flush = false;
+#else
+    // Each write is a message.
+    const std::shared_ptr<StreamSocket> socket;
+    const size_t limit = 0;
+    const bool flush = true;
+#endif
+
+    size_t frames = 0;
     std::shared_ptr<Message> item;
-    if (_senderQueue.dequeue(item))
+    while ((frames == 0 || (socket && socket->getPendingOutputSize() < limit)) &&
+           _senderQueue.dequeue(item))
     {
         try
         {
+            LOG_TRC(getName() << ": Send: " << item->abbr());
             const std::vector<char>& data = item->data();
-            if (item->isBinary())
+            if (!item->bodies().empty())
             {
-                Session::sendBinaryFrame(data.data(), data.size());
+                sendMessage(data.data(), data.size(), item->bodies(), WSOpCode::Binary, flush);
+            }
+            else if (item->isBinary())
+            {
+                sendMessage(data.data(), data.size(), WSOpCode::Binary, flush);
             }
             else
             {
-                Session::sendTextFrame(data.data(), data.size());
+                sendMessage(data.data(), data.size(), WSOpCode::Text, flush);
             }
+
+            ++frames;
         }
         catch (const std::exception& ex)
         {
@@ -987,7 +1031,9 @@ void ClientSession::performWrites()
         }
     }
 
-    LOG_TRC(getName() << " ClientSession: performed write.");
+    _framesSent += frames;
+
+    LOG_TRC(getName() << " ClientSession: performed " << frames << " writes.");
 }
 
 void ClientSession::postProcessCopyPayload(std::shared_ptr<Message> payload)
@@ -1012,9 +1058,10 @@ void ClientSession::postProcessCopyPayload(std::shared_ptr<Message> payload)
         });
 }
 
-bool ClientSession::handleKitToClientMessage(const char* buffer, const int length)
+bool ClientSession::handleKitToClientMessage(const std::shared_ptr<Message>& payload)
 {
-    const auto payload = std::make_shared<Message>(buffer, length, Message::Dir::Out);
+    const char* buffer = payload->data().data();
+    const int length = payload->data().size();
 
     LOG_TRC(getName() << ": handling kit-to-client [" << payload->abbr() << "].");
     const std::string& firstLine = payload->firstLine();
@@ -1489,17 +1536,22 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
 
     const std::string command = data->firstToken();
     std::unique_ptr<TileDesc> tile;
+    std::unique_ptr<TileCombined> tileCombined;
     if (command == "tile:")
     {
         // Avoid sending tile if it has the same wireID as the previously sent tile
         tile.reset(new TileDesc(TileDesc::parse(data->firstLine())));
-        auto iter = _oldWireIds.find(tile->generateID());
+        auto iter = _oldWireIds.find(tile->getKey());
         if(iter != _oldWireIds.end() && tile->getWireId() != 0 && tile->getWireId() == iter->second)
         {
             LOG_INF("WSD filters out a tile with the same wireID: " <<  tile->serialize("tile:"));
             return;
         }
     }
+    else if (command == "tilecombine:")
+    {
+        tileCombined.reset(new TileCombined(TileCombined::parse(data->firstLine())));
+    }
 
     LOG_TRC(getName() << " enqueueing client message " << data->id());
     size_t sizeBefore = _senderQueue.size();
@@ -1510,6 +1562,12 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
     {
         traceTileBySend(*tile, sizeBefore == newSize);
     }
+    else if (tileCombined)
+    {
+        // Each is acknowledged by the client, as if sent alone.
+        for (const auto& combinedTile : tileCombined->getTiles())
+            traceTileBySend(combinedTile);
+    }
 }
 
 Authorization ClientSession::getAuthorization() const
@@ -1542,26 +1600,48 @@ Authorization ClientSession::getAuthorization() const
 
 void ClientSession::addTileOnFly(const TileDesc& tile)
 {
-    _tilesOnFly.push_back({tile.generateID(), std::chrono::steady_clock::now()});
+    const TileKey key = tile.getKey();
+    _tilesOnFly.push_back({key, std::chrono::steady_clock::now(),
+                           static_cast<size_t>(std::max(tile.getImgSize(), 0))});
+    _tilesOnFlyByKey[key].push_back(std::prev(_tilesOnFly.end()));
+}
+
+void ClientSession::eraseTileOnFly(std::list<TileOnFly>::iterator it)
+{
+    const auto index = _tilesOnFlyByKey.find(it->_key);
+    if (index != _tilesOnFlyByKey.end())
+    {
+        std::deque<std::list<TileOnFly>::iterator>& sent = index->second;
+        sent.erase(std::find(sent.begin(), sent.end(), it));
+        if (sent.empty())
+            _tilesOnFlyByKey.erase(index);
+    }
+
+    _tilesOnFly.erase(it);
 }
 
 void ClientSession::clearTilesOnFly()
 {
     _tilesOnFly.clear();
+    _tilesOnFlyByKey.clear();
 }
 
 void ClientSession::removeOutdatedTilesOnFly()
 {
     // Check only the beginning of the list, tiles are ordered by timestamp
+    const auto now = std::chrono::steady_clock::now();
+    const int timeoutMs = _tileWindow.getTimeoutMs();
     bool continueLoop = true;
     while(!_tilesOnFly.empty() && continueLoop)
     {
         auto tileIter = _tilesOnFly.begin();
-        double elapsedTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tileIter->second).count();
-        if(elapsedTimeMs > TILE_ROUNDTRIP_TIMEOUT_MS)
+        double elapsedTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - tileIter->_sent).count();
+        if(elapsedTimeMs > timeoutMs)
         {
-            LOG_WRN("Tracker tileID was dropped because of time out. Tileprocessed message did not arrive");
-            _tilesOnFly.erase(tileIter);
+            LOG_WRN("Tracker tileID was dropped because of time out after " << timeoutMs <<
+                    "ms. Tileprocessed message did not arrive");
+            _tileWindow.onTimeout(now);
+            eraseTileOnFly(tileIter);
         }
         else
             continueLoop = false;
@@ -1570,14 +1650,8 @@ void ClientSession::removeOutdatedTilesOnFly()
 
 size_t ClientSession::countIdenticalTilesOnFly(const TileDesc& tile) const
 {
-    size_t count = 0;
-    std::string tileID = tile.generateID();
-    for(auto& tileItem : _tilesOnFly)
-    {
-        if(tileItem.first == tileID)
-            ++count;
-    }
-    return count;
+    const auto iter = _tilesOnFlyByKey.find(tile.getKey());
+    return iter != _tilesOnFlyByKey.end() ? iter->second.size() : 0;
 }
 
 Util::Rectangle ClientSession::getNormalizedVisibleArea() const
@@ -1590,9 +1664,61 @@ Util::Rectangle ClientSession::getNormalizedVisibleArea() const
     return normalizedVisArea;
 }
 
+void ClientSession::updateVisibleTiles()
+{
+    const Util::Rectangle normalizedVisArea = getNormalizedVisibleArea();
+    if (!normalizedVisArea.hasSurface() || _tileWidthTwips == 0 || _tileHeightTwips == 0)
+        return;
+
+    const int tilesFitOnWidth = std::ceil(normalizedVisArea.getRight() / _tileWidthTwips) -
+                                std::ceil(normalizedVisArea.getLeft() / _tileWidthTwips) + 1;
+    const int tilesFitOnHeight = std::ceil(normalizedVisArea.getBottom() / _tileHeightTwips) -
+                                 std::ceil(normalizedVisArea.getTop() / _tileHeightTwips) + 1;
+    _tileWindow.setVisibleTiles(tilesFitOnWidth * tilesFitOnHeight);
+}
+
+void ClientSession::getPrefetchTiles(const int margin, std::vector<TileDesc>& tiles) const
+{
+    if (!_clientVisibleArea.hasSurface() ||
+        _tileWidthPixel == 0 || _tileHeightPixel == 0 ||
+        _tileWidthTwips == 0 || _tileHeightTwips == 0 ||
+        (_clientSelectedPart == -1 && !_isTextDocument))
+    {
+        return;
+    }
+
+    // The visible tiles, as handleTileInvalidation has them.
+    const Util::Rectangle normalizedVisArea = getNormalizedVisibleArea();
+    const int top = std::ceil(normalizedVisArea.getTop() / _tileHeightTwips);
+    const int bottom = std::ceil(normalizedVisArea.getBottom() / _tileHeightTwips);
+    const int left = std::ceil(normalizedVisArea.getLeft() / _tileWidthTwips);
+    const int right = std::ceil(normalizedVisArea.getRight() / _tileWidthTwips);
+
+    // Twice the margin ahead of the scrolling.
+    const int firstRow = std::max(top - margin - (_scrollDirectionY < 0 ? margin : 0), 0);
+    const int lastRow = bottom + margin + (_scrollDirectionY > 0 ? margin : 0);
+    const int firstColumn = std::max(left - margin - (_scrollDirectionX < 0 ? margin : 0), 0);
+    const int lastColumn = right + margin + (_scrollDirectionX > 0 ? margin : 0);
+
+    const int part = std::max(_clientSelectedPart, 0);
+    for (int i = firstRow; i <= lastRow; ++i)
+    {
+        for (int j = firstColumn; j <= lastColumn; ++j)
+        {
+            if (i >= top && i <= bottom && j >= left && j <= right)
+                continue;
+
+            tiles.emplace_back(part, _tileWidthPixel, _tileHeightPixel, j * _tileWidthTwips, i * _tileHeightTwips,
+                               _tileWidthTwips, _tileHeightTwips, -1, 0, -1, false);
+        }
+    }
+}
+
 void ClientSession::onDisconnect()
 {
     LOG_INF(getName() << " Disconnected, current number of connections: " << LOOLWSD::NumConnections);
+    LOG_DBG(getName() << " sender queue max size " << _senderQueue.getMaxSize() <<
+            ", mean time in queue " << _senderQueue.getMeanWaitUs() << "us.");
 
     const std::shared_ptr<DocumentBroker> docBroker = getDocumentBroker();
     LOG_CHECK_RET(docBroker && "Null DocumentBroker instance", );
@@ -1664,7 +1790,12 @@ void ClientSession::dumpState(std::ostream& os)
        << "\n\t\tisTextDocument: " << _isTextDocument
        << "\n\t\tclipboardKeys[0]: " << _clipboardKeys[0]
        << "\n\t\tclipboardKeys[1]: " << _clipboardKeys[1]
-       << "\n\t\tclip sockets: " << _clipSockets.size();
+       << "\n\t\tclip sockets: " << _clipSockets.size()
+       << "\n\t\ttiles on fly: " << _tilesOnFly.size() << " window: " << _tileWindow.getWindow()
+       << "\n\t\ttile rtt: " << _tileWindow.getRttMs() << "ms min: " << _tileWindow.getMinRttMs()
+       << "ms timeout: " << _tileWindow.getTimeoutMs() << "ms"
+       << "\n\t\ttiles delivered: " << _tileWindow.getBytesDelivered() << " bytes, "
+       << _tileWindow.getDeliveryRate() << " bytes/s";
 
     std::shared_ptr<StreamSocket> socket = getSocket().lock();
     if (socket)
@@ -1672,6 +1803,7 @@ void ClientSession::dumpState(std::ostream& os)
         uint64_t sent, recv;
         socket->getIOStats(sent, recv);
         os << "\n\t\tsent/keystroke: " << (double)sent/_keyEvents << "bytes";
+        os << "\n\t\tframes/write: " << (double)_framesSent/std::max<uint64_t>(socket->getWriteCount(), 1);
     }
 
     os << "\n";
@@ -1683,6 +1815,7 @@ void ClientSession::handleTileInvalidation(const std::string& message,
     const std::shared_ptr<DocumentBroker>& docBroker)
 {
     docBroker->invalidateTiles(message);
+    _prefetchPending = true;
 
     // Skip requesting new tiles if we don't have client visible area data yet.
     if(!_clientVisibleArea.hasSurface() ||
@@ -1724,7 +1857,7 @@ void ClientSession::handleTileInvalidation(const std::string& message,
                     invalidTiles.emplace_back(part, _tileWidthPixel, _tileHeightPixel, j * _tileWidthTwips, i * _tileHeightTwips, _tileWidthTwips, _tileHeightTwips, -1, 0, -1, false);
 
                     TileWireId oldWireId = 0;
-                    auto iter = _oldWireIds.find(invalidTiles.back().generateID());
+                    auto iter = _oldWireIds.find(invalidTiles.back().getKey());
                     if(iter != _oldWireIds.end())
                         oldWireId = iter->second;
 
@@ -1747,12 +1880,21 @@ void ClientSession::resetWireIdMap()
     _oldWireIds.clear();
 }
 
+bool ClientSession::canApplyTileDelta(const TileDesc& tile) const
+{
+    if (!acceptsTileDeltas() || tile.getOldWireId() == 0)
+        return false;
+
+    const auto iter = _oldWireIds.find(tile.getKey());
+    return iter != _oldWireIds.end() && iter->second == tile.getOldWireId();
+}
+
 void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
 {
-    const std::string tileID = tile.generateID();
+    const TileKey key = tile.getKey();
 
     // Store wireId first
-    auto iter = _oldWireIds.find(tileID);
+    auto iter = _oldWireIds.find(key);
     if(iter != _oldWireIds.end())
     {
         iter->second = tile.getWireId();
@@ -1764,7 +1906,7 @@ void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
            tile.getTilePosX() >= _clientVisibleArea.getLeft() && tile.getTilePosX() <= _clientVisibleArea.getRight() &&
            tile.getTilePosY() >= _clientVisibleArea.getTop() && tile.getTilePosY() <= _clientVisibleArea.getBottom())
         {
-            _oldWireIds.insert(std::pair<std::string, TileWireId>(tileID, tile.getWireId()));
+            _oldWireIds.insert(std::make_pair(key, tile.getWireId()));
         }
     }
 
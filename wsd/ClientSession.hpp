@@ -14,12 +14,14 @@
 #include "Storage.hpp"
 #include "MessageQueue.hpp"
 #include "SenderQueue.hpp"
+#include "TileWindow.hpp"
 #include "DocumentBroker.hpp"
 #include <Poco/URI.h>
 #include <Rectangle.hpp>
 #include <deque>
 #include <map>
 #include <list>
+#include <unordered_map>
 #include <utility>
 
 class DocumentBroker;
@@ -64,7 +66,7 @@ public:
     bool isDocumentOwner() const { return _isDocumentOwner; }
 
     /// Handle kit-to-client message.
-    bool handleKitToClientMessage(const char* data, const int size);
+    bool handleKitToClientMessage(const std::shared_ptr<Message>& payload);
 
     /// Integer id of the view in the kit process, or -1 if unknown
     int getKitViewId() const { return _kitViewId; }
@@ -82,16 +84,18 @@ public:
         return true;
     }
 
+    /// Sends the tile after the header, sharing its data with the cache.
     bool sendTile(const std::string &header, const TileCache::Tile &tile)
     {
-        // FIXME: performance - optimize away this copy ...
-        std::vector<char> output;
-
-        output.resize(header.size() + tile->size());
-        std::memcpy(output.data(), header.data(), header.size());
-        std::memcpy(output.data() + header.size(), tile->data(), tile->size());
+        enqueueSendMessage(std::make_shared<Message>(header, tile, Message::Dir::Out));
+        return true;
+    }
 
-        return sendBinaryFrame(output.data(), output.size());
+    /// Sends the tiles after the tilecombine header, in its order, sharing their data with the cache.
+    bool sendTileCombined(const std::string &header, const std::vector<TileCache::Tile> &tiles)
+    {
+        enqueueSendMessage(std::make_shared<Message>(header, tiles, Message::Dir::Out));
+        return true;
     }
 
     bool sendTextFrame(const char* buffer, const int length) override
@@ -136,6 +140,9 @@ public:
     void removeOutdatedTilesOnFly();
     size_t countIdenticalTilesOnFly(const TileDesc& tile) const;
 
+    /// The number of tiles allowed on fly, following the client's roundtrip.
+    const TileWindow& getTileWindow() const { return _tileWindow; }
+
     Util::Rectangle getVisibleArea() const { return _clientVisibleArea; }
     /// Visible area can have negative value as position, but we have tiles only in the positive range
     Util::Rectangle getNormalizedVisibleArea() const;
@@ -150,6 +157,17 @@ public:
     /// Clear wireId map anytime when client visible area changes (visible area, zoom, part number)
     void resetWireIdMap();
 
+    /// Whether the client has the tile the delta in tile is against, and can apply it.
+    bool canApplyTileDelta(const TileDesc& tile) const;
+
+    /// Whether the tiles around the visible area may have changed since they were last prefetched.
+    bool isPrefetchPending() const { return _prefetchPending; }
+    void setPrefetchPending(bool pending) { _prefetchPending = pending; }
+
+    /// Appends the tiles within margin tiles around the visible area, twice that
+    /// in the direction it last scrolled, the visible ones excluded.
+    void getPrefetchTiles(int margin, std::vector<TileDesc>& tiles) const;
+
     bool isTextDocument() const { return _isTextDocument; }
 
     /// Do we recognize this clipboard ?
@@ -214,6 +232,9 @@ private:
     void handleTileInvalidation(const std::string& message,
                                 const std::shared_ptr<DocumentBroker>& docBroker);
 
+    /// Seed the tile window with the tiles of the visible area, once it and the zoom are known.
+    void updateVisibleTiles();
+
 private:
     std::weak_ptr<DocumentBroker> _docBroker;
 
@@ -238,6 +259,9 @@ private:
     /// Count of key-strokes
     uint64_t _keyEvents;
 
+    /// Count of messages framed by performWrites, against the socket's writes.
+    uint64_t _framesSent;
+
     SenderQueue<std::shared_ptr<Message>> _senderQueue;
 
     /// Visible area of the client
@@ -252,6 +276,13 @@ private:
     int _tileWidthTwips;
     int _tileHeightTwips;
 
+    /// The sign of the last move of the visible area on each axis.
+    int _scrollDirectionX;
+    int _scrollDirectionY;
+
+    /// The visible area, zoom or part changed, or tiles got invalidated.
+    bool _prefetchPending;
+
     /// The integer id of the view in the Kit process
     int _kitViewId;
 
@@ -264,14 +295,30 @@ private:
     /// Rotating clipboard remote access identifiers - protected by SessionMapMutex
     std::string _clipboardKeys[2];
 
-    /// TileID's of the sent tiles. Push by sending and pop by tileprocessed message from the client.
-    std::list<std::pair<std::string, std::chrono::steady_clock::time_point>> _tilesOnFly;
+    struct TileOnFly
+    {
+        TileKey _key;
+        std::chrono::steady_clock::time_point _sent;
+        size_t _size;
+    };
+
+    /// Removes one from _tilesOnFly and its index.
+    void eraseTileOnFly(std::list<TileOnFly>::iterator it);
+
+    /// The sent tiles. Push by sending and pop by tileprocessed message from the client.
+    std::list<TileOnFly> _tilesOnFly;
+
+    /// _tilesOnFly by tile, oldest first.
+    std::unordered_map<TileKey, std::deque<std::list<TileOnFly>::iterator>> _tilesOnFlyByKey;
+
+    /// Limits _tilesOnFly by the roundtrip of the tileprocessed messages.
+    TileWindow _tileWindow;
 
     /// Requested tiles are stored in this list, before we can send them to the client
     std::deque<TileDesc> _requestedTiles;
 
     /// Store wireID's of the sent tiles inside the actual visible area
-    std::map<std::string, TileWireId> _oldWireIds;
+    std::unordered_map<TileKey, TileWireId> _oldWireIds;
 
     /// Sockets to send binary selection content to
     std::vector<std::weak_ptr<StreamSocket>> _clipSockets;
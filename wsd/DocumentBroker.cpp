@@ -11,10 +11,13 @@
 
 #include "DocumentBroker.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cctype>
 #include <chrono>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <sstream>
 
@@ -43,8 +46,6 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
-#define TILES_ON_FLY_MIN_UPPER_LIMIT 10.0f
-
 using namespace LOOLProtocol;
 
 using Poco::JSON::Object;
@@ -191,6 +192,7 @@ DocumentBroker::DocumentBroker(const std::string& uri,
     _stop(false),
     _closeReason("stopped"),
     _tileVersion(0),
+    _knownTilesSent(0),
     _debugRenderedTileCount(0)
 {
     assert(!_docKey.empty());
@@ -279,6 +281,10 @@ void DocumentBroker::pollThread()
 
     const int limit_load_secs = LOOLWSD::getConfigValue<int>("per_document.limit_load_secs", 100);
     const auto loadDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(limit_load_secs);
+
+    const int tilePrefetchMargin = LOOLWSD::getConfigValue<int>("tile_cache.prefetch_margin", 0);
+#else
+    const int tilePrefetchMargin = 0;
 #endif
     auto last30SecCheckTime = std::chrono::steady_clock::now();
 
@@ -306,6 +312,19 @@ void DocumentBroker::pollThread()
             continue;
         }
 
+        if (isOverTimeLimit(now))
+        {
+            if (_childProcess)
+            {
+                LOG_WRN("Doc [" << _docKey << "] is taking too long to convert. Will kill process ["
+                                << _childProcess->getPid() << "].");
+                _childProcess->terminate();
+            }
+
+            stop("Conversion timed out");
+            continue;
+        }
+
         if (std::chrono::duration_cast<std::chrono::milliseconds>
                     (now - lastBWUpdateTime).count() >= 5 * 1000)
         {
@@ -320,6 +339,26 @@ void DocumentBroker::pollThread()
             LOG_DBG("Doc [" << _docKey << "] added sent: " << sent << " recv: " << recv << " bytes to totals");
             adminSent = sent;
             adminRecv = recv;
+
+            if (_tileCache)
+            {
+                // Shrink to our share of the total, even when we have no new tiles.
+                _tileCache->evictTiles();
+
+                Admin::instance().updateTileCacheStats(getDocKey(), _tileCache->getCacheSize(),
+                                                       _tileCache->getCacheHits(),
+                                                       _tileCache->getCacheMisses(),
+                                                       _tileCache->getCacheEvictions(),
+                                                       _tileCache->getTilesPrefetched(),
+                                                       _tileCache->getPrefetchHits());
+            }
+
+            for (const auto& it : _sessions)
+            {
+                const TileWindow& tileWindow = it.second->getTileWindow();
+                Admin::instance().updateTileWindow(getDocKey(), it.first, tileWindow.getWindow(),
+                                                   std::lround(tileWindow.getRttMs()));
+            }
         }
 #endif
 
@@ -349,6 +388,12 @@ void DocumentBroker::pollThread()
             last30SecCheckTime = std::chrono::steady_clock::now();
         }
 
+        if (tilePrefetchMargin > 0 && isLoaded() && !_stop)
+            prefetchTiles(tilePrefetchMargin);
+
+        if (isLoaded() && !_stop)
+            sendKnownTiles();
+
 #if !MOBILEAPP
         if (std::chrono::duration_cast<std::chrono::minutes>(now - lastClipboardHashUpdateTime).count() >= 2)
         for (auto &it : _sessions)
@@ -434,7 +479,12 @@ void DocumentBroker::pollThread()
 #endif
 
     if (_tileCache)
+    {
+        // Keep the tiles for the next time, unless they show changes we didn't save.
+        if (isLoaded() && !_isModified && !_documentChangedInStorage)
+            _tileCache->persist(_documentLastModifiedTime);
         _tileCache->clear();
+    }
 
     LOG_INF("Finished docBroker polling thread for docKey [" << _docKey << "].");
 }
@@ -794,7 +844,11 @@ bool DocumentBroker::load(const std::shared_ptr<ClientSession>& session, const s
 #endif
 
         _tileCache.reset(new TileCache(_storage->getUriString(), _lastFileModifiedTime, dontUseCache));
+        _knownTilesSent = 0;
         _tileCache->setThreadOwner(std::this_thread::get_id());
+        _tileCache->setMaxCacheSize(std::max(LOOLWSD::getConfigValue<int>("tile_cache.per_document_max_kb", 65536), 0) * 1024UL);
+        if (templateSource.empty())
+            _tileCache->openPersisted(_docKey, _documentLastModifiedTime);
     }
 
 #if !MOBILEAPP
@@ -1399,14 +1453,15 @@ void DocumentBroker::alertAllUsers(const std::string& msg)
 }
 
 /// Handles input from the prisoner / child kit process
-bool DocumentBroker::handleInput(const std::vector<char>& payload)
+bool DocumentBroker::handleInput(std::vector<char>&& payload)
 {
-    auto message = std::make_shared<Message>(payload.data(), payload.size(), Message::Dir::Out);
-    const auto& msg = message->abbr();
-    LOG_TRC("DocumentBroker handling child message: [" << msg << "].");
+    // Adopt the payload, it's shared from here on to the clients' queues.
+    auto message = std::make_shared<Message>(std::move(payload), Message::Dir::Out);
+    LOG_TRC("DocumentBroker handling child message: [" << message->abbr() << "].");
 
 #if !MOBILEAPP
-    LOOLWSD::dumpOutgoingTrace(getJailId(), "0", msg);
+    if (LOOLWSD::TraceDumper)
+        LOOLWSD::dumpOutgoingTrace(getJailId(), "0", message->abbr());
 #endif
 
     if (LOOLProtocol::getFirstToken(message->forwardToken(), '-') == "client")
@@ -1418,11 +1473,11 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
         const auto& command = message->firstToken();
         if (command == "tile:")
         {
-            handleTileResponse(payload);
+            handleTileResponse(message->data());
         }
-        else if (command == "tilecombine:")
+        else if (command == "tilecombine:" || command == "tilecombinebin:")
         {
-            handleTileCombinedResponse(payload);
+            handleTileCombinedResponse(message->data());
         }
         else if (command == "errortoall:")
         {
@@ -1443,10 +1498,24 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
                 Admin::instance().updateMemoryDirty(_docKey, dirty);
             }
         }
+        else if (command == "pngcachestats:")
+        {
+            uint64_t size = 0, count = 0, hits = 0, misses = 0, evictions = 0;
+            for (const std::string& token : message->tokens())
+            {
+                LOOLProtocol::getTokenUInt64(token, "size", size) ||
+                    LOOLProtocol::getTokenUInt64(token, "count", count) ||
+                    LOOLProtocol::getTokenUInt64(token, "hits", hits) ||
+                    LOOLProtocol::getTokenUInt64(token, "misses", misses) ||
+                    LOOLProtocol::getTokenUInt64(token, "evictions", evictions);
+            }
+
+            Admin::instance().updatePngCacheStats(_docKey, size, count, hits, misses, evictions);
+        }
 #endif
         else
         {
-            LOG_ERR("Unexpected message: [" << msg << "].");
+            LOG_ERR("Unexpected message: [" << message->abbr() << "].");
             return false;
         }
     }
@@ -1460,6 +1529,98 @@ void DocumentBroker::invalidateTiles(const std::string& tiles)
     _tileCache->invalidateTiles(tiles);
 }
 
+void DocumentBroker::prefetchTiles(const int margin)
+{
+    assertCorrectThread();
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (!_tileCache || !_childProcess || !_tileCache->isCacheEnabled() ||
+        !_tileCache->isRenderingIdle())
+        return;
+
+    // Requested tiles always go first.
+    for (const auto& it : _sessions)
+    {
+        if (!it.second->getRequestedTiles().empty())
+            return;
+    }
+
+    for (const auto& it : _sessions)
+    {
+        const std::shared_ptr<ClientSession>& session = it.second;
+        if (!session->isPrefetchPending())
+            continue;
+
+        session->setPrefetchPending(false);
+
+        std::vector<TileDesc> candidates;
+        session->getPrefetchTiles(margin, candidates);
+
+        std::vector<TileDesc> tiles;
+        for (TileDesc& tile : candidates)
+        {
+            if (_tileCache->hasCachedTile(tile) || _tileCache->hasTileBeingRendered(tile))
+                continue;
+
+            tile.setVersion(++_tileVersion);
+            _tileCache->registerTilePrefetch(tile);
+            tiles.push_back(tile);
+        }
+
+        if (!tiles.empty())
+        {
+            // One view per round, the next one once these are rendered.
+            LOG_TRC("Prefetching " << tiles.size() << " tiles for " << session->getName());
+            sendTileCombinedRequest(TileCombined::create(tiles), std::string());
+            return;
+        }
+    }
+}
+
+void DocumentBroker::sendTileCombinedRequest(const TileCombined& tileCombined, const std::string& suffix)
+{
+    if (_childProcess->acceptsBinaryTiles())
+    {
+        LOG_TRC("Sending to Kit: " << tileCombined.serialize("tilecombinebin", suffix));
+        _childProcess->sendBinaryFrame(tileCombined.serializeBinary("tilecombinebin", suffix));
+    }
+    else
+    {
+        const std::string req = tileCombined.serialize("tilecombine", suffix);
+        LOG_TRC("Sending to Kit: " << req);
+        _childProcess->sendTextFrame(req);
+    }
+}
+
+void DocumentBroker::sendKnownTiles()
+{
+    if (!_childProcess || !_tileCache || _knownTilesSent >= TileStore::getPinnedCount())
+        return;
+
+    std::vector<TileBinaryHash> hashes;
+    TileStore::getPinned(_knownTilesSent, hashes);
+    _knownTilesSent += hashes.size();
+    _tileCache->addKnownTiles(hashes);
+
+    std::ostringstream oss;
+    oss << "knowntiles ";
+    for (size_t i = 0; i < hashes.size(); ++i)
+        oss << (i ? "," : "") << hashes[i];
+
+    LOG_DBG("Telling the Kit of " << hashes.size() << " more shared tiles.");
+    _childProcess->sendTextFrame(oss.str());
+}
+
+void DocumentBroker::cancelTilePrefetches()
+{
+    const std::string canceltiles = _tileCache->cancelPrefetches();
+    if (!canceltiles.empty())
+    {
+        LOG_DBG("Cancelling tile prefetches: " << canceltiles);
+        _childProcess->sendTextFrame(canceltiles);
+    }
+}
+
 void DocumentBroker::handleTileRequest(TileDesc& tile,
                                        const std::shared_ptr<ClientSession>& session)
 {
@@ -1467,17 +1628,22 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
     std::unique_lock<std::mutex> lock(_mutex);
 
     tile.setVersion(++_tileVersion);
-    const std::string tileMsg = tile.serialize();
-    LOG_TRC("Tile request for " << tileMsg);
+    LOG_TRC("Tile request for " << tile.serialize());
 
     TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
     if (cachedTile)
     {
+        cancelTilePrefetches();
+        tile.setImgSize(cachedTile->size());
         const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
         session->sendTile(response, cachedTile);
         return;
     }
 
+    // Wait for the prefetch of the tile, if it is being rendered, the others go.
+    const bool prefetching = _tileCache->takeOverPrefetch(tile);
+    cancelTilePrefetches();
+
     if (tile.getBroadcast())
     {
         for (auto& it: _sessions)
@@ -1491,10 +1657,13 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
         tileCache().subscribeToTileRendering(tile, session);
     }
 
+    if (prefetching)
+        return;
+
     // Forward to child to render.
     LOG_DBG("Sending render request for tile (" << tile.getPart() << ',' <<
             tile.getTilePosX() << ',' << tile.getTilePosY() << ").");
-    const std::string request = "tile " + tileMsg;
+    const std::string request = "tile " + tile.serialize();
     _childProcess->sendTextFrame(request);
     _debugRenderedTileCount++;
 }
@@ -1512,7 +1681,7 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
     {
         tile.setVersion(++_tileVersion);
         TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
-        if(!cachedTile)
+        if (!cachedTile && !_tileCache->takeOverPrefetch(tile))
         {
             // Not cached, needs rendering.
             tilesNeedsRendering.push_back(tile);
@@ -1521,15 +1690,17 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
         }
     }
 
+    // Those requested are taken over above, the other prefetches go.
+    cancelTilePrefetches();
+
     // Send rendering request, prerender before we actually send the tiles
     if (!tilesNeedsRendering.empty())
     {
         TileCombined newTileCombined = TileCombined::create(tilesNeedsRendering);
 
         // Forward to child to render.
-        const std::string req = newTileCombined.serialize("tilecombine");
-        LOG_TRC("Sending uncached residual tilecombine request to Kit: " << req);
-        _childProcess->sendTextFrame(req);
+        LOG_TRC("Sending uncached residual tilecombine request to Kit.");
+        sendTileCombinedRequest(newTileCombined, session->acceptsTileDeltas() ? " deltas=true" : "");
     }
 
     // Accumulate tiles
@@ -1644,28 +1815,12 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
 {
     std::unique_lock<std::mutex> lock(_mutex);
 
-    // How many tiles we have on the visible area, set the upper limit accordingly
-    Util::Rectangle normalizedVisArea = session->getNormalizedVisibleArea();
-
-    float tilesOnFlyUpperLimit = 0;
-    if (normalizedVisArea.hasSurface() && session->getTileWidthInTwips() != 0 && session->getTileHeightInTwips() != 0)
-    {
-        const int tilesFitOnWidth = std::ceil(normalizedVisArea.getRight() / session->getTileWidthInTwips()) -
-                                    std::ceil(normalizedVisArea.getLeft() / session->getTileWidthInTwips()) + 1;
-        const int tilesFitOnHeight = std::ceil(normalizedVisArea.getBottom() / session->getTileHeightInTwips()) -
-                                     std::ceil(normalizedVisArea.getTop() / session->getTileHeightInTwips()) + 1;
-        const int tilesInVisArea = tilesFitOnWidth * tilesFitOnHeight;
-
-        tilesOnFlyUpperLimit = std::max(TILES_ON_FLY_MIN_UPPER_LIMIT, tilesInVisArea * 1.1f);
-    }
-    else
-    {
-        tilesOnFlyUpperLimit = 200; // Have a big number here to get all tiles requested by file opening
-    }
-
     // Drop tiles which we are waiting for too long
     session->removeOutdatedTilesOnFly();
 
+    // As many as the client takes without them queueing up on the way.
+    const size_t tilesOnFlyUpperLimit = session->getTileWindow().getWindow();
+
     // All tiles were processed on client side that we sent last time, so we can send
     // a new batch of tiles which was invalidated / requested in the meantime
     std::deque<TileDesc>& requestedTiles = session->getRequestedTiles();
@@ -1673,6 +1828,8 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
     {
         size_t delayedTiles = 0;
         std::vector<TileDesc> tilesNeedsRendering;
+        std::vector<TileDesc> cachedTiles;
+        std::vector<TileCache::Tile> cachedData;
         size_t beingRendered = _tileCache->countTilesBeingRenderedForSession(session);
         while(session->getTilesOnFlyCount() + beingRendered < tilesOnFlyUpperLimit &&
               !requestedTiles.empty() &&
@@ -1696,9 +1853,9 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
             if (cachedTile)
             {
-                //TODO: Combine the response to reduce latency.
-                const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
-                session->sendTile(response, cachedTile);
+                // Combined in one response below, to reduce latency.
+                cachedTiles.push_back(tile);
+                cachedData.push_back(cachedTile);
             }
             else
             {
@@ -1716,16 +1873,72 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             requestedTiles.pop_front();
         }
 
+        if (!cachedTiles.empty())
+            sendCachedTiles(session, cachedTiles, cachedData);
+
         // Send rendering request for those tiles which were not prerendered
         if (!tilesNeedsRendering.empty())
         {
             TileCombined newTileCombined = TileCombined::create(tilesNeedsRendering);
 
             // Forward to child to render.
-            const std::string req = newTileCombined.serialize("tilecombine");
-            LOG_TRC("Some of the tiles were not prerendered. Sending residual tilecombine: " << req);
-            _childProcess->sendTextFrame(req);
+            LOG_TRC("Some of the tiles were not prerendered. Sending residual tilecombine.");
+            sendTileCombinedRequest(newTileCombined, session->acceptsTileDeltas() ? " deltas=true" : "");
+        }
+    }
+}
+
+void DocumentBroker::sendCachedTiles(const std::shared_ptr<ClientSession>& session,
+                                     const std::vector<TileDesc>& tiles,
+                                     const std::vector<TileCache::Tile>& data)
+{
+    assert(tiles.size() == data.size());
+
+    std::vector<bool> sent(tiles.size(), false);
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        if (sent[i])
+            continue;
+
+        // Previews go alone, the rest together with all those of the same geometry.
+        const TileDesc& first = tiles[i];
+        const bool combine = session->acceptsTileCombined() && first.getId() < 0;
+        std::vector<TileDesc> combined(1, first);
+        std::vector<TileCache::Tile> bodies(1, data[i]);
+        for (size_t j = i + 1; j < tiles.size() && combine; ++j)
+        {
+            const TileDesc& tile = tiles[j];
+            if (!sent[j] && tile.getId() < 0 &&
+                tile.getPart() == first.getPart() &&
+                tile.getWidth() == first.getWidth() &&
+                tile.getHeight() == first.getHeight() &&
+                tile.getTileWidth() == first.getTileWidth() &&
+                tile.getTileHeight() == first.getTileHeight())
+            {
+                combined.push_back(tile);
+                bodies.push_back(data[j]);
+                sent[j] = true;
+            }
         }
+
+        if (combined.size() == 1)
+        {
+            // Sized like the combined ones, for the tile window to account for it.
+            TileDesc tile = first;
+            tile.setImgSize(data[i]->size());
+            const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
+            session->sendTile(response, data[i]);
+            continue;
+        }
+
+        TileCombined tileCombined = TileCombined::create(combined);
+        for (size_t j = 0; j < bodies.size(); ++j)
+            tileCombined.getTiles()[j].setImgSize(bodies[j]->size());
+
+        // The bodies are shared with the cache, only the header is new.
+        const std::string response = tileCombined.serialize("tilecombine:", ADD_DEBUG_RENDERID);
+        LOG_TRC("Sending " << bodies.size() << " cached tiles combined: " << response);
+        session->sendTileCombined(response, bodies);
     }
 }
 
@@ -1783,25 +1996,55 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 
 void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload)
 {
-    const std::string firstLine = getFirstLine(payload);
+    // Only the suffix of the binary form is text, its descriptor may hold a newline.
+    const bool binary = (LOOLProtocol::getFirstToken(payload) == "tilecombinebin:");
+    const std::string firstLine = (binary ? std::string("tilecombinebin:") : getFirstLine(payload));
     LOG_DBG("Handling tile combined: " << firstLine);
 
     try
     {
         const size_t length = payload.size();
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        const char* buffer = payload.data();
+        size_t offset = (binary ? sizeof("tilecombinebin:") : 0);
+        const TileCombined tileCombined = (binary ?
+                                           TileCombined::parseBinary(buffer, length, offset) :
+                                           TileCombined::parse(firstLine));
+        if (binary)
+            LOG_TRC("Binary tile combined: " << tileCombined.serialize("tilecombinebin:"));
+
+        // The tiles follow the newline ending the descriptor.
+        offset = std::find(buffer + offset, buffer + length, '\n') - buffer + 1;
+        if (offset < length)
         {
-            const TileCombined tileCombined = TileCombined::parse(firstLine);
-            const char* buffer = payload.data();
-            size_t offset = firstLine.size() + 1;
-
             std::unique_lock<std::mutex> lock(_mutex);
 
+            std::vector<std::pair<std::shared_ptr<ClientSession>, TileDesc>> needFullTiles;
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
+                if (TileCache::isDelta(buffer + offset, tile.getImgSize()))
+                {
+                    std::vector<std::shared_ptr<ClientSession>> sessions;
+                    tileCache().notifyDelta(tile, buffer + offset, tile.getImgSize(), sessions);
+                    for (const auto& session : sessions)
+                        needFullTiles.emplace_back(session, tile);
+                }
+                else
+                    tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
                 offset += tile.getImgSize();
             }
+
+            lock.unlock();
+
+            // Those not having the tile the delta is against get it all, as a png.
+            for (auto& needFullTile : needFullTiles)
+            {
+                TileDesc& tile = needFullTile.second;
+                tile.setOldWireId(0);
+                tile.setWireId(0);
+                tile.setImgSize(0);
+                TileCombined fullTile = TileCombined::create(std::vector<TileDesc>(1, tile));
+                handleTileCombinedRequest(fullTile, needFullTile.first);
+            }
         }
         else
         {
@@ -1922,8 +2165,10 @@ bool DocumentBroker::forwardToClient(const std::shared_ptr<Message>& payload)
             std::map<std::string, std::shared_ptr<ClientSession>> sessions(_sessions);
             for (const auto& it : _sessions)
             {
+                // Each gets its own copy, as sessions may rewrite it.
                 if (!it.second->inWaitDisconnected())
-                    it.second->handleKitToClientMessage(data, size);
+                    it.second->handleKitToClientMessage(
+                        std::make_shared<Message>(data, size, Message::Dir::Out));
             }
         }
         else
@@ -1934,7 +2179,7 @@ bool DocumentBroker::forwardToClient(const std::shared_ptr<Message>& payload)
                 // Take a ref as the session could be removed from _sessions
                 // if it's the save confirmation keeping a stopped session alive.
                 std::shared_ptr<ClientSession> session = it->second;
-                return session->handleKitToClientMessage(data, size);
+                return session->handleKitToClientMessage(payload);
             }
             else
             {
@@ -2059,23 +2304,221 @@ void DocumentBroker::getIOStats(uint64_t &sent, uint64_t &recv)
 
 static std::atomic<size_t> NumConverters;
 
+namespace
+{
+    /// The conversions waiting for their turn, and how long they, and those of each format, took.
+    struct ConversionQueue
+    {
+        struct Times
+        {
+            Times() : _count(0), _totalMs(0), _maxMs(0) {}
+
+            void add(const std::chrono::steady_clock::duration& duration)
+            {
+                const uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+                ++_count;
+                _totalMs += ms;
+                _maxMs = std::max(_maxMs, ms);
+            }
+
+            void toJSON(std::ostream& oss) const
+            {
+                oss << "{ \"count\": " << _count
+                    << ", \"avgMs\": " << (_count ? _totalMs / _count : 0)
+                    << ", \"maxMs\": " << _maxMs << " }";
+            }
+
+            uint64_t _count;
+            uint64_t _totalMs;
+            uint64_t _maxMs;
+        };
+
+        /// The brokers are kept by DocBrokers, until they are disposed of and leave the queue.
+        struct Job
+        {
+            ConvertToBroker* _broker;
+            std::weak_ptr<ConvertToBroker> _weak;
+            SocketPoll::CallbackFn _convert;
+        };
+
+        ConversionQueue() : _maxRunning(0), _maxQueued(0), _maxDuration(0), _running(0), _refused(0) {}
+
+        std::mutex _mutex;
+        size_t _maxRunning;
+        size_t _maxQueued;
+        std::chrono::seconds _maxDuration;
+        size_t _running;
+        uint64_t _refused;
+        std::deque<Job> _queued;
+        Times _waits;
+        std::map<std::string, Times> _formats;
+    };
+
+    ConversionQueue Conversions;
+
+    /// The format as reported in the stats, where anything odd is counted together.
+    std::string getStatsFormat(const std::string& format)
+    {
+        const bool plain = !format.empty() && format.size() <= 16 &&
+            std::all_of(format.begin(), format.end(), [](char c) { return std::isalnum(c) || c == '-' || c == '_'; });
+        return plain ? format : "other";
+    }
+}
+
 size_t ConvertToBroker::getInstanceCount()
 {
     return NumConverters;
 }
 
+void ConvertToBroker::setLimits(size_t maxRunning, size_t maxQueued, std::chrono::seconds maxDuration)
+{
+    std::unique_lock<std::mutex> lock(Conversions._mutex);
+    Conversions._maxRunning = maxRunning;
+    Conversions._maxQueued = maxQueued;
+    Conversions._maxDuration = maxDuration;
+}
+
+bool ConvertToBroker::isQueueFull()
+{
+    std::unique_lock<std::mutex> lock(Conversions._mutex);
+    if (Conversions._maxRunning == 0 || Conversions._running < Conversions._maxRunning
+        || Conversions._queued.size() < Conversions._maxQueued)
+        return false;
+
+    ++Conversions._refused;
+    return true;
+}
+
+size_t ConvertToBroker::getKitsWanted()
+{
+    std::unique_lock<std::mutex> lock(Conversions._mutex);
+    // Only the next ones to run: there is no point in kits waiting longer than them.
+    return std::min(Conversions._queued.size(), Conversions._maxRunning);
+}
+
+std::string ConvertToBroker::getStatsJSON()
+{
+    std::unique_lock<std::mutex> lock(Conversions._mutex);
+
+    std::ostringstream oss;
+    oss << "{ \"running\": " << Conversions._running
+        << ", \"queued\": " << Conversions._queued.size()
+        << ", \"refused\": " << Conversions._refused
+        << ", \"wait\": ";
+    Conversions._waits.toJSON(oss);
+    oss << ", \"formats\": {";
+    const char* separator = " ";
+    for (const auto& it : Conversions._formats)
+    {
+        oss << separator << '"' << it.first << "\": ";
+        it.second.toJSON(oss);
+        separator = ", ";
+    }
+    oss << " } }";
+
+    return oss.str();
+}
+
 ConvertToBroker::ConvertToBroker(const std::string& uri,
                                  const Poco::URI& uriPublic,
-                                 const std::string& docKey)
+                                 const std::string& docKey,
+                                 const std::string& format)
     : DocumentBroker(uri, uriPublic, docKey)
+    , _format(format)
+    , _queueTime(std::chrono::steady_clock::now())
+    , _running(false)
 {
     NumConverters++;
 }
 
+void ConvertToBroker::startConversion(const SocketPoll::CallbackFn& convert)
+{
+    {
+        std::unique_lock<std::mutex> lock(Conversions._mutex);
+        if (Conversions._maxRunning > 0 && Conversions._running >= Conversions._maxRunning)
+        {
+            LOG_DBG("Conversion of [" << _docKey << "] waits behind " << Conversions._queued.size()
+                    << " others, " << Conversions._running << " running.");
+            Conversions._queued.push_back({ this, std::static_pointer_cast<ConvertToBroker>(shared_from_this()),
+                                            convert });
+            return;
+        }
+
+        ++Conversions._running;
+        _running = true;
+        Conversions._waits.add(std::chrono::steady_clock::duration::zero());
+    }
+
+    runConversion(convert);
+}
+
+void ConvertToBroker::runConversion(const SocketPoll::CallbackFn& convert)
+{
+    _startTime = std::chrono::steady_clock::now();
+    startThread();
+    addCallback(convert);
+}
+
+bool ConvertToBroker::isOverTimeLimit(const std::chrono::steady_clock::time_point& now) const
+{
+    // Set before the thread starts, and not changed after.
+    return _running && Conversions._maxDuration.count() > 0
+        && now - _startTime > Conversions._maxDuration;
+}
+
+void ConvertToBroker::endConversion()
+{
+    std::shared_ptr<ConvertToBroker> next;
+    SocketPoll::CallbackFn convert;
+    {
+        std::unique_lock<std::mutex> lock(Conversions._mutex);
+        if (_running)
+        {
+            _running = false;
+            --Conversions._running;
+            Conversions._formats[getStatsFormat(_format)].add(std::chrono::steady_clock::now() - _startTime);
+        }
+        else
+        {
+            // Gave up while waiting for its turn.
+            for (auto it = Conversions._queued.begin(); it != Conversions._queued.end(); ++it)
+            {
+                if (it->_broker == this)
+                {
+                    Conversions._queued.erase(it);
+                    break;
+                }
+            }
+            return;
+        }
+
+        if (SigUtil::getShutdownRequestFlag() || SigUtil::getTerminationFlag())
+            return;
+
+        while (!next && !Conversions._queued.empty())
+        {
+            next = Conversions._queued.front()._weak.lock();
+            convert = Conversions._queued.front()._convert;
+            Conversions._queued.pop_front();
+        }
+
+        if (!next)
+            return;
+
+        ++Conversions._running;
+        next->_running = true;
+        Conversions._waits.add(std::chrono::steady_clock::now() - next->_queueTime);
+    }
+
+    LOG_DBG("Conversion of [" << next->getDocKey() << "] starts after waiting its turn.");
+    next->runConversion(convert);
+}
+
 void ConvertToBroker::dispose()
 {
     if (!_uriOrig.empty())
     {
+        endConversion();
         NumConverters--;
         removeFile(_uriOrig);
         _uriOrig.clear();
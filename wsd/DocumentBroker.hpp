@@ -67,7 +67,8 @@ public:
         _pid(pid),
         _jailId(jailId),
         _ws(std::make_shared<WebSocketHandler>(socket, request)),
-        _socket(socket)
+        _socket(socket),
+        _acceptsBinaryTiles(false)
     {
         LOG_INF("ChildProcess ctor [" << _pid << "].");
     }
@@ -148,27 +149,20 @@ public:
     Poco::Process::PID getPid() const { return _pid; }
     const std::string& getJailId() const { return _jailId; }
 
+    /// Whether the child takes tilecombinebin, as it said when connecting.
+    bool acceptsBinaryTiles() const { return _acceptsBinaryTiles; }
+    void setAcceptsBinaryTiles(bool accepts) { _acceptsBinaryTiles = accepts; }
+
     /// Send a text payload to the child-process WS.
     bool sendTextFrame(const std::string& data)
     {
-        try
-        {
-            if (_ws)
-            {
-                LOG_TRC("Send DocBroker to Child message: [" << LOOLProtocol::getAbbreviatedMessage(data) << "].");
-                _ws->sendMessage(data);
-                return true;
-            }
-        }
-        catch (const std::exception& exc)
-        {
-            LOG_ERR("Failed to send child [" << _pid << "] data [" <<
-                    LOOLProtocol::getAbbreviatedMessage(data) << "] due to: " << exc.what());
-            throw;
-        }
+        return sendFrame(data, WSOpCode::Text);
+    }
 
-        LOG_WRN("No socket between DocBroker and child to send [" << LOOLProtocol::getAbbreviatedMessage(data) << "]");
-        return false;
+    /// Send a binary payload, text up to its first space, to the child-process WS.
+    bool sendBinaryFrame(const std::string& data)
+    {
+        return sendFrame(data, WSOpCode::Binary);
     }
 
     /// Check whether this child is alive and socket not in error.
@@ -192,11 +186,42 @@ public:
     }
 
 private:
+    static std::string abbreviate(const std::string& data, WSOpCode code)
+    {
+        if (code == WSOpCode::Binary)
+            return LOOLProtocol::getFirstToken(data) + " (" + std::to_string(data.size()) + " bytes)";
+
+        return LOOLProtocol::getAbbreviatedMessage(data);
+    }
+
+    bool sendFrame(const std::string& data, WSOpCode code)
+    {
+        try
+        {
+            if (_ws)
+            {
+                LOG_TRC("Send DocBroker to Child message: [" << abbreviate(data, code) << "].");
+                _ws->sendMessage(data.data(), data.size(), code);
+                return true;
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Failed to send child [" << _pid << "] data [" <<
+                    abbreviate(data, code) << "] due to: " << exc.what());
+            throw;
+        }
+
+        LOG_WRN("No socket between DocBroker and child to send [" << abbreviate(data, code) << "]");
+        return false;
+    }
+
     Poco::Process::PID _pid;
     const std::string _jailId;
     std::shared_ptr<WebSocketHandler> _ws;
     std::shared_ptr<Socket> _socket;
     std::weak_ptr<DocumentBroker> _docBroker;
+    bool _acceptsBinaryTiles;
 };
 
 class ClientSession;
@@ -228,6 +253,9 @@ public:
     /// Called when removed from the DocBrokers list
     virtual void dispose() {}
 
+    /// Whether the broker has been at work for longer than allowed, to stop it.
+    virtual bool isOverTimeLimit(const std::chrono::steady_clock::time_point& /*now*/) const { return false; }
+
     /// Start processing events
     void startThread();
 
@@ -333,7 +361,7 @@ public:
 
     bool isMarkedToDestroy() const { return _markToDestroy || _stop; }
 
-    bool handleInput(const std::vector<char>& payload);
+    bool handleInput(std::vector<char>&& payload);
 
     /// Forward a message from client session to its respective child session.
     bool forwardToChild(const std::string& viewId, const std::string& message);
@@ -415,6 +443,25 @@ private:
     /// Forward a message from child session to its respective client session.
     bool forwardToClient(const std::shared_ptr<Message>& payload);
 
+    /// Sends the tiles found in the cache, in as few tilecombine responses as
+    /// they fit when the client takes those.
+    void sendCachedTiles(const std::shared_ptr<ClientSession>& session,
+                         const std::vector<TileDesc>& tiles,
+                         const std::vector<TileCache::Tile>& data);
+
+    /// Asks the kit, when it has nothing else to render, for the tiles just
+    /// outside the visible area of a view that moved since its last prefetch.
+    void prefetchTiles(int margin);
+
+    /// Drops the prefetches the kit hasn't rendered yet, ahead of real requests.
+    void cancelTilePrefetches();
+
+    /// Tells the Kit the hashes of the tiles pinned since last time, to refer to.
+    void sendKnownTiles();
+
+    /// Sends the tiles to render to the Kit, in the binary form if it takes that.
+    void sendTileCombinedRequest(const TileCombined& tileCombined, const std::string& suffix);
+
     /// The thread function that all of the I/O for all sessions
     /// associated with this document.
     void pollThread();
@@ -482,6 +529,9 @@ private:
     /// painting and invalidation.
     std::atomic<size_t> _tileVersion;
 
+    /// How many of the pinned tiles of the TileStore the Kit knows.
+    size_t _knownTilesSent;
+
     int _debugRenderedTileCount;
 
     std::chrono::steady_clock::time_point _lastActivityTime;
@@ -498,17 +548,50 @@ public:
     /// Construct DocumentBroker with URI and docKey
     ConvertToBroker(const std::string& uri,
                     const Poco::URI& uriPublic,
-                    const std::string& docKey);
+                    const std::string& docKey,
+                    const std::string& format);
     virtual ~ConvertToBroker();
 
     /// Called when removed from the DocBrokers list
     void dispose() override;
 
+    bool isOverTimeLimit(const std::chrono::steady_clock::time_point& now) const override;
+
+    /// Starts the thread and calls convert on it, now if fewer conversions than
+    /// allowed are running, else once one of those is done.
+    void startConversion(const SocketPoll::CallbackFn& convert);
+
     /// How many live conversions are running.
     static size_t getInstanceCount();
 
+    /// Sets the number of conversions running at the same time, 0 for unlimited, the
+    /// number waiting for their turn beyond which they are refused, and the time
+    /// each may take, 0 for unlimited.
+    static void setLimits(size_t maxRunning, size_t maxQueued, std::chrono::seconds maxDuration);
+
+    /// Whether as many conversions wait for their turn as allowed. Counts it as refused if so.
+    static bool isQueueFull();
+
+    /// How many kits the conversions waiting for their turn will need soon.
+    static size_t getKitsWanted();
+
+    /// The queue and the times taken, by format, as JSON.
+    static std::string getStatsJSON();
+
     /// Cleanup path and its parent
     static void removeFile(const std::string &uri);
+
+private:
+    /// Starts the thread and calls convert on it.
+    void runConversion(const SocketPoll::CallbackFn& convert);
+
+    /// Frees the place of the conversion, or its turn, for the next one.
+    void endConversion();
+
+    const std::string _format;
+    std::chrono::steady_clock::time_point _queueTime;
+    std::chrono::steady_clock::time_point _startTime;
+    std::atomic<bool> _running;
 };
 
 #endif
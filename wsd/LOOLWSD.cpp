@@ -125,6 +125,8 @@ using Poco::Net::PartHandler;
 #  include <SslSocket.hpp>
 #endif
 #include "Storage.hpp"
+#include "TileCache.hpp"
+#include "TileDiskCache.hpp"
 #include "TraceFile.hpp"
 #include <Unit.hpp>
 #include <UnitHTTP.hpp>
@@ -231,6 +233,9 @@ static int SimulatedLatencyMs = 0;
 
 #endif
 
+/// The largest message from a client, 0 for unlimited; see net.max_message_size_kb.
+static size_t MaxClientMessageSize = 0;
+
 namespace
 {
 
@@ -297,6 +302,59 @@ void alertAllUsersInternal(const std::string& msg)
 }
 #endif
 
+#if !MOBILEAPP
+/// How long the kits took in each phase of their startup.
+struct KitStartupTime
+{
+    KitStartupTime() : _count(0), _totalMs(0), _maxMs(0) {}
+
+    size_t _count;
+    uint64_t _totalMs;
+    uint64_t _maxMs;
+};
+
+std::mutex KitStartupTimesMutex;
+std::map<std::string, KitStartupTime> KitStartupTimes;
+
+/// Adds the times a new kit reports, as phase:ms,phase:ms,...
+void addKitStartupTimes(const std::string& times)
+{
+    std::lock_guard<std::mutex> lock(KitStartupTimesMutex);
+
+    StringTokenizer phases(times, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    for (const auto& phase : phases)
+    {
+        const size_t colon = phase.find(':');
+        if (colon == std::string::npos || colon == 0)
+            continue;
+
+        const std::string name = phase.substr(0, colon);
+        // Keep the kits from growing this at will.
+        if (KitStartupTimes.size() >= 16 && KitStartupTimes.find(name) == KitStartupTimes.end())
+            continue;
+
+        const uint64_t ms = std::strtoull(phase.c_str() + colon + 1, nullptr, 10);
+        KitStartupTime& time = KitStartupTimes[name];
+        ++time._count;
+        time._totalMs += ms;
+        time._maxMs = std::max(time._maxMs, ms);
+    }
+}
+
+void dumpKitStartupTimes(std::ostream& os)
+{
+    std::lock_guard<std::mutex> lock(KitStartupTimesMutex);
+
+    os << "Kit startup times (ms):\n";
+    for (const auto& it : KitStartupTimes)
+    {
+        os << "  " << it.first << ": count " << it.second._count
+           << ", avg " << it.second._totalMs / it.second._count
+           << ", max " << it.second._maxMs << "\n";
+    }
+}
+#endif
+
 static void checkDiskSpaceAndWarnClients(const bool cacheLastCheck)
 {
 #if !MOBILEAPP
@@ -456,7 +514,9 @@ static bool prespawnChildren()
 {
     // Rebalance if not forking already.
     std::unique_lock<std::mutex> lock(NewChildrenMutex, std::defer_lock);
-    return lock.try_lock() && (rebalanceChildren(LOOLWSD::NumPreSpawnedChildren) > 0);
+    // Have the conversions waiting for their turn find a kit ready too.
+    return lock.try_lock() &&
+        (rebalanceChildren(LOOLWSD::NumPreSpawnedChildren + ConvertToBroker::getKitsWanted()) > 0);
 }
 
 #endif
@@ -494,7 +554,7 @@ std::shared_ptr<ChildProcess> getNewChild_Blocks(
 
 #if !MOBILEAPP
     LOG_DBG("getNewChild: Rebalancing children.");
-    int numPreSpawn = LOOLWSD::NumPreSpawnedChildren;
+    int numPreSpawn = LOOLWSD::NumPreSpawnedChildren + ConvertToBroker::getKitsWanted();
     ++numPreSpawn; // Replace the one we'll dispatch just now.
     if (rebalanceChildren(numPreSpawn) < 0)
     {
@@ -727,6 +787,9 @@ std::chrono::time_point<std::chrono::system_clock> LOOLWSD::StartTime;
 
 static std::string UnitTestLibrary;
 
+/// Whether the server-wide polls, which hold every connection, use epoll.
+static bool UseEpoll = false;
+
 unsigned int LOOLWSD::NumPreSpawnedChildren = 0;
 std::unique_ptr<TraceFileWriter> LOOLWSD::TraceDumper;
 #if !MOBILEAPP
@@ -794,6 +857,9 @@ void LOOLWSD::initialize(Application& self)
         = { { "allowed_languages", "de_DE en_GB en_US es_ES fr_FR it nl pt_BR pt_PT ru" },
             { "admin_console.enable_pam", "false" },
             { "child_root_path", "jails" },
+            { "convert_to.limit_convert_secs", "300" },
+            { "convert_to.max_concurrent", "4" },
+            { "convert_to.max_queued", "100" },
             { "file_server_root_path", "loleaflet/.." },
             { "lo_jail_subpath", "lo" },
             { "logging.anonymize.filenames", "false" }, // Deprecated.
@@ -821,6 +887,8 @@ void LOOLWSD::initialize(Application& self)
             { "loleaflet_html", "loleaflet.html" },
             { "loleaflet_logging", "false" },
             { "net.listen", "any" },
+            { "net.max_message_size_kb", "102400" },
+            { "net.use_epoll", "false" },
             { "net.proto", "all" },
             { "net.service_root", "" },
             { "num_prespawn_children", "1" },
@@ -833,7 +901,11 @@ void LOOLWSD::initialize(Application& self)
             { "per_document.limit_load_secs", "100" },
             { "per_document.limit_stack_mem_kb", "8000" },
             { "per_document.limit_virt_mem_mb", "0" },
-            { "per_document.max_concurrency", "4" },
+            { "per_document.max_concurrency", "0" },
+            { "per_document.png_cache_size_kb", "4096" },
+            { "per_document.png_encoder", "deflate" },
+            { "per_document.png_compression_level", "4" },
+            { "per_document.png_filter", "none" },
             { "per_document.redlining_as_comments", "true" },
             { "per_view.idle_timeout_secs", "900" },
             { "per_view.out_of_focus_timeout_secs", "120" },
@@ -857,6 +929,11 @@ void LOOLWSD::initialize(Application& self)
             { "storage.wopi.max_file_size", "0" },
             { "storage.wopi[@allow]", "true" },
             { "sys_template_path", "systemplate" },
+            { "tile_cache.disk_max_mb", "512" },
+            { "tile_cache.disk_path", "" },
+            { "tile_cache.per_document_max_kb", "65536" },
+            { "tile_cache.prefetch_margin", "0" },
+            { "tile_cache.total_max_mb", "1024" },
             { "trace.path[@compress]", "true" },
             { "trace.path[@snapshot]", "false" },
             { "trace[@enable]", "false" }
@@ -1033,6 +1110,11 @@ void LOOLWSD::initialize(Application& self)
     while (ServiceRoot.length() > 0 && ServiceRoot[ServiceRoot.length() - 1] == '/')
         ServiceRoot.pop_back();
 
+    // The largest request or WebSocket message a client may send.
+    MaxClientMessageSize = static_cast<size_t>(getConfigValue<unsigned int>(conf, "net.max_message_size_kb", 102400)) * 1024;
+
+    UseEpoll = getConfigValue<bool>(conf, "net.use_epoll", false);
+
 #if ENABLE_SSL
     LOOLWSD::SSLEnabled.set(getConfigValue<bool>(conf, "ssl.enable", true));
 #endif
@@ -1070,12 +1152,21 @@ void LOOLWSD::initialize(Application& self)
     LOG_INF("NumPreSpawnedChildren set to " << NumPreSpawnedChildren << ".");
 
 #if !MOBILEAPP
-    const auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
+    const auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 0);
     if (maxConcurrency > 0)
     {
         setenv("MAX_CONCURRENCY", std::to_string(maxConcurrency).c_str(), 1);
+        LOG_INF("MAX_CONCURRENCY set to " << maxConcurrency << ".");
     }
-    LOG_INF("MAX_CONCURRENCY set to " << maxConcurrency << ".");
+    else
+        LOG_INF("MAX_CONCURRENCY unset, the kits use the available CPUs.");
+
+    // The kits read these, see Png::readEncoderOptions().
+    setenv("LOOL_PNG_ENCODER", getConfigValue<std::string>(conf, "per_document.png_encoder", "deflate").c_str(), 1);
+    setenv("LOOL_PNG_LEVEL", std::to_string(getConfigValue<int>(conf, "per_document.png_compression_level", 4)).c_str(), 1);
+    setenv("LOOL_PNG_FILTER", getConfigValue<std::string>(conf, "per_document.png_filter", "none").c_str(), 1);
+    // See PngCache::readCacheSize().
+    setenv("LOOL_PNG_CACHE_SIZE_KB", std::to_string(getConfigValue<int>(conf, "per_document.png_cache_size_kb", 4096)).c_str(), 1);
 #endif
 
     const auto redlining = getConfigValue<bool>(conf, "per_document.redlining_as_comments", true);
@@ -1088,6 +1179,26 @@ void LOOLWSD::initialize(Application& self)
     // Otherwise we profile the soft-device at jail creation time.
     setenv("SAL_DISABLE_OPENCL", "true", 1);
 
+    const auto tileCacheTotalMaxMb = getConfigValue<int>(conf, "tile_cache.total_max_mb", 1024);
+    TileCache::setMaxTotalCacheSize(std::max(tileCacheTotalMaxMb, 0) * 1024UL * 1024);
+    LOG_INF("Tile cache limited to " << tileCacheTotalMaxMb << " MB across all documents.");
+
+    const std::string tileCacheDiskPath = getPathFromConfig("tile_cache.disk_path");
+    if (!tileCacheDiskPath.empty() && getConfigValue<bool>(conf, "tile_cache_persistent", true))
+    {
+        const auto tileCacheDiskMaxMb = getConfigValue<int>(conf, "tile_cache.disk_max_mb", 512);
+        TileDiskCache::initialize(tileCacheDiskPath, std::max(tileCacheDiskMaxMb, 0) * 1024UL * 1024);
+        LOG_INF("Tiles kept on disk in [" << tileCacheDiskPath << "], up to " << tileCacheDiskMaxMb << " MB.");
+    }
+
+    const auto convertMaxConcurrent = getConfigValue<int>(conf, "convert_to.max_concurrent", 4);
+    const auto convertMaxQueued = getConfigValue<int>(conf, "convert_to.max_queued", 100);
+    const auto convertLimitSecs = getConfigValue<int>(conf, "convert_to.limit_convert_secs", 300);
+    ConvertToBroker::setLimits(std::max(convertMaxConcurrent, 0), std::max(convertMaxQueued, 0),
+                               std::chrono::seconds(std::max(convertLimitSecs, 0)));
+    LOG_INF("Conversions limited to " << convertMaxConcurrent << " at a time, " << convertMaxQueued
+            << " waiting, " << convertLimitSecs << " secs each.");
+
     // Log the connection and document limits.
     LOOLWSD::MaxConnections = MAX_CONNECTIONS;
     LOOLWSD::MaxDocuments = MAX_DOCUMENTS;
@@ -1885,6 +1996,7 @@ private:
             const Poco::URI::QueryParameters params = requestURI.getQueryParameters();
             int pid = socket->getPid();
             std::string jailId;
+            bool binaryTiles = false;
             for (const auto& param : params)
             {
                 if (param.first == "jailid")
@@ -1892,6 +2004,15 @@ private:
 
                 else if (param.first == "version")
                     LOOLWSD::LOKitVersion = param.second;
+
+                else if (param.first == "binarytiles")
+                    binaryTiles = (param.second == "true");
+
+                else if (param.first == "startup")
+                {
+                    LOG_INF("Child [" << socket->getPid() << "] startup took (ms) " << param.second << ".");
+                    addKitStartupTimes(param.second);
+                }
             }
 
             if (pid <= 0)
@@ -1914,11 +2035,13 @@ private:
 #else
             Poco::Process::PID pid = 100;
             std::string jailId = "jail";
+            const bool binaryTiles = false;
             socket->getInBuffer().clear();
 #endif
             LOG_TRC("Calling make_shared<ChildProcess>, for NewChildren?");
 
             auto child = std::make_shared<ChildProcess>(pid, jailId, socket, request);
+            child->setAcceptsBinaryTiles(binaryTiles);
 
             _childProcess = child; // weak
 
@@ -1943,20 +2066,19 @@ private:
         if (UnitWSD::get().filterChildMessage(data))
             return;
 
-        const std::string abbr = getAbbreviatedMessage(data);
         std::shared_ptr<StreamSocket> socket = getSocket().lock();
         if (socket)
-            LOG_TRC("#" << socket->getFD() << " Prisoner message [" << abbr << "].");
+            LOG_TRC("#" << socket->getFD() << " Prisoner message [" << getAbbreviatedMessage(data) << "].");
         else
             LOG_WRN("Message handler called but without valid socket.");
 
         std::shared_ptr<ChildProcess> child = _childProcess.lock();
         std::shared_ptr<DocumentBroker> docBroker = child ? child->getDocumentBroker() : nullptr;
         if (docBroker)
-            docBroker->handleInput(data);
+            docBroker->handleInput(std::move(data));
         else
             LOG_WRN("Child " << child->getPid() <<
-                    " has no DocumentBroker to handle message: [" << abbr << "].");
+                    " has no DocumentBroker to handle message: [" << getAbbreviatedMessage(data) << "].");
     }
 
     int getPollEvents(std::chrono::steady_clock::time_point /* now */,
@@ -2541,6 +2663,22 @@ private:
                 return;
             }
 
+            // Refuse before taking the upload, when too many conversions wait already.
+            if (ConvertToBroker::isQueueFull())
+            {
+                LOG_WRN("Conversion refused, too many waiting.");
+                std::ostringstream oss;
+                oss << "HTTP/1.1 503\r\n"
+                    "Date: " << Util::getHttpTimeNow() << "\r\n"
+                    "User-Agent: " HTTP_AGENT_STRING "\r\n"
+                    "Retry-After: 1\r\n"
+                    "Content-Length: 0\r\n"
+                    "\r\n";
+                socket->send(oss.str());
+                socket->shutdown();
+                return;
+            }
+
             ConvertToPartHandler handler(/*convertTo =*/ true);
             HTMLForm form(request, message, handler);
 
@@ -2575,7 +2713,7 @@ private:
                     std::unique_lock<std::mutex> docBrokersLock(DocBrokersMutex);
 
                     LOG_DBG("New DocumentBroker for docKey [" << docKey << "].");
-                    auto docBroker = std::make_shared<ConvertToBroker>(fromPath, uriPublic, docKey);
+                    auto docBroker = std::make_shared<ConvertToBroker>(fromPath, uriPublic, docKey, format);
                     handler.takeFile();
 
                     cleanupDocBrokers();
@@ -2596,32 +2734,36 @@ private:
                     {
                         // Perform all of this after removing the socket
 
-                        // Make sure the thread is running before adding callback.
-                        docBroker->startThread();
-
                         // We no longer own this socket.
                         moveSocket->setThreadOwner(std::thread::id(0));
 
-                        docBroker->addCallback([docBroker, moveSocket, clientSession, format, sOptions]()
+                        // Starts the thread and calls back now, or once there is room for another conversion.
+                        // The queue must not keep the broker alive once it is disposed of.
+                        std::weak_ptr<ConvertToBroker> weakBroker = docBroker;
+                        docBroker->startConversion([weakBroker, moveSocket, clientSession, format, sOptions]()
                         {
+                            std::shared_ptr<ConvertToBroker> broker = weakBroker.lock();
+                            if (!broker)
+                                return;
+
                             auto streamSocket = std::static_pointer_cast<StreamSocket>(moveSocket);
                             clientSession->setSaveAsSocket(streamSocket);
 
                             // Move the socket into DocBroker.
-                            docBroker->addSocketToPoll(moveSocket);
+                            broker->addSocketToPoll(moveSocket);
 
                             // First add and load the session.
-                            docBroker->addSession(clientSession);
+                            broker->addSession(clientSession);
 
                             // Load the document manually and request saving in the target format.
                             std::string encodedFrom;
-                            URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
+                            URI::encode(broker->getPublicUri().getPath(), "", encodedFrom);
                             const std::string load = "load url=" + encodedFrom;
                             std::vector<char> loadRequest(load.begin(), load.end());
                             clientSession->handleMessage(true, WSOpCode::Text, loadRequest);
 
                             // FIXME: Check for security violations.
-                            Path toPath(docBroker->getPublicUri().getPath());
+                            Path toPath(broker->getPublicUri().getPath());
                             toPath.setExtension(format);
                             const std::string toJailURL = "file://" + std::string(JAILED_DOCUMENT_ROOT) + toPath.getFileName();
                             std::string encodedTo;
@@ -3049,9 +3191,10 @@ class PlainSocketFactory final : public SocketFactory
         if (SimulatedLatencyMs > 0)
             fd = Delay::create(SimulatedLatencyMs, physicalFd);
 #endif
-        std::shared_ptr<Socket> socket =
+        std::shared_ptr<StreamSocket> socket =
             StreamSocket::create<StreamSocket>(
                 fd, false, std::make_shared<ClientRequestDispatcher>());
+        socket->setMaxMessageSize(MaxClientMessageSize);
 
         return socket;
     }
@@ -3069,8 +3212,12 @@ class SslSocketFactory final : public SocketFactory
             fd = Delay::create(SimulatedLatencyMs, physicalFd);
 #endif
 
-        return StreamSocket::create<SslStreamSocket>(
-            fd, false, std::make_shared<ClientRequestDispatcher>());
+        std::shared_ptr<StreamSocket> socket =
+            StreamSocket::create<SslStreamSocket>(
+                fd, false, std::make_shared<ClientRequestDispatcher>());
+        socket->setMaxMessageSize(MaxClientMessageSize);
+
+        return socket;
     }
 };
 #endif
@@ -3105,6 +3252,7 @@ public:
 
     void startPrisoners()
     {
+        PrisonerPoll.setUseEpoll(UseEpoll);
         PrisonerPoll.startThread();
         PrisonerPoll.insertNewSocket(findPrisonerServerPort());
     }
@@ -3116,6 +3264,7 @@ public:
 
     void start(const int port)
     {
+        _acceptPoll.setUseEpoll(UseEpoll);
         _acceptPoll.startThread();
         std::shared_ptr<ServerSocket> serverSocket(findServerPort(port));
         _acceptPoll.insertNewSocket(serverSocket);
@@ -3124,9 +3273,11 @@ public:
         loolwsd_server_socket_fd = serverSocket->getFD();
 #endif
 
+        WebServerPoll.setUseEpoll(UseEpoll);
         WebServerPoll.startThread();
 
 #if !MOBILEAPP
+        Admin::instance().setUseEpoll(UseEpoll);
         Admin::instance().start();
 #endif
     }
@@ -3173,6 +3324,8 @@ public:
 
         // If we have any delaying work going on.
         Delay::dumpState(os);
+
+        dumpKitStartupTimes(os);
 #endif
 
         os << "Document Broker polls "
@@ -3180,6 +3333,7 @@ public:
         for (auto &i : DocBrokers)
             i.second->dumpState(os);
         os << "Converter count: " << ConvertToBroker::getInstanceCount() << "\n";
+        os << "Conversions: " << ConvertToBroker::getStatsJSON() << "\n";
 
         Socket::InhibitThreadChecks = false;
         SocketPoll::InhibitThreadChecks = false;
@@ -3519,6 +3673,9 @@ int LOOLWSD::innerMain()
 
     DocBrokers.clear();
 
+    // Write the tiles of the documents closed.
+    TileDiskCache::shutdown();
+
 #if !defined(KIT_IN_PROCESS) && !MOBILEAPP
     // Terminate child processes
     LOG_INF("Requesting forkit process " << ForKitProcId << " to terminate.");
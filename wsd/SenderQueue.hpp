@@ -10,11 +10,16 @@
 #ifndef INCLUDED_SENDERQUEUE_HPP
 #define INCLUDED_SENDERQUEUE_HPP
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <Poco/Dynamic/Var.h>
@@ -27,23 +32,64 @@
 #include "TileDesc.hpp"
 
 /// A queue of data to send to certain Session's WS.
+/// Messages that make an earlier queued one obsolete (a newer version of
+/// the same tile, cursor position of the same view etc.) replace it; those
+/// are found by their key via an index instead of parsing the whole queue.
 template <typename Item>
 class SenderQueue final
 {
 public:
 
     SenderQueue()
+        : _frontSeq(0)
+        , _size(0)
+        , _maxSize(0)
+        , _dequeued(0)
+        , _superseded(0)
+        , _totalWaitUs(0)
+        , _maxWaitUs(0)
     {
     }
 
     size_t enqueue(const Item& item)
     {
+        // Outside of the lock, that's the expensive part.
+        std::string baseKey;
+        std::string key = getKey(item, baseKey);
+
         std::unique_lock<std::mutex> lock(_mutex);
 
-        if (!SigUtil::getTerminationFlag() && deduplicate(item))
-            _queue.push_back(item);
+        if (!SigUtil::getTerminationFlag())
+        {
+            // The item needs the queued one it is based on: keep that from being replaced.
+            if (!baseKey.empty())
+                _index.erase(baseKey);
+
+            if (!key.empty())
+            {
+                // Remove previous identical entry, if any, and use most recent (incoming).
+                const auto it = _index.find(key);
+                if (it != _index.end())
+                {
+                    Entry& entry = _queue[it->second - _frontSeq];
+                    LOG_TRC("SenderQueue: replacing " << entry._item->abbr() << " by " << item->abbr());
+                    entry._item = Item();
+                    --_size;
+                    ++_superseded;
+                    it->second = _frontSeq + _queue.size();
+                }
+                else
+                {
+                    _index.emplace(key, _frontSeq + _queue.size());
+                }
+            }
 
-        return _queue.size();
+            _queue.emplace_back(item, std::move(key));
+            ++_size;
+            _maxSize = std::max(_maxSize, _size);
+        }
+
+        return _size;
     }
 
     /// Dequeue an item if we have one - @returns true if we do, else false.
@@ -51,10 +97,28 @@ public:
     {
         std::unique_lock<std::mutex> lock(_mutex);
 
+        popSuperseded();
         if (!_queue.empty() && !SigUtil::getTerminationFlag())
         {
-            item = _queue.front();
+            Entry& entry = _queue.front();
+            item = entry._item;
+            if (!entry._key.empty())
+            {
+                // Unless a later item of the same key is indexed already.
+                const auto it = _index.find(entry._key);
+                if (it != _index.end() && it->second == _frontSeq)
+                    _index.erase(it);
+            }
+
+            const uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - entry._enqueued).count();
+            _totalWaitUs += waitUs;
+            _maxWaitUs = std::max(_maxWaitUs, waitUs);
+            ++_dequeued;
+
             _queue.pop_front();
+            ++_frontSeq;
+            --_size;
             return true;
         }
         else
@@ -68,92 +132,144 @@ public:
     size_t size() const
     {
         std::lock_guard<std::mutex> lock(_mutex);
-        return _queue.size();
+        return _size;
+    }
+
+    /// The largest the queue has been.
+    size_t getMaxSize() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _maxSize;
+    }
+
+    /// The mean time the dequeued items spent in the queue.
+    uint64_t getMeanWaitUs() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dequeued ? _totalWaitUs / _dequeued : 0;
     }
 
     void dumpState(std::ostream& os)
     {
-        os << "\n\t\tqueue size " << _queue.size() << "\n";
         std::lock_guard<std::mutex> lock(_mutex);
-        for (const Item &item : _queue)
+        os << "\n\t\tqueue size " << _size << " (max " << _maxSize << ")"
+           << ", dequeued " << _dequeued << ", superseded " << _superseded
+           << ", time in queue mean " << (_dequeued ? _totalWaitUs / _dequeued : 0)
+           << "us max " << _maxWaitUs << "us\n";
+        for (const Entry &entry : _queue)
         {
-            os << "\t\t\ttype: " << (item->isBinary() ? "binary" : "text") << "\n";
-            os << "\t\t\t" << item->abbr() << "\n";
+            if (!entry._item)
+                continue;
+
+            os << "\t\t\ttype: " << (entry._item->isBinary() ? "binary" : "text") << "\n";
+            os << "\t\t\t" << entry._item->abbr() << "\n";
         }
     }
 
 private:
-    /// Deduplicate messages based on the new one.
-    /// Returns true if the new message should be
-    /// enqueued, otherwise false.
-    bool deduplicate(const Item& item)
+    struct Entry
+    {
+        Entry(const Item& item, std::string&& key)
+            : _item(item)
+            , _key(std::move(key))
+            , _enqueued(std::chrono::steady_clock::now())
+        {
+        }
+
+        /// Empty when replaced by a later item of the same key.
+        Item _item;
+        std::string _key;
+        std::chrono::steady_clock::time_point _enqueued;
+    };
+
+    /// Whether the body of the tile: message is a delta, applied to the tile the client has.
+    static bool isTileDelta(const Item& item)
     {
-        // Deduplicate messages based on the incoming one.
-        const std::string command = item->firstToken();
+        const size_t bodyOffset = item->firstLine().size() + 1;
+        const std::vector<char>& data = item->data();
+        if (data.size() > bodyOffset)
+            return data[bodyOffset] == 'D';
+
+        for (const auto& body : item->bodies())
+        {
+            if (!body->empty())
+                return body->front() == 'D';
+        }
+
+        return false;
+    }
+
+    /// What identifies the messages the item makes obsolete,
+    /// empty if it doesn't make any obsolete.
+    /// baseKey is that of the queued messages the item needs to be sent before it,
+    /// which must not be replaced from now on, empty if none.
+    static std::string getKey(const Item& item, std::string& baseKey)
+    {
+        const std::string& command = item->firstToken();
         if (command == "tile:")
         {
-            // Remove previous identical tile, if any, and use most recent (incoming).
-            const TileDesc newTile = TileDesc::parse(item->firstLine());
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&newTile](const queue_item_t& cur)
-                {
-                    return cur->firstToken() == "tile:" &&
-                           newTile == TileDesc::parse(cur->firstLine());
-                });
+            // The same tile, ignoring the version.
+            const TileDesc tile = TileDesc::parse(item->firstLine());
+            std::ostringstream oss;
+            oss << command << ' ' << tile.getPart() << ':' << tile.getWidth() << ':' << tile.getHeight()
+                << ':' << tile.getTilePosX() << ':' << tile.getTilePosY()
+                << ':' << tile.getTileWidth() << ':' << tile.getTileHeight()
+                << ':' << tile.getId() << ':' << tile.getBroadcast();
+            if (!isTileDelta(item))
+                return oss.str();
 
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            // A delta only replaces the very same delta: it is based on the tile
+            // queued before it, and the next ones on it in turn.
+            baseKey = oss.str();
+            oss << ':' << tile.getOldWireId() << ':' << tile.getWireId();
+            return oss.str();
         }
         else if (command == "statusindicatorsetvalue:" ||
                  command == "invalidatecursor:" ||
                  command == "setpart:")
         {
-            // Remove previous identical enties of this command,
-            // if any, and use most recent (incoming).
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&command](const queue_item_t& cur)
-                {
-                    return cur->firstToken() == command;
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            return command;
         }
         else if (command == "invalidateviewcursor:")
         {
-            // Remove previous cursor invalidation for same view,
-            // if any, and use most recent (incoming).
-            const std::string newMsg = item->jsonString();
-            Poco::JSON::Parser newParser;
-            const Poco::Dynamic::Var newResult = newParser.parse(newMsg);
-            const auto& newJson = newResult.extract<Poco::JSON::Object::Ptr>();
-            const std::string viewId = newJson->get("viewId").toString();
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [command, viewId](const queue_item_t& cur)
-                {
-                    if (cur->firstToken() == command)
-                    {
-                        const std::string msg = cur->jsonString();
-                        Poco::JSON::Parser parser;
-                        const Poco::Dynamic::Var result = parser.parse(msg);
-                        const auto& json = result.extract<Poco::JSON::Object::Ptr>();
-                        return viewId == json->get("viewId").toString();
-                    }
-
-                    return false;
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            // The cursor invalidation of the same view.
+            Poco::JSON::Parser parser;
+            const Poco::Dynamic::Var result = parser.parse(item->jsonString());
+            const auto& json = result.extract<Poco::JSON::Object::Ptr>();
+            return command + ' ' + json->get("viewId").toString();
         }
 
-        return true;
+        return std::string();
+    }
+
+    /// Drop the replaced items from the front.
+    void popSuperseded()
+    {
+        while (!_queue.empty() && !_queue.front()._item)
+        {
+            _queue.pop_front();
+            ++_frontSeq;
+        }
     }
 
 private:
     mutable std::mutex _mutex;
-    std::deque<Item> _queue;
-    typedef typename std::deque<Item>::value_type queue_item_t;
+
+    /// The items in the order of arrival, the replaced ones left in place
+    /// until they get to the front, so the positions in _index stay valid.
+    std::deque<Entry> _queue;
+    /// The sequence number of the front of _queue.
+    uint64_t _frontSeq;
+    /// The sequence number of the queued item for each key.
+    std::unordered_map<std::string, uint64_t> _index;
+    /// The number of items not replaced.
+    size_t _size;
+
+    size_t _maxSize;
+    uint64_t _dequeued;
+    uint64_t _superseded;
+    uint64_t _totalWaitUs;
+    uint64_t _maxWaitUs;
 };
 
 #endif
@@ -21,6 +21,8 @@ void DocumentBroker::assertCorrectThread() const {}
 
 void ClientSession::traceTileBySend(const TileDesc& /*tile*/, bool /*deduplicated = false*/) {}
 
+bool ClientSession::canApplyTileDelta(const TileDesc& /*tile*/) const { return false; }
+
 void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& /*data*/) {};
 
 ClientSession::~ClientSession() {}
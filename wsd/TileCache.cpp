@@ -11,18 +11,21 @@
 
 #include "TileCache.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdio>
 #include <cstddef>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include "ClientSession.hpp"
+#include "TileDiskCache.hpp"
 #include <Common.hpp>
 #include <Protocol.hpp>
 #include <Unit.hpp>
@@ -31,12 +34,42 @@
 
 using namespace LOOLProtocol;
 
+std::atomic<size_t> TileCache::TotalCacheSize(0);
+std::atomic<size_t> TileCache::MaxTotalCacheSize(0);
+std::atomic<size_t> TileCache::NumCaches(0);
+
+std::mutex TileStore::Mutex;
+std::unordered_map<TileBinaryHash, TileStore::Entry> TileStore::Tiles;
+size_t TileStore::SweptCount(0);
+std::vector<TileCache::Tile> TileStore::PinnedTiles;
+std::vector<TileBinaryHash> TileStore::PinnedHashes;
+
+/// A tile stored this many times, by more than one document, is pinned, if there is room.
+static const size_t TilePinUses = 8;
+/// Pinned tiles are small, blank or repeated backgrounds, and few.
+static const size_t MaxPinnedTiles = 256;
+static const size_t MaxPinnedTileSize = 16 * 1024;
+
+/// How many of the least recently used tiles to consider when picking one to evict.
+/// The largest of these goes first, so we free the most memory for the least recency lost.
+static const size_t EvictionSampleSize = 4;
+
 TileCache::TileCache(const std::string& docURL,
                      const std::chrono::system_clock::time_point& modifiedTime,
                      bool dontCache) :
     _docURL(docURL),
-    _dontCache(dontCache)
+    _storeOwner(std::hash<std::string>()(docURL)),
+    _dontCache(dontCache),
+    _cacheSize(0),
+    _maxCacheSize(0),
+    _cacheHits(0),
+    _cacheMisses(0),
+    _cacheEvictions(0),
+    _tilesPrefetched(0),
+    _prefetchHits(0),
+    _persistedHits(0)
 {
+    ++NumCaches;
 #ifndef BUILDING_TESTS
     LOG_INF("TileCache ctor for uri [" << LOOLWSD::anonymizeUrl(_docURL) <<
             "], modifiedTime=" << std::chrono::duration_cast<std::chrono::seconds>
@@ -48,6 +81,8 @@ TileCache::TileCache(const std::string& docURL,
 TileCache::~TileCache()
 {
     _owner = std::thread::id();
+    TotalCacheSize -= _cacheSize;
+    --NumCaches;
 #ifndef BUILDING_TESTS
     LOG_INF("~TileCache dtor for uri [" << LOOLWSD::anonymizeUrl(_docURL) << "].");
 #endif
@@ -56,23 +91,62 @@ TileCache::~TileCache()
 void TileCache::clear()
 {
     _cache.clear();
+    _lru.clear();
+    _tileGrids.clear();
+    TotalCacheSize -= _cacheSize;
+    _cacheSize = 0;
     for (auto i : _streamCache)
         i.clear();
+    _persisted.reset();
     LOG_INF("Completely cleared tile cache for: " << _docURL);
 }
 
+void TileCache::openPersisted(const std::string& docKey, const std::chrono::system_clock::time_point& modifiedTime)
+{
+    // Without a modified time we can't tell whether they are of this document.
+    if (_dontCache || !TileDiskCache::isEnabled() ||
+        modifiedTime == std::chrono::system_clock::time_point())
+        return;
+
+    _persistedDocKey = docKey;
+    _persisted = TileDiskCache::open(docKey, modifiedTime);
+}
+
+void TileCache::persist(const std::chrono::system_clock::time_point& modifiedTime)
+{
+    assertCorrectThread();
+
+    if (_persistedDocKey.empty() || modifiedTime == std::chrono::system_clock::time_point())
+        return;
+
+    // Only references to the tiles, which are immutable; the I/O thread writes them.
+    TileDiskCache::Tiles tiles;
+    tiles.reserve(_cache.size());
+    for (const TileCacheDesc* desc : _lru)
+        tiles.emplace_back(*desc, _cache.find(*desc)->second._tile);
+
+    TileDiskCache::save(_persistedDocKey, modifiedTime, std::move(tiles), _persisted);
+    _persisted.reset();
+}
+
 /// Tracks the rendering of a given tile
 /// to avoid duplication and help clock
 /// rendering latency.
 struct TileCache::TileBeingRendered
 {
-    TileBeingRendered(const TileDesc& tile)
+    TileBeingRendered(const TileDesc& tile, bool prefetch = false)
      : _startTime(std::chrono::steady_clock::now()),
-       _tile(tile)
+       _tile(tile),
+       _prefetch(prefetch)
     {
     }
 
     const TileDesc& getTile() const { return _tile; }
+
+    /// Rendered ahead of any request, until somebody subscribes.
+    bool isPrefetch() const { return _prefetch; }
+    void setPrefetch(bool prefetch) { _prefetch = prefetch; }
+
     int getVersion() const { return _tile.getVersion(); }
     void setVersion(int version) { _tile.setVersion(version); }
 
@@ -87,6 +161,7 @@ private:
     std::vector<std::weak_ptr<ClientSession>> _subscribers;
     std::chrono::steady_clock::time_point _startTime;
     TileDesc _tile;
+    bool _prefetch;
 };
 
 size_t TileCache::countTilesBeingRenderedForSession(const std::shared_ptr<ClientSession>& session)
@@ -154,6 +229,13 @@ TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
         return TileCache::Tile();
 
     TileCache::Tile ret = findTile(tile);
+    if (!ret && _persisted)
+        ret = findPersistedTile(tile);
+
+    if (ret)
+        ++_cacheHits;
+    else
+        ++_cacheMisses;
 
     UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
                               tile.getTilePosX(), tile.getTilePosY(),
@@ -168,13 +250,37 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
 
     std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
 
-    // Save to disk.
+    // The one copy of the tile data, shared by the cache and all the subscribers,
+    // and by the caches of other documents having the same tile.
+    Tile tileData;
+    if (TileRef::isRef(data, size))
+    {
+        const TileBinaryHash hash = TileRef::parse(data);
+        if (_knownTiles.find(hash) != _knownTiles.end())
+            tileData = TileStore::findPinned(hash);
+        if (!tileData)
+        {
+            // It will get re-issued as we don't forget it.
+            LOG_ERR("Unknown tile reference " << hash << " for: " << cacheFileName(tile));
+            return;
+        }
+    }
+    else
+        tileData = TileStore::intern(data, size, _storeOwner);
 
     // Ignore if we can't save the tile, things will work anyway, but slower.
     // An error indication is supposed to be sent to all users in that case.
-    saveDataToCache(tile, data, size);
+    saveDataToCache(tile, tileData);
     LOG_TRC("Saved cache tile: " << cacheFileName(tile) << " of size " << size << " bytes");
 
+    if (tileBeingRendered && tileBeingRendered->isPrefetch())
+    {
+        auto it = _cache.find(tile);
+        if (it != _cache.end())
+            it->second._prefetched = true;
+        ++_tilesPrefetched;
+    }
+
     // Notify subscribers, if any.
     if (tileBeingRendered)
     {
@@ -185,11 +291,7 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
             LOG_DBG("Sending tile message to " << subscriberCount << " subscribers: " << response);
 
             // Send to first subscriber as-is (without cache marker).
-            auto payload = std::make_shared<Message>(response,
-                                                     Message::Dir::Out,
-                                                     response.size() + 1 + size);
-            payload->append("\n", 1);
-            payload->append(data, size);
+            auto payload = std::make_shared<Message>(response + '\n', tileData, Message::Dir::Out);
 
             auto& firstSubscriber = tileBeingRendered->getSubscribers()[0];
             std::shared_ptr<ClientSession> firstSession = firstSubscriber.lock();
@@ -203,12 +305,8 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
                 // All others must get served from the cache.
                 response += " renderid=cached\n";
 
-                // Create a new Payload.
-                payload.reset();
-                payload = std::make_shared<Message>(response,
-                                                    Message::Dir::Out,
-                                                    response.size() + size);
-                payload->append(data, size);
+                // Create a new Payload, with the same data.
+                payload = std::make_shared<Message>(response, tileData, Message::Dir::Out);
 
                 for (size_t i = 1; i < subscriberCount; ++i)
                 {
@@ -240,6 +338,45 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
     }
 }
 
+void TileCache::notifyDelta(const TileDesc& tile, const char* data, const size_t size,
+                            std::vector<std::shared_ptr<ClientSession>>& needFullTile)
+{
+    assertCorrectThread();
+
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    if (!tileBeingRendered)
+    {
+        LOG_DBG("No subscribers for delta: " << cacheFileName(tile));
+        return;
+    }
+
+    const std::string response = tile.serialize("tile:") + '\n';
+    std::shared_ptr<Message> payload;
+    const bool done = tileBeingRendered->getVersion() <= tile.getVersion();
+    for (const auto& subscriber : tileBeingRendered->getSubscribers())
+    {
+        std::shared_ptr<ClientSession> session = subscriber.lock();
+        if (!session)
+            continue;
+
+        if (session->canApplyTileDelta(tile))
+        {
+            if (!payload)
+                payload = std::make_shared<Message>(response, std::make_shared<const std::vector<char>>(data, data + size),
+                                                    Message::Dir::Out);
+            session->enqueueSendMessage(payload);
+        }
+        else if (done)
+            needFullTile.push_back(session);
+    }
+
+    LOG_DBG("Sent delta of " << size << " bytes, " << needFullTile.size() <<
+            " subscribers need the whole tile: " << response);
+
+    if (done)
+        forgetTileBeingRendered(tileBeingRendered);
+}
+
 bool TileCache::getTextStream(StreamType type, const std::string& fileName, std::string& content)
 {
     Tile textStream = lookupCachedStream(type, fileName);
@@ -296,15 +433,101 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
 
     assertCorrectThread();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
+    if (_persisted)
+        _persisted->invalidate(part, x, y, width, height);
+
+    std::vector<const TileCacheDesc*> tiles;
+    for (const auto& grid : _tileGrids)
+    {
+        if (part == -1 || std::get<0>(grid.first) == part)
+            findIntersectingTiles(grid.first, grid.second, x, y, width, height, tiles);
+    }
+
+    for (const TileCacheDesc* desc : tiles)
     {
-        if (intersectsTile(it->first, part, x, y, width, height))
+        LOG_TRC("Removing tile: " << desc->serialize());
+        removeTile(_cache.find(*desc));
+    }
+}
+
+void TileCache::findIntersectingTiles(const TileGridKey& key, const TileGrid& grid,
+                                      int x, int y, int width, int height,
+                                      std::vector<const TileCacheDesc*>& tiles) const
+{
+    const int64_t tileWidth = std::get<1>(key);
+    const int64_t tileHeight = std::get<2>(key);
+
+    // A tile at pos intersects when pos <= x + width and pos + tileWidth >= x,
+    // and it is filed under the cell pos / tileWidth.
+    const auto floorDiv = [](int64_t a, int64_t b) { return a / b - (a % b < 0 ? 1 : 0); };
+    const int64_t firstColumn = std::max<int64_t>(floorDiv(x - tileWidth, tileWidth), 0);
+    const int64_t lastColumn = floorDiv(static_cast<int64_t>(x) + width, tileWidth);
+    const int64_t firstRow = std::max<int64_t>(floorDiv(y - tileHeight, tileHeight), 0);
+    const int64_t lastRow = floorDiv(static_cast<int64_t>(y) + height, tileHeight);
+    if (lastColumn < firstColumn || lastRow < firstRow)
+        return;
+
+    const auto addIfIntersecting = [&](const std::vector<const TileCacheDesc*>& cell)
+    {
+        for (const TileCacheDesc* desc : cell)
         {
-            LOG_TRC("Removing tile: " << it->first.serialize());
-            it = _cache.erase(it);
+            if (intersectsTile(*desc, -1, x, y, width, height))
+                tiles.push_back(desc);
+        }
+    };
+
+    // Large areas (eg. EMPTY) cover more cells than we have, walk what we have then.
+    const uint64_t cellCount = (lastColumn - firstColumn + 1) * static_cast<uint64_t>(lastRow - firstRow + 1);
+    if (cellCount > grid.size())
+    {
+        for (const auto& cell : grid)
+        {
+            const int64_t column = cell.first >> 32;
+            const int64_t row = static_cast<uint32_t>(cell.first);
+            if (column >= firstColumn && column <= lastColumn && row >= firstRow && row <= lastRow)
+                addIfIntersecting(cell.second);
+        }
+    }
+    else
+    {
+        for (int64_t column = firstColumn; column <= lastColumn; ++column)
+        {
+            for (int64_t row = firstRow; row <= lastRow; ++row)
+            {
+                const auto cell = grid.find(gridCell(column, row));
+                if (cell != grid.end())
+                    addIfIntersecting(cell->second);
+            }
         }
-        else
-            ++it;
+    }
+}
+
+void TileCache::addToGrid(const TileCacheDesc* desc)
+{
+    TileGrid& grid = _tileGrids[TileGridKey(desc->getPart(), desc->getTileWidth(), desc->getTileHeight())];
+    grid[gridCell(desc->getTilePosX() / desc->getTileWidth(),
+                  desc->getTilePosY() / desc->getTileHeight())].push_back(desc);
+}
+
+void TileCache::removeFromGrid(const TileCacheDesc& desc)
+{
+    const auto gridIt = _tileGrids.find(TileGridKey(desc.getPart(), desc.getTileWidth(), desc.getTileHeight()));
+    if (gridIt == _tileGrids.end())
+        return;
+
+    TileGrid& grid = gridIt->second;
+    const auto cellIt = grid.find(gridCell(desc.getTilePosX() / desc.getTileWidth(),
+                                           desc.getTilePosY() / desc.getTileHeight()));
+    if (cellIt == grid.end())
+        return;
+
+    std::vector<const TileCacheDesc*>& cell = cellIt->second;
+    cell.erase(std::remove(cell.begin(), cell.end(), &desc), cell.end());
+    if (cell.empty())
+    {
+        grid.erase(cellIt);
+        if (grid.empty())
+            _tileGrids.erase(gridIt);
     }
 }
 
@@ -416,6 +639,13 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
                 tileBeingRendered->getSubscribers().size() << " subscribers already.");
         tileBeingRendered->getSubscribers().push_back(subscriber);
 
+        if (tileBeingRendered->isPrefetch())
+        {
+            // Requested while prefetching, it's a real one now.
+            ++_prefetchHits;
+            tileBeingRendered->setPrefetch(false);
+        }
+
         const auto duration = (std::chrono::steady_clock::now() - tileBeingRendered->getStartTime());
         if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() > COMMAND_TIMEOUT_MS)
         {
@@ -503,6 +733,65 @@ std::string TileCache::cancelTiles(const std::shared_ptr<ClientSession> &subscri
     return canceltiles.empty() ? canceltiles : "canceltiles " + canceltiles;
 }
 
+void TileCache::registerTilePrefetch(const TileDesc& tile)
+{
+    assertCorrectThread();
+
+    if (findTileBeingRendered(tile))
+        return;
+
+    LOG_TRC("Prefetching tile " << tile.serialize());
+    _tilesBeingRendered[tile] = std::make_shared<TileBeingRendered>(tile, true);
+}
+
+bool TileCache::takeOverPrefetch(TileDesc& tile)
+{
+    assertCorrectThread();
+
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    if (!tileBeingRendered || !tileBeingRendered->isPrefetch())
+        return false;
+
+    LOG_TRC("Requested tile being prefetched " << tile.serialize());
+    // Counted as prefetched here, it is no prefetch anymore once rendered.
+    ++_tilesPrefetched;
+    ++_prefetchHits;
+    tileBeingRendered->setPrefetch(false);
+    tile.setVersion(tileBeingRendered->getVersion());
+    return true;
+}
+
+std::string TileCache::cancelPrefetches()
+{
+    assertCorrectThread();
+
+    std::ostringstream oss;
+    for (auto it = _tilesBeingRendered.begin(); it != _tilesBeingRendered.end(); )
+    {
+        if (it->second->isPrefetch() && it->second->getSubscribers().empty())
+        {
+            oss << it->second->getVersion() << ',';
+            it = _tilesBeingRendered.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    const std::string canceltiles = oss.str();
+    return canceltiles.empty() ? canceltiles : "canceltiles " + canceltiles;
+}
+
+bool TileCache::isRenderingIdle() const
+{
+    for (const auto& it : _tilesBeingRendered)
+    {
+        if (it.second->getElapsedTimeMs() < COMMAND_TIMEOUT_MS)
+            return false;
+    }
+
+    return true;
+}
+
 void TileCache::assertCorrectThread()
 {
     const bool correctThread = _owner == std::thread::id() || std::this_thread::get_id() == _owner;
@@ -518,21 +807,132 @@ TileCache::Tile TileCache::findTile(const TileDesc &desc)
     auto it = _cache.find(desc);
     if (it != _cache.end())
     {
-        LOG_TRC("Found cache tile: " << desc.serialize() << " of size " << it->second->size() << " bytes");
-        return it->second;
+        LOG_TRC("Found cache tile: " << desc.serialize() << " of size " << it->second._tile->size() << " bytes");
+
+        if (it->second._prefetched)
+        {
+            ++_prefetchHits;
+            it->second._prefetched = false;
+        }
+
+        // Mark as most recently used.
+        _lru.splice(_lru.begin(), _lru, it->second._lruPos);
+        return it->second._tile;
     }
     else
         return TileCache::Tile();
 }
 
-void TileCache::saveDataToCache(const TileDesc &desc, const char *data, const size_t size)
+TileCache::Tile TileCache::findPersistedTile(const TileDesc &desc)
+{
+    size_t size = 0;
+    const char* data = _persisted->find(desc, size);
+    if (!data)
+        return TileCache::Tile();
+
+    LOG_TRC("Found persisted tile: " << desc.serialize() << " of size " << size << " bytes");
+    ++_persistedHits;
+
+    const Tile tile = TileStore::intern(data, size, _storeOwner);
+    saveDataToCache(desc, tile);
+    return tile;
+}
+
+bool TileCache::hasCachedTile(const TileDesc& tile) const
+{
+    return _cache.find(tile) != _cache.end() || (_persisted && _persisted->has(tile));
+}
+
+void TileCache::saveDataToCache(const TileDesc &desc, const Tile& tile)
 {
     if (_dontCache)
         return;
 
-    TileCache::Tile tile = std::make_shared<std::vector<char>>(size);
-    std::memcpy(tile->data(), data, size);
-    _cache[desc] = tile;
+    const size_t size = tile->size();
+    auto it = _cache.find(desc);
+    if (it != _cache.end())
+    {
+        _cacheSize -= it->second._tile->size();
+        TotalCacheSize -= it->second._tile->size();
+        it->second._tile = tile;
+        it->second._prefetched = false;
+        _lru.splice(_lru.begin(), _lru, it->second._lruPos);
+    }
+    else
+    {
+        it = _cache.emplace(desc, CacheEntry()).first;
+        it->second._tile = tile;
+        it->second._prefetched = false;
+        // Keys of unordered_map nodes are stable across rehashing.
+        _lru.push_front(&it->first);
+        it->second._lruPos = _lru.begin();
+        addToGrid(&it->first);
+    }
+
+    _cacheSize += size;
+    TotalCacheSize += size;
+
+    evictTiles();
+}
+
+TileCache::CacheMap::iterator TileCache::removeTile(CacheMap::iterator it)
+{
+    const size_t size = it->second._tile->size();
+    _cacheSize -= size;
+    TotalCacheSize -= size;
+    _lru.erase(it->second._lruPos);
+    removeFromGrid(it->first);
+    return _cache.erase(it);
+}
+
+void TileCache::setMaxCacheSize(size_t maxCacheSize)
+{
+    _maxCacheSize = maxCacheSize;
+    evictTiles();
+}
+
+bool TileCache::isOverBudget() const
+{
+    if (_maxCacheSize > 0 && _cacheSize > _maxCacheSize)
+        return true;
+
+    // We can only evict our own tiles, so over the global budget
+    // we shrink down to our share and leave the rest to the others.
+    const size_t maxTotal = MaxTotalCacheSize;
+    if (maxTotal > 0 && TotalCacheSize > maxTotal)
+        return _cacheSize > maxTotal / std::max<size_t>(NumCaches, 1);
+
+    return false;
+}
+
+void TileCache::evictTiles()
+{
+    assertCorrectThread();
+
+    while (!_lru.empty() && isOverBudget())
+    {
+        // Pick the largest of the least recently used few,
+        // but never the most recent one, unless it's all we have.
+        auto victim = std::prev(_lru.end());
+        size_t victimSize = _cache.find(**victim)->second._tile->size();
+        auto lruIt = victim;
+        for (size_t i = 1; i < EvictionSampleSize && lruIt != _lru.begin() &&
+                            std::prev(lruIt) != _lru.begin(); ++i)
+        {
+            --lruIt;
+            const size_t size = _cache.find(**lruIt)->second._tile->size();
+            if (size > victimSize)
+            {
+                victim = lruIt;
+                victimSize = size;
+            }
+        }
+
+        auto it = _cache.find(**victim);
+        LOG_TRC("Evicting tile: " << it->first.serialize() << " of size " << victimSize << " bytes");
+        removeTile(it);
+        ++_cacheEvictions;
+    }
 }
 
 void TileCache::saveDataToStreamCache(StreamType type, const std::string &fileName, const char *data, const size_t size)
@@ -540,9 +940,7 @@ void TileCache::saveDataToStreamCache(StreamType type, const std::string &fileNa
     if (_dontCache)
         return;
 
-    TileCache::Tile tile = std::make_shared<std::vector<char>>(size);
-    std::memcpy(tile->data(), data, size);
-    _streamCache[type][fileName] = tile;
+    _streamCache[type][fileName] = std::make_shared<const std::vector<char>>(data, data + size);
 }
 
 void TileCache::TileBeingRendered::dumpState(std::ostream& os)
@@ -555,20 +953,139 @@ void TileCache::TileBeingRendered::dumpState(std::ostream& os)
     }
 }
 
-void TileCache::dumpState(std::ostream& os)
+void TileCache::addKnownTiles(const std::vector<TileBinaryHash>& hashes)
 {
+    _knownTiles.insert(hashes.begin(), hashes.end());
+}
+
+TileCache::Tile TileStore::intern(const char* data, size_t size, size_t owner)
+{
+    const TileBinaryHash hash = TileRef::hash(data, size);
+
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    auto it = Tiles.find(hash);
+    if (it != Tiles.end())
     {
-        size_t num = 0, size = 0;
-        for (const auto& it : _cache)
+        TileCache::Tile tile = it->second._tile.lock();
+        if (tile && tile->size() == size && std::equal(tile->begin(), tile->end(), data))
         {
-            num++; size += it.second->size();
+            Entry& entry = it->second;
+            entry._shared = entry._shared || entry._owner != owner;
+            if (++entry._uses >= TilePinUses && entry._shared && !entry._pinned &&
+                PinnedTiles.size() < MaxPinnedTiles && size <= MaxPinnedTileSize)
+            {
+                LOG_DBG("Pinning shared tile " << hash << " of " << size << " bytes.");
+                entry._pinned = true;
+                PinnedTiles.push_back(tile);
+                PinnedHashes.push_back(hash);
+            }
+
+            return tile;
+        }
+
+        if (tile)
+        {
+            // Another tile with the same hash, very unlikely; it's just not shared.
+            return std::make_shared<const std::vector<char>>(data, data + size);
+        }
+    }
+
+    TileCache::Tile tile = std::make_shared<const std::vector<char>>(data, data + size);
+    Tiles[hash] = Entry{ tile, 1, owner, false, false };
+    sweep();
+    return tile;
+}
+
+void TileStore::sweep()
+{
+    if (Tiles.size() < std::max<size_t>(1024, SweptCount * 2))
+        return;
+
+    for (auto it = Tiles.begin(); it != Tiles.end(); )
+    {
+        if (it->second._tile.expired())
+            it = Tiles.erase(it);
+        else
+            ++it;
+    }
+
+    SweptCount = Tiles.size();
+}
+
+TileCache::Tile TileStore::findPinned(TileBinaryHash hash)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    const auto it = Tiles.find(hash);
+    if (it == Tiles.end() || !it->second._pinned)
+        return TileCache::Tile();
+
+    return it->second._tile.lock();
+}
+
+size_t TileStore::getPinnedCount()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    return PinnedHashes.size();
+}
+
+void TileStore::getPinned(size_t index, std::vector<TileBinaryHash>& hashes)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (index < PinnedHashes.size())
+        hashes.insert(hashes.end(), PinnedHashes.begin() + index, PinnedHashes.end());
+}
+
+void TileStore::getStats(size_t& count, size_t& size)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    count = 0;
+    size = 0;
+    for (const auto& it : Tiles)
+    {
+        const TileCache::Tile tile = it.second._tile.lock();
+        if (tile)
+        {
+            ++count;
+            size += tile->size();
         }
-        os << "  tile cache: num: " << num << " size: " << size << " bytes\n";
-        for (const auto& it : _cache)
+    }
+}
+
+void TileStore::clear()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    Tiles.clear();
+    SweptCount = 0;
+    PinnedTiles.clear();
+    PinnedHashes.clear();
+}
+
+void TileCache::dumpState(std::ostream& os)
+{
+    {
+        os << "  tile cache: num: " << _cache.size() << " size: " << _cacheSize << " bytes"
+           << " max: " << _maxCacheSize << " bytes\n"
+           << "  tile cache hits: " << _cacheHits << " misses: " << _cacheMisses
+           << " evictions: " << _cacheEvictions << "\n"
+           << "  tiles prefetched: " << _tilesPrefetched << " hits: " << _prefetchHits << "\n"
+           << "  all tile caches: " << NumCaches << " size: " << TotalCacheSize << " bytes"
+           << " max: " << MaxTotalCacheSize << " bytes\n";
+
+        size_t storeCount = 0, storeSize = 0;
+        TileStore::getStats(storeCount, storeSize);
+        os << "  distinct tiles: " << storeCount << " size: " << storeSize << " bytes"
+           << " pinned: " << TileStore::getPinnedCount() << "\n";
+        os << "  persisted tiles: " << (_persisted ? _persisted->getCount() : 0)
+           << " hits: " << _persistedHits << "\n";
+        for (const auto& it : _lru)
         {
-            os << "    " << std::setw(4) << it.first.getWireId()
-               << "\t" << std::setw(6) << it.second->size() << " bytes"
-               << "\t'" << it.first.serialize() << "'\n" ;
+            const CacheEntry& entry = _cache.find(*it)->second;
+            os << "    " << std::setw(4) << it->getWireId()
+               << "\t" << std::setw(6) << entry._tile->size() << " bytes"
+               << "\t'" << it->serialize() << "'\n" ;
         }
     }
 
@@ -10,17 +10,25 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
+#include <chrono>
 #include <iosfwd>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <string>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <Rectangle.hpp>
 
 #include "TileDesc.hpp"
 
 class ClientSession;
+class PersistedTiles;
 
 class TileCacheDesc : public TileDesc
 {
@@ -55,16 +63,9 @@ struct TileCacheDescHasher
     size_t
     operator()(const TileCacheDesc &t) const
     {
-        size_t hash = t.getPart();
-
-        hash = (hash << 5) + hash + t.getWidth();
-        hash = (hash << 5) + hash + t.getHeight();
-        hash = (hash << 5) + hash + t.getTilePosX();
-        hash = (hash << 5) + hash + t.getTilePosY();
-        hash = (hash << 5) + hash + t.getTileWidth();
-        hash = (hash << 5) + hash + t.getTileHeight();
-
-        return hash;
+        // The pixel size rarely differs but for previews.
+        return t.getKey() ^ (static_cast<size_t>(t.getWidth()) << 40) ^
+               (static_cast<size_t>(t.getHeight()) << 28);
     }
 };
 
@@ -77,7 +78,8 @@ class TileCache
     std::shared_ptr<TileBeingRendered> findTileBeingRendered(const TileDesc& tile);
 
 public:
-    typedef std::shared_ptr<std::vector<char>> Tile;
+    /// Immutable once cached, so it can be shared by all the messages sending it.
+    typedef std::shared_ptr<const std::vector<char>> Tile;
 
     /// When the docURL is a non-file:// url, the timestamp has to be provided by the caller.
     /// For file:// url's, it's ignored.
@@ -88,6 +90,40 @@ public:
     /// Completely clear the cache contents.
     void clear();
 
+    /// Uses the tiles TileDiskCache has for the document, if any, as long as it is not modified.
+    void openPersisted(const std::string& docKey, const std::chrono::system_clock::time_point& modifiedTime);
+
+    /// Hands the tiles over to TileDiskCache, for the document having modifiedTime now.
+    void persist(const std::chrono::system_clock::time_point& modifiedTime);
+
+    /// Set the maximum number of bytes of tile data to keep for this document.
+    /// Least recently used tiles are evicted beyond it. Zero means unlimited.
+    void setMaxCacheSize(size_t maxCacheSize);
+    size_t getMaxCacheSize() const { return _maxCacheSize; }
+
+    /// The number of bytes of tile data currently cached for this document.
+    size_t getCacheSize() const { return _cacheSize; }
+
+    /// Set the maximum number of bytes of tile data to keep across all documents.
+    /// Caches holding more than their fair share evict when this is exceeded. Zero means unlimited.
+    static void setMaxTotalCacheSize(size_t maxTotalCacheSize) { MaxTotalCacheSize = maxTotalCacheSize; }
+    static size_t getMaxTotalCacheSize() { return MaxTotalCacheSize; }
+
+    /// The number of bytes of tile data cached by all documents.
+    static size_t getTotalCacheSize() { return TotalCacheSize; }
+
+    /// Evicts tiles, the least recently used first, until we are within budget.
+    /// Called periodically too, for the idle caches to give way when all are over budget.
+    void evictTiles();
+
+    uint64_t getCacheHits() const { return _cacheHits; }
+    uint64_t getCacheMisses() const { return _cacheMisses; }
+    uint64_t getCacheEvictions() const { return _cacheEvictions; }
+
+    /// Tiles rendered ahead of any request, and how many of those were then asked for.
+    uint64_t getTilesPrefetched() const { return _tilesPrefetched; }
+    uint64_t getPrefetchHits() const { return _prefetchHits; }
+
     TileCache(const TileCache&) = delete;
 
     /// Subscribes if no subscription exists and returns the version number.
@@ -102,11 +138,45 @@ public:
     /// Cancels all tile requests by the given subscriber.
     std::string cancelTiles(const std::shared_ptr<ClientSession>& subscriber);
 
+    /// Registers the tile as sent to the kit to render ahead of any request,
+    /// only to be cached. It counts as a prefetch hit when requested later.
+    void registerTilePrefetch(const TileDesc& tile);
+
+    /// Makes the prefetch of the tile the kit is rendering, if any, a requested tile,
+    /// counting a prefetch hit. Returns whether there was one, then setting the version
+    /// of tile to that being rendered, so that it is not requested again.
+    bool takeOverPrefetch(TileDesc& tile);
+
+    /// Forgets the prefetches nobody subscribed to, returning the canceltiles
+    /// message to remove them from the render queue of the kit, if any.
+    std::string cancelPrefetches();
+
+    /// True when the kit has no tiles to render for us, stalled ones aside.
+    bool isRenderingIdle() const;
+
+    /// Whether the tile is cached, or on disk, without counting it as a hit or miss.
+    bool hasCachedTile(const TileDesc& tile) const;
+
+    bool isCacheEnabled() const { return !_dontCache; }
+
     /// Find the tile with this description
     Tile lookupTile(const TileDesc& tile);
 
+    /// Takes a TileRef as data only if its hash was sent to our kit by addKnownTiles().
     void saveTileAndNotify(const TileDesc& tile, const char* data, const size_t size);
 
+    /// Records the hashes of the pinned tiles the kit of our document was told of.
+    void addKnownTiles(const std::vector<TileBinaryHash>& hashes);
+
+    /// Whether the rendered tile data is a delta against the oldwid of the tile, not a png.
+    static bool isDelta(const char* data, const size_t size) { return size > 0 && data[0] == 'D'; }
+
+    /// Sends a delta to the subscribers that can apply it; it's not cached, being
+    /// of use only to those having the old tile. Those that can't apply it are
+    /// appended to needFullTile, to request the whole tile for.
+    void notifyDelta(const TileDesc& tile, const char* data, const size_t size,
+                     std::vector<std::shared_ptr<ClientSession>>& needFullTile);
+
     enum StreamType {
         Font,
         Style,
@@ -134,6 +204,9 @@ public:
     /// Parse invalidateTiles message to a part number and a rectangle of the invalidated area
     static std::pair<int, Util::Rectangle> parseInvalidateMsg(const std::string& tiles);
 
+    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
+    static bool intersectsTile(const TileDesc &tileDesc, int part, int x, int y, int width, int height);
+
     void forgetTileBeingRendered(const std::shared_ptr<TileCache::TileBeingRendered>& tileBeingRendered);
     double getTileBeingRenderedElapsedTimeMs(const TileDesc &tileDesc) const;
 
@@ -147,11 +220,52 @@ public:
     void assertCorrectThread();
 
 private:
+    /// A cached tile and its position in the recency list.
+    struct CacheEntry
+    {
+        Tile _tile;
+        std::list<const TileCacheDesc*>::iterator _lruPos;
+        /// Rendered ahead of any request, and not requested yet.
+        bool _prefetched;
+    };
+
+    typedef std::unordered_map<TileCacheDesc, CacheEntry,
+                               TileCacheDescHasher,
+                               TileCacheDescCompareEqual> CacheMap;
+
+    /// Keys of _cache bucketed by the grid cell of their position.
+    typedef std::unordered_map<uint64_t, std::vector<const TileCacheDesc*>> TileGrid;
+
+    /// Tiles of the same part and tile size share a grid.
+    typedef std::tuple<int, int, int> TileGridKey;
+
+    static uint64_t gridCell(int64_t column, int64_t row)
+    {
+        return (static_cast<uint64_t>(column) << 32) | static_cast<uint32_t>(row);
+    }
+
+    void addToGrid(const TileCacheDesc* desc);
+    void removeFromGrid(const TileCacheDesc& desc);
+
+    /// Collects the tiles of the grid intersecting [x, y, width, height].
+    void findIntersectingTiles(const TileGridKey& key, const TileGrid& grid,
+                               int x, int y, int width, int height,
+                               std::vector<const TileCacheDesc*>& tiles) const;
+
     void invalidateTiles(int part, int x, int y, int width, int height);
 
+    /// Removes the tile from the cache and its size from the totals.
+    CacheMap::iterator removeTile(CacheMap::iterator it);
+
+    /// True when we hold more tile data than our budget allows.
+    bool isOverBudget() const;
+
     /// Lookup tile in our cache.
     TileCache::Tile findTile(const TileDesc &desc);
 
+    /// Lookup tile in the persisted ones, caching it when found.
+    TileCache::Tile findPersistedTile(const TileDesc &desc);
+
     /// Lookup tile in our stream cache.
     TileCache::Tile findStreamTile(StreamType type, const std::string &fileName);
 
@@ -161,21 +275,40 @@ private:
     static std::string cacheFileName(const TileDesc& tileDesc);
     static bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
 
-    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
-    static bool intersectsTile(const TileDesc &tileDesc, int part, int x, int y, int width, int height);
-
-    void saveDataToCache(const TileDesc &desc, const char *data, const size_t size);
+    void saveDataToCache(const TileDesc &desc, const Tile& tile);
     void saveDataToStreamCache(StreamType type, const std::string &fileName, const char *data, const size_t size);
 
     const std::string _docURL;
+    /// Who we are to the TileStore, the same for all the caches of the document.
+    const size_t _storeOwner;
 
     std::thread::id _owner;
 
     bool _dontCache;
     // FIXME: should we have a tile-desc to WID map instead and a simpler lookup ?
-    std::unordered_map<TileCacheDesc, Tile,
-                       TileCacheDescHasher,
-                       TileCacheDescCompareEqual> _cache;
+    CacheMap _cache;
+    /// Keys of _cache, most recently used first.
+    std::list<const TileCacheDesc*> _lru;
+    /// Spatial index of _cache, so invalidation doesn't have to scan it all.
+    std::map<TileGridKey, TileGrid> _tileGrids;
+
+    /// Bytes of tile data in _cache.
+    size_t _cacheSize;
+    size_t _maxCacheSize;
+
+    uint64_t _cacheHits;
+    uint64_t _cacheMisses;
+    uint64_t _cacheEvictions;
+    uint64_t _tilesPrefetched;
+    uint64_t _prefetchHits;
+
+    /// The pinned tiles our kit may refer to, and no other.
+    std::unordered_set<TileBinaryHash> _knownTiles;
+
+    /// The tiles on disk since we were opened, until invalidated.
+    std::shared_ptr<PersistedTiles> _persisted;
+    std::string _persistedDocKey;
+    uint64_t _persistedHits;
     // FIXME: TileBeingRendered contains TileDesc too ...
     std::unordered_map<TileCacheDesc, std::shared_ptr<TileBeingRendered>,
                        TileCacheDescHasher,
@@ -183,6 +316,62 @@ private:
 
     // old-style file-name to data grab-bag.
     std::map<std::string, Tile> _streamCache[(int)StreamType::Last];
+
+    /// Each DocumentBroker owns its cache on its own thread, these are shared.
+    static std::atomic<size_t> TotalCacheSize;
+    static std::atomic<size_t> MaxTotalCacheSize;
+    static std::atomic<size_t> NumCaches;
+};
+
+/// The tile data of all the documents by content, so that identical tiles,
+/// like blank backgrounds, are kept once however many caches have them.
+/// Those stored the most, by more than one document, are pinned: the kits
+/// are told their hashes and send TileRefs instead of them. A tile of a
+/// single document is never pinned, lest its content be referred to from
+/// the kit of another.
+class TileStore
+{
+public:
+    /// Returns the data stored with the same content, else stores a copy.
+    /// The owner is that of the document storing it.
+    static TileCache::Tile intern(const char* data, size_t size, size_t owner);
+
+    /// The data of a pinned TileRef hash, else nothing.
+    static TileCache::Tile findPinned(TileBinaryHash hash);
+
+    /// The number of pinned tiles, which are never unpinned.
+    static size_t getPinnedCount();
+
+    /// Appends the hashes of the pinned tiles from the index-th on, in the order pinned.
+    static void getPinned(size_t index, std::vector<TileBinaryHash>& hashes);
+
+    /// The number and bytes of distinct tiles held, in any cache or pinned.
+    static void getStats(size_t& count, size_t& size);
+
+    /// Forgets all, for the tests.
+    static void clear();
+
+private:
+    struct Entry
+    {
+        std::weak_ptr<const std::vector<char>> _tile;
+        /// How many times the tile was stored.
+        size_t _uses;
+        /// The document that stored it first, and whether another did too.
+        size_t _owner;
+        bool _shared;
+        bool _pinned;
+    };
+
+    /// Drops the entries of tiles no longer held, when they are many.
+    static void sweep();
+
+    static std::mutex Mutex;
+    static std::unordered_map<TileBinaryHash, Entry> Tiles;
+    /// The entries after the last sweep.
+    static size_t SweptCount;
+    static std::vector<TileCache::Tile> PinnedTiles;
+    static std::vector<TileBinaryHash> PinnedHashes;
 };
 
 #endif
@@ -11,19 +11,32 @@
 #define INCLUDED_TILEDESC_HPP
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <Poco/StringTokenizer.h>
 
 #include "Exceptions.hpp"
 #include "Protocol.hpp"
+#include "SpookyV2.h"
 
 #define TILE_WIRE_ID
 typedef uint32_t TileWireId;
 typedef uint64_t TileBinaryHash;
 
+/// The identity of a tile as the client sees it, that generateID() spells:
+/// the part, the position and the size in twips, but not the size in pixels.
+/// Tiles on the grid pack exactly: 11 bits part, 16 bits size, 14 bits column
+/// and 22 bits row. Others, off the grid or too far out, get a hash of those
+/// with the top bit set instead.
+typedef uint64_t TileKey;
+
 /// Tile Descriptor
 /// Represents a tile's coordinates and dimensions.
 class TileDesc
@@ -250,6 +263,60 @@ public:
         return tileID.str();
     }
 
+    TileKey getKey() const
+    {
+        return makeKey(_part, _tilePosX, _tilePosY, _tileWidth, _tileHeight);
+    }
+
+    static TileKey makeKey(int part, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
+    {
+        if (tileWidth == tileHeight && tileWidth > 0 && tileWidth < (1 << 16) &&
+            part >= 0 && part < (1 << 11) && tilePosX >= 0 && tilePosY >= 0 &&
+            tilePosX % tileWidth == 0 && tilePosY % tileHeight == 0)
+        {
+            const int column = tilePosX / tileWidth;
+            const int row = tilePosY / tileHeight;
+            if (column < (1 << 14) && row < (1 << 22))
+            {
+                return (static_cast<TileKey>(part) << 52) |
+                       (static_cast<TileKey>(tileWidth) << 36) |
+                       (static_cast<TileKey>(column) << 22) |
+                       static_cast<TileKey>(row);
+            }
+        }
+
+        // FNV-1a over the fields.
+        TileKey hash = 14695981039346656037ULL;
+        for (const int value : { part, tilePosX, tilePosY, tileWidth, tileHeight })
+            hash = (hash ^ static_cast<uint32_t>(value)) * 1099511628211ULL;
+
+        return hash | (1ULL << 63);
+    }
+
+    /// The key of a generateID() string, as tileprocessed sends it back.
+    static bool parseKey(const std::string& tileID, TileKey& key)
+    {
+        int values[5];
+        const char* pos = tileID.c_str();
+        for (int i = 0; i < 5; ++i)
+        {
+            char* end = nullptr;
+            errno = 0;
+            const long value = std::strtol(pos, &end, 10);
+            if (end == pos || errno != 0 || value < INT_MIN || value > INT_MAX ||
+                *end != (i < 4 ? ':' : '\0'))
+            {
+                return false;
+            }
+
+            values[i] = value;
+            pos = end + 1;
+        }
+
+        key = makeKey(values[0], values[1], values[2], values[3], values[4]);
+        return true;
+    }
+
 protected:
     int _part;
     int _width;
@@ -272,12 +339,7 @@ protected:
 class TileCombined
 {
 private:
-    TileCombined(int part, int width, int height,
-                 const std::string& tilePositionsX, const std::string& tilePositionsY,
-                 int tileWidth, int tileHeight, const std::string& vers,
-                 const std::string& imgSizes,
-                 const std::string& oldWireIds,
-                 const std::string& wireIds) :
+    TileCombined(int part, int width, int height, int tileWidth, int tileHeight) :
         _part(part),
         _width(width),
         _height(height),
@@ -292,7 +354,16 @@ private:
         {
             throw BadArgumentException("Invalid tilecombine descriptor.");
         }
+    }
 
+    TileCombined(int part, int width, int height,
+                 const std::string& tilePositionsX, const std::string& tilePositionsY,
+                 int tileWidth, int tileHeight, const std::string& vers,
+                 const std::string& imgSizes,
+                 const std::string& oldWireIds,
+                 const std::string& wireIds) :
+        TileCombined(part, width, height, tileWidth, tileHeight)
+    {
         Poco::StringTokenizer positionXtokens(tilePositionsX, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
         Poco::StringTokenizer positionYtokens(tilePositionsY, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
         Poco::StringTokenizer imgSizeTokens(imgSizes, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
@@ -350,12 +421,82 @@ private:
                 throw BadArgumentException("Invalid tilecombine descriptor.");
             }
 
-            _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, imgSize, -1, false);
-            _tiles.back().setOldWireId(oldWireId);
-            _tiles.back().setWireId(wireId);
+            addTile(x, y, ver, imgSize, oldWireId, wireId);
+        }
+    }
+
+    void addTile(int x, int y, int ver, int imgSize, TileWireId oldWireId, TileWireId wireId)
+    {
+        _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, imgSize, -1, false);
+        _tiles.back().setOldWireId(oldWireId);
+        _tiles.back().setWireId(wireId);
+    }
+
+    static void writeVarint(std::string& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+
+        out += static_cast<char>(value);
+    }
+
+    static void writeSigned(std::string& out, int64_t value)
+    {
+        // Zigzag, so small negative numbers stay short.
+        writeVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    static uint64_t readVarint(const char* data, size_t size, size_t& offset)
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (offset >= size)
+                throw BadArgumentException("Truncated binary tilecombine descriptor.");
+
+            const unsigned char byte = data[offset++];
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
         }
+
+        throw BadArgumentException("Invalid binary tilecombine descriptor.");
+    }
+
+    static int readInt(const char* data, size_t size, size_t& offset)
+    {
+        const uint64_t value = readVarint(data, size, offset);
+        if (value > INT_MAX)
+            throw BadArgumentException("Invalid binary tilecombine descriptor.");
+
+        return value;
+    }
+
+    static int readSigned(const char* data, size_t size, size_t& offset)
+    {
+        const uint64_t zigzag = readVarint(data, size, offset);
+        const int64_t value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+        if (value < INT_MIN || value > INT_MAX)
+            throw BadArgumentException("Invalid binary tilecombine descriptor.");
+
+        return value;
+    }
+
+    static TileWireId readWireId(const char* data, size_t size, size_t& offset)
+    {
+        const uint64_t value = readVarint(data, size, offset);
+        if (value > UINT32_MAX)
+            throw BadArgumentException("Invalid binary tilecombine descriptor.");
+
+        return value;
     }
 
+    /// The version of the binary form, its first byte.
+    static constexpr char BinaryVersion = 1;
+
 public:
     int getPart() const { return _part; }
     int getWidth() const { return _width; }
@@ -436,6 +577,88 @@ public:
         return oss.str();
     }
 
+    /// Serialize this instance into the compact form of serialize(): the prefix, a space,
+    /// the fields as varints, then the suffix. The positions are differences to the
+    /// previous tile, small in a row of tiles.
+    std::string serializeBinary(const std::string& prefix,
+                                const std::string& suffix = std::string()) const
+    {
+        return serializeBinary(prefix, suffix, _tiles);
+    }
+
+    std::string serializeBinary(const std::string& prefix, const std::string& suffix,
+                                const std::vector<TileDesc>& tiles) const
+    {
+        std::string out;
+        out.reserve(prefix.size() + 16 + tiles.size() * 16 + suffix.size());
+        out += prefix;
+        out += ' ';
+        out += BinaryVersion;
+        writeVarint(out, _part);
+        writeVarint(out, _width);
+        writeVarint(out, _height);
+        writeVarint(out, _tileWidth);
+        writeVarint(out, _tileHeight);
+        writeVarint(out, tiles.size());
+
+        int x = 0;
+        int y = 0;
+        for (const auto& tile : tiles)
+        {
+            writeSigned(out, static_cast<int64_t>(tile.getTilePosX()) - x);
+            writeSigned(out, static_cast<int64_t>(tile.getTilePosY()) - y);
+            writeSigned(out, tile.getVersion());
+            writeVarint(out, tile.getImgSize());
+            writeVarint(out, tile.getOldWireId());
+            writeVarint(out, tile.getWireId());
+            x = tile.getTilePosX();
+            y = tile.getTilePosY();
+        }
+
+        out += suffix;
+        return out;
+    }
+
+    /// Deserialize the binary form, data[offset] being the first byte after the prefix and
+    /// its space; on return offset is past the last byte of it, where the suffix starts.
+    static TileCombined parseBinary(const char* data, size_t size, size_t& offset)
+    {
+        if (offset >= size || data[offset] != BinaryVersion)
+            throw BadArgumentException("Unknown binary tilecombine descriptor version.");
+        ++offset;
+
+        const int part = readInt(data, size, offset);
+        const int width = readInt(data, size, offset);
+        const int height = readInt(data, size, offset);
+        const int tileWidth = readInt(data, size, offset);
+        const int tileHeight = readInt(data, size, offset);
+        TileCombined result(part, width, height, tileWidth, tileHeight);
+
+        // Each tile takes 6 bytes at least.
+        const uint64_t count = readVarint(data, size, offset);
+        if (count > (size - offset) / 6)
+            throw BadArgumentException("Truncated binary tilecombine descriptor.");
+
+        result._tiles.reserve(count);
+        int64_t x = 0;
+        int64_t y = 0;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            x += readSigned(data, size, offset);
+            y += readSigned(data, size, offset);
+            if (x < 0 || x > INT_MAX || y < 0 || y > INT_MAX)
+                throw BadArgumentException("Invalid binary tilecombine descriptor.");
+
+            const int ver = readSigned(data, size, offset);
+            const int imgSize = readInt(data, size, offset);
+            const TileWireId oldWireId = readWireId(data, size, offset);
+            const TileWireId wireId = readWireId(data, size, offset);
+            result.addTile(x, y, ver, imgSize, oldWireId, wireId);
+        }
+
+        return result;
+    }
+
     /// Deserialize a TileDesc from a tokenized string.
     static TileCombined parse(const std::vector<std::string>& tokens)
     {
@@ -507,25 +730,16 @@ public:
     {
         assert(!tiles.empty());
 
-        std::ostringstream xs;
-        std::ostringstream ys;
-        std::ostringstream vers;
-        std::ostringstream oldhs;
-        std::ostringstream hs;
-
+        TileCombined result(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
+                            tiles[0].getTileWidth(), tiles[0].getTileHeight());
+        result._tiles.reserve(tiles.size());
         for (const auto& tile : tiles)
         {
-            xs << tile.getTilePosX() << ',';
-            ys << tile.getTilePosY() << ',';
-            vers << tile.getVersion() << ',';
-            oldhs << tile.getOldWireId() << ',';
-            hs << tile.getWireId() << ',';
+            result.addTile(tile.getTilePosX(), tile.getTilePosY(), tile.getVersion(), 0,
+                           tile.getOldWireId(), tile.getWireId());
         }
 
-        vers.seekp(-1, std::ios_base::cur); // Remove last comma.
-        return TileCombined(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
-                            xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(),
-                            vers.str(), "", oldhs.str(), hs.str());
+        return result;
     }
 
     /// To support legacy / under-used renderTile
@@ -548,6 +762,41 @@ private:
     int _tileHeight;
 };
 
+/// Encoded tile data that WSD has already, sent as a reference to it instead of
+/// a png or a delta: 'R' followed by the hash() of the data, little-endian.
+struct TileRef
+{
+    static const size_t Size = 9;
+
+    /// The hash of encoded tile data. Unlike Png::hashSubBuffer() of the pixels,
+    /// the same in every process.
+    static TileBinaryHash hash(const char* data, size_t size)
+    {
+        return SpookyHash::Hash64(data, size, 0x7e3779b97f4a7c15);
+    }
+
+    static bool isRef(const char* data, size_t size)
+    {
+        return size == Size && data[0] == 'R';
+    }
+
+    static void append(std::vector<char>& output, TileBinaryHash hash)
+    {
+        output.push_back('R');
+        for (int i = 0; i < 8; ++i)
+            output.push_back(static_cast<char>(hash >> (i * 8)));
+    }
+
+    /// The hash of a reference, isRef() being true.
+    static TileBinaryHash parse(const char* data)
+    {
+        TileBinaryHash hash = 0;
+        for (int i = 0; i < 8; ++i)
+            hash |= static_cast<TileBinaryHash>(static_cast<unsigned char>(data[1 + i])) << (i * 8);
+        return hash;
+    }
+};
+
 #endif
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
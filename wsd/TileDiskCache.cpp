@@ -0,0 +1,441 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "TileDiskCache.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <sstream>
+#include <unordered_set>
+
+#include <Log.hpp>
+#include <SpookyV2.h>
+#include <net/Socket.hpp>
+
+std::string TileDiskCache::Path;
+size_t TileDiskCache::MaxSize(0);
+std::unique_ptr<SocketPoll> TileDiskCache::Poll;
+
+namespace
+{
+    /// The file starts with: Magic, the Version, the length of the docKey, the modified time
+    /// in ms, the number of tiles, the docKey, then per tile: part, width, height, tileposx,
+    /// tileposy, tilewidth, tileheight, size, offset of the data, and its TileRef::hash().
+    /// All in the byte order of the machine, the files are not meant to move.
+    const char Magic[8] = { 'L', 'O', 'O', 'L', 'T', 'I', 'L', 'E' };
+    const uint32_t Version = 1;
+    const size_t HeaderSize = sizeof(Magic) + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    const size_t EntrySize = 8 * sizeof(int32_t) + 2 * sizeof(uint64_t);
+
+    const char* const Extension = ".tiles";
+
+    template <typename T>
+    void append(std::vector<char>& buffer, T value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    template <typename T>
+    T read(const char* data, size_t& offset)
+    {
+        T value;
+        std::memcpy(&value, data + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    }
+
+    int64_t toMs(const std::chrono::system_clock::time_point& time)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    bool writeAll(int fd, const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t written = ::write(fd, data, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            data += written;
+            size -= written;
+        }
+
+        return true;
+    }
+}
+
+PersistedTiles::PersistedTiles(const std::string& docKey,
+                               const std::chrono::system_clock::time_point& modifiedTime) :
+    _docKey(docKey),
+    _modifiedTime(modifiedTime),
+    _map(nullptr),
+    _mapSize(0),
+    _loaded(false)
+{
+}
+
+PersistedTiles::~PersistedTiles()
+{
+    if (_map)
+        munmap(_map, _mapSize);
+}
+
+const char* PersistedTiles::find(const TileDesc& tile, size_t& size) const
+{
+    if (!isLoaded())
+        return nullptr;
+
+    const auto it = _index.find(tile);
+    if (it == _index.end())
+        return nullptr;
+
+    size = it->second._size;
+    return static_cast<const char*>(_map) + it->second._offset;
+}
+
+void PersistedTiles::invalidate(int part, int x, int y, int width, int height)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!isLoaded())
+    {
+        _invalidations.emplace_back(part, Util::Rectangle(x, y, width, height));
+        return;
+    }
+
+    for (auto it = _index.begin(); it != _index.end(); )
+    {
+        if (TileCache::intersectsTile(it->first, part, x, y, width, height))
+            it = _index.erase(it);
+        else
+            ++it;
+    }
+}
+
+void PersistedTiles::setLoaded(void* map, size_t mapSize, Index& index)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _map = map;
+    _mapSize = mapSize;
+    _index.swap(index);
+
+    for (auto& invalidation : _invalidations)
+    {
+        Util::Rectangle& rect = invalidation.second;
+        for (auto it = _index.begin(); it != _index.end(); )
+        {
+            if (TileCache::intersectsTile(it->first, invalidation.first, rect.getLeft(), rect.getTop(),
+                                          rect.getWidth(), rect.getHeight()))
+                it = _index.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    _invalidations.clear();
+
+    // Only now, find() doesn't lock.
+    _loaded = true;
+}
+
+void TileDiskCache::initialize(const std::string& path, size_t maxSize)
+{
+    if (mkdir(path.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+    {
+        LOG_SYS("Failed to create the tile cache directory [" << path << "], not keeping tiles on disk");
+        return;
+    }
+
+    Path = path;
+    if (Path.back() != '/')
+        Path += '/';
+    MaxSize = maxSize;
+
+    Poll.reset(new SocketPoll("tile_disk"));
+    Poll->startThread();
+}
+
+void TileDiskCache::shutdown()
+{
+    if (!Poll)
+        return;
+
+    flush();
+    Poll->joinThread();
+    Poll.reset();
+}
+
+void TileDiskCache::flush()
+{
+    if (!Poll)
+        return;
+
+    std::promise<void> done;
+    Poll->addCallback([&done]() { done.set_value(); });
+    done.get_future().wait();
+}
+
+std::string TileDiskCache::getFileName(const std::string& docKey)
+{
+    std::ostringstream oss;
+    oss << Path << std::hex << std::setw(16) << std::setfill('0')
+        << SpookyHash::Hash64(docKey.data(), docKey.size(), 0) << Extension;
+    return oss.str();
+}
+
+std::shared_ptr<PersistedTiles> TileDiskCache::open(const std::string& docKey,
+                                                    const std::chrono::system_clock::time_point& modifiedTime)
+{
+    std::shared_ptr<PersistedTiles> persisted = std::make_shared<PersistedTiles>(docKey, modifiedTime);
+    if (Poll)
+        Poll->addCallback([persisted]() { load(persisted); });
+
+    return persisted;
+}
+
+void TileDiskCache::save(const std::string& docKey,
+                         const std::chrono::system_clock::time_point& modifiedTime,
+                         Tiles tiles, const std::shared_ptr<PersistedTiles>& previous)
+{
+    if (!Poll)
+        return;
+
+    std::shared_ptr<Tiles> saved = std::make_shared<Tiles>();
+    saved->swap(tiles);
+    Poll->addCallback([docKey, modifiedTime, saved, previous]()
+                      {
+                          write(docKey, modifiedTime, *saved, previous);
+                          trim();
+                      });
+}
+
+void TileDiskCache::load(const std::shared_ptr<PersistedTiles>& persisted)
+{
+    PersistedTiles::Index index;
+
+    const std::string fileName = getFileName(persisted->_docKey);
+    const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_DBG("No tiles on disk for [" << persisted->_docKey << "].");
+        persisted->setLoaded(nullptr, 0, index);
+        return;
+    }
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    size_t mapSize = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        mapSize = st.st_size;
+        map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the tiles of [" << persisted->_docKey << "] in [" << fileName << "]");
+        persisted->setLoaded(nullptr, 0, index);
+        return;
+    }
+
+    const char* data = static_cast<const char*>(map);
+    size_t offset = sizeof(Magic);
+    bool valid = (mapSize >= HeaderSize && std::memcmp(data, Magic, sizeof(Magic)) == 0 &&
+                  read<uint32_t>(data, offset) == Version);
+    const size_t keyLength = (valid ? read<uint32_t>(data, offset) : 0);
+    const int64_t modifiedTime = (valid ? read<int64_t>(data, offset) : 0);
+    const uint64_t count = (valid ? read<uint64_t>(data, offset) : 0);
+    valid = valid && keyLength <= mapSize - HeaderSize &&
+            count <= (mapSize - HeaderSize - keyLength) / EntrySize &&
+            persisted->_docKey.compare(0, std::string::npos, data + offset, keyLength) == 0;
+
+    if (!valid || modifiedTime != toMs(persisted->_modifiedTime))
+    {
+        // Stale, of another document with the same file name, or broken; in any case useless.
+        LOG_INF("Removing " << (valid ? "outdated" : "invalid") << " tiles on disk of [" <<
+                persisted->_docKey << "] in [" << fileName << "].");
+        munmap(map, mapSize);
+        unlink(fileName.c_str());
+        persisted->setLoaded(nullptr, 0, index);
+        return;
+    }
+
+    offset += keyLength;
+    const size_t dataStart = offset + count * EntrySize;
+    size_t invalid = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const int part = read<int32_t>(data, offset);
+        const int width = read<int32_t>(data, offset);
+        const int height = read<int32_t>(data, offset);
+        const int tilePosX = read<int32_t>(data, offset);
+        const int tilePosY = read<int32_t>(data, offset);
+        const int tileWidth = read<int32_t>(data, offset);
+        const int tileHeight = read<int32_t>(data, offset);
+        const uint32_t size = read<uint32_t>(data, offset);
+        const uint64_t tileOffset = read<uint64_t>(data, offset);
+        const uint64_t hash = read<uint64_t>(data, offset);
+
+        // Reading the whole tile to check it also brings it in memory, so the
+        // DocumentBroker doesn't wait for the disk when it needs it.
+        if (width <= 0 || height <= 0 || tileWidth <= 0 || tileHeight <= 0 ||
+            tileOffset < dataStart || tileOffset > mapSize || size > mapSize - tileOffset ||
+            TileRef::hash(data + tileOffset, size) != hash)
+        {
+            ++invalid;
+            continue;
+        }
+
+        const TileDesc tile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, -1, 0, -1, false);
+        index[tile] = PersistedTiles::Entry{ static_cast<size_t>(tileOffset), size };
+    }
+
+    // Mark as recently used.
+    utimes(fileName.c_str(), nullptr);
+
+    LOG_INF("Loaded " << index.size() << " tiles on disk of [" << persisted->_docKey << "] from [" <<
+            fileName << "], " << invalid << " invalid.");
+    persisted->setLoaded(map, mapSize, index);
+}
+
+void TileDiskCache::write(const std::string& docKey,
+                          const std::chrono::system_clock::time_point& modifiedTime,
+                          const Tiles& tiles, const std::shared_ptr<PersistedTiles>& previous)
+{
+    // The tiles to save, within our budget, and where they are.
+    std::vector<std::pair<const TileDesc*, std::pair<const char*, size_t>>> saved;
+    std::unordered_set<TileCacheDesc, TileCacheDescHasher, TileCacheDescCompareEqual> seen;
+    size_t total = HeaderSize + docKey.size();
+
+    const auto add = [&](const TileDesc& tile, const char* data, size_t size)
+    {
+        if (total + EntrySize + size > MaxSize || !seen.insert(tile).second)
+            return;
+
+        saved.emplace_back(&tile, std::make_pair(data, size));
+        total += EntrySize + size;
+    };
+
+    for (const auto& tile : tiles)
+        add(tile.first, tile.second->data(), tile.second->size());
+
+    if (previous && previous->isLoaded())
+    {
+        for (const auto& entry : previous->_index)
+            add(entry.first, static_cast<const char*>(previous->_map) + entry.second._offset, entry.second._size);
+    }
+
+    const std::string fileName = getFileName(docKey);
+    if (saved.empty())
+    {
+        unlink(fileName.c_str());
+        return;
+    }
+
+    std::vector<char> header;
+    header.insert(header.end(), Magic, Magic + sizeof(Magic));
+    append<uint32_t>(header, Version);
+    append<uint32_t>(header, docKey.size());
+    append<int64_t>(header, toMs(modifiedTime));
+    append<uint64_t>(header, saved.size());
+    header.insert(header.end(), docKey.begin(), docKey.end());
+
+    uint64_t tileOffset = HeaderSize + docKey.size() + saved.size() * EntrySize;
+    for (const auto& tile : saved)
+    {
+        const TileDesc& desc = *tile.first;
+        append<int32_t>(header, desc.getPart());
+        append<int32_t>(header, desc.getWidth());
+        append<int32_t>(header, desc.getHeight());
+        append<int32_t>(header, desc.getTilePosX());
+        append<int32_t>(header, desc.getTilePosY());
+        append<int32_t>(header, desc.getTileWidth());
+        append<int32_t>(header, desc.getTileHeight());
+        append<uint32_t>(header, tile.second.second);
+        append<uint64_t>(header, tileOffset);
+        append<uint64_t>(header, TileRef::hash(tile.second.first, tile.second.second));
+        tileOffset += tile.second.second;
+    }
+
+    // Replace the file at once, it may be mapped by the previous.
+    const std::string tempName = fileName + ".new";
+    const int fd = ::open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    bool written = (fd >= 0 && writeAll(fd, header.data(), header.size()));
+    for (size_t i = 0; written && i < saved.size(); ++i)
+        written = writeAll(fd, saved[i].second.first, saved[i].second.second);
+
+    if (fd >= 0)
+        written = (close(fd) == 0) && written;
+
+    if (!written || rename(tempName.c_str(), fileName.c_str()) != 0)
+    {
+        LOG_SYS("Failed to save the tiles of [" << docKey << "] to [" << fileName << "]");
+        unlink(tempName.c_str());
+        return;
+    }
+
+    LOG_INF("Saved " << saved.size() << " tiles of [" << docKey << "] to [" << fileName <<
+            "], " << total << " bytes.");
+}
+
+void TileDiskCache::trim()
+{
+    DIR* dir = opendir(Path.c_str());
+    if (!dir)
+        return;
+
+    // Size and last use of our files.
+    std::vector<std::pair<time_t, std::pair<std::string, size_t>>> files;
+    size_t total = 0;
+    const size_t extensionLength = std::strlen(Extension);
+    while (struct dirent* entry = readdir(dir))
+    {
+        const std::string name = entry->d_name;
+        struct stat st;
+        if (name.size() <= extensionLength ||
+            name.compare(name.size() - extensionLength, extensionLength, Extension) != 0 ||
+            stat((Path + name).c_str(), &st) != 0)
+            continue;
+
+        files.emplace_back(st.st_mtime, std::make_pair(Path + name, static_cast<size_t>(st.st_size)));
+        total += st.st_size;
+    }
+
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i < files.size() && total > MaxSize; ++i)
+    {
+        LOG_DBG("Removing tiles on disk in [" << files[i].second.first << "], " << total <<
+                " bytes beyond " << MaxSize << ".");
+        unlink(files[i].second.first.c_str());
+        total -= files[i].second.second;
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
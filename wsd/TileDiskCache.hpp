@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEDISKCACHE_HPP
+#define INCLUDED_TILEDISKCACHE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Rectangle.hpp>
+
+#include "TileCache.hpp"
+
+class SocketPoll;
+
+/// The tiles of a document saved by TileDiskCache, mapped in memory.
+/// Loaded on the I/O thread of TileDiskCache; until isLoaded() it has no tiles.
+class PersistedTiles
+{
+public:
+    PersistedTiles(const std::string& docKey, const std::chrono::system_clock::time_point& modifiedTime);
+    ~PersistedTiles();
+
+    PersistedTiles(const PersistedTiles&) = delete;
+    PersistedTiles& operator=(const PersistedTiles&) = delete;
+
+    bool isLoaded() const { return _loaded; }
+
+    /// The data of the tile, if it was saved and not invalidated since, else nullptr.
+    const char* find(const TileDesc& tile, size_t& size) const;
+
+    bool has(const TileDesc& tile) const { return isLoaded() && _index.find(tile) != _index.end(); }
+
+    /// Forgets the tiles intersecting the area, as TileCache::invalidateTiles() does;
+    /// those invalidated before isLoaded() once loaded.
+    void invalidate(int part, int x, int y, int width, int height);
+
+    size_t getCount() const { return isLoaded() ? _index.size() : 0; }
+
+private:
+    friend class TileDiskCache;
+
+    struct Entry
+    {
+        size_t _offset;
+        size_t _size;
+    };
+
+    typedef std::unordered_map<TileCacheDesc, Entry,
+                               TileCacheDescHasher,
+                               TileCacheDescCompareEqual> Index;
+
+    /// Takes the tiles found in the file, on the I/O thread.
+    void setLoaded(void* map, size_t mapSize, Index& index);
+
+    const std::string _docKey;
+    const std::chrono::system_clock::time_point _modifiedTime;
+
+    void* _map;
+    size_t _mapSize;
+    Index _index;
+
+    /// Guards the above until loaded, and the invalidations to apply then.
+    std::mutex _mutex;
+    std::vector<std::pair<int, Util::Rectangle>> _invalidations;
+    std::atomic<bool> _loaded;
+};
+
+/// Keeps the tiles of documents on disk between two editing sessions, so that
+/// opening a document again doesn't render them all again. One file per document,
+/// by its docKey, valid as long as the document has the same modified time.
+/// The files used least recently are removed beyond the size limit.
+/// All the disk I/O is done on a thread of its own.
+class TileDiskCache
+{
+public:
+    typedef std::vector<std::pair<TileDesc, TileCache::Tile>> Tiles;
+
+    /// Starts the I/O thread, keeping up to maxSize bytes of tiles in path.
+    static void initialize(const std::string& path, size_t maxSize);
+
+    /// Finishes the I/O queued and stops the I/O thread.
+    static void shutdown();
+
+    static bool isEnabled() { return Poll != nullptr; }
+
+    /// Loads the tiles saved for the document, if they are for modifiedTime, in the background.
+    static std::shared_ptr<PersistedTiles> open(const std::string& docKey,
+                                                const std::chrono::system_clock::time_point& modifiedTime);
+
+    /// Replaces the tiles saved for the document in the background, by tiles, the most
+    /// recently used first, and then the still valid ones of previous.
+    static void save(const std::string& docKey,
+                     const std::chrono::system_clock::time_point& modifiedTime,
+                     Tiles tiles, const std::shared_ptr<PersistedTiles>& previous);
+
+    /// Waits for the I/O queued so far.
+    static void flush();
+
+private:
+    static std::string getFileName(const std::string& docKey);
+
+    static void load(const std::shared_ptr<PersistedTiles>& persisted);
+    static void write(const std::string& docKey,
+                      const std::chrono::system_clock::time_point& modifiedTime,
+                      const Tiles& tiles, const std::shared_ptr<PersistedTiles>& previous);
+
+    /// Removes the least recently used files until we are within MaxSize.
+    static void trim();
+
+    static std::string Path;
+    static size_t MaxSize;
+    static std::unique_ptr<SocketPoll> Poll;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
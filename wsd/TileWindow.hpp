@@ -0,0 +1,182 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEWINDOW_HPP
+#define INCLUDED_TILEWINDOW_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "Common.hpp"
+
+/// How many tiles a client may have on fly, sent but not acknowledged by
+/// tileprocessed, adjusted to the roundtrip measured by those acknowledgements.
+/// It grows while the roundtrip stays near the lowest seen, doubling per roundtrip
+/// at first and by one tile per roundtrip later, and backs off when the roundtrip
+/// grows (tiles queue up on the way) or a tile isn't acknowledged in time.
+/// Until then, it is the whole visible area, or the largest before that is known.
+class TileWindow
+{
+public:
+    TileWindow(size_t minWindow = TILES_ON_FLY_MIN_UPPER_LIMIT,
+               size_t maxWindow = TILES_ON_FLY_MAX_UPPER_LIMIT)
+        : _minWindow(minWindow)
+        , _maxWindow(std::max(minWindow, maxWindow))
+        , _window(_maxWindow)
+        , _slowStartThreshold(_maxWindow)
+        , _srttMs(0)
+        , _rttVarMs(0)
+        , _minRttMs(0)
+        , _periodMinRttMs(0)
+        , _bytesDelivered(0)
+        , _rateBytes(0)
+        , _deliveryRate(0)
+    {
+    }
+
+    /// Sizes the window to the tiles visible on the client, as long as
+    /// no roundtrip is measured, so that the first view is sent at once.
+    void setVisibleTiles(size_t tiles)
+    {
+        if (_srttMs == 0)
+            _window = std::min(std::max(tiles * 1.1, static_cast<double>(_minWindow)),
+                               static_cast<double>(_maxWindow));
+    }
+
+    /// The number of tiles that may be on fly.
+    size_t getWindow() const { return static_cast<size_t>(_window); }
+
+    /// The smoothed roundtrip in ms, 0 before the first acknowledgement.
+    double getRttMs() const { return _srttMs; }
+
+    /// The lowest recent roundtrip in ms, that of an empty path.
+    double getMinRttMs() const { return _minRttMs; }
+
+    /// The total size of the acknowledged tiles.
+    uint64_t getBytesDelivered() const { return _bytesDelivered; }
+
+    /// The bytes per second acknowledged over the last roundtrip or so.
+    double getDeliveryRate() const { return _deliveryRate; }
+
+    /// How long to wait for the acknowledgement of a tile before giving up on it.
+    int getTimeoutMs() const
+    {
+        if (_srttMs == 0)
+            return TILE_ROUNDTRIP_TIMEOUT_MS;
+
+        const int timeoutMs = std::ceil(_srttMs + 4 * _rttVarMs);
+        return std::min(std::max(timeoutMs, TILE_ROUNDTRIP_MIN_TIMEOUT_MS), TILE_ROUNDTRIP_TIMEOUT_MS);
+    }
+
+    /// A tile of the given size, sent at sent, was acknowledged at now.
+    void onAcknowledged(std::chrono::steady_clock::time_point sent,
+                        std::chrono::steady_clock::time_point now,
+                        size_t size)
+    {
+        // Tolerated growth of the roundtrip above twice the lowest, for the
+        // jitter of decoding on the client.
+        constexpr double QueueingSlackMs = 50;
+        constexpr double RateIntervalMinMs = 100;
+        constexpr std::chrono::seconds MinRttPeriod(10);
+
+        const double rttMs = std::chrono::duration<double, std::milli>(now - sent).count();
+
+        // As TCP estimates its retransmission timeout.
+        if (_srttMs == 0)
+        {
+            _srttMs = rttMs;
+            _rttVarMs = rttMs / 2;
+        }
+        else
+        {
+            _rttVarMs = 0.75 * _rttVarMs + 0.25 * std::fabs(_srttMs - rttMs);
+            _srttMs = 0.875 * _srttMs + 0.125 * rttMs;
+        }
+
+        if (_minRttMs == 0)
+            _minRttTime = now;
+        if (_minRttMs == 0 || rttMs < _minRttMs)
+            _minRttMs = rttMs;
+        if (_periodMinRttMs == 0 || rttMs < _periodMinRttMs)
+            _periodMinRttMs = rttMs;
+
+        // Keep only the lowest of the last period, the path itself may have got slower.
+        // Drain the window too, the next period sees a roundtrip without our own queue.
+        if (now - _minRttTime > MinRttPeriod)
+        {
+            _minRttMs = _periodMinRttMs;
+            _periodMinRttMs = 0;
+            _minRttTime = now;
+            _slowStartThreshold = _window;
+            _window = _minWindow;
+        }
+
+        _bytesDelivered += size;
+        const double rateMs = std::chrono::duration<double, std::milli>(now - _rateStart).count();
+        if (rateMs >= std::max(_srttMs, RateIntervalMinMs))
+        {
+            if (_rateStart != std::chrono::steady_clock::time_point())
+                _deliveryRate = (_bytesDelivered - _rateBytes) * 1000 / rateMs;
+            _rateStart = now;
+            _rateBytes = _bytesDelivered;
+        }
+
+        if (_srttMs > _minRttMs * 2 + QueueingSlackMs)
+        {
+            // More tiles only wait longer in some buffer.
+            decrease(now, 0.8);
+        }
+        else if (_window < _slowStartThreshold)
+            _window = std::min(_window + 1, static_cast<double>(_maxWindow));
+        else
+            _window = std::min(_window + 1 / _window, static_cast<double>(_maxWindow));
+    }
+
+    /// A tile wasn't acknowledged within getTimeoutMs().
+    void onTimeout(std::chrono::steady_clock::time_point now)
+    {
+        decrease(now, 0.5);
+    }
+
+private:
+    /// Shrinks the window, once per roundtrip: the tiles of the same flight tell the same.
+    void decrease(std::chrono::steady_clock::time_point now, double factor)
+    {
+        if (std::chrono::duration<double, std::milli>(now - _lastDecrease).count() < _srttMs)
+            return;
+
+        _window = std::max(_window * factor, static_cast<double>(_minWindow));
+        _slowStartThreshold = _window;
+        _lastDecrease = now;
+    }
+
+    const size_t _minWindow;
+    const size_t _maxWindow;
+    double _window;
+    double _slowStartThreshold;
+
+    double _srttMs;
+    double _rttVarMs;
+    double _minRttMs;
+    double _periodMinRttMs;
+    std::chrono::steady_clock::time_point _minRttTime;
+    std::chrono::steady_clock::time_point _lastDecrease;
+
+    uint64_t _bytesDelivered;
+    uint64_t _rateBytes;
+    std::chrono::steady_clock::time_point _rateStart;
+    double _deliveryRate;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */